@@ -60,13 +60,30 @@
 #include <sys/mman.h>
 #endif
 
+#ifdef _EVENT_HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
 #ifdef _EVENT_HAVE_SYS_SENDFILE_H
 #include <sys/sendfile.h>
 #endif
 
+#ifdef _EVENT_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
+#ifdef _EVENT_HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #ifdef _EVENT_HAVE_STDARG_H
 #include <stdarg.h>
@@ -85,6 +102,7 @@
 #include "util-internal.h"
 #include "evthread-internal.h"
 #include "evbuffer-internal.h"
+#include "event-internal.h"
 
 /* some systems do not have MAP_FAILED */
 #ifndef MAP_FAILED
@@ -109,6 +127,13 @@
 #ifdef USE_SENDFILE
 static int use_sendfile = 1;
 #endif
+
+#if defined(_EVENT_HAVE_MSG_ZEROCOPY) && defined(_EVENT_HAVE_SYS_UIO_H)
+#define USE_ZEROCOPY
+#endif
+#if defined(SIOCOUTQ) && defined(_EVENT_HAVE_SYS_UIO_H)
+#define USE_SNDBUF_ROOM
+#endif
 #ifdef _EVENT_HAVE_MMAP
 static int use_mmap = 1;
 #endif
@@ -134,34 +159,317 @@ static int use_mmap = 1;
 #define CHAIN_SPACE_LEN(ch) ((ch)->flags & EVBUFFER_IMMUTABLE ? \
 	    0 : (ch)->buffer_len - ((ch)->misalign + (ch)->off))
 
+/* The largest chain we allocate, unless we need more for one piece of
+ * data. */
+#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
+/* The same, for an evbuffer whose large chains come from huge pages:
+ * there, big chains cost us nothing extra, and save on per-chain work. */
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+#define EVBUFFER_CHAIN_MAX_AUTO_SIZE_HUGE (256*1024)
+#define CHAIN_MAX_AUTO_SIZE(buf)					\
+	(((buf)->alloc_flags & EVBUFFER_ALLOC_HUGE_PAGES) ?		\
+	    EVBUFFER_CHAIN_MAX_AUTO_SIZE_HUGE : EVBUFFER_CHAIN_MAX_AUTO_SIZE)
+#else
+#define CHAIN_MAX_AUTO_SIZE(buf) EVBUFFER_CHAIN_MAX_AUTO_SIZE
+#endif
+
 #define CHAIN_PINNED(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_ANY) != 0)
 #define CHAIN_PINNED_R(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_R) != 0)
 
 static void evbuffer_chain_align(struct evbuffer_chain *chain);
 static void evbuffer_deferred_callback(struct deferred_cb *cb, void *arg);
+static void evbuffer_zerocopy_release(struct evbuffer_write_state *ws,
+    int all);
 static int evbuffer_ptr_memcmp(const struct evbuffer *buf,
     const struct evbuffer_ptr *pos, const char *mem, size_t len);
 
+/* Where we can, we keep the memory accounts' counters with atomic
+ * operations, so that allocating or freeing a chain takes no lock unless
+ * a global cap is set.  Otherwise, each account's lock protects it. */
+#ifdef _EVENT_HAVE_GCC_ATOMICS
+#define USE_MEM_ATOMICS
+#define MEM_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define MEM_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define MEM_LOAD(p) (*(p))
+#define MEM_STORE(p, v) (*(p) = (v))
+#endif
+
+/* All the chain memory any evbuffer has allocated, and what to do when
+ * there's too much of it.  See evbuffer_set_global_memory_cap().  high,
+ * low, over_cap, cb and cbarg change only under the global lock, but
+ * high and over_cap may be read without it. */
+static struct {
+	struct evbuffer_mem_account acct;
+	/** Over the cap once more than this is used; 0 for no cap. */
+	size_t high;
+	/** Back under the cap once no more than this is used. */
+	size_t low;
+	int over_cap;
+	evbuffer_memory_cap_cb cb;
+	void *cbarg;
+} global_mem;
+
+void
+_evbuffer_mem_global_setup_lock(void)
+{
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	if (!global_mem.acct.lock)
+		EVTHREAD_ALLOC_LOCK(global_mem.acct.lock);
+#endif
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+	_evbuffer_huge_setup_lock();
+#endif
+}
+
+/* Must hold the global lock.  Returns true iff crossing a watermark
+ * changed whether we're over the cap. */
+static int
+evbuffer_mem_global_check_cap(void)
+{
+	int over = global_mem.over_cap;
+	size_t used = MEM_LOAD(&global_mem.acct.used);
+
+	if (!global_mem.high)
+		over = 0;
+	else if (used > global_mem.high)
+		over = 1;
+	else if (used <= global_mem.low)
+		over = 0;
+	if (over == global_mem.over_cap)
+		return 0;
+	MEM_STORE(&global_mem.over_cap, over);
+	return 1;
+}
+
+/** Add 'len' bytes to what 'acct' is charged, or take them away if 'add'
+ * is false.  Without atomics, the caller must hold acct->lock. */
+static void
+evbuffer_mem_account_adjust(struct evbuffer_mem_account *acct, size_t len,
+    int add)
+{
+#ifdef USE_MEM_ATOMICS
+	size_t used, peak;
+
+	if (!add) {
+		used = __atomic_sub_fetch(&acct->used, len, __ATOMIC_RELAXED);
+		EVUTIL_ASSERT(used + len >= len);
+		return;
+	}
+	used = __atomic_add_fetch(&acct->used, len, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&acct->peak, __ATOMIC_RELAXED);
+	while (used > peak &&
+	    !__atomic_compare_exchange_n(&acct->peak, &peak, used, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+#else
+	if (add) {
+		acct->used += len;
+		if (acct->used > acct->peak)
+			acct->peak = acct->used;
+	} else {
+		EVUTIL_ASSERT(acct->used >= len);
+		acct->used -= len;
+	}
+#endif
+}
+
+/** Add 'len' bytes to the global count, or take them away if 'add' is
+ * false, and tell the cap callback if that took us over or under the
+ * cap.  The callback runs after we release the global lock. */
+static void
+evbuffer_mem_global_adjust(size_t len, int add)
+{
+	evbuffer_memory_cap_cb cb = NULL;
+	void *cbarg = NULL;
+	size_t used;
+	int over;
+
+#ifdef USE_MEM_ATOMICS
+	evbuffer_mem_account_adjust(&global_mem.acct, len, add);
+	/* With no cap, there's no watermark to cross.  If a cap is being
+	 * set right now, we'll notice crossing it at the next chain. */
+	if (!MEM_LOAD(&global_mem.high))
+		return;
+	EVLOCK_LOCK(global_mem.acct.lock, EVTHREAD_WRITE);
+#else
+	EVLOCK_LOCK(global_mem.acct.lock, EVTHREAD_WRITE);
+	evbuffer_mem_account_adjust(&global_mem.acct, len, add);
+#endif
+	if (evbuffer_mem_global_check_cap()) {
+		cb = global_mem.cb;
+		cbarg = global_mem.cbarg;
+	}
+	used = MEM_LOAD(&global_mem.acct.used);
+	over = global_mem.over_cap;
+	EVLOCK_UNLOCK(global_mem.acct.lock, EVTHREAD_WRITE);
+
+	if (cb)
+		cb(over, used, cbarg);
+}
+
+/** Return true iff evbuffers are over the global cap. */
+static inline int
+evbuffer_mem_global_over_cap(void)
+{
+#ifdef USE_MEM_ATOMICS
+	return MEM_LOAD(&global_mem.over_cap);
+#else
+	int over;
+	EVLOCK_LOCK(global_mem.acct.lock, EVTHREAD_READ);
+	over = global_mem.over_cap;
+	EVLOCK_UNLOCK(global_mem.acct.lock, EVTHREAD_READ);
+	return over;
+#endif
+}
+
+struct evbuffer_mem_account *
+_evbuffer_mem_account_new(void)
+{
+	struct evbuffer_mem_account *acct;
+
+	if (!(acct = mm_calloc(1, sizeof(struct evbuffer_mem_account))))
+		return NULL;
+#ifndef USE_MEM_ATOMICS
+	EVTHREAD_ALLOC_LOCK(acct->lock);
+#endif
+	acct->refcnt = 1;
+	acct->numa_node = -1;
+	return acct;
+}
+
+/** Take 'len' bytes away from 'acct', and drop a reference to it. */
+static void
+evbuffer_mem_account_release(struct evbuffer_mem_account *acct, size_t len)
+{
+	int refcnt;
+
+#ifdef USE_MEM_ATOMICS
+	evbuffer_mem_account_adjust(acct, len, 0);
+	refcnt = __atomic_sub_fetch(&acct->refcnt, 1, __ATOMIC_ACQ_REL);
+#else
+	EVLOCK_LOCK(acct->lock, EVTHREAD_WRITE);
+	evbuffer_mem_account_adjust(acct, len, 0);
+	refcnt = --acct->refcnt;
+	EVLOCK_UNLOCK(acct->lock, EVTHREAD_WRITE);
+#endif
+
+	if (refcnt == 0) {
+#ifndef USE_MEM_ATOMICS
+		EVTHREAD_FREE_LOCK(acct->lock);
+#endif
+		mm_free(acct);
+	}
+}
+
+void
+_evbuffer_mem_account_decref(struct evbuffer_mem_account *acct)
+{
+	evbuffer_mem_account_release(acct, 0);
+}
+
+static void
+evbuffer_mem_account_incref(struct evbuffer_mem_account *acct)
+{
+#ifdef USE_MEM_ATOMICS
+	__atomic_add_fetch(&acct->refcnt, 1, __ATOMIC_RELAXED);
+#else
+	EVLOCK_LOCK(acct->lock, EVTHREAD_WRITE);
+	++acct->refcnt;
+	EVLOCK_UNLOCK(acct->lock, EVTHREAD_WRITE);
+#endif
+}
+
+/** Charge the memory of a new chain to its evbuffer's account, if it has
+ * one, and to the global one. */
+static void
+evbuffer_mem_charge(struct evbuffer *buf, struct evbuffer_chain *chain)
+{
+	struct evbuffer_mem_account *acct = buf->mem_account;
+
+	if (acct) {
+#ifdef USE_MEM_ATOMICS
+		evbuffer_mem_account_incref(acct);
+		evbuffer_mem_account_adjust(acct, chain->mem_len, 1);
+#else
+		EVLOCK_LOCK(acct->lock, EVTHREAD_WRITE);
+		++acct->refcnt;
+		evbuffer_mem_account_adjust(acct, chain->mem_len, 1);
+		EVLOCK_UNLOCK(acct->lock, EVTHREAD_WRITE);
+#endif
+		chain->mem_account = acct;
+	}
+	evbuffer_mem_global_adjust(chain->mem_len, 1);
+}
+
+/** Free the memory of a chain, and stop charging anybody for it. */
+static void
+evbuffer_chain_free_mem(struct evbuffer_chain *chain)
+{
+	struct evbuffer_mem_account *acct = chain->mem_account;
+	size_t len = chain->mem_len;
+
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+	if (chain->flags & EVBUFFER_HUGE_PAGES)
+		_evbuffer_huge_free(chain);
+	else
+#endif
+		mm_free(chain);
+	if (acct)
+		evbuffer_mem_account_release(acct, len);
+	evbuffer_mem_global_adjust(len, 0);
+}
+
+/** Allocate a chain for 'buf' that can hold 'size' bytes, or return NULL
+ * if we can't, or if 'buf' may not have any more memory right now. */
 static struct evbuffer_chain *
-evbuffer_chain_new(size_t size)
+evbuffer_chain_new(struct evbuffer *buf, size_t size)
 {
 	struct evbuffer_chain *chain;
 	size_t to_alloc;
 
+	if (buf->mem_limited && evbuffer_mem_global_over_cap()) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
 	size += EVBUFFER_CHAIN_SIZE;
 
-	/* get the next largest memory that can hold the buffer */
-	to_alloc = MIN_BUFFER_SIZE;
-	while (to_alloc < size)
-		to_alloc <<= 1;
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+	if (buf->alloc_flags & EVBUFFER_ALLOC_HUGE_PAGES) {
+		int node = -1;
+		if (buf->mem_account) {
+			/* Until the loop notices, we use wherever we are. */
+			node = buf->mem_account->numa_node;
+			buf->mem_account->huge_pages_used = 1;
+		}
+		/* If the chain is too small, or there's no memory there, we
+		 * use malloc. */
+		if ((chain = _evbuffer_huge_alloc(size, node, &to_alloc))) {
+			memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+			chain->flags = EVBUFFER_HUGE_PAGES;
+		}
+	} else
+#endif
+		chain = NULL;
 
-	/* we get everything in one chunk */
-	if ((chain = mm_malloc(to_alloc)) == NULL)
-		return (NULL);
+	if (!chain) {
+		/* get the next largest memory that can hold the buffer */
+		to_alloc = MIN_BUFFER_SIZE;
+		while (to_alloc < size)
+			to_alloc <<= 1;
 
-	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+		/* we get everything in one chunk */
+		if ((chain = mm_malloc(to_alloc)) == NULL)
+			return (NULL);
+
+		memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	}
 
 	chain->buffer_len = to_alloc - EVBUFFER_CHAIN_SIZE;
+	chain->refcnt = 1;
+	chain->mem_len = to_alloc;
+	evbuffer_mem_charge(buf, chain);
 
 	/* this way we can manipulate the buffer to different addresses,
 	 * which is required for mmap for example.
@@ -174,12 +482,19 @@ evbuffer_chain_new(size_t size)
 static inline void
 evbuffer_chain_free(struct evbuffer_chain *chain)
 {
+	EVUTIL_ASSERT(chain->refcnt > 0);
+	if (--chain->refcnt > 0) {
+		/* other evbuffers still share this chain's memory */
+		return;
+	}
 	if (CHAIN_PINNED(chain)) {
+		/* we'll be back when the chain is unpinned */
+		chain->refcnt++;
 		chain->flags |= EVBUFFER_DANGLING;
 		return;
 	}
-	if (chain->flags & (EVBUFFER_MMAP|EVBUFFER_SENDFILE|
-		EVBUFFER_REFERENCE)) {
+	if (chain->flags & (EVBUFFER_FILESEGMENT|EVBUFFER_REFERENCE|
+		EVBUFFER_MULTICAST)) {
 		if (chain->flags & EVBUFFER_REFERENCE) {
 			struct evbuffer_chain_reference *info =
 			    EVBUFFER_CHAIN_EXTRA(
@@ -190,30 +505,93 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 				    chain->buffer_len,
 				    info->extra);
 		}
-#ifdef _EVENT_HAVE_MMAP
-		if (chain->flags & EVBUFFER_MMAP) {
-			struct evbuffer_chain_fd *info =
-			    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd,
-				chain);
-			if (munmap(chain->buffer, chain->buffer_len) == -1)
-				event_warn("%s: munmap failed", __func__);
-			if (close(info->fd) == -1)
-				event_warn("%s: close(%d) failed",
-				    __func__, info->fd);
+		if (chain->flags & EVBUFFER_FILESEGMENT) {
+			struct evbuffer_chain_file_segment *info =
+			    EVBUFFER_CHAIN_EXTRA(
+				    struct evbuffer_chain_file_segment,
+				    chain);
+			evbuffer_file_segment_free(info->segment);
 		}
-#endif
-#ifdef USE_SENDFILE
-		if (chain->flags & EVBUFFER_SENDFILE) {
-			struct evbuffer_chain_fd *info =
-			    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd,
-				chain);
-			if (close(info->fd) == -1)
-				event_warn("%s: close(%d) failed",
-				    __func__, info->fd);
+		if (chain->flags & EVBUFFER_MULTICAST) {
+			struct evbuffer_multicast_parent *info =
+			    EVBUFFER_CHAIN_EXTRA(
+				    struct evbuffer_multicast_parent,
+				    chain);
+			EVBUFFER_LOCK(info->source, EVTHREAD_WRITE);
+			evbuffer_chain_free(info->parent);
+			_evbuffer_decref_and_unlock(info->source);
 		}
-#endif
 	}
-	mm_free(chain);
+	evbuffer_chain_free_mem(chain);
+}
+
+/* True iff 'ch' is a chain that evbuffer_compact() may copy out of and
+ * free. */
+#define CHAIN_SMALL(buf, ch)						\
+	((ch)->off > 0 && (ch)->off < (buf)->compact_small_size &&	\
+	    !CHAIN_PINNED(ch) && (ch)->buffer != NULL)
+
+/** Copy every run of two or more adjacent small chains in 'buf' into a
+ * single chain.  We never touch the last two chains, since a read may have
+ * reserved space in them. */
+static void
+evbuffer_compact(struct evbuffer *buf)
+{
+	struct evbuffer_chain *prev = NULL, *chain, *next, *merged, *tmp, *stop;
+	size_t total;
+	int n;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+	buf->n_small_added = 0;
+	if (buf->freeze_start)
+		return;
+	++buf->compact_stats.n_compactions;
+
+	stop = buf->previous_to_last ? buf->previous_to_last : buf->last;
+	for (chain = buf->first; chain && chain != stop;
+	     prev = merged, chain = next) {
+		merged = chain;
+		next = chain->next;
+		if (!CHAIN_SMALL(buf, chain))
+			continue;
+		total = chain->off;
+		n = 1;
+		while (next && next != stop && CHAIN_SMALL(buf, next) &&
+		    total + next->off <= EVBUFFER_CHAIN_MAX_AUTO_SIZE) {
+			total += next->off;
+			++n;
+			next = next->next;
+		}
+		if (n < 2)
+			continue;
+
+		if (!(chain->flags & EVBUFFER_IMMUTABLE) &&
+		    chain->buffer_len >= total) {
+			/* The first chain has room for all the rest. */
+			if (chain->buffer_len - chain->misalign < total)
+				evbuffer_chain_align(chain);
+			tmp = chain->next;
+		} else {
+			if ((merged = evbuffer_chain_new(buf, total)) == NULL)
+				return;
+			tmp = chain;
+		}
+		while (tmp != next) {
+			struct evbuffer_chain *after = tmp->next;
+			memcpy(merged->buffer + merged->misalign + merged->off,
+			    tmp->buffer + tmp->misalign, tmp->off);
+			merged->off += tmp->off;
+			buf->compact_stats.n_bytes_copied += tmp->off;
+			evbuffer_chain_free(tmp);
+			tmp = after;
+		}
+		merged->next = next;
+		if (prev)
+			prev->next = merged;
+		else
+			buf->first = merged;
+		buf->compact_stats.n_chains_merged += n - 1;
+	}
 }
 
 static inline void
@@ -227,7 +605,10 @@ evbuffer_chain_insert(struct evbuffer *buf, struct evbuffer_chain *chain)
 		/* the last chain is empty so we can just drop it */
 		if (buf->last->off == 0 && !CHAIN_PINNED(buf->last)) {
 			evbuffer_chain_free(buf->last);
-			buf->previous_to_last->next = chain;
+			if (buf->previous_to_last)
+				buf->previous_to_last->next = chain;
+			else
+				buf->first = chain;
 			buf->last = chain;
 		} else {
 			buf->previous_to_last = buf->last;
@@ -237,6 +618,10 @@ evbuffer_chain_insert(struct evbuffer *buf, struct evbuffer_chain *chain)
 	}
 
 	buf->total_len += chain->off;
+
+	if (buf->compact_small_size && CHAIN_SMALL(buf, chain) &&
+	    ++buf->n_small_added >= buf->compact_max_small)
+		evbuffer_compact(buf);
 }
 
 void
@@ -407,6 +792,12 @@ _evbuffer_decref_and_unlock(struct evbuffer *buffer)
 		next = chain->next;
 		evbuffer_chain_free(chain);
 	}
+	if (buffer->write_state) {
+		evbuffer_zerocopy_release(buffer->write_state, 1);
+		mm_free(buffer->write_state);
+	}
+	if (buffer->mem_account)
+		_evbuffer_mem_account_decref(buffer->mem_account);
 	evbuffer_remove_all_callbacks(buffer);
 	if (buffer->deferred_cbs)
 		event_deferred_cb_cancel(buffer->cb_queue, &buffer->deferred);
@@ -604,6 +995,14 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
+	if (outbuf->compact_small_size) {
+		struct evbuffer_chain *chain;
+		for (chain = inbuf->first; chain; chain = chain->next) {
+			if (CHAIN_SMALL(outbuf, chain))
+				++outbuf->n_small_added;
+		}
+	}
+
 	if (out_total_len == 0) {
 		COPY_CHAIN(outbuf, inbuf);
 	} else {
@@ -615,6 +1014,10 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
         inbuf->n_del_for_cb += in_total_len;
         outbuf->n_add_for_cb += in_total_len;
 
+	if (outbuf->compact_small_size &&
+	    outbuf->n_small_added >= outbuf->compact_max_small)
+		evbuffer_compact(outbuf);
+
 	evbuffer_invoke_callbacks(inbuf);
 	evbuffer_invoke_callbacks(outbuf);
 
@@ -623,6 +1026,107 @@ done:
 	return result;
 }
 
+int
+evbuffer_add_buffer_reference(struct evbuffer *outbuf, struct evbuffer *inbuf)
+{
+	struct evbuffer_chain *chain, *tmp, *first = NULL, *last = NULL;
+	size_t in_total_len;
+	int result = 0;
+
+	EVBUFFER_LOCK2(inbuf, outbuf);
+	in_total_len = inbuf->total_len;
+
+	if (in_total_len == 0 || outbuf == inbuf)
+		goto done;
+
+	if (outbuf->freeze_end) {
+		result = -1;
+		goto done;
+	}
+
+	for (chain = inbuf->first; chain; chain = chain->next) {
+		if (chain->flags & EVBUFFER_MULTICAST) {
+			/* we only share memory one level deep, so that
+			 * freeing a chain never has to take more than one
+			 * other evbuffer's lock. */
+			result = -1;
+			goto done;
+		}
+	}
+
+	/* Make all the new chains before we touch outbuf, so that we can
+	 * give up cleanly if we run out of memory. */
+	for (chain = inbuf->first; chain; chain = chain->next) {
+		if (chain->off == 0)
+			continue;
+		if (chain->flags & EVBUFFER_FILESEGMENT) {
+			/* The segment is refcounted already; share that. */
+			struct evbuffer_file_segment *seg =
+			    (EVBUFFER_CHAIN_EXTRA(
+				    struct evbuffer_chain_file_segment,
+				    chain))->segment;
+			tmp = evbuffer_chain_new(outbuf,
+				sizeof(struct evbuffer_chain_file_segment));
+			if (tmp == NULL)
+				goto nomem;
+			tmp->flags |= chain->flags &
+			    (EVBUFFER_FILESEGMENT|EVBUFFER_SENDFILE|
+				EVBUFFER_IMMUTABLE);
+			EVLOCK_LOCK(seg->lock, EVTHREAD_WRITE);
+			++seg->refcnt;
+			EVLOCK_UNLOCK(seg->lock, EVTHREAD_WRITE);
+			(EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment,
+			    tmp))->segment = seg;
+		} else {
+			struct evbuffer_multicast_parent *info;
+			tmp = evbuffer_chain_new(outbuf,
+				sizeof(struct evbuffer_multicast_parent));
+			if (tmp == NULL)
+				goto nomem;
+			tmp->flags |= EVBUFFER_MULTICAST|EVBUFFER_IMMUTABLE;
+			info = EVBUFFER_CHAIN_EXTRA(
+				struct evbuffer_multicast_parent, tmp);
+			_evbuffer_incref(inbuf);
+			info->source = inbuf;
+			/* Nobody may write to the parent's memory now, or
+			 * move it. */
+			++chain->refcnt;
+			chain->flags |= EVBUFFER_IMMUTABLE;
+			info->parent = chain;
+		}
+		tmp->buffer = chain->buffer;
+		tmp->buffer_len = chain->buffer_len;
+		tmp->misalign = chain->misalign;
+		tmp->off = chain->off;
+		if (last)
+			last->next = tmp;
+		else
+			first = tmp;
+		last = tmp;
+	}
+
+	for (chain = first; chain; chain = tmp) {
+		tmp = chain->next;
+		chain->next = NULL;
+		evbuffer_chain_insert(outbuf, chain);
+	}
+	outbuf->n_add_for_cb += in_total_len;
+	evbuffer_invoke_callbacks(outbuf);
+
+done:
+	EVBUFFER_UNLOCK2(inbuf, outbuf);
+	return result;
+
+nomem:
+	event_warn("%s: out of memory", __func__);
+	for (chain = first; chain; chain = tmp) {
+		tmp = chain->next;
+		evbuffer_chain_free(chain);
+	}
+	result = -1;
+	goto done;
+}
+
 int
 evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 {
@@ -912,7 +1416,8 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		tmp->off = size;
 		size -= old_off;
 		chain = chain->next;
-	} else if (chain->buffer_len - chain->misalign >= (size_t)size) {
+	} else if (!(chain->flags & EVBUFFER_IMMUTABLE) &&
+	    chain->buffer_len - chain->misalign >= (size_t)size) {
 		/* already have enough space in the first chain */
 		size_t old_off = chain->off;
 		buffer = chain->buffer + chain->misalign + chain->off;
@@ -921,7 +1426,7 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		size -= old_off;
 		chain = chain->next;
 	} else {
-		if ((tmp = evbuffer_chain_new(size)) == NULL) {
+		if ((tmp = evbuffer_chain_new(buf, size)) == NULL) {
 			event_warn("%s: out of memory", __func__);
 			goto done;
 		}
@@ -982,14 +1487,14 @@ evbuffer_strchr(struct evbuffer_ptr *it, const char chr)
 	int count = 0;
 	while (chain != NULL) {
 		char *buffer = (char *)chain->buffer + chain->misalign;
-		for (; i < chain->off; ++i, ++count) {
-			if (buffer[i] == chr) {
-				it->_internal.chain = chain;
-				it->_internal.pos_in_chain = i;
-				it->pos += count;
-				return (count);
-			}
+		char *p = memchr(buffer + i, chr, chain->off - i);
+		if (p) {
+			it->_internal.chain = chain;
+			it->_internal.pos_in_chain = p - buffer;
+			it->pos += count + (p - buffer - i);
+			return (count + (p - buffer - i));
 		}
+		count += chain->off - i;
 		i = 0;
 		chain = chain->next;
 	}
@@ -997,25 +1502,24 @@ evbuffer_strchr(struct evbuffer_ptr *it, const char chr)
 	return (-1);
 }
 
+/* As evbuffer_strchr, but stop at either of two characters. */
 static inline int
-evbuffer_strpbrk(struct evbuffer_ptr *it, const char *chrset)
+evbuffer_strchr2(struct evbuffer_ptr *it, const char chr1, const char chr2)
 {
 	struct evbuffer_chain *chain = it->_internal.chain;
 	unsigned i = it->_internal.pos_in_chain;
 	int count = 0;
 	while (chain != NULL) {
 		char *buffer = (char *)chain->buffer + chain->misalign;
-		for (; i < chain->off; ++i, ++count) {
-			const char *p = chrset;
-			while (*p) {
-				if (buffer[i] == *p++) {
-					it->_internal.chain = chain;
-					it->_internal.pos_in_chain = i;
-					it->pos += count;
-					return (count);
-				}
-			}
+		const char *p = evutil_memchr2(buffer + i, chr1, chr2,
+		    chain->off - i);
+		if (p) {
+			it->_internal.chain = chain;
+			it->_internal.pos_in_chain = p - buffer;
+			it->pos += count + (p - buffer - i);
+			return (count + (p - buffer - i));
 		}
+		count += chain->off - i;
 		i = 0;
 		chain = chain->next;
 	}
@@ -1095,7 +1599,7 @@ evbuffer_search_eol(struct evbuffer *buffer,
 	 * characters we are going to drain afterwards. */
 	switch (eol_style) {
 	case EVBUFFER_EOL_ANY:
-		if (evbuffer_strpbrk(&it, "\r\n") < 0)
+		if (evbuffer_strchr2(&it, '\r', '\n') < 0)
 			goto done;
 		memcpy(&it2, &it, sizeof(it));
 		extra_drain = evbuffer_strspn(&it2, "\r\n");
@@ -1109,7 +1613,7 @@ evbuffer_search_eol(struct evbuffer *buffer,
 	}
 	case EVBUFFER_EOL_CRLF:
 		while (1) {
-			if (evbuffer_strpbrk(&it, "\r\n") < 0)
+			if (evbuffer_strchr2(&it, '\r', '\n') < 0)
 				goto done;
 			if (evbuffer_getchr(&it) == '\n') {
 				extra_drain = 1;
@@ -1186,8 +1690,6 @@ done:
         return result;
 }
 
-#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
-
 /* Adds data to an event buffer */
 
 int
@@ -1242,11 +1744,11 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 
 	/* we need to add another chain */
 	to_alloc = chain->buffer_len;
-	if (to_alloc <= EVBUFFER_CHAIN_MAX_AUTO_SIZE/2)
+	if (to_alloc <= CHAIN_MAX_AUTO_SIZE(buf)/2)
 		to_alloc <<= 1;
 	if (datlen > to_alloc)
 		to_alloc = datlen;
-	tmp = evbuffer_chain_new(to_alloc);
+	tmp = evbuffer_chain_new(buf, to_alloc);
 	if (tmp == NULL)
 		goto done;
 
@@ -1294,8 +1796,9 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 		chain->misalign = chain->buffer_len;
 	}
 
-	/* we cannot touch immutable buffers */
-	if ((chain->flags & EVBUFFER_IMMUTABLE) == 0) {
+	/* we cannot touch immutable buffers, or the space in front of a
+	 * chain that the kernel may still be sending from */
+	if ((chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ZC)) == 0) {
 		if ((size_t)chain->misalign >= datlen) {
 			/* we have enough space */
 			memcpy(chain->buffer + chain->misalign - datlen,
@@ -1318,7 +1821,7 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 	}
 
 	/* we need to add another chain */
-	if ((tmp = evbuffer_chain_new(datlen)) == NULL)
+	if ((tmp = evbuffer_chain_new(buf, datlen)) == NULL)
 		goto done;
 	buf->first = tmp;
 	if (buf->previous_to_last == NULL)
@@ -1367,7 +1870,7 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 
 	if (chain == NULL ||
 	    (chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ANY))) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new(buf, datlen);
 		if (chain == NULL)
 			goto err;
 
@@ -1392,7 +1895,7 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 
 	/* figure out how much space we need */
 	length = chain->buffer_len - chain->misalign + datlen;
-	tmp = evbuffer_chain_new(length);
+	tmp = evbuffer_chain_new(buf, length);
 	if (tmp == NULL)
 		goto err;
 	/* copy the data over that we had so far */
@@ -1427,7 +1930,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
         ASSERT_EVBUFFER_LOCKED(buf);
 
 	if (chain == NULL || (chain->flags & EVBUFFER_IMMUTABLE)) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new(buf, datlen);
 		if (chain == NULL)
 			return (-1);
 
@@ -1460,7 +1963,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 		/* If there are no bytes on this chain, free it and
 		   replace it with a better one. */
 		/* XXX round up. */
-		tmp = evbuffer_chain_new(datlen-avail_in_prev);
+		tmp = evbuffer_chain_new(buf, datlen-avail_in_prev);
 		if (tmp == NULL)
 			return -1;
 		/* XXX write functions to in new chains */
@@ -1475,7 +1978,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 		/* Add a new chunk big enough to hold what won't fit
 		 * in chunk. */
 		/*XXX round this up. */
-		tmp = evbuffer_chain_new(datlen-avail);
+		tmp = evbuffer_chain_new(buf, datlen-avail);
 		if (tmp == NULL)
 			return (-1);
 
@@ -1499,8 +2002,15 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 
 #ifdef _EVENT_HAVE_SYS_UIO_H
 /* number of iovec we use for writev, fragmentation is going to determine
- * how much we end up writing */
+ * how much we end up writing.  We use as many as the system lets us, up to
+ * a limit that keeps the array a reasonable size for the stack. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define NUM_IOVEC IOV_MAX
+#elif defined(IOV_MAX) || defined(UIO_MAXIOV)
+#define NUM_IOVEC 1024
+#else
 #define NUM_IOVEC 128
+#endif
 #define IOV_TYPE struct iovec
 #define IOV_PTR_FIELD iov_base
 #define IOV_LEN_FIELD iov_len
@@ -1726,6 +2236,224 @@ done:
 	return result;
 }
 
+/* Writes smaller than this aren't worth a system call or two to find out
+ * how much the socket will take. */
+#define EVBUFFER_WRITE_PROBE_MIN 65536
+/* However little room the socket says it has, we offer it this much; it
+ * can always take less. */
+#define EVBUFFER_WRITE_MIN_ROOM 4096
+/* Writes at least this big go out with MSG_ZEROCOPY, if we may.  Copying
+ * less is cheaper than pinning pages and reading a notification. */
+#define EVBUFFER_ZEROCOPY_MIN 16384
+
+int
+evbuffer_set_write_flags(struct evbuffer *buf, unsigned flags)
+{
+	struct evbuffer_write_state *ws;
+	int result = -1;
+
+	if (flags & ~(EVBUFFER_WRITE_FIT_SNDBUF|EVBUFFER_WRITE_ZEROCOPY))
+		return -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (!(ws = buf->write_state) && flags) {
+		if ((ws = mm_calloc(1, sizeof(struct evbuffer_write_state)))
+		    == NULL)
+			goto done;
+		ws->fd = -1;
+		TAILQ_INIT(&ws->pending);
+		buf->write_state = ws;
+	}
+	if (ws) {
+		/* Look at the socket again the next time we write. */
+		ws->checked = 0;
+	}
+	buf->write_flags = flags;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return result;
+}
+
+/** Helper: unpin the chains of every pending MSG_ZEROCOPY send, oldest
+ * first, until we reach one the kernel isn't done with; or of all of them,
+ * if 'all' is true. */
+static void
+evbuffer_zerocopy_release(struct evbuffer_write_state *ws, int all)
+{
+	struct evbuffer_zerocopy_send *zs;
+	int i;
+
+	while ((zs = TAILQ_FIRST(&ws->pending)) != NULL && (all || zs->done)) {
+		TAILQ_REMOVE(&ws->pending, zs, next);
+		--ws->n_pending;
+		for (i = 0; i < zs->n_chains; ++i)
+			_evbuffer_chain_unpin(zs->chains[i],
+			    EVBUFFER_MEM_PINNED_ZC);
+		mm_free(zs);
+	}
+}
+
+/** Helper: make 'buf''s write_state describe 'fd', looking at the socket
+ * if we haven't yet. */
+static struct evbuffer_write_state *
+evbuffer_write_state_update(struct evbuffer *buf, evutil_socket_t fd)
+{
+	struct evbuffer_write_state *ws = buf->write_state;
+
+	if (ws->fd != fd) {
+		/* We'll never hear what became of sends on another
+		 * socket. */
+		evbuffer_zerocopy_release(ws, 1);
+		ws->fd = fd;
+		ws->zerocopy_ok = 0;
+		ws->zerocopy_next = 0;
+		ws->checked = 0;
+	}
+	if (ws->checked)
+		return ws;
+	ws->checked = 1;
+
+	ws->notsent_lowat = 0;
+#if defined(USE_SNDBUF_ROOM) && defined(TCP_NOTSENT_LOWAT)
+	if (buf->write_flags & EVBUFFER_WRITE_FIT_SNDBUF) {
+		int lowat;
+		ev_socklen_t len = sizeof(lowat);
+		/* Without a limit of its own, a socket reports the
+		 * system's, which is usually "none" and comes out
+		 * negative. */
+		if (getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			(void *)&lowat, &len) == 0 && lowat > 0)
+			ws->notsent_lowat = lowat;
+	}
+#endif
+#ifdef USE_ZEROCOPY
+	if ((buf->write_flags & EVBUFFER_WRITE_ZEROCOPY) && !ws->zerocopy_ok) {
+		int one = 1;
+		ws->zerocopy_ok = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+		    (void *)&one, sizeof(one)) == 0;
+	}
+#endif
+	return ws;
+}
+
+#ifdef USE_SNDBUF_ROOM
+/** Helper: return how many more bytes the socket that 'ws' describes will
+ * take from us, or -1 if we can't tell. */
+static ev_ssize_t
+evbuffer_socket_room(struct evbuffer_write_state *ws)
+{
+	int sndbuf, queued;
+	ev_socklen_t len = sizeof(sndbuf);
+	ev_ssize_t room;
+
+	if (getsockopt(ws->fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf,
+		&len) < 0 || ioctl(ws->fd, SIOCOUTQ, &queued) < 0)
+		return -1;
+	room = (ev_ssize_t)sndbuf - queued;
+#ifdef SIOCOUTQNSD
+	if (ws->notsent_lowat) {
+		int unsent;
+		if (ioctl(ws->fd, SIOCOUTQNSD, &unsent) == 0 &&
+		    room > (ev_ssize_t)ws->notsent_lowat - unsent)
+			room = (ev_ssize_t)ws->notsent_lowat - unsent;
+	}
+#endif
+	return room;
+}
+#endif
+
+#ifdef USE_ZEROCOPY
+/** Helper: read the notifications on the error queue of the socket that
+ * 'ws' describes, and mark the sends they cover as done. */
+static void
+evbuffer_zerocopy_read_notifications(struct evbuffer_write_state *ws)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	struct evbuffer_zerocopy_send *zs;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(ws->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == IPPROTO_IP &&
+				cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == IPPROTO_IPV6 &&
+				cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* Sends ee_info through ee_data are done; the
+			 * numbers can wrap around. */
+			TAILQ_FOREACH(zs, &ws->pending, next) {
+				if ((ev_uint32_t)(zs->id - serr->ee_info) <=
+				    (ev_uint32_t)(serr->ee_data - serr->ee_info))
+					zs->done = 1;
+			}
+		}
+	}
+}
+
+/** Helper: the first 'n' bytes of 'buf' just went out in a MSG_ZEROCOPY
+ * send.  Record it in 'zs', and pin its chains until the kernel is done
+ * with them. */
+static void
+evbuffer_zerocopy_pin(struct evbuffer *buf, struct evbuffer_write_state *ws,
+    struct evbuffer_zerocopy_send *zs, size_t n)
+{
+	struct evbuffer_zerocopy_send *last =
+	    TAILQ_LAST(&ws->pending, evbuffer_zerocopy_queue);
+	struct evbuffer_chain *chain;
+
+	zs->id = ws->zerocopy_next++;
+	zs->done = 0;
+	zs->n_chains = 0;
+	for (chain = buf->first; n; chain = chain->next) {
+		if (chain->flags & EVBUFFER_MEM_PINNED_ZC) {
+			/* An earlier send has a piece of this chain; it's
+			 * ours now, since we'll be released after it. */
+			EVUTIL_ASSERT(last && last->n_chains &&
+			    last->chains[last->n_chains - 1] == chain);
+			--last->n_chains;
+		} else {
+			_evbuffer_chain_pin(chain, EVBUFFER_MEM_PINNED_ZC);
+		}
+		zs->chains[zs->n_chains++] = chain;
+		n -= n < chain->off ? n : chain->off;
+	}
+	TAILQ_INSERT_TAIL(&ws->pending, zs, next);
+	++ws->n_pending;
+}
+#endif
+
+int
+evbuffer_zerocopy_reap(struct evbuffer *buf, evutil_socket_t fd)
+{
+	struct evbuffer_write_state *ws;
+	int n_pending = 0;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if ((ws = buf->write_state) != NULL) {
+		if (ws->n_pending && ws->fd == fd) {
+#ifdef USE_ZEROCOPY
+			evbuffer_zerocopy_read_notifications(ws);
+#endif
+			evbuffer_zerocopy_release(ws, 0);
+		}
+		n_pending = ws->n_pending;
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return n_pending;
+}
+
 #ifdef USE_IOVEC_IMPL
 static inline int
 evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
@@ -1734,14 +2462,14 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
 	IOV_TYPE iov[NUM_IOVEC];
 	struct evbuffer_chain *chain = buffer->first;
 	int n, i = 0;
+#ifdef USE_ZEROCOPY
+	struct evbuffer_write_state *ws = buffer->write_state;
+#endif
 
 	if (howmuch < 0)
 		return -1;
 
         ASSERT_EVBUFFER_LOCKED(buffer);
-	/* XXX make this top out at some maximal data length?  if the
-	 * buffer has (say) 1MB in it, split over 128 chains, there's
-	 * no way it all gets written in one go. */
 	while (chain != NULL && i < NUM_IOVEC && howmuch) {
 #ifdef USE_SENDFILE
 		/* we cannot write the file info via writev */
@@ -1767,6 +2495,36 @@ evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
 			n = bytesSent;
 	}
 #else
+#ifdef USE_ZEROCOPY
+	if (ws && ws->zerocopy_ok &&
+	    (buffer->write_flags & EVBUFFER_WRITE_ZEROCOPY)) {
+		struct evbuffer_zerocopy_send *zs = NULL;
+		size_t total = 0;
+		int j;
+
+		for (j = 0; j < i; ++j)
+			total += iov[j].IOV_LEN_FIELD;
+		if (total >= EVBUFFER_ZEROCOPY_MIN)
+			zs = mm_malloc(sizeof(struct evbuffer_zerocopy_send) +
+			    (i - 1) * sizeof(struct evbuffer_chain *));
+		if (zs) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = i;
+			n = sendmsg(fd, &msg, MSG_ZEROCOPY);
+			if (n > 0) {
+				evbuffer_zerocopy_pin(buffer, ws, zs, n);
+				return (n);
+			}
+			mm_free(zs);
+			/* ENOBUFS means too many notifications are
+			 * outstanding; copy this time. */
+			if (n == 0 || errno != ENOBUFS)
+				return (n);
+		}
+	}
+#endif
 	n = writev(fd, iov, i);
 #endif
 	return (n);
@@ -1779,8 +2537,9 @@ evbuffer_write_sendfile(struct evbuffer *buffer, evutil_socket_t fd,
     ev_ssize_t howmuch)
 {
 	struct evbuffer_chain *chain = buffer->first;
-	struct evbuffer_chain_fd *info =
-	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+	struct evbuffer_chain_file_segment *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+	const int source_fd = info->segment->fd;
 #if defined(SENDFILE_IS_MACOSX) || defined(SENDFILE_IS_FREEBSD)
 	int res;
 	off_t len = chain->off;
@@ -1792,27 +2551,27 @@ evbuffer_write_sendfile(struct evbuffer *buffer, evutil_socket_t fd,
         ASSERT_EVBUFFER_LOCKED(buffer);
 
 #if defined(SENDFILE_IS_MACOSX)
-	res = sendfile(info->fd, fd, chain->misalign, &len, NULL, 0);
+	res = sendfile(source_fd, fd, chain->misalign, &len, NULL, 0);
 	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
 		return (-1);
 
 	return (len);
 #elif defined(SENDFILE_IS_FREEBSD)
-	res = sendfile(info->fd, fd, chain->misalign, chain->off, NULL, &len, 0);
+	res = sendfile(source_fd, fd, chain->misalign, chain->off, NULL, &len, 0);
 	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
 		return (-1);
 
 	return (len);
 #elif defined(SENDFILE_IS_LINUX)
 	/* TODO(niels): implement splice */
-	res = sendfile(fd, info->fd, &offset, chain->off);
+	res = sendfile(fd, source_fd, &offset, chain->off);
 	if (res == -1 && EVUTIL_ERR_RW_RETRIABLE(errno)) {
 		/* if this is EAGAIN or EINTR return 0; otherwise, -1 */
 		return (0);
 	}
 	return (res);
 #elif defined(SENDFILE_IS_SOLARIS)
-	res = sendfile(fd, info->fd, &offset, chain->off);
+	res = sendfile(fd, source_fd, &offset, chain->off);
 	if (res == -1 && EVUTIL_ERR_RW_RETRIABLE(errno)) {
 		/* if this is EAGAIN or EINTR return 0; otherwise, -1 */
 		return (0);
@@ -1834,14 +2593,35 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 		goto done;
 	}
 
-	if (howmuch < 0)
+	if (howmuch < 0 || (size_t)howmuch > buffer->total_len)
 		howmuch = buffer->total_len;
 
-	{
-#ifdef USE_SENDFILE
-		struct evbuffer_chain *chain = buffer->first;
-		if (chain != NULL && (chain->flags & EVBUFFER_SENDFILE))
-			n = evbuffer_write_sendfile(buffer, fd, howmuch);
+	if (buffer->write_state) {
+		struct evbuffer_write_state *ws = buffer->write_state;
+		if (buffer->write_flags)
+			ws = evbuffer_write_state_update(buffer, fd);
+		if (ws->n_pending && ws->fd == fd) {
+#ifdef USE_ZEROCOPY
+			evbuffer_zerocopy_read_notifications(ws);
+#endif
+			evbuffer_zerocopy_release(ws, 0);
+		}
+#ifdef USE_SNDBUF_ROOM
+		if ((buffer->write_flags & EVBUFFER_WRITE_FIT_SNDBUF) &&
+		    howmuch > EVBUFFER_WRITE_PROBE_MIN) {
+			ev_ssize_t room = evbuffer_socket_room(ws);
+			if (room >= 0 && room < howmuch)
+				howmuch = room > EVBUFFER_WRITE_MIN_ROOM ?
+				    room : EVBUFFER_WRITE_MIN_ROOM;
+		}
+#endif
+	}
+
+	{
+#ifdef USE_SENDFILE
+		struct evbuffer_chain *chain = buffer->first;
+		if (chain != NULL && (chain->flags & EVBUFFER_SENDFILE))
+			n = evbuffer_write_sendfile(buffer, fd, howmuch);
 		else
 #endif
 #ifdef USE_IOVEC_IMPL
@@ -2008,31 +2788,51 @@ evbuffer_search_range(struct evbuffer *buffer, const char *what, size_t len, con
                 const unsigned char *start_at =
                     chain->buffer + chain->misalign +
                     pos._internal.pos_in_chain;
-                p = memchr(start_at, first,
-                    chain->off - pos._internal.pos_in_chain);
-                if (p) {
-                        pos.pos += p - start_at;
-                        pos._internal.pos_in_chain += p - start_at;
-                        if (!evbuffer_ptr_memcmp(buffer, &pos, what, len)) {
-				if (end && pos.pos + len > end->pos)
-					goto not_found;
-				else
-					goto done;
-			}
-                        ++pos.pos;
-                        ++pos._internal.pos_in_chain;
-                        if (pos._internal.pos_in_chain == chain->off) {
-                                chain = pos._internal.chain = chain->next;
-                                pos._internal.pos_in_chain = 0;
-                        }
-                } else {
-			if (chain == last_chain)
-				goto not_found;
-                        pos.pos += chain->off - pos._internal.pos_in_chain;
-                        chain = pos._internal.chain = chain->next;
-                        pos._internal.pos_in_chain = 0;
-                }
+                size_t n = chain->off - pos._internal.pos_in_chain;
+
+		if (end && (end->pos < 0 || pos.pos + len > (size_t)end->pos))
+			goto not_found;
+
+		/* First look for a match that lies entirely in this
+		 * chain... */
+		p = evutil_memmem(start_at, n, what, len);
+		if (p) {
+			pos.pos += p - start_at;
+			pos._internal.pos_in_chain += p - start_at;
+			goto found;
+		}
+
+		/* ...then for one that starts in the last len-1 bytes of
+		 * the chain, and runs on into the next ones. */
+		if (n >= len) {
+			pos.pos += n - len + 1;
+			pos._internal.pos_in_chain += n - len + 1;
+			start_at += n - len + 1;
+			n = len - 1;
+		}
+		while (n && (p = memchr(start_at, first, n)) != NULL) {
+			pos.pos += p - start_at;
+			pos._internal.pos_in_chain += p - start_at;
+			if (!evbuffer_ptr_memcmp(buffer, &pos, what, len))
+				goto found;
+			++pos.pos;
+			++pos._internal.pos_in_chain;
+			n -= p - start_at + 1;
+			start_at = p + 1;
+		}
+
+		if (chain == last_chain)
+			goto not_found;
+		pos.pos += n;
+		chain = pos._internal.chain = chain->next;
+		pos._internal.pos_in_chain = 0;
         }
+	goto not_found;
+
+found:
+	if (end && (end->pos < 0 || pos.pos + len > (size_t)end->pos))
+		goto not_found;
+	goto done;
 
 not_found:
         pos.pos = -1;
@@ -2086,6 +2886,175 @@ evbuffer_peek(struct evbuffer *buffer, ev_ssize_t len,
 	return idx;
 }
 
+const void *
+evbuffer_peek_contiguous(struct evbuffer *buffer,
+    struct evbuffer_ptr *start_at, size_t len, void *scratch)
+{
+	struct evbuffer_chain *chain;
+	size_t pos_in_chain, n;
+	const unsigned char *result = NULL;
+	unsigned char *out = scratch;
+
+	EVBUFFER_LOCK(buffer, EVTHREAD_READ);
+
+	if (start_at) {
+		if (start_at->pos < 0 ||
+		    len > buffer->total_len - start_at->pos)
+			goto done;
+		chain = start_at->_internal.chain;
+		pos_in_chain = start_at->_internal.pos_in_chain;
+	} else {
+		if (len > buffer->total_len)
+			goto done;
+		chain = buffer->first;
+		pos_in_chain = 0;
+	}
+	if (len == 0) {
+		result = (const unsigned char *)"";
+		goto done;
+	}
+
+	while (pos_in_chain == chain->off) {
+		chain = chain->next;
+		pos_in_chain = 0;
+	}
+	if (chain->buffer == NULL)
+		goto done;
+	if (chain->off - pos_in_chain >= len) {
+		/* The common case: it's all here. */
+		result = chain->buffer + chain->misalign + pos_in_chain;
+		goto done;
+	}
+	if (scratch == NULL)
+		goto done;
+
+	while (len) {
+		if (chain->buffer == NULL)
+			goto done;
+		n = chain->off - pos_in_chain;
+		if (n > len)
+			n = len;
+		memcpy(out, chain->buffer + chain->misalign + pos_in_chain, n);
+		out += n;
+		len -= n;
+		chain = chain->next;
+		pos_in_chain = 0;
+	}
+	result = scratch;
+
+done:
+	EVBUFFER_UNLOCK(buffer, EVTHREAD_READ);
+	return result;
+}
+
+/** Invoke 'cb' on each run of bytes in the 'len' bytes of 'buffer' that
+ * start at 'start', or on all the bytes after it if 'len' is negative,
+ * in order.  Returns 0 on success, or -1 if the buffer holds fewer bytes
+ * than that or if some of them are being sent with sendfile. */
+static int
+evbuffer_foreach_range(struct evbuffer *buffer,
+    const struct evbuffer_ptr *start, ev_ssize_t len,
+    void (*cb)(const unsigned char *, size_t, void *), void *arg)
+{
+	struct evbuffer_chain *chain;
+	size_t pos_in_chain, remaining, n;
+	int result = -1;
+
+	EVBUFFER_LOCK(buffer, EVTHREAD_READ);
+
+	if (start) {
+		if (start->pos < 0 || (size_t)start->pos > buffer->total_len)
+			goto done;
+		chain = start->_internal.chain;
+		pos_in_chain = start->_internal.pos_in_chain;
+		remaining = buffer->total_len - start->pos;
+	} else {
+		chain = buffer->first;
+		pos_in_chain = 0;
+		remaining = buffer->total_len;
+	}
+	if (len < 0)
+		len = remaining;
+	else if ((size_t)len > remaining)
+		goto done;
+
+	while (len > 0) {
+		n = chain->off - pos_in_chain;
+		if (n > (size_t)len)
+			n = len;
+		if (n) {
+			if (chain->buffer == NULL)
+				goto done;
+			cb(chain->buffer + chain->misalign + pos_in_chain, n,
+			    arg);
+			len -= n;
+		}
+		chain = chain->next;
+		pos_in_chain = 0;
+	}
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buffer, EVTHREAD_READ);
+	return result;
+}
+
+static void
+crc32c_cb(const unsigned char *data, size_t len, void *arg)
+{
+	ev_uint32_t *crc = arg;
+	*crc = evutil_crc32c(*crc, data, len);
+}
+
+int
+evbuffer_crc32c(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *crc)
+{
+	ev_uint32_t c = *crc;
+
+	if (evbuffer_foreach_range(buffer, start, len, crc32c_cb, &c) < 0)
+		return -1;
+	*crc = c;
+	return 0;
+}
+
+static void
+adler32_cb(const unsigned char *data, size_t len, void *arg)
+{
+	ev_uint32_t *adler = arg;
+	*adler = evutil_adler32(*adler, data, len);
+}
+
+int
+evbuffer_adler32(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *adler)
+{
+	ev_uint32_t a = *adler;
+
+	if (evbuffer_foreach_range(buffer, start, len, adler32_cb, &a) < 0)
+		return -1;
+	*adler = a;
+	return 0;
+}
+
+static void
+hash64_cb(const unsigned char *data, size_t len, void *arg)
+{
+	evutil_hash64_update(arg, data, len);
+}
+
+int
+evbuffer_hash64(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint64_t seed, ev_uint64_t *hash_out)
+{
+	struct evutil_hash64_state st;
+
+	evutil_hash64_init(&st, seed);
+	if (evbuffer_foreach_range(buffer, start, len, hash64_cb, &st) < 0)
+		return -1;
+	*hash_out = evutil_hash64_final(&st);
+	return 0;
+}
+
 
 int
 evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
@@ -2155,6 +3124,158 @@ evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
 	return (res);
 }
 
+/* A run of bytes for evbuffer_add_pieces() to append. */
+struct evbuffer_piece {
+	const char *data;
+	size_t len;
+};
+
+/** Helper: append all of 'pieces' to 'buf' as one contiguous block, and
+ * invoke the callbacks once.  Returns the number of bytes added, or -1. */
+static int
+evbuffer_add_pieces(struct evbuffer *buf, const struct evbuffer_piece *pieces,
+    int n_pieces)
+{
+	struct evbuffer_chain *chain;
+	size_t total = 0, to_alloc;
+	unsigned char *p;
+	int i, result = -1;
+
+	for (i = 0; i < n_pieces; ++i)
+		total += pieces[i].len;
+	if (total > INT_MAX)
+		return -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+
+	if (buf->freeze_end)
+		goto done;
+
+	chain = buf->last;
+	if (chain && !(chain->flags & EVBUFFER_IMMUTABLE) &&
+	    chain->buffer_len - chain->misalign - chain->off >= total) {
+		/* It fits at the end of the last chain. */
+	} else if (chain && !(chain->flags & EVBUFFER_IMMUTABLE) &&
+	    !CHAIN_PINNED(chain) && chain->buffer_len - chain->off >= total) {
+		evbuffer_chain_align(chain);
+	} else {
+		/* Grow the way evbuffer_add() does, but never split the
+		 * pieces across two chains. */
+		to_alloc = chain ? chain->buffer_len : 0;
+		if (to_alloc <= CHAIN_MAX_AUTO_SIZE(buf)/2)
+			to_alloc <<= 1;
+		if (total > to_alloc)
+			to_alloc = total;
+		if ((chain = evbuffer_chain_new(buf, to_alloc)) == NULL)
+			goto done;
+		evbuffer_chain_insert(buf, chain);
+	}
+
+	p = chain->buffer + chain->misalign + chain->off;
+	for (i = 0; i < n_pieces; ++i) {
+		memcpy(p, pieces[i].data, pieces[i].len);
+		p += pieces[i].len;
+	}
+	chain->off += total;
+	buf->total_len += total;
+	buf->n_add_for_cb += total;
+
+	evbuffer_invoke_callbacks(buf);
+	result = (int)total;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return result;
+}
+
+/* Enough room for any 64-bit integer in decimal, with its sign. */
+#define INT_BUF_LEN 21
+
+/** Helper: write 'value' in base 'base' so that it ends just before 'end',
+ * and return a pointer to its first digit. */
+static char *
+format_uint(char *end, ev_uint64_t value, unsigned base)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	do {
+		*--end = digits[value % base];
+		value /= base;
+	} while (value);
+	return end;
+}
+
+int
+evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t value)
+{
+	char tmp[INT_BUF_LEN];
+	char *p = format_uint(tmp + sizeof(tmp), value, 10);
+	size_t len = tmp + sizeof(tmp) - p;
+
+	return evbuffer_add(buf, p, len) < 0 ? -1 : (int)len;
+}
+
+int
+evbuffer_add_int(struct evbuffer *buf, ev_int64_t value)
+{
+	char tmp[INT_BUF_LEN];
+	char *p;
+	size_t len;
+
+	if (value < 0) {
+		/* Negate in unsigned arithmetic so that INT64_MIN works. */
+		p = format_uint(tmp + sizeof(tmp), 0 - (ev_uint64_t)value, 10);
+		*--p = '-';
+	} else {
+		p = format_uint(tmp + sizeof(tmp), (ev_uint64_t)value, 10);
+	}
+	len = tmp + sizeof(tmp) - p;
+
+	return evbuffer_add(buf, p, len) < 0 ? -1 : (int)len;
+}
+
+int
+evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t value)
+{
+	char tmp[INT_BUF_LEN];
+	char *p = format_uint(tmp + sizeof(tmp), value, 16);
+	size_t len = tmp + sizeof(tmp) - p;
+
+	return evbuffer_add(buf, p, len) < 0 ? -1 : (int)len;
+}
+
+int
+evbuffer_add_chunk_size(struct evbuffer *buf, size_t size)
+{
+	char tmp[INT_BUF_LEN];
+	char *p;
+	size_t len;
+
+	tmp[sizeof(tmp) - 2] = '\r';
+	tmp[sizeof(tmp) - 1] = '\n';
+	p = format_uint(tmp + sizeof(tmp) - 2, size, 16);
+	len = tmp + sizeof(tmp) - p;
+
+	return evbuffer_add(buf, p, len) < 0 ? -1 : (int)len;
+}
+
+int
+evbuffer_add_header_line(struct evbuffer *buf, const char *key,
+    const char *value)
+{
+	struct evbuffer_piece pieces[4];
+
+	pieces[0].data = key;
+	pieces[0].len = strlen(key);
+	pieces[1].data = ": ";
+	pieces[1].len = 2;
+	pieces[2].data = value;
+	pieces[2].len = strlen(value);
+	pieces[3].data = "\r\n";
+	pieces[3].len = 2;
+
+	return evbuffer_add_pieces(buf, pieces, 4);
+}
+
 int
 evbuffer_add_reference(struct evbuffer *outbuf,
     const void *data, size_t datlen,
@@ -2164,9 +3285,13 @@ evbuffer_add_reference(struct evbuffer *outbuf,
 	struct evbuffer_chain_reference *info;
 	int result = -1;
 
-	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_reference));
+        EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
+	if (outbuf->freeze_end)
+		goto done;
+	chain = evbuffer_chain_new(outbuf,
+	    sizeof(struct evbuffer_chain_reference));
 	if (!chain)
-		return (-1);
+		goto done;
 	chain->flags |= EVBUFFER_REFERENCE | EVBUFFER_IMMUTABLE;
 	chain->buffer = (u_char *)data;
 	chain->buffer_len = datlen;
@@ -2176,13 +3301,6 @@ evbuffer_add_reference(struct evbuffer *outbuf,
 	info->cleanupfn = cleanupfn;
 	info->extra = extra;
 
-        EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
-	if (outbuf->freeze_end) {
-		/* don't call chain_free; we do not want to actually invoke
-		 * the cleanup function */
-		mm_free(chain);
-		goto done;
-	}
 	evbuffer_chain_insert(outbuf, chain);
         outbuf->n_add_for_cb += datlen;
 
@@ -2202,46 +3320,46 @@ done:
 /* TODO(niels): we may want to add to automagically convert to mmap, in
  * case evbuffer_remove() or evbuffer_pullup() are being used.
  */
-int
-evbuffer_add_file(struct evbuffer *outbuf, int fd,
-    off_t offset, size_t length)
+struct evbuffer_file_segment *
+evbuffer_file_segment_new(
+	int fd, off_t offset, off_t length, unsigned flags)
 {
-#if defined(USE_SENDFILE) || defined(_EVENT_HAVE_MMAP)
-	struct evbuffer_chain *chain;
-	struct evbuffer_chain_fd *info;
-#endif
-	int ok = 1;
-
-#if defined(USE_SENDFILE)
-	if (use_sendfile) {
-		chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_fd));
-		if (chain == NULL) {
-			event_warn("%s: out of memory", __func__);
-			return (-1);
-		}
-
-		chain->flags |= EVBUFFER_SENDFILE | EVBUFFER_IMMUTABLE;
-		chain->buffer = NULL;	/* no reading possible */
-		chain->buffer_len = length + offset;
-		chain->off = length;
-		chain->misalign = offset;
+	struct evbuffer_file_segment *seg =
+	    mm_calloc(sizeof(struct evbuffer_file_segment), 1);
+	if (!seg)
+		return NULL;
+	seg->refcnt = 1;
+	seg->fd = fd;
+	seg->flags = flags;
+	seg->file_offset = offset;
 
-		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
-		info->fd = fd;
+	if (offset < 0)
+		goto err;
+	if (length == -1) {
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size < offset)
+			goto err;
+		length = st.st_size - offset;
+	} else if (length < 0) {
+		goto err;
+	}
+	seg->length = length;
 
-                EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
-		if (outbuf->freeze_end) {
-			mm_free(chain);
-			ok = 0;
-		} else {
-			outbuf->n_add_for_cb += length;
-			evbuffer_chain_insert(outbuf, chain);
-		}
-	} else
+#if defined(USE_SENDFILE)
+	if (use_sendfile && !(flags & EVBUF_FS_DISABLE_SENDFILE)) {
+		seg->can_sendfile = 1;
+		goto done;
+	}
 #endif
+	if (length == 0)
+		goto done;
 #if defined(_EVENT_HAVE_MMAP)
-	if (use_mmap) {
-		void *mapped = mmap(NULL, length + offset, PROT_READ,
+	if (use_mmap && !(flags & EVBUF_FS_DISABLE_MMAP)) {
+		/* mmap wants an offset that is a multiple of the page size,
+		 * so we map from the start of the page holding 'offset'. */
+		long page_size = sysconf(_SC_PAGESIZE);
+		off_t leftover = page_size > 0 ? offset % page_size : 0;
+		void *mapped = mmap(NULL, length + leftover, PROT_READ,
 #ifdef MAP_NOCACHE
 		    MAP_NOCACHE |
 #endif
@@ -2249,97 +3367,171 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 		    MAP_FILE |
 #endif
 		    MAP_PRIVATE,
-		    fd, 0);
-		/* some mmap implementations require offset to be a multiple of
-		 * the page size.  most users of this api, are likely to use 0
-		 * so mapping everything is not likely to be a problem.
-		 * TODO(niels): determine page size and round offset to that
-		 * page size to avoid mapping too much memory.
-		 */
+		    fd, offset - leftover);
 		if (mapped == MAP_FAILED) {
-			event_warn("%s: mmap(%d, %d, %zu) failed",
-			    __func__, fd, 0, (size_t)(offset + length));
-			return (-1);
-		}
-		chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_fd));
-		if (chain == NULL) {
-			event_warn("%s: out of memory", __func__);
-			munmap(mapped, length);
-			return (-1);
+			/* Maybe the fd isn't a regular file; try reading it
+			 * instead. */
+			event_debug(("%s: mmap(%d, %d, %zu) failed",
+				__func__, fd, (int)(offset - leftover),
+				(size_t)(length + leftover)));
+		} else {
+			seg->mapping = mapped;
+			seg->mmap_len = length + leftover;
+			seg->contents = (char *)mapped + leftover;
+			goto done;
 		}
+	}
+#endif
+	{
+		/* the default implementation: read the whole segment into
+		 * memory, once, and share that. */
+		char *mem;
+		off_t pos;
+		ev_ssize_t n;
 
-		chain->flags |= EVBUFFER_MMAP | EVBUFFER_IMMUTABLE;
-		chain->buffer = mapped;
-		chain->buffer_len = length + offset;
-		chain->off = length + offset;
+		if (!(mem = mm_malloc(length)))
+			goto err;
+#ifdef WIN32
+		if (_lseek(fd, offset, SEEK_SET) == -1) {
+#else
+		if (lseek(fd, offset, SEEK_SET) == -1) {
+#endif
+			mm_free(mem);
+			goto err;
+		}
+		for (pos = 0; pos < length; pos += n) {
+#ifdef WIN32
+			n = _read(fd, mem + pos, (unsigned)(length - pos));
+#else
+			n = read(fd, mem + pos, length - pos);
+#endif
+			if (n <= 0) {
+				/* an error, or the file is shorter than we
+				 * were told */
+				mm_free(mem);
+				goto err;
+			}
+		}
+		seg->contents = mem;
+	}
 
-		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
-		info->fd = fd;
+done:
+	if (!(flags & EVBUF_FS_DISABLE_LOCKING))
+		EVTHREAD_ALLOC_LOCK(seg->lock);
+	return seg;
+err:
+	mm_free(seg);
+	return NULL;
+}
 
-                EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
-		if (outbuf->freeze_end) {
-			info->fd = -1;
-			evbuffer_chain_free(chain);
-			ok = 0;
-		} else {
-			outbuf->n_add_for_cb += length;
+void
+evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
+{
+	int refcnt;
 
-			evbuffer_chain_insert(outbuf, chain);
+	EVLOCK_LOCK(seg->lock, EVTHREAD_WRITE);
+	refcnt = --seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, EVTHREAD_WRITE);
+	if (refcnt > 0)
+		return;
+	EVUTIL_ASSERT(refcnt == 0);
 
-			/* we need to subtract whatever we don't need */
-			evbuffer_drain(outbuf, offset);
-		}
+#if defined(_EVENT_HAVE_MMAP)
+	if (seg->mapping) {
+		if (munmap(seg->mapping, seg->mmap_len) == -1)
+			event_warn("%s: munmap failed", __func__);
 	} else
 #endif
-	{
-		/* the default implementation */
-		struct evbuffer *tmp = evbuffer_new();
-		ev_ssize_t read;
-
-		if (tmp == NULL)
-			return (-1);
+	if (seg->contents) {
+		mm_free(seg->contents);
+	}
 
+	if ((seg->flags & EVBUF_FS_CLOSE_ON_FREE) && seg->fd >= 0) {
 #ifdef WIN32
-#define lseek _lseek
+		if (_close(seg->fd) == -1)
+#else
+		if (close(seg->fd) == -1)
 #endif
-		if (lseek(fd, offset, SEEK_SET) == -1) {
-			evbuffer_free(tmp);
-			return (-1);
-		}
+			event_warn("%s: close(%d) failed", __func__, seg->fd);
+	}
 
-		/* we add everything to a temporary buffer, so that we
-		 * can abort without side effects if the read fails.
-		 */
-		while (length) {
-			read = evbuffer_read(tmp, fd, length);
-			if (read == -1) {
-				evbuffer_free(tmp);
-				return (-1);
-			}
+	EVTHREAD_FREE_LOCK(seg->lock);
+	mm_free(seg);
+}
 
-			length -= read;
-		}
+int
+evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_file_segment *extra;
 
-                EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
-		if (outbuf->freeze_end) {
-			evbuffer_free(tmp);
-			ok = 0;
-		} else {
-			evbuffer_add_buffer(outbuf, tmp);
-			evbuffer_free(tmp);
+	if (offset < 0 || offset > seg->length)
+		return (-1);
+	if (length == -1)
+		length = seg->length - offset;
+	else if (length < 0 || length > seg->length - offset)
+		return (-1);
+	if (length == 0)
+		return (0);
 
-#ifdef WIN32
-#define close _close
-#endif
-			close(fd);
-		}
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (buf->freeze_end) {
+		EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+		return (-1);
+	}
+	chain = evbuffer_chain_new(buf,
+	    sizeof(struct evbuffer_chain_file_segment));
+	if (chain == NULL) {
+		EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+		event_warn("%s: out of memory", __func__);
+		return (-1);
 	}
 
-	if (ok)
-		evbuffer_invoke_callbacks(outbuf);
-        EVBUFFER_UNLOCK(outbuf, EVTHREAD_WRITE);
+	chain->flags |= EVBUFFER_FILESEGMENT | EVBUFFER_IMMUTABLE;
+	if (seg->can_sendfile) {
+		chain->flags |= EVBUFFER_SENDFILE;
+		chain->buffer = NULL;	/* no reading possible */
+		chain->misalign = seg->file_offset + offset;
+		chain->buffer_len = chain->misalign + length;
+	} else {
+		chain->buffer = (unsigned char *)seg->contents + offset;
+		chain->buffer_len = length;
+	}
+	chain->off = length;
+
+	EVLOCK_LOCK(seg->lock, EVTHREAD_WRITE);
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, EVTHREAD_WRITE);
+	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+	extra->segment = seg;
 
-	return ok ? 0 : -1;
+	buf->n_add_for_cb += length;
+	evbuffer_chain_insert(buf, chain);
+	evbuffer_invoke_callbacks(buf);
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+
+	return (0);
+}
+
+int
+evbuffer_add_file(struct evbuffer *outbuf, int fd,
+    off_t offset, size_t length)
+{
+	struct evbuffer_file_segment *seg;
+	int r;
+
+	seg = evbuffer_file_segment_new(fd, offset, length,
+	    EVBUF_FS_CLOSE_ON_FREE);
+	if (seg == NULL)
+		return (-1);
+	r = evbuffer_add_file_segment(outbuf, seg, 0, length);
+	if (r < 0) {
+		/* If we fail, the caller still owns the fd. */
+		seg->flags &= ~EVBUF_FS_CLOSE_ON_FREE;
+	}
+	evbuffer_file_segment_free(seg);
+	return (r);
 }
 
 
@@ -2427,6 +3619,141 @@ evbuffer_cb_clear_flags(struct evbuffer *buffer,
 	return 0;
 }
 
+int
+evbuffer_set_compaction(struct evbuffer *buf, size_t small_chain_size,
+    unsigned max_small_chains)
+{
+	if (small_chain_size && max_small_chains < 2)
+		return -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	buf->compact_small_size = small_chain_size;
+	buf->compact_max_small = max_small_chains;
+	buf->n_small_added = 0;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
+void
+evbuffer_get_compaction_stats(struct evbuffer *buf,
+    struct evbuffer_compaction_stats *stats_out)
+{
+	EVBUFFER_LOCK(buf, EVTHREAD_READ);
+	*stats_out = buf->compact_stats;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_READ);
+}
+
+size_t
+evbuffer_get_memory_used(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	size_t used = 0;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_READ);
+	for (chain = buf->first; chain; chain = chain->next)
+		used += chain->mem_len;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_READ);
+	return used;
+}
+
+int
+evbuffer_set_memory_base(struct evbuffer *buf, struct event_base *base)
+{
+	struct evbuffer_mem_account *acct = base ? base->evbuffer_mem : NULL;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (acct != buf->mem_account) {
+		/* Chains already allocated stay charged where they were. */
+		if (acct)
+			evbuffer_mem_account_incref(acct);
+		if (buf->mem_account)
+			_evbuffer_mem_account_decref(buf->mem_account);
+		buf->mem_account = acct;
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
+int
+evbuffer_set_alloc_flags(struct evbuffer *buf, unsigned flags)
+{
+	if (flags & ~EVBUFFER_ALLOC_HUGE_PAGES)
+		return -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	buf->alloc_flags = flags;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
+int
+evbuffer_set_memory_limited(struct evbuffer *buf, int limited)
+{
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	buf->mem_limited = limited ? 1 : 0;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
+static void
+evbuffer_mem_account_get_stats(struct evbuffer_mem_account *acct,
+    struct evbuffer_memory_stats *stats_out)
+{
+#ifdef USE_MEM_ATOMICS
+	stats_out->used = MEM_LOAD(&acct->used);
+	stats_out->peak = MEM_LOAD(&acct->peak);
+#else
+	EVLOCK_LOCK(acct->lock, EVTHREAD_READ);
+	stats_out->used = acct->used;
+	stats_out->peak = acct->peak;
+	EVLOCK_UNLOCK(acct->lock, EVTHREAD_READ);
+#endif
+}
+
+void
+evbuffer_get_global_memory_stats(struct evbuffer_memory_stats *stats_out)
+{
+	evbuffer_mem_account_get_stats(&global_mem.acct, stats_out);
+}
+
+void
+event_base_get_evbuffer_memory_stats(struct event_base *base,
+    struct evbuffer_memory_stats *stats_out)
+{
+	evbuffer_mem_account_get_stats(base->evbuffer_mem, stats_out);
+}
+
+int
+evbuffer_set_global_memory_cap(size_t high, size_t low,
+    evbuffer_memory_cap_cb cb, void *cbarg)
+{
+	size_t used;
+	int over, changed;
+
+	if (high && low > high)
+		return -1;
+
+	EVLOCK_LOCK(global_mem.acct.lock, EVTHREAD_WRITE);
+	MEM_STORE(&global_mem.high, high);
+	global_mem.low = low;
+	global_mem.cb = cb;
+	global_mem.cbarg = cbarg;
+	changed = evbuffer_mem_global_check_cap();
+	used = MEM_LOAD(&global_mem.acct.used);
+	over = global_mem.over_cap;
+	EVLOCK_UNLOCK(global_mem.acct.lock, EVTHREAD_WRITE);
+
+	if (changed && cb)
+		cb(over, used, cbarg);
+	return 0;
+}
+
+int
+evbuffer_global_memory_over_cap(void)
+{
+	return evbuffer_mem_global_over_cap();
+}
+
 int
 evbuffer_freeze(struct evbuffer *buffer, int start)
 {
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file buffer_hugepage.c
+
+   Memory for large evbuffer chains, carved out of 2MB regions that are
+   backed by huge pages where we can get them, and placed on a given NUMA
+   node.  See EVBUFFER_ALLOC_HUGE_PAGES.
+
+   Each region holds slots of one size: a region's worth, less its
+   header, divided by 2, 4, ... 32.  The header sits at the start of the
+   region, and regions are aligned to their size, so we can find a slot's
+   region from its address.  A chain too big for a whole region gets a
+   mapping of its own, with the same header in front.
+
+   Regions come from mmap().  We ask for MAP_HUGETLB pages first, and if
+   the system has none reserved, we map ordinary memory and ask for
+   transparent huge pages with madvise().  Before touching a new region,
+   we tell the kernel which node it should come from with mbind().
+*/
+
+#include "event-config.h"
+
+#ifdef _EVENT_HAVE_GETCPU
+/* We need this for getcpu() in sched.h. */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/queue.h>
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _EVENT_HAVE_GETCPU
+#include <sched.h>
+#endif
+
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
+#include "event2/util.h"
+#include "event2/thread.h"
+#include "util-internal.h"
+#include "evthread-internal.h"
+#include "evbuffer-internal.h"
+#include "mm-internal.h"
+
+#define HUGE_REGION_SIZE (2*1024*1024)
+/* Slot sizes are the region's room divided by 1, 2, 4, ... 32. */
+#define HUGE_N_CLASSES 6
+/* We keep pools for this many nodes; the rest share pool 0. */
+#define HUGE_MAX_NODES 64
+
+struct huge_region {
+	/** Next in its pool's list of regions with free slots. */
+	TAILQ_ENTRY(huge_region) next;
+	/** How many bytes we mapped; more than HUGE_REGION_SIZE only for a
+	 * region holding one big chain. */
+	size_t len;
+	size_t slot_size;
+	/** Which of the pool's lists we go on; -1 for a big chain. */
+	int cls;
+	/** The index of the pool we belong to. */
+	int pool;
+	int n_slots;
+	int n_used;
+	/** Slots handed out at least once; the rest haven't been touched. */
+	int n_carved;
+	/** Freed slots, linked through their first word. */
+	void *free_slots;
+};
+
+/* Rounded so that slots stay cache-line aligned. */
+#define HUGE_HEADER_SIZE ((sizeof(struct huge_region) + 63) & ~(size_t)63)
+#define HUGE_SLOT_SIZE(cls) \
+	(((HUGE_REGION_SIZE - HUGE_HEADER_SIZE) >> (cls)) & ~(size_t)63)
+/* Chains smaller than half the smallest slot aren't worth a slot. */
+#define HUGE_MIN_ALLOC (HUGE_SLOT_SIZE(HUGE_N_CLASSES - 1) / 2)
+
+TAILQ_HEAD(huge_region_list, huge_region);
+
+struct huge_pool {
+	/** Regions with at least one free slot, by size class. */
+	struct huge_region_list partial[HUGE_N_CLASSES];
+	/** Regions with no slots in use, by size class.  We keep one of
+	 * each around, so that a buffer that fills and drains doesn't map
+	 * and unmap a region every time. */
+	int n_empty[HUGE_N_CLASSES];
+	unsigned initialized : 1;
+};
+
+static struct huge_pool pools[HUGE_MAX_NODES];
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+static void *huge_lock = NULL;
+#endif
+
+void
+_evbuffer_huge_setup_lock(void)
+{
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	if (!huge_lock)
+		EVTHREAD_ALLOC_LOCK(huge_lock);
+#endif
+}
+
+int
+_evbuffer_huge_current_node(void)
+{
+	unsigned cpu, node;
+
+#ifdef _EVENT_HAVE_GETCPU
+	/* The C library's getcpu() goes through the vDSO, where there is
+	 * one, and doesn't need to enter the kernel. */
+	if (getcpu(&cpu, &node) < 0)
+		return -1;
+#else
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -1;
+#endif
+	return (int)node;
+}
+
+/** Map 'len' bytes, aligned to HUGE_REGION_SIZE, preferably from 'node'.
+ * Returns NULL on failure. */
+static void *
+huge_map(size_t len, int node)
+{
+	char *mem, *aligned;
+	size_t extra;
+
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (mem == MAP_FAILED) {
+		/* No huge pages reserved: map enough to find an aligned
+		 * stretch, trim the rest, and hope for transparent ones. */
+		mem = mmap(NULL, len + HUGE_REGION_SIZE,
+		    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+		aligned = (char *)(((uintptr_t)mem + HUGE_REGION_SIZE - 1) &
+		    ~(uintptr_t)(HUGE_REGION_SIZE - 1));
+		if (aligned > mem)
+			munmap(mem, aligned - mem);
+		extra = (mem + len + HUGE_REGION_SIZE) - (aligned + len);
+		if (extra)
+			munmap(aligned + len, extra);
+		mem = aligned;
+		madvise(mem, len, MADV_HUGEPAGE);
+	}
+
+	if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+		/* Nothing is allocated until we touch the memory, so this
+		 * decides where all of it goes.  If it fails, the kernel
+		 * puts the pages wherever it likes. */
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, mem, len, MPOL_PREFERRED, &mask,
+		    sizeof(mask) * 8, 0);
+	}
+	return mem;
+}
+
+static struct huge_region *
+huge_region_new(struct huge_pool *pool, int pool_idx, int node, int cls,
+    size_t len)
+{
+	struct huge_region *region;
+
+	if ((region = huge_map(len, node)) == NULL)
+		return NULL;
+	memset(region, 0, sizeof(struct huge_region));
+	region->len = len;
+	region->cls = cls;
+	region->pool = pool_idx;
+	if (cls < 0) {
+		region->slot_size = len - HUGE_HEADER_SIZE;
+		region->n_slots = 1;
+	} else {
+		region->slot_size = HUGE_SLOT_SIZE(cls);
+		region->n_slots = 1 << cls;
+		TAILQ_INSERT_HEAD(&pool->partial[cls], region, next);
+		++pool->n_empty[cls];
+	}
+	return region;
+}
+
+void *
+_evbuffer_huge_alloc(size_t size, int node, size_t *len_out)
+{
+	struct huge_pool *pool;
+	struct huge_region *region;
+	int pool_idx, cls, i;
+	char *slot = NULL;
+
+	if (size < HUGE_MIN_ALLOC)
+		return NULL;
+	if (node < 0)
+		node = _evbuffer_huge_current_node();
+	pool_idx = (node >= 0 && node < HUGE_MAX_NODES) ? node : 0;
+	pool = &pools[pool_idx];
+
+	EVLOCK_LOCK(huge_lock, EVTHREAD_WRITE);
+	if (!pool->initialized) {
+		for (i = 0; i < HUGE_N_CLASSES; ++i)
+			TAILQ_INIT(&pool->partial[i]);
+		pool->initialized = 1;
+	}
+
+	if (size > HUGE_SLOT_SIZE(0)) {
+		size_t len = (size + HUGE_HEADER_SIZE + HUGE_REGION_SIZE - 1) &
+		    ~(size_t)(HUGE_REGION_SIZE - 1);
+		if ((region = huge_region_new(pool, pool_idx, node, -1, len)))
+			goto found;
+		goto done;
+	}
+
+	/* The smallest slots that fit. */
+	for (cls = HUGE_N_CLASSES - 1; HUGE_SLOT_SIZE(cls) < size; --cls)
+		;
+	region = TAILQ_FIRST(&pool->partial[cls]);
+	if (!region && !(region = huge_region_new(pool, pool_idx, node, cls,
+		    HUGE_REGION_SIZE)))
+		goto done;
+
+found:
+	if (region->n_used == 0 && region->cls >= 0)
+		--pool->n_empty[region->cls];
+	if (region->free_slots) {
+		slot = region->free_slots;
+		region->free_slots = *(void **)slot;
+	} else {
+		slot = (char *)region + HUGE_HEADER_SIZE +
+		    region->n_carved++ * region->slot_size;
+	}
+	if (++region->n_used == region->n_slots && region->cls >= 0)
+		TAILQ_REMOVE(&pool->partial[region->cls], region, next);
+	*len_out = region->slot_size;
+done:
+	EVLOCK_UNLOCK(huge_lock, EVTHREAD_WRITE);
+	return slot;
+}
+
+void
+_evbuffer_huge_free(void *mem)
+{
+	struct huge_region *region = (struct huge_region *)
+	    ((uintptr_t)mem & ~(uintptr_t)(HUGE_REGION_SIZE - 1));
+	struct huge_pool *pool = &pools[region->pool];
+	int cls = region->cls;
+
+	if (cls < 0) {
+		munmap(region, region->len);
+		return;
+	}
+
+	EVLOCK_LOCK(huge_lock, EVTHREAD_WRITE);
+	if (region->n_used-- == region->n_slots)
+		TAILQ_INSERT_HEAD(&pool->partial[cls], region, next);
+	*(void **)mem = region->free_slots;
+	region->free_slots = mem;
+	if (region->n_used == 0) {
+		if (pool->n_empty[cls]) {
+			TAILQ_REMOVE(&pool->partial[cls], region, next);
+			munmap(region, region->len);
+		} else {
+			++pool->n_empty[cls];
+		}
+	}
+	EVLOCK_UNLOCK(huge_lock, EVTHREAD_WRITE);
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file buffer_uring.c
+
+   This module implements io_uring read and write functions for evbuffer
+   objects on Linux, in the manner of buffer_iocp.c.
+*/
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
+#include "event2/util.h"
+#include "event2/thread.h"
+#include "util-internal.h"
+#include "evthread-internal.h"
+#include "evbuffer-internal.h"
+#include "mm-internal.h"
+#include "uring-internal.h"
+
+/* How much memory a read that doesn't use a provided buffer gets. */
+#define URING_READ_SIZE 16384
+/* Reads up to this size are copied into the evbuffer, and the read buffer
+ * is kept for next time.  Larger ones are handed over by reference. */
+#define URING_READ_COPY_MAX 4096
+
+static inline struct evbuffer_uring_io *
+upcast_op(struct event_uring_op *op)
+{
+	return EVUTIL_UPCAST(op, struct evbuffer_uring_io, op);
+}
+
+/** Unpin all the chains noted as pinned in 'io'. */
+static void
+pin_release(struct evbuffer_uring_io *io, unsigned flag)
+{
+	int i;
+
+	for (i = 0; i < io->n_pinned; ++i)
+		_evbuffer_chain_unpin(io->pinned[i], flag);
+	io->n_pinned = 0;
+}
+
+/* Cleanup callback for read buffers that we gave to an evbuffer. */
+static void
+rbuf_free(const void *data, size_t len, void *arg)
+{
+	mm_free((void *)data);
+}
+
+/** Callback invoked when a read operation is finished. */
+static void
+read_completed(struct event_uring_op *op, int res, unsigned flags)
+{
+	struct evbuffer_uring_io *io = upcast_op(op);
+	struct evbuffer *buf = io->buf;
+	int r;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	io->in_progress = 0;
+
+	/* Even a failed read can have used up a provided buffer. */
+	r = event_uring_port_take_pbuf(io->port, flags, buf,
+	    res > 0 ? res : 0);
+	if (r < 0) {
+		res = -ENOMEM;
+	} else if (r == 0 && res > 0) {
+		EVUTIL_ASSERT(!io->pbuf);
+		if (res <= URING_READ_COPY_MAX) {
+			if (evbuffer_add(buf, io->rbuf, res) < 0)
+				res = -ENOMEM;
+		} else if (evbuffer_add_reference(buf, io->rbuf, res,
+			rbuf_free, NULL) == 0) {
+			io->rbuf = NULL;
+			io->rbuf_len = 0;
+		} else {
+			res = -ENOMEM;
+		}
+	}
+
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	io->done(io, res);
+}
+
+/** Callback invoked when a write operation is finished. */
+static void
+write_completed(struct event_uring_op *op, int res, unsigned flags)
+{
+	struct evbuffer_uring_io *io = upcast_op(op);
+	struct evbuffer *buf = io->buf;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	io->in_progress = 0;
+	evbuffer_unfreeze(buf, 1);
+	if (io->poll_then_write) {
+		/* The socket is writable (or broken); now we can try. */
+		io->poll_then_write = 0;
+		if (res >= 0) {
+			res = evbuffer_write_atmost(buf, io->fd,
+			    io->iov[0].iov_len);
+			if (res < 0)
+				res = -errno;
+		}
+	} else {
+		if (res > 0)
+			evbuffer_drain(buf, res);
+		pin_release(io, EVBUFFER_MEM_PINNED_W);
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	io->done(io, res);
+}
+
+int
+evbuffer_uring_launch_read(struct evbuffer_uring_io *io,
+    struct event_uring_port *port, evutil_socket_t fd, struct evbuffer *buf,
+    size_t at_most, int use_pbuf)
+{
+	struct io_uring_sqe sqe;
+	int r = -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (io->in_progress || buf->freeze_end)
+		goto done;
+
+	io->op.cb = read_completed;
+	io->buf = buf;
+	io->port = port;
+	io->fd = fd;
+	io->pbuf = use_pbuf && event_uring_port_has_pbuf(port);
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = fd;
+	if (io->pbuf) {
+		/* The kernel picks a buffer once there's data, and never
+		 * reads more than the buffer holds. */
+		sqe.flags = IOSQE_BUFFER_SELECT;
+		sqe.buf_group = 0;
+		sqe.len = at_most > URING_READ_SIZE ? URING_READ_SIZE : at_most;
+	} else {
+		if (!io->rbuf) {
+			if (!(io->rbuf = mm_malloc(URING_READ_SIZE)))
+				goto done;
+			io->rbuf_len = URING_READ_SIZE;
+		}
+		sqe.addr = (ev_uint64_t)(uintptr_t)io->rbuf;
+		sqe.len = at_most > io->rbuf_len ? io->rbuf_len : at_most;
+	}
+
+	if (event_uring_port_submit(port, &sqe, &io->op) < 0)
+		goto done;
+	io->in_progress = 1;
+	r = 0;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return r;
+}
+
+int
+evbuffer_uring_launch_write(struct evbuffer_uring_io *io,
+    struct event_uring_port *port, evutil_socket_t fd, struct evbuffer *buf,
+    ev_ssize_t at_most)
+{
+	struct io_uring_sqe sqe;
+	struct evbuffer_chain *chain;
+	int i, r = -1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (io->in_progress || buf->freeze_start)
+		goto done;
+	if (!buf->total_len) {
+		/* Nothing to write */
+		r = 0;
+		goto done;
+	} else if (at_most < 0 || (size_t)at_most > buf->total_len) {
+		at_most = buf->total_len;
+	}
+
+	io->op.cb = write_completed;
+	io->buf = buf;
+	io->port = port;
+	io->fd = fd;
+	memset(&sqe, 0, sizeof(sqe));
+
+	chain = buf->first;
+	if (chain->flags & EVBUFFER_SENDFILE) {
+		/* There's no memory to point the kernel at, and it can only
+		 * splice from a file through a pipe.  So wait until the
+		 * socket is writable, and use sendfile() as usual. */
+		io->poll_then_write = 1;
+		io->iov[0].iov_len = at_most;
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.fd = fd;
+		sqe.poll32_events = POLLOUT;
+	} else {
+		for (i = 0; i < EVBUFFER_URING_MAX_IOVECS && chain &&
+			 at_most > 0; ++i, chain = chain->next) {
+			if (chain->flags & EVBUFFER_SENDFILE)
+				break;
+			io->iov[i].iov_base = chain->buffer + chain->misalign;
+			io->iov[i].iov_len = (size_t)at_most > chain->off ?
+			    chain->off : (size_t)at_most;
+			at_most -= io->iov[i].iov_len;
+			_evbuffer_chain_pin(chain, EVBUFFER_MEM_PINNED_W);
+			io->pinned[i] = chain;
+		}
+		io->n_pinned = i;
+
+		memset(&io->msg, 0, sizeof(io->msg));
+		io->msg.msg_iov = io->iov;
+		io->msg.msg_iovlen = i;
+		sqe.opcode = IORING_OP_SENDMSG;
+		sqe.fd = fd;
+		sqe.addr = (ev_uint64_t)(uintptr_t)&io->msg;
+		sqe.len = 1;
+		/* A closed peer is an error for us to report, not a reason
+		 * to kill the process. */
+		sqe.msg_flags = MSG_NOSIGNAL;
+	}
+
+	if (event_uring_port_submit(port, &sqe, &io->op) < 0) {
+		pin_release(io, EVBUFFER_MEM_PINNED_W);
+		io->poll_then_write = 0;
+		goto done;
+	}
+	/* Nobody drains what the kernel is sending until it's done. */
+	evbuffer_freeze(buf, 1);
+	io->in_progress = 1;
+	r = 0;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return r;
+}
+
+void
+evbuffer_uring_io_clear(struct evbuffer_uring_io *io)
+{
+	EVUTIL_ASSERT(!io->in_progress);
+	if (io->rbuf) {
+		mm_free(io->rbuf);
+		io->rbuf = NULL;
+		io->rbuf_len = 0;
+	}
+}
@@ -83,6 +83,10 @@ enum bufferevent_ctrl_op {
 	BEV_CTRL_SET_FD,
 	BEV_CTRL_GET_FD,
 	BEV_CTRL_GET_UNDERLYING,
+	/** Sent by bufferevent_free(): the user is done with the bufferevent,
+	    so any operation in progress that holds a reference to it should
+	    be stopped. */
+	BEV_CTRL_CANCEL_ALL,
 };
 
 /** Possible data types for a control callback */
@@ -152,6 +156,13 @@ extern const struct bufferevent_ops bufferevent_ops_async;
 #define BEV_IS_ASYNC(bevp) 0
 #endif
 
+#ifdef _EVENT_HAVE_IO_URING
+extern const struct bufferevent_ops bufferevent_ops_uring;
+#define BEV_IS_URING(bevp) ((bevp)->be_ops == &bufferevent_ops_uring)
+#else
+#define BEV_IS_URING(bevp) 0
+#endif
+
 /** Initialize the shared parts of a bufferevent. */
 int bufferevent_init_common(struct bufferevent_private *, struct event_base *, const struct bufferevent_ops *, enum bufferevent_options options);
 
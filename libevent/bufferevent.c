@@ -227,6 +227,8 @@ bufferevent_init_common(struct bufferevent_private *bufev_private,
 
 	bufev_private->refcnt = 1;
 	bufev->ev_base = base;
+	evbuffer_set_memory_base(bufev->input, base);
+	evbuffer_set_memory_base(bufev->output, base);
 
 	/* Disable timeouts. */
 	evutil_timerclear(&bufev->timeout_read);
@@ -510,6 +512,8 @@ void
 bufferevent_free(struct bufferevent *bufev)
 {
 	BEV_LOCK(bufev);
+	if (bufev->be_ops->ctrl)
+		bufev->be_ops->ctrl(bufev, BEV_CTRL_CANCEL_ALL, NULL);
 	_bufferevent_decref_and_unlock(bufev);
 }
 
@@ -631,7 +635,7 @@ _bufferevent_init_generic_timeout_cbs(struct bufferevent *bev)
 {
 	evtimer_assign(&bev->ev_read, bev->ev_base,
 	    bufferevent_generic_read_timeout_cb, bev);
-	evtimer_assign(&bev->ev_read, bev->ev_base,
+	evtimer_assign(&bev->ev_write, bev->ev_base,
 	    bufferevent_generic_write_timeout_cb, bev);
 }
 
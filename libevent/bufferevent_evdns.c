@@ -31,6 +31,13 @@
  *
  * It isn't part of bufferevent_socket because evdns is in libevent_extras,
  * and bufferevent is in libevent_core.
+ *
+ * When the caller doesn't ask for a particular address family, we look up
+ * A and AAAA records at the same time and race connection attempts to the
+ * addresses we get back, in the style of RFC 6555 ("Happy Eyeballs"):
+ * addresses alternate between families, IPv6 first, and each attempt gets
+ * a short head start before we launch the next one.  The first socket to
+ * connect is handed to the bufferevent; the rest are closed.
  */
 
 #ifdef WIN32
@@ -53,74 +60,307 @@
 #ifdef _EVENT_HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 
 #include <event2/event.h>
+#include <event2/event_struct.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_struct.h>
 #include <event2/dns.h>
 #include "bufferevent-internal.h"
 #include "mm-internal.h"
+#include "util-internal.h"
+
+/* If the A answer comes back first, how long do we wait for the AAAA answer
+ * before we start connecting anyway? */
+#define RESOLUTION_DELAY_MSEC 50
+/* How long does each connection attempt get before we start the next one
+ * in parallel? */
+#define CONNECT_ATTEMPT_DELAY_MSEC 250
 
-/* Holds info passed to the dns callback  */
-struct resolveinfo {
-	ev_uint8_t family; /* address family that we tried to resolve. */
+struct hostname_connect;
+
+/* A single in-progress connect() to one of the resolved addresses. */
+struct connect_attempt {
+	evutil_socket_t fd;
+	struct event ev; /* fires when fd is writable, i.e. done connecting. */
+	struct hostname_connect *hc;
+	struct connect_attempt *next;
+};
+
+/* Holds the state of one resolve-then-connect operation, from the moment
+ * we launch the lookups until the last dns callback has been invoked. */
+struct hostname_connect {
+	/* bufferevent to inform of the result.  Set to NULL once we have
+	 * either handed it a socket or reported an error to it. */
+	struct bufferevent *bev;
 	ev_uint16_t port; /* port to connect to, in network order. */
-	struct bufferevent *bev; /* bufferevent to inform of the resolve. */
+	int n_dns_pending; /* number of lookups whose callbacks haven't run. */
+	int started; /* true iff we've started connecting. */
+	int last_family; /* family of the most recent attempt, or AF_UNSPEC */
+
+	/* Addresses we've resolved, and the index of the next one to try. */
+	ev_uint32_t *ipv4_addrs;
+	int n_ipv4, next_ipv4;
+	unsigned char *ipv6_addrs;
+	int n_ipv6, next_ipv6;
+
+	/* Timer to tell us when to start the next attempt. */
+	struct event timer;
+	/* Linked list of connect attempts that haven't succeeded or failed. */
+	struct connect_attempt *attempts;
 };
 
+static int hostname_connect_launch(struct hostname_connect *hc);
+
+/* Release hc if we're done connecting and won't hear from evdns again. */
+static void
+hostname_connect_maybe_free(struct hostname_connect *hc)
+{
+	if (hc->bev || hc->n_dns_pending)
+		return;
+	EVUTIL_ASSERT(!hc->attempts);
+	if (hc->ipv4_addrs)
+		mm_free(hc->ipv4_addrs);
+	if (hc->ipv6_addrs)
+		mm_free(hc->ipv6_addrs);
+	memset(hc, 0, sizeof(*hc));
+	mm_free(hc);
+}
+
+/* Finish the connect operation.  If fd is a connected socket, give it to
+ * the bufferevent.  Otherwise if sa is set, have the bufferevent connect to
+ * it on its own socket.  Otherwise report an error.  Every other connect
+ * attempt is cancelled.  hc may be freed by the time this returns. */
+static void
+hostname_connect_done(struct hostname_connect *hc, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen)
+{
+	struct bufferevent *bev = hc->bev;
+	struct connect_attempt *a, *next;
+
+	for (a = hc->attempts; a; a = next) {
+		next = a->next;
+		event_del(&a->ev);
+		if (a->fd != fd)
+			EVUTIL_CLOSESOCKET(a->fd);
+		mm_free(a);
+	}
+	hc->attempts = NULL;
+	evtimer_del(&hc->timer);
+	hc->bev = NULL;
+
+	BEV_LOCK(bev);
+	if (fd >= 0) {
+		/* The socket is already connected; this just makes the
+		 * bufferevent notice that and report BEV_EVENT_CONNECTED. */
+		bufferevent_setfd(bev, fd);
+		bufferevent_socket_connect(bev, NULL, 0);
+	} else if (sa) {
+		bufferevent_socket_connect(bev, sa, socklen);
+	} else {
+		_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+	}
+	_bufferevent_decref_and_unlock(bev);
+
+	hostname_connect_maybe_free(hc);
+}
+
+/* Return true iff there are addresses we haven't tried yet. */
+static int
+hostname_connect_has_addrs(struct hostname_connect *hc)
+{
+	return hc->next_ipv4 < hc->n_ipv4 || hc->next_ipv6 < hc->n_ipv6;
+}
+
+/* Report failure if there is nothing left that could succeed.  Return 1 if
+ * we did so (and hc may be gone), 0 otherwise. */
+static int
+hostname_connect_check_failure(struct hostname_connect *hc)
+{
+	if (hc->bev && !hc->attempts && !hc->n_dns_pending &&
+	    !hostname_connect_has_addrs(hc)) {
+		hostname_connect_done(hc, -1, NULL, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/* Pick the next address to try, alternating between address families,
+ * and store it in ss.  Return its length, or 0 if there are none left. */
+static int
+hostname_connect_next_addr(struct hostname_connect *hc,
+    struct sockaddr_storage *ss)
+{
+	int family;
+
+	if (hc->last_family == AF_INET6)
+		family = hc->next_ipv4 < hc->n_ipv4 ? AF_INET : AF_INET6;
+	else
+		family = hc->next_ipv6 < hc->n_ipv6 ? AF_INET6 : AF_INET;
+
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET6 && hc->next_ipv6 < hc->n_ipv6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = hc->port;
+		memcpy(sin6->sin6_addr.s6_addr,
+		    hc->ipv6_addrs + 16 * hc->next_ipv6++, 16);
+		hc->last_family = AF_INET6;
+		return sizeof(struct sockaddr_in6);
+	} else if (family == AF_INET && hc->next_ipv4 < hc->n_ipv4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = hc->port;
+		sin->sin_addr.s_addr = hc->ipv4_addrs[hc->next_ipv4++];
+		hc->last_family = AF_INET;
+		return sizeof(struct sockaddr_in);
+	}
+	return 0;
+}
+
+/* Callback: Invoked when one of our connect attempts is done connecting,
+ * successfully or not. */
+static void
+connect_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct connect_attempt *a = arg, **ap;
+	struct hostname_connect *hc = a->hc;
+	int r;
+
+	r = evutil_socket_finished_connecting(fd);
+	if (r == 0) {
+		event_add(&a->ev, NULL);
+		return;
+	} else if (r == 1) {
+		/* We have a winner. */
+		hostname_connect_done(hc, fd, NULL, 0);
+		return;
+	}
+
+	/* This one failed; don't wait for the timer to try the next one. */
+	for (ap = &hc->attempts; *ap != a; ap = &(*ap)->next)
+		;
+	*ap = a->next;
+	EVUTIL_CLOSESOCKET(a->fd);
+	mm_free(a);
+
+	hostname_connect_launch(hc);
+}
+
+/* Callback: Invoked when it's time to start another connect attempt. */
+static void
+hostname_connect_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	hostname_connect_launch(arg);
+}
+
+/* Start a connect attempt to the next address we haven't tried.  Return
+ * 1 if the connect operation finished (and hc may be gone), 0 otherwise. */
+static int
+hostname_connect_launch(struct hostname_connect *hc)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr *sa = (struct sockaddr *)&ss;
+	struct connect_attempt *a;
+	struct timeval tv;
+	evutil_socket_t fd;
+	int socklen, r;
+
+	hc->started = 1;
+	while ((socklen = hostname_connect_next_addr(hc, &ss))) {
+		if (bufferevent_getfd(hc->bev) >= 0) {
+			/* The caller gave us a socket to use, so we can't
+			 * race; let the bufferevent connect it. */
+			hostname_connect_done(hc, -1, sa, socklen);
+			return 1;
+		}
+
+		fd = -1;
+		r = evutil_socket_connect(&fd, sa, socklen);
+		if (r < 0)
+			continue;
+		if (r == 1) {
+			hostname_connect_done(hc, fd, NULL, 0);
+			return 1;
+		}
+
+		if (!(a = mm_calloc(1, sizeof(*a)))) {
+			EVUTIL_CLOSESOCKET(fd);
+			continue;
+		}
+		a->fd = fd;
+		a->hc = hc;
+		event_assign(&a->ev, hc->bev->ev_base, fd, EV_WRITE,
+		    connect_attempt_cb, a);
+		event_add(&a->ev, NULL);
+		a->next = hc->attempts;
+		hc->attempts = a;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = CONNECT_ATTEMPT_DELAY_MSEC * 1000;
+		evtimer_add(&hc->timer, &tv);
+		return 0;
+	}
+
+	return hostname_connect_check_failure(hc);
+}
+
 /* Callback: Invoked when we are done resolving (or failing to resolve) the
- * hostname */
+ * hostname for one address family. */
 static void
 dns_reply_callback(int result, char type, int count, int ttl, void *addresses,
     void *arg)
 {
-	struct resolveinfo *info = arg;
-	struct sockaddr_in sin;
-	struct sockaddr_in6 sin6;
-	struct sockaddr *sa = NULL;
-	int socklen;
-
-	EVUTIL_ASSERT(info->bev);
-	BEV_LOCK(info->bev);
-
-	if (result != DNS_ERR_NONE || count == 0) {
-		_bufferevent_run_eventcb(info->bev, BEV_EVENT_ERROR);
-		_bufferevent_decref_and_unlock(info->bev);
-		memset(info, 0, sizeof(*info));
-		mm_free(info);
+	struct hostname_connect *hc = arg;
+	void *copy;
+
+	--hc->n_dns_pending;
+	if (!hc->bev) {
+		/* We already connected or gave up. */
+		hostname_connect_maybe_free(hc);
 		return;
 	}
 
-	if (type == DNS_IPv4_A) {
-		EVUTIL_ASSERT(info->family == AF_INET);
-		memset(&sin, 0, sizeof(sin));
-		sin.sin_family = AF_INET;
-		sin.sin_port = info->port;
-		/* XXX handle multiple addresses better */
-		sin.sin_addr.s_addr = *(ev_uint32_t*)addresses;
-		sa = (struct sockaddr*)&sin;
-		socklen = sizeof(sin);
-	} else if (type == DNS_IPv6_AAAA) {
-		EVUTIL_ASSERT(info->family == AF_INET6);
-		memset(&sin6, 0, sizeof(sin6));
-		sin6.sin6_family = AF_INET;
-		sin6.sin6_port = info->port;
-		/* XXX handle multiple addresses better */
-		memcpy(sin6.sin6_addr.s6_addr, addresses, 16);
-		sa = (struct sockaddr*)&sin6;
-		socklen = sizeof(sin6);
-	} else {
-		EVUTIL_ASSERT(info->family == AF_INET ||
-		    info->family == AF_INET6);
-		return; /* unreachable */
+	if (result == DNS_ERR_NONE && count > 0) {
+		if (type == DNS_IPv4_A && !hc->ipv4_addrs &&
+		    (copy = mm_malloc(count * 4))) {
+			memcpy(copy, addresses, count * 4);
+			hc->ipv4_addrs = copy;
+			hc->n_ipv4 = count;
+		} else if (type == DNS_IPv6_AAAA && !hc->ipv6_addrs &&
+		    (copy = mm_malloc(count * 16))) {
+			memcpy(copy, addresses, count * 16);
+			hc->ipv6_addrs = copy;
+			hc->n_ipv6 = count;
+		}
+	}
+
+	if (!hc->started) {
+		if (hc->n_ipv6 || (hc->n_ipv4 && !hc->n_dns_pending)) {
+			hostname_connect_launch(hc);
+			return;
+		} else if (hc->n_ipv4) {
+			/* Give the AAAA answer a moment to show up, so we can
+			 * try IPv6 first. */
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = RESOLUTION_DELAY_MSEC * 1000;
+			evtimer_add(&hc->timer, &tv);
+			return;
+		}
+	} else if (!hc->attempts) {
+		/* Everything we tried so far failed; try the new addresses
+		 * right away. */
+		hostname_connect_launch(hc);
+		return;
 	}
 
-	bufferevent_socket_connect(info->bev, sa, socklen);
-	_bufferevent_decref_and_unlock(info->bev);
-	memset(info, 0, sizeof(*info));
-	mm_free(info);
+	hostname_connect_check_failure(hc);
 }
 
 /* Implements the asynchronous-resolve side of
@@ -133,35 +373,36 @@ _bufferevent_socket_connect_hostname_evdns(
 	const char *hostname,
 	int port)
 {
-	struct evdns_request *r;
-	struct resolveinfo *resolveinfo;
+	struct hostname_connect *hc;
 
-	if (family == AF_UNSPEC)
-		family = AF_INET; /* XXXX handle "unspec" correctly */
-	if (family != AF_INET && family != AF_INET6)
+	if (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC)
 		return -1;
 	if (!bufev || !evdns_base || !hostname)
 		return -1;
 	if (port < 1 || port > 65535)
 		return -1;
 
-	resolveinfo = mm_calloc(1, sizeof(resolveinfo));
-	if (!resolveinfo)
+	hc = mm_calloc(1, sizeof(*hc));
+	if (!hc)
 		return -1;
-	resolveinfo->family = family;
-	resolveinfo->port = htons(port);
-	resolveinfo->bev = bufev;
+	hc->port = htons(port);
+	hc->bev = bufev;
+	hc->last_family = AF_UNSPEC;
+	evtimer_assign(&hc->timer, bufev->ev_base, hostname_connect_timer_cb,
+	    hc);
 
-	if (family == AF_INET) {
-		r = evdns_base_resolve_ipv4(evdns_base, hostname, 0,
-		    dns_reply_callback, resolveinfo);
-	} else {
-		r = evdns_base_resolve_ipv6(evdns_base, hostname, 0,
-		    dns_reply_callback, resolveinfo);
-	}
+	/* Set n_dns_pending before we launch anything, so that the first
+	 * callback doesn't think it's the last. */
+	hc->n_dns_pending = (family == AF_UNSPEC) ? 2 : 1;
+	if (family != AF_INET6 && !evdns_base_resolve_ipv4(evdns_base,
+		hostname, 0, dns_reply_callback, hc))
+		--hc->n_dns_pending;
+	if (family != AF_INET && !evdns_base_resolve_ipv6(evdns_base,
+		hostname, 0, dns_reply_callback, hc))
+		--hc->n_dns_pending;
 
-	if (!r) {
-		mm_free(resolveinfo);
+	if (!hc->n_dns_pending) {
+		mm_free(hc);
 		return -1;
 	}
 
@@ -171,4 +412,3 @@ _bufferevent_socket_connect_hostname_evdns(
 	bufferevent_incref(bufev);
 	return 0;
 }
-
@@ -70,6 +70,7 @@
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "util-internal.h"
+#include "uring-internal.h"
 #ifdef WIN32
 #include "iocp-internal.h"
 #endif
@@ -98,6 +99,34 @@ const struct bufferevent_ops bufferevent_ops_socket = {
 #define be_socket_add(ev, t)			\
 	_bufferevent_add_event((ev), (t))
 
+/* With BEV_OPT_EDGE_TRIGGERED, the most we read or write in one callback
+ * before giving the other active events a turn. */
+#define MAX_EDGE_TRIGGERED_IO (128*1024)
+
+/* Return the flags for our read and write events: edge-triggered if we were
+ * asked for that, and the backend can do it. */
+static short
+be_socket_ev_flags(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if ((bufev_p->options & BEV_OPT_EDGE_TRIGGERED) && bufev->ev_base &&
+	    (event_base_get_features(bufev->ev_base) & EV_FEATURE_ET))
+		return EV_PERSIST|EV_ET;
+	return EV_PERSIST;
+}
+
+/* An edge-triggered event won't tell us again about data (or space) that
+ * is already there, so if we stop before the socket would block, we have to
+ * come back ourselves: once the other active events have had their turn. */
+static void
+be_socket_run_again(struct event *ev, short what)
+{
+	if (event_pending(ev, what, NULL))
+		event_active(ev, what, 1);
+}
+
 static void
 bufferevent_socket_outbuf_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *cbinfo,
@@ -119,9 +148,10 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 {
 	struct bufferevent *bufev = arg;
 	struct evbuffer *input;
-	int res = 0;
+	int res = 0, n_read = 0;
 	short what = BEV_EVENT_READING;
 	int howmuch = -1;
+	int et = bufev->ev_read.ev_events & EV_ET;
 
 	_bufferevent_incref_and_lock(bufev);
 
@@ -130,6 +160,10 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 		goto error;
 	}
 
+	/* Notifications for MSG_ZEROCOPY sends make the socket look
+	 * readable until somebody reads them. */
+	evbuffer_zerocopy_reap(bufev->output, fd);
+
 	input = bufev->input;
 
 	/*
@@ -145,10 +179,34 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 		}
 	}
 
+	if (et && (howmuch < 0 || howmuch > MAX_EDGE_TRIGGERED_IO))
+		howmuch = MAX_EDGE_TRIGGERED_IO;
+
+	/* Edge-triggered, we keep reading until the socket runs dry, or we
+	 * have read as much as we're allowed to. */
 	evbuffer_unfreeze(input, 0);
-	res = evbuffer_read(input, fd, howmuch);
+	do {
+		res = evbuffer_read(input, fd, howmuch);
+		if (res > 0) {
+			n_read += res;
+			howmuch -= res;
+		}
+	} while (et && res > 0 && howmuch > 0);
 	evbuffer_freeze(input, 0);
 
+	if (et && res > 0) {
+		be_socket_run_again(&bufev->ev_read, EV_READ);
+	} else if (n_read && res <= 0) {
+		/* We got some data before the socket ran dry, or hit EOF or
+		 * an error.  Hand over the data first: if it was EOF or an
+		 * error, we'll see it (or, after a reset, an EOF) again when
+		 * we next read. */
+		if (res == 0 ||
+		    !EVUTIL_ERR_RW_RETRIABLE(evutil_socket_geterror(fd)))
+			be_socket_run_again(&bufev->ev_read, EV_READ);
+		res = n_read;
+	}
+
 	if (res == -1) {
 		int err = evutil_socket_geterror(fd);
 		if (EVUTIL_ERR_RW_RETRIABLE(err))
@@ -191,6 +249,7 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	int res = 0;
 	short what = BEV_EVENT_WRITING;
 	int connected = 0;
+	int et = bufev->ev_write.ev_events & EV_ET;
 
 	_bufferevent_incref_and_lock(bufev);
 
@@ -221,14 +280,28 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	}
 
 	if (evbuffer_get_length(bufev->output)) {
+		int n_written = 0;
+		/* Edge-triggered, we keep writing until the socket is full,
+		 * or we have written as much as we're allowed to. */
 		evbuffer_unfreeze(bufev->output, 1);
-		res = evbuffer_write(bufev->output, fd);
+		do {
+			res = evbuffer_write(bufev->output, fd);
+			if (res > 0)
+				n_written += res;
+		} while (et && res > 0 && n_written < MAX_EDGE_TRIGGERED_IO &&
+		    evbuffer_get_length(bufev->output));
 		evbuffer_freeze(bufev->output, 1);
+		if (et && res > 0 && evbuffer_get_length(bufev->output))
+			be_socket_run_again(&bufev->ev_write, EV_WRITE);
 		if (res == -1) {
 			int err = evutil_socket_geterror(fd);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				goto reschedule;
-			what |= BEV_EVENT_ERROR;
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				if (!n_written)
+					goto reschedule;
+				res = n_written;
+			} else {
+				what |= BEV_EVENT_ERROR;
+			}
 		} else if (res == 0) {
 			/* eof case
 			   XXXX Actually, a 0 on write doesn't indicate
@@ -277,6 +350,10 @@ bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
 	if (base && event_base_get_iocp(base))
 		return bufferevent_async_new(base, fd, options);
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	if (base && event_base_get_uring(base))
+		return bufferevent_uring_new(base, fd, options);
+#endif
 
 	if ((bufev_p = mm_calloc(1, sizeof(struct bufferevent_private)))== NULL)
 		return NULL;
@@ -289,9 +366,9 @@ bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
 	bufev = &bufev_p->bev;
 
 	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
+	    EV_READ|be_socket_ev_flags(bufev), bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	    EV_WRITE|be_socket_ev_flags(bufev), bufferevent_writecb, bufev);
 
 	evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb, bufev);
 
@@ -329,6 +406,20 @@ bufferevent_socket_connect(struct bufferevent *bev,
 			goto done;
 		ownfd = 1;
 	}
+#ifdef _EVENT_HAVE_IO_URING
+	if (BEV_IS_URING(bev)) {
+		/* Nothing gets read or written until the kernel has
+		 * connected us. */
+		bufev_p->connecting = 1;
+		bufferevent_setfd(bev, fd);
+		if (bufferevent_uring_connect(bev, fd, sa, socklen) < 0) {
+			bufev_p->connecting = 0;
+			goto freesock;
+		}
+		result = 0;
+		goto done;
+	}
+#endif
 	if (sa) {
 #ifdef WIN32
 		if (bufferevent_async_can_connect(bev)) {
@@ -549,9 +640,9 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 	event_del(&bufev->ev_write);
 
 	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
+	    EV_READ|be_socket_ev_flags(bufev), bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	    EV_WRITE|be_socket_ev_flags(bufev), bufferevent_writecb, bufev);
 	BEV_UNLOCK(bufev);
 }
 
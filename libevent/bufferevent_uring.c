@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event-config.h"
+
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "event2/util.h"
+#include "event2/bufferevent.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent_struct.h"
+#include "event2/event.h"
+#include "log-internal.h"
+#include "mm-internal.h"
+#include "bufferevent-internal.h"
+#include "util-internal.h"
+#include "uring-internal.h"
+
+/* prototypes */
+static int be_uring_enable(struct bufferevent *, short);
+static int be_uring_disable(struct bufferevent *, short);
+static void be_uring_destruct(struct bufferevent *);
+static int be_uring_flush(struct bufferevent *, short, enum bufferevent_flush_mode);
+static int be_uring_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
+
+const struct bufferevent_ops bufferevent_ops_uring = {
+	"socket_uring",
+	0,
+	be_uring_enable,
+	be_uring_disable,
+	be_uring_destruct,
+	_bufferevent_generic_adj_timeouts,
+	be_uring_flush,
+	be_uring_ctrl,
+};
+
+/*
+ * A bufferevent that has the kernel do its reads and writes through the
+ * event_base's event_uring_port, rather than waiting to be told that the
+ * socket is ready.  Every operation the kernel has holds a reference to the
+ * bufferevent, so freeing it cancels them all, and the memory goes away
+ * once the last of them comes back.
+ */
+struct bufferevent_uring {
+	struct bufferevent_private bev;
+	struct event_uring_port *port;
+	evutil_socket_t fd;
+	struct evbuffer_uring_io read_io;
+	struct evbuffer_uring_io write_io;
+	struct event_uring_op connect_op;
+	/* The kernel reads this when the connect is handed over, not when we
+	 * queue it, so it has to outlive bufferevent_uring_connect(). */
+	struct sockaddr_storage connect_addr;
+	int connect_addrlen;
+	unsigned connect_in_progress : 1;
+	/* Set if we're connecting with a poll rather than a connect. */
+	unsigned connect_poll : 1;
+	/* Set after EOF or an error on read; we don't read again until we
+	 * get a new fd. */
+	unsigned read_stopped : 1;
+	/* As read_stopped, for writes. */
+	unsigned write_stopped : 1;
+	/* Set if the last read ran out of provided buffers. */
+	unsigned read_no_pbuf : 1;
+	/* Set once the user has freed us: start nothing new. */
+	unsigned unlinked : 1;
+};
+
+static inline struct bufferevent_uring *
+upcast(struct bufferevent *bev)
+{
+	struct bufferevent_uring *bev_u;
+	if (bev->be_ops != &bufferevent_ops_uring)
+		return NULL;
+	bev_u = EVUTIL_UPCAST(bev, struct bufferevent_uring, bev.bev);
+	EVUTIL_ASSERT(bev_u->bev.bev.be_ops == &bufferevent_ops_uring);
+	return bev_u;
+}
+
+static void
+bev_uring_consider_writing(struct bufferevent_uring *b)
+{
+	struct bufferevent *bev = &b->bev.bev;
+
+	/* Don't write if there's a write in progress, or we do not
+	 * want to write. */
+	if (b->write_io.in_progress || !(bev->enabled&EV_WRITE))
+		return;
+	if (b->fd < 0 || b->bev.connecting || b->write_stopped || b->unlinked)
+		return;
+	/* Don't write if there's nothing to write */
+	if (!evbuffer_get_length(bev->output))
+		return;
+
+	if (evbuffer_uring_launch_write(&b->write_io, b->port, b->fd,
+		bev->output, -1) < 0) {
+		b->write_stopped = 1;
+		_bufferevent_run_eventcb(bev,
+		    BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+	} else {
+		bufferevent_incref(bev);
+	}
+}
+
+static void
+bev_uring_consider_reading(struct bufferevent_uring *b)
+{
+	struct bufferevent *bev = &b->bev.bev;
+	size_t cur_size;
+	size_t read_high;
+	size_t at_most;
+
+	/* Don't read if there is a read in progress, or we do not
+	 * want to read. */
+	if (b->read_io.in_progress || !(bev->enabled&EV_READ) ||
+	    b->bev.read_suspended)
+		return;
+	if (b->fd < 0 || b->bev.connecting || b->read_stopped || b->unlinked)
+		return;
+
+	/* Don't read if we're full */
+	cur_size = evbuffer_get_length(bev->input);
+	read_high = bev->wm_read.high;
+	if (read_high) {
+		if (cur_size >= read_high)
+			return;
+		at_most = read_high - cur_size;
+	} else {
+		at_most = 16384;
+	}
+
+	if (evbuffer_uring_launch_read(&b->read_io, b->port, b->fd,
+		bev->input, at_most, !b->read_no_pbuf) < 0) {
+		b->read_stopped = 1;
+		_bufferevent_run_eventcb(bev,
+		    BEV_EVENT_READING|BEV_EVENT_ERROR);
+	} else {
+		b->read_no_pbuf = 0;
+		bufferevent_incref(bev);
+	}
+}
+
+static void
+read_done(struct evbuffer_uring_io *io, int res)
+{
+	struct bufferevent_uring *b =
+	    EVUTIL_UPCAST(io, struct bufferevent_uring, read_io);
+	struct bufferevent *bev = &b->bev.bev;
+
+	/* We still have the reference we took when the read started. */
+	BEV_LOCK(bev);
+	if (res > 0) {
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		if (evbuffer_get_length(bev->input) >= bev->wm_read.low &&
+		    bev->readcb != NULL)
+			_bufferevent_run_readcb(bev);
+		bev_uring_consider_reading(b);
+	} else if (res == -ECANCELED || res == -EAGAIN || res == -EINTR) {
+		bev_uring_consider_reading(b);
+	} else if (res == -ENOBUFS) {
+		/* Every provided buffer is in use; read into our own. */
+		b->read_no_pbuf = 1;
+		bev_uring_consider_reading(b);
+	} else {
+		b->read_stopped = 1;
+		if (res == 0) {
+			_bufferevent_run_eventcb(bev,
+			    BEV_EVENT_READING|BEV_EVENT_EOF);
+		} else {
+			EVUTIL_SET_SOCKET_ERROR(-res);
+			_bufferevent_run_eventcb(bev,
+			    BEV_EVENT_READING|BEV_EVENT_ERROR);
+		}
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+write_done(struct evbuffer_uring_io *io, int res)
+{
+	struct bufferevent_uring *b =
+	    EVUTIL_UPCAST(io, struct bufferevent_uring, write_io);
+	struct bufferevent *bev = &b->bev.bev;
+
+	BEV_LOCK(bev);
+	if (res > 0) {
+		BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
+		if (bev->writecb != NULL &&
+		    evbuffer_get_length(bev->output) <= bev->wm_write.low)
+			_bufferevent_run_writecb(bev);
+		bev_uring_consider_writing(b);
+	} else if (res == 0 || res == -ECANCELED || res == -EAGAIN ||
+	    res == -EINTR) {
+		bev_uring_consider_writing(b);
+	} else {
+		b->write_stopped = 1;
+		EVUTIL_SET_SOCKET_ERROR(-res);
+		_bufferevent_run_eventcb(bev,
+		    BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+be_uring_outbuf_callback(struct evbuffer *buf,
+    const struct evbuffer_cb_info *cbinfo,
+    void *arg)
+{
+	struct bufferevent *bev = arg;
+	struct bufferevent_uring *bev_u = upcast(bev);
+
+	/* If we added data to the outbuf and were not writing before, we
+	 * may want to write now.  (Data that we've sent gets drained
+	 * while we finish a write, and write_done handles that.) */
+	if (cbinfo->n_added) {
+		_bufferevent_incref_and_lock(bev);
+		bev_uring_consider_writing(bev_u);
+		_bufferevent_decref_and_unlock(bev);
+	}
+}
+
+static int
+be_uring_enable(struct bufferevent *buf, short what)
+{
+	struct bufferevent_uring *bev_u = upcast(buf);
+
+	_bufferevent_generic_adj_timeouts(buf);
+
+	/* If we newly enable reading or writing, and we aren't reading or
+	   writing already, consider launching a new read or write. */
+
+	if (what & EV_READ)
+		bev_uring_consider_reading(bev_u);
+	if (what & EV_WRITE)
+		bev_uring_consider_writing(bev_u);
+	return 0;
+}
+
+static int
+be_uring_disable(struct bufferevent *bev, short what)
+{
+	struct bufferevent_uring *bev_u = upcast(bev);
+
+	_bufferevent_generic_adj_timeouts(bev);
+
+	/* A read that's waiting for data would otherwise hand it to us
+	 * whenever it showed up, so take it back.  A write has already
+	 * taken its data out of the user's hands; let it finish. */
+	if ((what & EV_READ) && bev_u->read_io.in_progress)
+		event_uring_port_cancel(bev_u->port, &bev_u->read_io.op);
+
+	return 0;
+}
+
+static void
+be_uring_destruct(struct bufferevent *bev)
+{
+	struct bufferevent_uring *bev_u = upcast(bev);
+
+	/* Each operation holds a reference, so they're all done. */
+	EVUTIL_ASSERT(!bev_u->read_io.in_progress &&
+	    !bev_u->write_io.in_progress && !bev_u->connect_in_progress);
+
+	_bufferevent_del_generic_timeout_cbs(bev);
+	evbuffer_uring_io_clear(&bev_u->read_io);
+	evbuffer_uring_io_clear(&bev_u->write_io);
+
+	if ((bev_u->bev.options & BEV_OPT_CLOSE_ON_FREE) && bev_u->fd >= 0)
+		EVUTIL_CLOSESOCKET(bev_u->fd);
+}
+
+static int
+be_uring_flush(struct bufferevent *bev, short what,
+    enum bufferevent_flush_mode mode)
+{
+	return 0;
+}
+
+static int
+uring_submit_connect(struct bufferevent_uring *b)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.fd = b->fd;
+	if (b->connect_poll) {
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.poll32_events = POLLOUT;
+	} else {
+		sqe.opcode = IORING_OP_CONNECT;
+		sqe.addr = (ev_uint64_t)(uintptr_t)&b->connect_addr;
+		sqe.off = b->connect_addrlen;
+	}
+	return event_uring_port_submit(b->port, &sqe, &b->connect_op);
+}
+
+static void
+connect_complete(struct event_uring_op *op, int res, unsigned flags)
+{
+	struct bufferevent_uring *b =
+	    EVUTIL_UPCAST(op, struct bufferevent_uring, connect_op);
+	struct bufferevent *bev = &b->bev.bev;
+
+	BEV_LOCK(bev);
+
+	EVUTIL_ASSERT(b->bev.connecting);
+	b->connect_in_progress = 0;
+
+	if (b->connect_poll && res >= 0) {
+		int c = evutil_socket_finished_connecting(b->fd);
+		if (c == 0) {
+			if (!b->unlinked && uring_submit_connect(b) == 0) {
+				/* Not yet; keep our reference. */
+				b->connect_in_progress = 1;
+				BEV_UNLOCK(bev);
+				return;
+			}
+			res = -ECANCELED;
+		} else {
+			res = c < 0 ? -EVUTIL_SOCKET_ERROR() : 0;
+		}
+	}
+
+	b->bev.connecting = 0;
+	if (res < 0) {
+		EVUTIL_SET_SOCKET_ERROR(-res);
+		_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+	} else {
+		_bufferevent_run_eventcb(bev, BEV_EVENT_CONNECTED);
+		bev_uring_consider_reading(b);
+		bev_uring_consider_writing(b);
+	}
+
+	_bufferevent_decref_and_unlock(bev);
+}
+
+struct bufferevent *
+bufferevent_uring_new(struct event_base *base,
+    evutil_socket_t fd, int options)
+{
+	struct bufferevent_uring *bev_u;
+	struct bufferevent *bev;
+	struct event_uring_port *port;
+
+	if (!(port = event_base_get_uring(base)))
+		return NULL;
+
+	if (!(bev_u = mm_calloc(1, sizeof(struct bufferevent_uring))))
+		return NULL;
+
+	if (bufferevent_init_common(&bev_u->bev, base, &bufferevent_ops_uring,
+		options)<0) {
+		mm_free(bev_u);
+		return NULL;
+	}
+	bev = &bev_u->bev.bev;
+
+	bev_u->port = port;
+	bev_u->fd = fd;
+	bev_u->read_io.done = read_done;
+	bev_u->write_io.done = write_done;
+	bev_u->connect_op.cb = connect_complete;
+
+	evbuffer_add_cb(bev->output, be_uring_outbuf_callback, bev);
+	_bufferevent_init_generic_timeout_cbs(bev);
+
+	return bev;
+}
+
+int
+bufferevent_uring_connect(struct bufferevent *bev, evutil_socket_t fd,
+    const struct sockaddr *sa, int socklen)
+{
+	struct bufferevent_uring *bev_u = upcast(bev);
+
+	EVUTIL_ASSERT(bev_u && fd >= 0 && fd == bev_u->fd);
+	if (bev_u->connect_in_progress)
+		return -1;
+
+	if (sa) {
+		if ((size_t)socklen > sizeof(bev_u->connect_addr))
+			return -1;
+		memcpy(&bev_u->connect_addr, sa, socklen);
+		bev_u->connect_addrlen = socklen;
+		bev_u->connect_poll = 0;
+	} else {
+		/* Someone else called connect(); wait for it to finish. */
+		bev_u->connect_poll = 1;
+	}
+
+	if (uring_submit_connect(bev_u) < 0)
+		return -1;
+	bev_u->connect_in_progress = 1;
+	bufferevent_incref(bev);
+	return 0;
+}
+
+static int
+be_uring_ctrl(struct bufferevent *bev, enum bufferevent_ctrl_op op,
+    union bufferevent_ctrl_data *data)
+{
+	struct bufferevent_uring *bev_u = upcast(bev);
+
+	switch (op) {
+	case BEV_CTRL_GET_FD:
+		data->fd = bev_u->fd;
+		return 0;
+	case BEV_CTRL_SET_FD:
+		bev_u->fd = data->fd;
+		bev_u->read_stopped = bev_u->write_stopped = 0;
+		bev_uring_consider_reading(bev_u);
+		bev_uring_consider_writing(bev_u);
+		return 0;
+	case BEV_CTRL_CANCEL_ALL:
+		/* The user is done with us.  Nothing we finish from here on
+		 * should reach their callbacks. */
+		bev_u->unlinked = 1;
+		bev->readcb = bev->writecb = NULL;
+		bev->errorcb = NULL;
+		_bufferevent_del_generic_timeout_cbs(bev);
+		if (bev_u->read_io.in_progress)
+			event_uring_port_cancel(bev_u->port,
+			    &bev_u->read_io.op);
+		if (bev_u->write_io.in_progress)
+			event_uring_port_cancel(bev_u->port,
+			    &bev_u->write_io.op);
+		if (bev_u->connect_in_progress)
+			event_uring_port_cancel(bev_u->port,
+			    &bev_u->connect_op);
+		return 0;
+	case BEV_CTRL_GET_UNDERLYING:
+	default:
+		return -1;
+	}
+}
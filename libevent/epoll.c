@@ -43,6 +43,10 @@
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#if defined(_EVENT_HAVE_SYS_TIMERFD_H) && defined(_EVENT_HAVE_TIMERFD_CREATE)
+#include <sys/timerfd.h>
+#define USING_TIMERFD
+#endif
 
 #include "event-internal.h"
 #include "evsignal-internal.h"
@@ -55,6 +59,12 @@ struct epollop {
 	struct epoll_event *events;
 	int nevents;
 	int epfd;
+	/* With EVENT_BASE_FLAG_PRECISE_TIMER, how we wait for less than a
+	 * millisecond: either epoll_pwait2(), which takes a timespec, or a
+	 * timerfd in the epoll set.  timerfd is -1 if we aren't using one. */
+	int use_pwait2;
+	int timerfd;
+	int timerfd_armed;
 };
 
 static void *epoll_init	(struct event_base *);
@@ -95,6 +105,43 @@ const struct eventop epollops = {
  */
 #define MAX_EPOLL_TIMEOUT_MSEC (35*60*1000)
 
+/* Set epollop up to wait with microsecond precision, if we can.  If we
+ * can't, we just round up to the next millisecond as usual. */
+static void
+epoll_init_precise_timer(struct epollop *epollop)
+{
+#ifdef _EVENT_HAVE_EPOLL_PWAIT2
+	struct timespec ts = { 0, 0 };
+
+	/* The C library may know about epoll_pwait2 when the kernel
+	 * (before 5.11) doesn't. */
+	if (epoll_pwait2(epollop->epfd, epollop->events, 1, &ts, NULL) >= 0) {
+		epollop->use_pwait2 = 1;
+		return;
+	}
+#endif
+#ifdef USING_TIMERFD
+	{
+		struct epoll_event epev = {0, {0}};
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+		if (fd < 0) {
+			event_warn("timerfd_create");
+			return;
+		}
+		FD_CLOSEONEXEC(fd);
+		epev.data.fd = fd;
+		epev.events = EPOLLIN;
+		if (epoll_ctl(epollop->epfd, EPOLL_CTL_ADD, fd, &epev) == -1) {
+			event_warn("epoll_ctl(timerfd)");
+			close(fd);
+			return;
+		}
+		epollop->timerfd = fd;
+	}
+#endif
+}
+
 static void *
 epoll_init(struct event_base *base)
 {
@@ -123,6 +170,10 @@ epoll_init(struct event_base *base)
 		return (NULL);
 	}
 	epollop->nevents = INITIAL_NEVENT;
+	epollop->timerfd = -1;
+
+	if (base->flags & EVENT_BASE_FLAG_PRECISE_TIMER)
+		epoll_init_precise_timer(epollop);
 
 	evsig_init(base);
 
@@ -134,19 +185,54 @@ epoll_dispatch(struct event_base *base, struct timeval *tv)
 {
 	struct epollop *epollop = base->evbase;
 	struct epoll_event *events = epollop->events;
-	int i, res, timeout = -1;
+	int i, res, timeout = -1, precise = 0;
 
-	if (tv != NULL)
+	if (tv != NULL) {
 		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+		/* Rounding up to a whole millisecond would make us late. */
+		precise = (tv->tv_usec % 1000) != 0 &&
+		    (epollop->use_pwait2 || epollop->timerfd >= 0);
+	}
 
 	if (timeout > MAX_EPOLL_TIMEOUT_MSEC) {
 		/* Linux kernels can wait forever if the timeout is too big;
 		 * see comment on MAX_EPOLL_TIMEOUT_MSEC. */
 		timeout = MAX_EPOLL_TIMEOUT_MSEC;
+		precise = 0;
 	}
 
+#ifdef USING_TIMERFD
+	if (epollop->timerfd >= 0 && (precise || epollop->timerfd_armed)) {
+		/* Arming the timer, or disarming it if this wait doesn't
+		 * need it, also clears any expiry we haven't read. */
+		struct itimerspec is;
+
+		memset(&is, 0, sizeof(is));
+		if (precise) {
+			is.it_value.tv_sec = tv->tv_sec;
+			is.it_value.tv_nsec = tv->tv_usec * 1000;
+			timeout = -1;
+		}
+		if (timerfd_settime(epollop->timerfd, 0, &is, NULL) == -1) {
+			event_warn("timerfd_settime");
+		} else {
+			epollop->timerfd_armed = precise;
+		}
+	}
+#endif
+
 	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 
+#ifdef _EVENT_HAVE_EPOLL_PWAIT2
+	if (precise && epollop->use_pwait2) {
+		struct timespec ts;
+
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		res = epoll_pwait2(epollop->epfd, events, epollop->nevents,
+		    &ts, NULL);
+	} else
+#endif
 	res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
 
 	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
@@ -181,6 +267,8 @@ epoll_dispatch(struct event_base *base, struct timeval *tv)
 
 		if (!events)
 			continue;
+		if (events[i].data.fd == epollop->timerfd)
+			continue;
 
 		evmap_io_active(base, events[i].data.fd, ev | EV_ET);
 	}
@@ -256,6 +344,9 @@ epoll_del(struct event_base *base, int fd, short old, short events, void *p)
 			res = EPOLLIN;
 			op = EPOLL_CTL_MOD;
 		}
+		/* Whatever is left stays edge-triggered, if it was. */
+		if (op == EPOLL_CTL_MOD && (events & EV_ET))
+			res |= EPOLLET;
 	}
 
 	epev.data.fd = fd;
@@ -277,6 +368,8 @@ epoll_dealloc(struct event_base *base)
 		mm_free(epollop->events);
 	if (epollop->epfd >= 0)
 		close(epollop->epfd);
+	if (epollop->timerfd >= 0)
+		close(epollop->timerfd);
 
 	memset(epollop, 0, sizeof(struct epollop));
 	mm_free(epollop);
@@ -67,6 +67,7 @@ struct evbuffer_cb_entry {
 };
 
 struct evbuffer_chain;
+struct evbuffer_write_state;
 struct evbuffer {
 	/** The first chain in this buffer's linked list of chains. */
 	struct evbuffer_chain *first;
@@ -133,10 +134,97 @@ struct evbuffer {
 	 * invoked from the event loop. */
 	struct deferred_cb deferred;
 
+	/** Chains holding fewer bytes than this are merged by
+	 * evbuffer_compact(); 0 if we never compact. */
+	size_t compact_small_size;
+	/** Compact once this many small chains have been appended. */
+	unsigned compact_max_small;
+	/** How many small chains have been appended since we last
+	 * compacted. */
+	unsigned n_small_added;
+	/** What compaction has done so far. */
+	struct evbuffer_compaction_stats compact_stats;
+
+	/** EVBUFFER_WRITE_* flags set with evbuffer_set_write_flags(). */
+	unsigned write_flags;
+	/** What we know about the socket we write to; allocated the first
+	 * time write_flags are set. */
+	struct evbuffer_write_state *write_state;
+
+	/** The account that chains allocated for this buffer are charged
+	 * to, besides the global one; see evbuffer_set_memory_base(). */
+	struct evbuffer_mem_account *mem_account;
+	/** True iff we refuse to allocate chains while the global memory
+	 * cap is exceeded; see evbuffer_set_memory_limited(). */
+	unsigned mem_limited : 1;
+	/** EVBUFFER_ALLOC_* flags set with evbuffer_set_alloc_flags(). */
+	unsigned alloc_flags;
+
 	/** A doubly-linked-list of callback functions */
 	TAILQ_HEAD(evbuffer_cb_queue, evbuffer_cb_entry) callbacks;
 };
 
+/** A count of the chain memory allocated on behalf of some evbuffers:
+ * those charged to one event_base, or all of them. */
+struct evbuffer_mem_account {
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	/** Protects refcnt, used and peak, unless we have atomic operations
+	 * to update them with; see buffer.c. */
+	void *lock;
+#endif
+	/** One for whoever made the account, plus one for each evbuffer
+	 * that charges chains to it and one for each chain charged to it. */
+	int refcnt;
+	/** Bytes of chain memory charged to the account right now. */
+	size_t used;
+	/** The most that 'used' has ever been. */
+	size_t peak;
+	/** The NUMA node where the event loop last ran, or -1 if we don't
+	 * know.  Huge page chains go there; see EVBUFFER_ALLOC_HUGE_PAGES. */
+	int numa_node;
+	/** True once an evbuffer charged to this account has allocated a
+	 * chain with EVBUFFER_ALLOC_HUGE_PAGES.  Until then, the event loop
+	 * doesn't keep numa_node up to date. */
+	int huge_pages_used;
+};
+
+/** One MSG_ZEROCOPY send whose memory the kernel may still be using. */
+struct evbuffer_zerocopy_send {
+	TAILQ_ENTRY(evbuffer_zerocopy_send) next;
+	/** The kernel's number for this send.  Each socket counts its
+	 * successful MSG_ZEROCOPY sends from 0. */
+	ev_uint32_t id;
+	/** True iff the kernel has told us it is done with this send. */
+	unsigned done : 1;
+	/** The number of chains in chains. */
+	int n_chains;
+	/** The chains this send pinned with EVBUFFER_MEM_PINNED_ZC.  A chain
+	 * that is sent in pieces belongs to the latest send that has a piece
+	 * of it; since we release sends in order, that is enough to keep it
+	 * pinned until the kernel is done with every piece. */
+	struct evbuffer_chain *chains[1];
+};
+
+/** What evbuffer_write_atmost() remembers about the socket it writes to,
+ * when write_flags are set. */
+struct evbuffer_write_state {
+	/** The socket the rest of this structure describes, or -1. */
+	evutil_socket_t fd;
+	/** The socket's TCP_NOTSENT_LOWAT, or 0 if it has none. */
+	int notsent_lowat;
+	/** True iff we have looked at the socket since the flags last
+	 * changed. */
+	unsigned checked : 1;
+	/** True iff the socket accepted SO_ZEROCOPY. */
+	unsigned zerocopy_ok : 1;
+	/** The kernel's number for our next MSG_ZEROCOPY send. */
+	ev_uint32_t zerocopy_next;
+	/** MSG_ZEROCOPY sends we have not released yet, oldest first. */
+	TAILQ_HEAD(evbuffer_zerocopy_queue, evbuffer_zerocopy_send) pending;
+	/** The number of entries in pending. */
+	int n_pending;
+};
+
 /** A single item in an evbuffer. */
 struct evbuffer_chain {
 	/** points to next buffer in the chain */
@@ -156,7 +244,7 @@ struct evbuffer_chain {
 
 	/** Set if special handling is required for this chain */
 	unsigned flags;
-#define EVBUFFER_MMAP		0x0001  /**< memory in buffer is mmaped */
+#define EVBUFFER_FILESEGMENT	0x0001  /**< a chain from a file segment */
 #define EVBUFFER_SENDFILE	0x0002  /**< a chain used for sendfile */
 #define EVBUFFER_REFERENCE	0x0004	/**< a chain with a mem reference */
 #define EVBUFFER_IMMUTABLE	0x0008  /**< read-only chain */
@@ -164,10 +252,31 @@ struct evbuffer_chain {
 	 * memmoved, until the chain is un-pinned. */
 #define EVBUFFER_MEM_PINNED_R	0x0010
 #define EVBUFFER_MEM_PINNED_W	0x0020
-#define EVBUFFER_MEM_PINNED_ANY (EVBUFFER_MEM_PINNED_R|EVBUFFER_MEM_PINNED_W)
+	/** a chain whose memory the kernel may still be sending from, after
+	 * a MSG_ZEROCOPY send; see struct evbuffer_write_state. */
+#define EVBUFFER_MEM_PINNED_ZC	0x0100
+#define EVBUFFER_MEM_PINNED_ANY (EVBUFFER_MEM_PINNED_R|EVBUFFER_MEM_PINNED_W|\
+	    EVBUFFER_MEM_PINNED_ZC)
 	/** a chain that should be freed, but can't be freed until it is
 	 * un-pinned. */
 #define EVBUFFER_DANGLING	0x0040
+	/** a chain that refers to the memory of a chain in another
+	 * evbuffer; see evbuffer_add_buffer_reference(). */
+#define EVBUFFER_MULTICAST	0x0080
+	/** a chain whose memory came from _evbuffer_huge_alloc(). */
+#define EVBUFFER_HUGE_PAGES	0x0200
+
+	/** number of references to this chain: one for the evbuffer that
+	 * holds it, plus one for each EVBUFFER_MULTICAST chain that shares
+	 * its memory.  Protected by the lock of the evbuffer that holds
+	 * it. */
+	int refcnt;
+
+	/** How many bytes we allocated for this chain, header included. */
+	size_t mem_len;
+	/** The account besides the global one that mem_len is charged to,
+	 * or NULL. */
+	struct evbuffer_mem_account *mem_account;
 
 	/** Usually points to the read-write memory belonging to this
 	 * buffer allocated as part of the evbuffer_chain allocation.
@@ -178,12 +287,34 @@ struct evbuffer_chain {
 	unsigned char *buffer;
 };
 
-/* this is currently used by both mmap and sendfile */
-/* TODO(niels): something strange needs to happen for Windows here, I am not
- * sure what that is, but it needs to get looked into.
- */
-struct evbuffer_chain_fd {
-	int fd;	/**< the fd associated with this chain */
+/** A file, or a piece of one, that any number of evbuffers can send from.
+ * See evbuffer_file_segment_new(). */
+struct evbuffer_file_segment {
+	void *lock; /**< lock prevent concurrent access to refcnt */
+	int refcnt; /**< Reference count for this file segment */
+	unsigned flags; /**< combination of EVBUF_FS_* flags */
+
+	/** the fd that we read the data from. */
+	int fd;
+	/** If we're using sendfile, this is true. */
+	unsigned can_sendfile : 1;
+	/** If we're using mmap, this is the start of the mapping, which
+	 * begins at the page holding file_offset. */
+	void *mapping;
+	/** The length of the mapping. */
+	size_t mmap_len;
+	/** If we're using mmap or read, this is the first byte of the
+	 * segment's data. */
+	char *contents;
+	/** Position of this segment within the file. */
+	off_t file_offset;
+	/** Total length of this segment. */
+	off_t length;
+};
+
+/** Extra data allocated with an EVBUFFER_FILESEGMENT chain. */
+struct evbuffer_chain_file_segment {
+	struct evbuffer_file_segment *segment; /**< we hold a reference */
 };
 
 /** callback for a reference buffer; lets us know what to do with it when
@@ -193,6 +324,15 @@ struct evbuffer_chain_reference {
 	void *extra;
 };
 
+/** Extra data allocated with an EVBUFFER_MULTICAST chain. */
+struct evbuffer_multicast_parent {
+	/** the evbuffer that holds 'parent'; we hold a reference to it,
+	 * so that its lock outlives the chain. */
+	struct evbuffer *source;
+	/** the chain whose memory we share; we hold a reference to it. */
+	struct evbuffer_chain *parent;
+};
+
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
 /** Return a pointer to extra data allocated along with an evbuffer. */
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -254,6 +394,28 @@ void _evbuffer_chain_unpin(struct evbuffer_chain *chain, unsigned flag);
  * releases the lock before freeing it and the buffer. */
 void _evbuffer_decref_and_unlock(struct evbuffer *buffer);
 
+/** Make a new memory account for an event_base, with one reference. */
+struct evbuffer_mem_account *_evbuffer_mem_account_new(void);
+/** Drop a reference to a memory account, freeing it if it was the last. */
+void _evbuffer_mem_account_decref(struct evbuffer_mem_account *acct);
+/** Allocate a lock for the global memory account, once locking has been
+ * turned on. */
+void _evbuffer_mem_global_setup_lock(void);
+
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+/** Allocate at least 'size' bytes of huge page memory on NUMA node 'node',
+ * or on the calling thread's node if 'node' is -1, and set *len_out to how
+ * much we allocated.  Returns NULL on failure, or if 'size' is too small
+ * to be worth it. */
+void *_evbuffer_huge_alloc(size_t size, int node, size_t *len_out);
+/** Free memory from _evbuffer_huge_alloc(). */
+void _evbuffer_huge_free(void *mem);
+/** Return the NUMA node the calling thread is running on, or -1. */
+int _evbuffer_huge_current_node(void);
+/** Allocate the huge page allocator's lock, once locking is turned on. */
+void _evbuffer_huge_setup_lock(void);
+#endif
+
 /** As evbuffer_expand, but does not guarantee that the newly allocated memory
  * is contiguous.  Instead, it may be split across two chunks. */
 int _evbuffer_expand_fast(struct evbuffer *, size_t);
@@ -109,6 +109,7 @@
 #include <event2/event_struct.h>
 #include <event2/thread.h>
 
+#include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_struct.h>
 #include "bufferevent-internal.h"
@@ -167,6 +168,11 @@ typedef unsigned int uint;
 #define MAX_ADDRS 32  /* maximum number of addresses from a single packet */
 /* which we bother recording */
 
+/* By default, a TCP server port takes at most this many connections at */
+/* once, and hangs up on a client that's sent nothing for this many seconds. */
+#define SERVER_TCP_MAX_CONNS 64
+#define SERVER_TCP_IDLE_TIMEOUT 10
+
 #define TYPE_A	       EVDNS_TYPE_A
 #define TYPE_CNAME     5
 #define TYPE_PTR       EVDNS_TYPE_PTR
@@ -189,15 +195,28 @@ struct evdns_request {
 	struct search_state *search_state;
 	char *search_origname;	/* needs to be free()ed */
 	int search_flags;
+	/* the parallel search that this request is a candidate of, if any; */
+	/* search_group_idx is its position in the search order. */
+	struct search_group *search_group;
+	int search_group_idx;
+
+	/* If we answered this request from the hosts file, the answer to */
+	/* deliver.  Such requests never go to the network: they wait in */
+	/* req_local_head until their timeout_event fires with the answer. */
+	struct reply *local_reply;
 
 	/* these objects are kept in a circular list */
 	struct evdns_request *next, *prev;
 
 	struct event timeout_event;
 
+	/* The TCP connection that this request was last written to, if any. */
+	struct nameserver_tcp_conn *tcp_conn;
+
 	u16 trans_id;  /* the transaction id */
 	char request_appended;	/* true if the request pointer is data which follows this struct */
 	char transmit_me;  /* needs to be transmitted */
+	char use_tcp;  /* true if we got a truncated reply and moved to TCP */
 
 	struct evdns_base *base;
 };
@@ -220,13 +239,42 @@ struct reply {
 	} data;
 };
 
+/* A TCP connection to a nameserver, used to retry requests whose UDP */
+/* replies came back truncated.  Every query on the connection is */
+/* prefixed with its length in network order, as per RFC 1035 4.2.2, */
+/* and many queries can be outstanding on one connection at once. */
+struct nameserver_tcp_conn {
+	evutil_socket_t socket;
+	struct event event;
+	struct evbuffer *input;
+	struct evbuffer *output;
+	struct nameserver *ns;
+	/* number of inflight requests that were last written here */
+	int n_outstanding;
+	char connecting;  /* true until the connect() has finished */
+	short events;  /* the events that we're currently listening for */
+	/* the next connection to the same nameserver */
+	struct nameserver_tcp_conn *next;
+};
+
+/* One of the UDP sockets we send requests to a nameserver from. */
+struct nameserver_udp_socket {
+	evutil_socket_t socket;
+	struct event event;
+	struct nameserver *ns;
+	char choked;  /* true if we have an EAGAIN from this socket */
+	char write_waiting;  /* true if we are waiting for EV_WRITE events */
+};
+
 struct nameserver {
-	evutil_socket_t socket;	 /* a connected UDP socket */
+	/* The UDP sockets we use for this server, each bound to its own */
+	/* source port.  We spread requests over all of them. */
+	struct nameserver_udp_socket **udp_sockets;
+	int n_udp_sockets;
 	struct sockaddr_storage address;
 	ev_socklen_t addrlen;
 	int failed_times;  /* number of times which we have given this server a chance */
 	int timedout;  /* number of times in a row a request has timed out */
-	struct event event;
 	/* these objects are kept in a circular list */
 	struct nameserver *next, *prev;
 	struct event timeout_event;  /* used to keep the timeout for */
@@ -234,25 +282,40 @@ struct nameserver {
 				     /* Valid if state == 0 */
 	/* Outstanding probe request for this nameserver, if any */
 	struct evdns_request *probe_request;
+	/* A list of open TCP connections to this nameserver. */
+	struct nameserver_tcp_conn *tcp_conns;
+	int n_tcp_conns;
+	/* A bitmap of the transaction ids used by inflight requests to this */
+	/* nameserver, allocated when we first need it, and how many are */
+	/* set.  The bit for 0xffff is always set, since we never use it. */
+	u32 *trans_ids_used;
+	int n_trans_ids_used;
 	char state;  /* zero if we think that this server is down */
-	char choked;  /* true if we have an EAGAIN from this server's socket */
-	char write_waiting;  /* true if we are waiting for EV_WRITE events */
+	char choked;  /* true if we have an EAGAIN from all of our UDP sockets */
 	struct evdns_base *base;
 };
 
 
-/* Represents a local port where we're listening for DNS requests. Right now, */
-/* only UDP is supported. */
+/* Represents a local port where we're listening for DNS requests. This */
+/* is either a UDP socket, or a listening TCP socket. */
 struct evdns_server_port {
 	evutil_socket_t socket; /* socket we use to read queries and write replies. */
 	int refcnt; /* reference count. */
 	char choked; /* Are we currently blocked from writing? */
 	char closing; /* Are we trying to close this port, pending writes? */
+	char is_tcp; /* Is socket a listening TCP socket? */
 	evdns_request_callback_fn_type user_callback; /* Fn to handle requests */
 	void *user_data; /* Opaque pointer passed to user_callback */
 	struct event event; /* Read/write event */
 	/* circular list of replies that we want to write. */
 	struct server_request *pending_replies;
+	/* list of connections that we have accepted, if this is a TCP port. */
+	struct server_tcp_conn *tcp_conns;
+	int n_tcp_conns;
+	/* We refuse connections beyond max_tcp_conns, and close ones that */
+	/* have been idle for tcp_idle_timeout (if it's nonzero). */
+	int max_tcp_conns;
+	struct timeval tcp_idle_timeout;
 	struct event_base *event_base;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
@@ -261,6 +324,23 @@ struct evdns_server_port {
 #endif
 };
 
+/* Represents a TCP connection accepted on a server port.  Requests and */
+/* replies on it are each prefixed by a two-byte length. */
+struct server_tcp_conn {
+	evutil_socket_t socket; /* -1 once we have closed the connection. */
+	struct event event;
+	struct evbuffer *input;
+	struct evbuffer *output;
+	struct evdns_server_port *port;
+	struct sockaddr_storage addr; /* The address of the client. */
+	ev_socklen_t addrlen;
+	int n_pending; /* Number of requests that we haven't answered yet. */
+	char read_eof; /* Has the client finished sending requests? */
+	short events; /* The events that we're currently listening for */
+	/* Links in the port's list of connections. */
+	struct server_tcp_conn *next, *prev;
+};
+
 /* Represents part of a reply being built.	(That is, a single RR.) */
 struct server_reply_item {
 	struct server_reply_item *next; /* next item in sequence. */
@@ -284,6 +364,8 @@ struct server_request {
 
 	u16 trans_id; /* Transaction id. */
 	struct evdns_server_port *port; /* Which port received this request on? */
+	/* Which TCP connection this request arrived on, or NULL for UDP. */
+	struct server_tcp_conn *tcp_conn;
 	struct sockaddr_storage addr; /* Where to send the response */
 	ev_socklen_t addrlen; /* length of addr */
 
@@ -305,16 +387,24 @@ struct server_request {
 };
 
 struct evdns_base {
-	/* An array of n_req_heads circular lists for inflight requests.
-	 * Each inflight request req is in req_heads[req->trans_id % n_req_heads].
-	 */
-	struct evdns_request **req_heads;
+	/* A circular list of all inflight requests. */
+	struct evdns_request *req_inflight_head;
+	/* An open-addressed hash table of the inflight requests, keyed on
+	 * (nameserver, transaction id), so that we can find the request that
+	 * a reply answers without walking a list.  It has req_table_size
+	 * slots (a power of two), and we keep it at most half full, so that
+	 * the runs of linear probing stay short. */
+	struct evdns_request **req_table;
+	int req_table_size;
+	int req_table_count;
 	/* A circular list of requests that we're waiting to send, but haven't
 	 * sent yet because there are too many requests inflight */
 	struct evdns_request *req_waiting_head;
+	/* A circular list of requests that we answered from the hosts file,
+	 * and whose callbacks we haven't scheduled yet. */
+	struct evdns_request *req_local_head;
 	/* A circular list of nameservers. */
 	struct nameserver *server_head;
-	int n_req_heads;
 
 	struct event_base *event_base;
 
@@ -337,6 +427,15 @@ struct evdns_base {
 	int global_max_nameserver_timeout;
 	/* true iff we will use the 0x20 hack to prevent poisoning attacks. */
 	int global_randomize_case;
+	/* true iff we retry requests over TCP when the reply is truncated. */
+	int global_tcp_fallback;
+	/* the largest number of TCP connections we keep to each nameserver */
+	int global_max_tcp_conns;
+	/* how many requests we put on a TCP connection before we would */
+	/* rather open another one. */
+	int global_tcp_pipeline;
+	/* how many UDP sockets we use for each nameserver */
+	int global_udp_sockets;
 
 	/** Port to bind to for outgoing DNS packets. */
 	struct sockaddr_storage global_outgoing_address;
@@ -344,6 +443,21 @@ struct evdns_base {
 	ev_socklen_t global_outgoing_addrlen;
 
 	struct search_state *global_search_state;
+	/* true iff we look up all of a search's candidate names at once, */
+	/* rather than one after another. */
+	int global_search_parallel;
+
+	/* An index of the hosts file: hosts_n_buckets chains of entries, */
+	/* hashed by name. */
+	struct hosts_entry **hosts_table;
+	int hosts_n_buckets;
+	int hosts_n_entries;
+	/* The file we loaded the index from, or NULL if we haven't, and its */
+	/* modification time, so we can reload it when it changes. */
+	char *hosts_fname;
+	time_t hosts_mtime;
+	/* The last time we checked whether the hosts file had changed. */
+	time_t hosts_last_check;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -359,8 +473,6 @@ static struct evdns_base *current_base = NULL;
 	((struct server_request*)					\
 	  (((char*)(base_ptr) - evutil_offsetof(struct server_request, base))))
 
-#define REQ_HEAD(base, id) ((base)->req_heads[id % (base)->n_req_heads])
-
 /* These are the timeout values for nameservers. If we find a nameserver is down */
 /* we try to probe it at intervals as given below. Values are in seconds. */
 static const struct timeval global_nameserver_timeouts[] = {{10, 0}, {60, 0}, {300, 0}, {900, 0}, {3600, 0}};
@@ -370,14 +482,25 @@ static struct nameserver *nameserver_pick(struct evdns_base *base);
 static void evdns_request_insert(struct evdns_request *req, struct evdns_request **head);
 static void evdns_request_remove(struct evdns_request *req, struct evdns_request **head);
 static void nameserver_ready_callback(evutil_socket_t fd, short events, void *arg);
+static int nameserver_set_udp_sockets(struct nameserver *ns, int n);
+static void nameserver_tcp_callback(evutil_socket_t fd, short events, void *arg);
+static int nameserver_tcp_send(struct nameserver *ns, struct evdns_request *req);
+static void request_switch_to_tcp(struct evdns_request *req);
 static int evdns_transmit(struct evdns_base *base);
 static int evdns_request_transmit(struct evdns_request *req);
 static void nameserver_send_probe(struct nameserver *const ns);
 static void search_request_finished(struct evdns_request *const);
 static int search_try_next(struct evdns_request *const req);
 static struct evdns_request *search_request_new(struct evdns_base *base, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg);
+static void search_group_result(struct evdns_request *req, u32 ttl, u32 err, struct reply *reply);
+static void search_group_cancel(struct search_group *group);
+static struct evdns_request *hosts_request_new(struct evdns_base *base, int type, const char *name, int flags, evdns_callback_type callback, void *ptr);
+static void hosts_clear(struct evdns_base *base);
+static int evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname);
 static void evdns_requests_pump_waiting_queue(struct evdns_base *base);
-static u16 transaction_id_pick(struct evdns_base *base);
+static u16 transaction_id_pick(struct nameserver *ns);
+static void transaction_id_release(struct nameserver *ns, u16 trans_id);
+static int request_change_ns(struct evdns_request *req, struct nameserver *ns);
 static struct evdns_request *request_new(struct evdns_base *base, int type, const char *name, int flags, evdns_callback_type callback, void *ptr);
 static void request_submit(struct evdns_request *const req);
 
@@ -385,6 +508,11 @@ static int server_request_free(struct server_request *req);
 static void server_request_free_answers(struct server_request *req);
 static void server_port_free(struct evdns_server_port *port);
 static void server_port_ready_callback(evutil_socket_t fd, short events, void *arg);
+static void server_port_accept_callback(evutil_socket_t fd, short events, void *arg);
+static void server_tcp_conn_callback(evutil_socket_t fd, short events, void *arg);
+static void server_tcp_conn_maybe_free(struct server_tcp_conn *conn);
+static void nameserver_tcp_conn_free(struct nameserver_tcp_conn *conn);
+static void request_tcp_detach(struct evdns_request *req);
 static int evdns_base_resolv_conf_parse_impl(struct evdns_base *base, int flags, const char *const filename);
 static int evdns_base_set_option_impl(struct evdns_base *base,
     const char *option, const char *val, int flags);
@@ -479,21 +607,104 @@ _evdns_log(int warn, const char *fmt, ...)
 
 #define log _evdns_log
 
-/* This walks the list of inflight requests to find the */
-/* one with a matching transaction id. Returns NULL on */
-/* failure */
-static struct evdns_request *
-request_find_from_trans_id(struct evdns_base *base, u16 trans_id) {
-	struct evdns_request *req = REQ_HEAD(base, trans_id);
-	struct evdns_request *const started_at = req;
+/* Return the slot in base->req_table where we start looking for the */
+/* request to ns with transaction id trans_id. */
+static int
+request_table_slot(const struct evdns_base *base, const struct nameserver *ns,
+    u16 trans_id) {
+	/* transaction ids are already random; we mix in the nameserver so */
+	/* that the same id at two servers lands in different places. */
+	u32 h = (u32) (((unsigned long) ns) >> 4);
+	h = (h * 2654435761U) ^ trans_id;
+	return (int) (h & (base->req_table_size - 1));
+}
+
+/* Replace base->req_table with an empty table of 'size' slots, and */
+/* rehash every inflight request into it.  Returns 0 on success, -1 on */
+/* failure. */
+static int
+request_table_resize(struct evdns_base *base, int size) {
+	struct evdns_request **table, *req;
+	int i;
 
 	ASSERT_LOCKED(base);
+	table = mm_calloc(size, sizeof(struct evdns_request *));
+	if (!table)
+		return -1;
+	if (base->req_table)
+		mm_free(base->req_table);
+	base->req_table = table;
+	base->req_table_size = size;
 
+	req = base->req_inflight_head;
 	if (req) {
 		do {
-			if (req->trans_id == trans_id) return req;
+			i = request_table_slot(base, req->ns, req->trans_id);
+			while (table[i])
+				i = (i + 1) & (size - 1);
+			table[i] = req;
 			req = req->next;
-		} while (req != started_at);
+		} while (req != base->req_inflight_head);
+	}
+	return 0;
+}
+
+static int
+request_table_insert(struct evdns_base *base, struct evdns_request *req) {
+	int i;
+	if ((base->req_table_count + 1) * 2 > base->req_table_size &&
+	    request_table_resize(base, base->req_table_size * 2) < 0)
+		return -1;
+	i = request_table_slot(base, req->ns, req->trans_id);
+	while (base->req_table[i])
+		i = (i + 1) & (base->req_table_size - 1);
+	base->req_table[i] = req;
+	base->req_table_count++;
+	return 0;
+}
+
+static void
+request_table_remove(struct evdns_base *base, struct evdns_request *req) {
+	struct evdns_request **table = base->req_table;
+	const int mask = base->req_table_size - 1;
+	int i, j, k;
+
+	i = request_table_slot(base, req->ns, req->trans_id);
+	while (table[i] != req) {
+		EVUTIL_ASSERT(table[i]);
+		i = (i + 1) & mask;
+	}
+	table[i] = NULL;
+	base->req_table_count--;
+
+	/* Close the gap: move back any later entry in this run that can't */
+	/* be found any more now that slot i is empty. */
+	for (j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+		k = request_table_slot(base, table[j]->ns, table[j]->trans_id);
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			table[i] = table[j];
+			table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/* Look in the inflight table for the request we sent to ns with the */
+/* given transaction id.  Returns NULL on failure. */
+static struct evdns_request *
+request_find_from_trans_id(struct evdns_base *base, struct nameserver *ns,
+    u16 trans_id) {
+	struct evdns_request *req;
+	int i;
+
+	ASSERT_LOCKED(base);
+
+	i = request_table_slot(base, ns, trans_id);
+	while ((req = base->req_table[i])) {
+		if (req->trans_id == trans_id && req->ns == ns)
+			return req;
+		i = (i + 1) & (base->req_table_size - 1);
 	}
 
 	return NULL;
@@ -546,7 +757,6 @@ static void
 nameserver_failed(struct nameserver *const ns, const char *msg) {
 	struct evdns_request *req, *started_at;
 	struct evdns_base *base = ns->base;
-	int i;
 
 	ASSERT_LOCKED(base);
 	/* if this nameserver has already been marked as failed */
@@ -579,18 +789,16 @@ nameserver_failed(struct nameserver *const ns, const char *msg) {
 	/* trying to reassign requests to one */
 	if (!base->global_good_nameservers) return;
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		req = started_at = base->req_heads[i];
-		if (req) {
-			do {
-				if (req->tx_count == 0 && req->ns == ns) {
-					/* still waiting to go out, can be moved */
-					/* to another server */
-					req->ns = nameserver_pick(base);
-				}
-				req = req->next;
-			} while (req != started_at);
-		}
+	req = started_at = base->req_inflight_head;
+	if (req) {
+		do {
+			if (req->tx_count == 0 && req->ns == ns) {
+				/* still waiting to go out, can be moved */
+				/* to another server */
+				request_change_ns(req, nameserver_pick(base));
+			}
+			req = req->next;
+		} while (req != started_at);
 	}
 }
 
@@ -617,6 +825,58 @@ request_trans_id_set(struct evdns_request *const req, const u16 trans_id) {
 	*((u16 *) req->request) = htons(trans_id);
 }
 
+/* Give req, which is going to req->ns, a transaction id, and add it to */
+/* the inflight list and table.  Does not count it as inflight.  Returns */
+/* -1 if we can't, because every transaction id for req->ns is in use. */
+static int
+request_inflight_insert(struct evdns_request *const req) {
+	struct evdns_base *base = req->base;
+	const u16 trans_id = transaction_id_pick(req->ns);
+
+	ASSERT_LOCKED(base);
+	if (trans_id == 0xffff)
+		return -1;
+	request_trans_id_set(req, trans_id);
+	if (request_table_insert(base, req) < 0) {
+		transaction_id_release(req->ns, trans_id);
+		return -1;
+	}
+	evdns_request_insert(req, &base->req_inflight_head);
+	return 0;
+}
+
+/* Undo request_inflight_insert(). */
+static void
+request_inflight_remove(struct evdns_request *const req) {
+	struct evdns_base *base = req->base;
+	ASSERT_LOCKED(base);
+	request_table_remove(base, req);
+	transaction_id_release(req->ns, req->trans_id);
+	evdns_request_remove(req, &base->req_inflight_head);
+}
+
+/* Move the inflight request req over to nameserver ns.  Since */
+/* transaction ids are only unique per nameserver, it gets a new one. */
+/* Returns 0 on success, or -1 (leaving req alone) if ns has no free ids. */
+static int
+request_change_ns(struct evdns_request *req, struct nameserver *ns) {
+	struct evdns_base *base = req->base;
+	u16 trans_id;
+
+	ASSERT_LOCKED(base);
+	if (ns == req->ns)
+		return 0;
+	if ((trans_id = transaction_id_pick(ns)) == 0xffff)
+		return -1;
+	request_table_remove(base, req);
+	transaction_id_release(req->ns, req->trans_id);
+	req->ns = ns;
+	request_trans_id_set(req, trans_id);
+	/* can't fail: we just made room. */
+	request_table_insert(base, req);
+	return 0;
+}
+
 /* Called to remove a request from a list and dealloc it. */
 /* head is a pointer to the head of the list it should be */
 /* removed from or NULL if the request isn't in a list. */
@@ -625,13 +885,21 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 	struct evdns_base *base = req->base;
 	int was_inflight = (head != &base->req_waiting_head);
 	EVDNS_LOCK(base);
-	if (head)
+	if (head == &base->req_inflight_head)
+		request_inflight_remove(req);
+	else if (head)
 		evdns_request_remove(req, head);
 
 	log(EVDNS_LOG_DEBUG, "Removing timeout for request %lx",
 	    (unsigned long) req);
 	search_request_finished(req);
-	if (was_inflight) {
+	request_tcp_detach(req);
+	if (head == &base->req_local_head) {
+		/* it was answered from the hosts file, and never counted */
+		/* as inflight or waiting. */
+		evtimer_del(&req->timeout_event);
+		mm_free(req->local_reply);
+	} else if (was_inflight) {
 		evtimer_del(&req->timeout_event);
 		base->global_requests_inflight--;
 	} else {
@@ -660,19 +928,21 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 /*   1 failed/reissue is pointless */
 static int
 request_reissue(struct evdns_request *req) {
-	const struct nameserver *const last_ns = req->ns;
+	struct nameserver *const ns = nameserver_pick(req->base);
 	ASSERT_LOCKED(req->base);
 	/* the last nameserver should have been marked as failing */
 	/* by the caller of this function, therefore pick will try */
 	/* not to return it */
-	req->ns = nameserver_pick(req->base);
-	if (req->ns == last_ns) {
+	if (ns == req->ns) {
 		/* ... but pick did return it */
 		/* not a lot of point in trying again with the */
 		/* same server */
 		return 1;
 	}
+	if (request_change_ns(req, ns) < 0)
+		return 1;
 
+	request_tcp_detach(req);
 	req->reissue_count++;
 	req->tx_count = 0;
 	req->transmit_me = 1;
@@ -691,15 +961,20 @@ evdns_requests_pump_waiting_queue(struct evdns_base *base) {
 		/* move a request from the waiting queue to the inflight queue */
 		EVUTIL_ASSERT(base->req_waiting_head);
 		req = base->req_waiting_head;
+		if (!(req->ns = nameserver_pick(base)))
+			break;
 		evdns_request_remove(req, &base->req_waiting_head);
+		if (request_inflight_insert(req) < 0) {
+			/* no free ids at that server; put it back in front */
+			req->ns = NULL;
+			evdns_request_insert(req, &base->req_waiting_head);
+			base->req_waiting_head = base->req_waiting_head->prev;
+			break;
+		}
 
 		base->global_requests_waiting--;
 		base->global_requests_inflight++;
 
-		req->ns = nameserver_pick(base);
-		request_trans_id_set(req, transaction_id_pick(base));
-
-		evdns_request_insert(req, &REQ_HEAD(base, req->trans_id));
 		evdns_request_transmit(req);
 		evdns_transmit(base);
 	}
@@ -758,7 +1033,7 @@ reply_run_callback(struct deferred_cb *d, void *user_pointer)
 }
 
 static void
-reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
+reply_schedule_user_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
 {
 	struct deferred_reply_callback *d = mm_calloc(1, sizeof(*d));
 
@@ -780,6 +1055,18 @@ reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struc
 		&d->deferred);
 }
 
+/* Called when req has its final answer or error.  Usually that means */
+/* telling the user; but if req is one candidate of a parallel search, */
+/* the search decides whether this is the answer the user hears about. */
+static void
+reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
+{
+	if (req->search_group)
+		search_group_result(req, ttl, err, reply);
+	else
+		reply_schedule_user_callback(req, ttl, err, reply);
+}
+
 /* this processes a parsed reply packet */
 static void
 reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *reply) {
@@ -840,21 +1127,21 @@ reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *
 				/* the user callback will be made when
 				 * that request (or a */
 				/* child of it) finishes. */
-				request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+				request_finished(req, &req->base->req_inflight_head);
 				return;
 			}
 		}
 
 		/* all else failed. Pass the failure up */
 		reply_schedule_callback(req, 0, error, NULL);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		request_finished(req, &req->base->req_inflight_head);
 	} else {
 		/* all ok, tell the user */
 		reply_schedule_callback(req, ttl, 0, reply);
 		if (req == req->ns->probe_request)
 			req->ns->probe_request = NULL; /* Avoid double-free */
 		nameserver_up(req->ns);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		request_finished(req, &req->base->req_inflight_head);
 	}
 }
 
@@ -914,9 +1201,10 @@ name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
 	return -1;
 }
 
-/* parses a raw request from a nameserver */
+/* parses a raw request from a nameserver.  via_tcp is true iff the reply */
+/* came over one of our TCP connections to ns. */
 static int
-reply_parse(struct evdns_base *base, u8 *packet, int length) {
+reply_parse(struct evdns_base *base, struct nameserver *ns, u8 *packet, int length, int via_tcp) {
 	int j = 0, k = 0;  /* index into packet */
 	u16 _t;	 /* used by the macros */
 	u32 _t32;  /* used by the macros */
@@ -941,7 +1229,7 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 	(void) authority; /* suppress "unused variable" warnings. */
 	(void) additional; /* suppress "unused variable" warnings. */
 
-	req = request_find_from_trans_id(base, trans_id);
+	req = request_find_from_trans_id(base, ns, trans_id);
 	if (!req) return -1;
 	EVUTIL_ASSERT(req->base == base);
 
@@ -949,6 +1237,20 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 
 	/* If it's not an answer, it doesn't correspond to any request. */
 	if (!(flags & 0x8000)) return -1;  /* must be an answer */
+	if (flags & 0x0200) {
+		/* The reply was truncated.  If we haven't already, try the */
+		/* request again over TCP, where it will fit. */
+		if (req->use_tcp && !via_tcp) {
+			/* This is a stale reply to an earlier UDP attempt. */
+			return -1;
+		}
+		/* If it was truncated over TCP too, retrying won't help; */
+		/* we fail the request as truncated below. */
+		if (!via_tcp && base->global_tcp_fallback) {
+			request_switch_to_tcp(req);
+			return 0;
+		}
+	}
 	if (flags & 0x020f) {
 		/* there was an error */
 		goto err;
@@ -1073,9 +1375,10 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 
 /* Parse a raw request (packet,length) sent to a nameserver port (port) from */
 /* a DNS client (addr,addrlen), and if it's well-formed, call the corresponding */
-/* callback. */
+/* callback.  If the request came over TCP, conn is the connection it */
+/* arrived on. */
 static int
-request_parse(u8 *packet, int length, struct evdns_server_port *port, struct sockaddr *addr, ev_socklen_t addrlen)
+request_parse(u8 *packet, int length, struct evdns_server_port *port, struct sockaddr *addr, ev_socklen_t addrlen, struct server_tcp_conn *conn)
 {
 	int j = 0;	/* index into packet */
 	u16 _t;	 /* used by the macros */
@@ -1134,6 +1437,10 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port, struct soc
 
 	server_req->port = port;
 	port->refcnt++;
+	if (conn) {
+		server_req->tcp_conn = conn;
+		conn->n_pending++;
+	}
 
 	/* Only standard queries are supported. */
 	if (flags & 0x7800) {
@@ -1249,18 +1556,58 @@ evdns_set_random_bytes_fn(void (*fn)(char *, size_t))
 	trans_id_function = trans_id_from_random_bytes_fn;
 }
 
+#define TRANS_ID_IS_USED(ns, id) ((ns)->trans_ids_used[(id) >> 5] & (1U << ((id) & 31)))
+
 /* Try to choose a strong transaction id which isn't already in flight */
+/* to ns, and mark it as in use.  Returns 0xffff if they all are. */
 static u16
-transaction_id_pick(struct evdns_base *base) {
-	ASSERT_LOCKED(base);
-	for (;;) {
-		u16 trans_id = trans_id_function();
+transaction_id_pick(struct nameserver *ns) {
+	u16 trans_id;
+	int i, w, b;
 
-		if (trans_id == 0xffff) continue;
-		/* now check to see if that id is already inflight */
-		if (request_find_from_trans_id(base, trans_id) == NULL)
-			return trans_id;
+	ASSERT_LOCKED(ns->base);
+	if (!ns->trans_ids_used) {
+		ns->trans_ids_used = mm_calloc(65536 / 32, sizeof(u32));
+		if (!ns->trans_ids_used)
+			return 0xffff;
+		ns->trans_ids_used[0xffff >> 5] |= 1U << (0xffff & 31);
+	}
+	if (ns->n_trans_ids_used >= 0xffff)
+		return 0xffff;
+
+	/* Unless the server is nearly full, a few random guesses will */
+	/* almost always find a free id. */
+	for (i = 0; i < 8; ++i) {
+		trans_id = trans_id_function();
+		if (!TRANS_ID_IS_USED(ns, trans_id))
+			goto found;
+	}
+	/* Otherwise, scan for a free one, starting at a random place. */
+	w = trans_id_function() >> 5;
+	for (i = 0; i < 65536 / 32; ++i, w = (w + 1) & (65536 / 32 - 1)) {
+		if (ns->trans_ids_used[w] == 0xffffffffU)
+			continue;
+		for (b = 0; b < 32; ++b) {
+			if (!(ns->trans_ids_used[w] & (1U << b))) {
+				trans_id = (u16) (w * 32 + b);
+				goto found;
+			}
+		}
 	}
+	EVUTIL_ASSERT(0); /* unreachable: the count said there was room. */
+	return 0xffff;
+
+found:
+	ns->trans_ids_used[trans_id >> 5] |= 1U << (trans_id & 31);
+	ns->n_trans_ids_used++;
+	return trans_id;
+}
+
+static void
+transaction_id_release(struct nameserver *ns, u16 trans_id) {
+	EVUTIL_ASSERT(TRANS_ID_IS_USED(ns, trans_id));
+	ns->trans_ids_used[trans_id >> 5] &= ~(1U << (trans_id & 31));
+	ns->n_trans_ids_used--;
 }
 
 /* choose a namesever to use. This function will try to ignore */
@@ -1303,17 +1650,18 @@ nameserver_pick(struct evdns_base *base) {
 
 /* this is called when a namesever socket is ready for reading */
 static void
-nameserver_read(struct nameserver *ns) {
+nameserver_read(struct nameserver_udp_socket *s) {
+	struct nameserver *const ns = s->ns;
 	struct sockaddr_storage ss;
 	ev_socklen_t addrlen = sizeof(ss);
 	u8 packet[1500];
 	ASSERT_LOCKED(ns->base);
 
 	for (;;) {
-		const int r = recvfrom(ns->socket, packet, sizeof(packet), 0,
+		const int r = recvfrom(s->socket, packet, sizeof(packet), 0,
 		    (struct sockaddr*)&ss, &addrlen);
 		if (r < 0) {
-			int err = evutil_socket_geterror(ns->socket);
+			int err = evutil_socket_geterror(s->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
 			nameserver_failed(ns,
@@ -1329,7 +1677,7 @@ nameserver_read(struct nameserver *ns) {
 		}
 
 		ns->timedout = 0;
-		reply_parse(ns->base, packet, r);
+		reply_parse(ns->base, ns, packet, r, 0);
 	}
 }
 
@@ -1355,8 +1703,246 @@ server_port_read(struct evdns_server_port *s) {
 				evutil_socket_error_to_string(err), err);
 			return;
 		}
-		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen);
+		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen, NULL);
+	}
+}
+
+/* Change the set of events that we're waiting for on a TCP connection */
+/* to a server port, and restart its idle timer. */
+static void
+server_tcp_conn_set_events(struct server_tcp_conn *conn, short events)
+{
+	struct evdns_server_port *port = conn->port;
+	ASSERT_LOCKED(port);
+	if (conn->events != events) {
+		conn->events = events;
+		(void) event_del(&conn->event);
+		if (!events)
+			return;
+		event_assign(&conn->event, port->event_base,
+		    conn->socket, events | EV_PERSIST,
+		    server_tcp_conn_callback, conn);
+	} else if (!events) {
+		return;
+	}
+	if (event_add(&conn->event,
+		evutil_timerisset(&port->tcp_idle_timeout) ?
+		&port->tcp_idle_timeout : NULL) < 0) {
+		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server connection.");
+	}
+}
+
+/* Close a TCP connection to a server port, and free it once we no longer */
+/* have any requests that might refer to it. */
+static void
+server_tcp_conn_close(struct server_tcp_conn *conn)
+{
+	ASSERT_LOCKED(conn->port);
+	if (conn->socket >= 0) {
+		server_tcp_conn_set_events(conn, 0);
+		CLOSE_SOCKET(conn->socket);
+		conn->socket = -1;
 	}
+	server_tcp_conn_maybe_free(conn);
+}
+
+/* Free all storage held by a TCP connection to a server port, and */
+/* remove it from the port's list. */
+static void
+server_tcp_conn_free(struct server_tcp_conn *conn)
+{
+	struct evdns_server_port *port = conn->port;
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		port->tcp_conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	--port->n_tcp_conns;
+	(void) event_del(&conn->event);
+	if (conn->socket >= 0)
+		CLOSE_SOCKET(conn->socket);
+	evbuffer_free(conn->input);
+	evbuffer_free(conn->output);
+	mm_free(conn);
+}
+
+/* Free conn if it's closed, or the client is done with it, and we have */
+/* no more replies to send on it. */
+static void
+server_tcp_conn_maybe_free(struct server_tcp_conn *conn)
+{
+	if (conn->n_pending)
+		return;
+	if (conn->socket < 0 ||
+	    (conn->read_eof && !evbuffer_get_length(conn->output)))
+		server_tcp_conn_free(conn);
+}
+
+/* Queue a formatted reply to be written on a TCP connection to a server */
+/* port.  Returns 0 on success, -1 on failure. */
+static int
+server_tcp_conn_queue_reply(struct server_tcp_conn *conn, const char *response, size_t response_len)
+{
+	u16 len;
+	ASSERT_LOCKED(conn->port);
+	if (conn->socket < 0)
+		return -1;
+	len = htons((u16) response_len);
+	if (evbuffer_add(conn->output, &len, 2) < 0 ||
+	    evbuffer_add(conn->output, response, response_len) < 0)
+		return -1;
+	server_tcp_conn_set_events(conn,
+	    (conn->read_eof ? 0 : EV_READ) | EV_WRITE);
+	return 0;
+}
+
+/* Parse every complete request in a TCP connection's input buffer. */
+static void
+server_tcp_conn_read_requests(struct server_tcp_conn *conn)
+{
+	ASSERT_LOCKED(conn->port);
+	for (;;) {
+		size_t buflen = evbuffer_get_length(conn->input);
+		u8 *packet;
+		int len;
+		if (buflen < 2)
+			return;
+		packet = evbuffer_pullup(conn->input, 2);
+		len = (packet[0] << 8) | packet[1];
+		if (buflen < (size_t)len + 2)
+			return;
+		packet = evbuffer_pullup(conn->input, len + 2);
+		request_parse(packet + 2, len, conn->port,
+		    (struct sockaddr*) &conn->addr, conn->addrlen, conn);
+		evbuffer_drain(conn->input, len + 2);
+	}
+}
+
+/* a callback function. Called by libevent when the kernel says that */
+/* a TCP connection to a server port is ready for writing or reading. */
+static void
+server_tcp_conn_callback(evutil_socket_t fd, short events, void *arg)
+{
+	struct server_tcp_conn *conn = arg;
+	struct evdns_server_port *port = conn->port;
+	int r;
+
+	EVDNS_LOCK(port);
+	if (events & EV_TIMEOUT) {
+		/* The connection has been idle for a while.  Unless the */
+		/* client is still waiting for us to answer, hang up. */
+		if (!conn->n_pending) {
+			log(EVDNS_LOG_DEBUG, "Closing idle DNS server connection.");
+			server_tcp_conn_close(conn);
+		}
+		goto done;
+	}
+	if (events & EV_WRITE) {
+		r = evbuffer_write(conn->output, fd);
+		if (r < 0) {
+			int err = evutil_socket_geterror(fd);
+			if (!EVUTIL_ERR_RW_RETRIABLE(err)) {
+				log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to connection; dropping", evutil_socket_error_to_string(err), err);
+				server_tcp_conn_close(conn);
+				goto done;
+			}
+		}
+		if (!evbuffer_get_length(conn->output)) {
+			if (conn->read_eof && !conn->n_pending) {
+				server_tcp_conn_close(conn);
+				goto done;
+			}
+			server_tcp_conn_set_events(conn,
+			    conn->read_eof ? 0 : EV_READ);
+		} else if (r > 0) {
+			server_tcp_conn_set_events(conn, conn->events);
+		}
+	}
+	if (events & EV_READ) {
+		r = evbuffer_read(conn->input, fd, -1);
+		if (r < 0) {
+			int err = evutil_socket_geterror(fd);
+			if (!EVUTIL_ERR_RW_RETRIABLE(err)) {
+				log(EVDNS_LOG_WARN, "Error %s (%d) while reading request.", evutil_socket_error_to_string(err), err);
+				server_tcp_conn_close(conn);
+			}
+			goto done;
+		} else if (r == 0) {
+			/* The client is done; finish answering what it */
+			/* asked, then close. */
+			conn->read_eof = 1;
+			if (!conn->n_pending &&
+			    !evbuffer_get_length(conn->output)) {
+				server_tcp_conn_close(conn);
+				goto done;
+			}
+			server_tcp_conn_set_events(conn,
+			    evbuffer_get_length(conn->output) ? EV_WRITE : 0);
+			goto done;
+		}
+		server_tcp_conn_read_requests(conn);
+		server_tcp_conn_set_events(conn, conn->events);
+	}
+done:
+	EVDNS_UNLOCK(port);
+}
+
+/* a callback function. Called by libevent when the kernel says that */
+/* a listening TCP server port has connections for us to accept. */
+static void
+server_port_accept_callback(evutil_socket_t fd, short events, void *arg)
+{
+	struct evdns_server_port *port = arg;
+	struct server_tcp_conn *conn;
+	struct sockaddr_storage addr;
+	ev_socklen_t addrlen;
+	evutil_socket_t s;
+	(void) events;
+
+	EVDNS_LOCK(port);
+	for (;;) {
+		addrlen = sizeof(addr);
+		s = accept(fd, (struct sockaddr*) &addr, &addrlen);
+		if (s < 0) {
+			int err = evutil_socket_geterror(fd);
+			if (!EVUTIL_ERR_ACCEPT_RETRIABLE(err))
+				log(EVDNS_LOG_WARN, "Error %s (%d) while accepting connection.",
+				    evutil_socket_error_to_string(err), err);
+			break;
+		}
+		if (port->n_tcp_conns >= port->max_tcp_conns) {
+			log(EVDNS_LOG_DEBUG, "Too many DNS server connections; "
+			    "refusing a new one.");
+			CLOSE_SOCKET(s);
+			continue;
+		}
+		evutil_make_socket_nonblocking(s);
+		if (!(conn = mm_calloc(1, sizeof(struct server_tcp_conn))))
+			goto err;
+		if (!(conn->input = evbuffer_new()) ||
+		    !(conn->output = evbuffer_new())) {
+			if (conn->input)
+				evbuffer_free(conn->input);
+			mm_free(conn);
+			goto err;
+		}
+		conn->socket = s;
+		conn->port = port;
+		memcpy(&conn->addr, &addr, addrlen);
+		conn->addrlen = addrlen;
+		conn->next = port->tcp_conns;
+		if (port->tcp_conns)
+			port->tcp_conns->prev = conn;
+		port->tcp_conns = conn;
+		++port->n_tcp_conns;
+		server_tcp_conn_set_events(conn, EV_READ);
+		continue;
+	err:
+		log(EVDNS_LOG_WARN, "Out of memory while accepting connection.");
+		CLOSE_SOCKET(s);
+	}
+	EVDNS_UNLOCK(port);
 }
 
 /* Try to write all pending replies on a given DNS server port. */
@@ -1396,16 +1982,17 @@ server_port_flush(struct evdns_server_port *port)
 /* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
 /* we stop these events. */
 static void
-nameserver_write_waiting(struct nameserver *ns, char waiting) {
+nameserver_write_waiting(struct nameserver_udp_socket *s, char waiting) {
+	struct nameserver *const ns = s->ns;
 	ASSERT_LOCKED(ns->base);
-	if (ns->write_waiting == waiting) return;
-
-	ns->write_waiting = waiting;
-	(void) event_del(&ns->event);
-	event_assign(&ns->event, ns->base->event_base,
-	    ns->socket, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
-	    nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
+	if (s->write_waiting == waiting) return;
+
+	s->write_waiting = waiting;
+	(void) event_del(&s->event);
+	event_assign(&s->event, ns->base->event_base,
+	    s->socket, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
+	    nameserver_ready_callback, s);
+	if (event_add(&s->event, NULL) < 0) {
 	  log(EVDNS_LOG_WARN, "Error from libevent when adding event for %s",
 	      debug_ntop((struct sockaddr *)&ns->address));
 	  /* ???? Do more? */
@@ -1416,22 +2003,299 @@ nameserver_write_waiting(struct nameserver *ns, char waiting) {
 /* a nameserver socket is ready for writing or reading */
 static void
 nameserver_ready_callback(evutil_socket_t fd, short events, void *arg) {
-	struct nameserver *ns = (struct nameserver *) arg;
+	struct nameserver_udp_socket *s = arg;
+	struct nameserver *ns = s->ns;
 	(void)fd;
 
 	EVDNS_LOCK(ns->base);
 	if (events & EV_WRITE) {
+		s->choked = 0;
 		ns->choked = 0;
 		if (!evdns_transmit(ns->base)) {
-			nameserver_write_waiting(ns, 0);
+			nameserver_write_waiting(s, 0);
 		}
 	}
 	if (events & EV_READ) {
-		nameserver_read(ns);
+		nameserver_read(s);
 	}
 	EVDNS_UNLOCK(ns->base);
 }
 
+/* Stop remembering which TCP connection a request was written to. */
+static void
+request_tcp_detach(struct evdns_request *req) {
+	ASSERT_LOCKED(req->base);
+	if (req->tcp_conn) {
+		--req->tcp_conn->n_outstanding;
+		req->tcp_conn = NULL;
+	}
+}
+
+/* Called when a nameserver tells us that its reply to req didn't fit */
+/* in a UDP packet.  We send the request again over TCP. */
+static void
+request_switch_to_tcp(struct evdns_request *req) {
+	ASSERT_LOCKED(req->base);
+	log(EVDNS_LOG_DEBUG, "Reply to request %lx was truncated; "
+	    "retrying over TCP", (unsigned long) req);
+	(void) evtimer_del(&req->timeout_event);
+	req->use_tcp = 1;
+	req->tx_count = 0;
+	evdns_request_transmit(req);
+}
+
+/* Change the set of events that we're waiting for on a TCP connection */
+/* to a nameserver. */
+static void
+nameserver_tcp_conn_set_events(struct nameserver_tcp_conn *conn, short events) {
+	ASSERT_LOCKED(conn->ns->base);
+	if (conn->events == events) return;
+
+	conn->events = events;
+	(void) event_del(&conn->event);
+	event_assign(&conn->event, conn->ns->base->event_base,
+	    conn->socket, events | EV_PERSIST,
+	    nameserver_tcp_callback, conn);
+	if (event_add(&conn->event, NULL) < 0) {
+		log(EVDNS_LOG_WARN, "Error from libevent when adding event for "
+		    "TCP connection to %s",
+		    debug_ntop((struct sockaddr *)&conn->ns->address));
+	}
+}
+
+/* Open a new TCP connection to ns, and add it to ns's list of */
+/* connections.  Returns NULL on failure. */
+static struct nameserver_tcp_conn *
+nameserver_tcp_conn_new(struct nameserver *ns) {
+	struct nameserver_tcp_conn *conn;
+	int r;
+
+	ASSERT_LOCKED(ns->base);
+	conn = mm_calloc(1, sizeof(struct nameserver_tcp_conn));
+	if (!conn) return NULL;
+	conn->ns = ns;
+	conn->socket = -1;
+	if (!(conn->input = evbuffer_new()) ||
+	    !(conn->output = evbuffer_new()))
+		goto err;
+
+	r = evutil_socket_connect(&conn->socket,
+	    (struct sockaddr *)&ns->address, ns->addrlen);
+	if (r < 0) {
+		log(EVDNS_LOG_WARN, "Unable to open TCP connection to %s",
+		    debug_ntop((struct sockaddr *)&ns->address));
+		goto err;
+	}
+	conn->connecting = (r == 0);
+	nameserver_tcp_conn_set_events(conn,
+	    conn->connecting ? EV_WRITE : EV_READ);
+
+	conn->next = ns->tcp_conns;
+	ns->tcp_conns = conn;
+	ns->n_tcp_conns++;
+	log(EVDNS_LOG_DEBUG, "Opened TCP connection %lx to %s",
+	    (unsigned long) conn, debug_ntop((struct sockaddr *)&ns->address));
+	return conn;
+err:
+	if (conn->socket >= 0)
+		CLOSE_SOCKET(conn->socket);
+	if (conn->input)
+		evbuffer_free(conn->input);
+	if (conn->output)
+		evbuffer_free(conn->output);
+	mm_free(conn);
+	return NULL;
+}
+
+/* Choose a TCP connection to ns to send a request on.  We pipeline */
+/* requests onto the least loaded connection we have, until they all */
+/* have global_tcp_pipeline requests outstanding; then we open a new */
+/* one, unless we already have global_max_tcp_conns of them. */
+static struct nameserver_tcp_conn *
+nameserver_tcp_conn_pick(struct nameserver *ns) {
+	struct evdns_base *base = ns->base;
+	struct nameserver_tcp_conn *conn, *best = NULL;
+
+	ASSERT_LOCKED(base);
+	for (conn = ns->tcp_conns; conn; conn = conn->next) {
+		if (!best || conn->n_outstanding < best->n_outstanding)
+			best = conn;
+	}
+	if (best && (best->n_outstanding < base->global_tcp_pipeline ||
+		ns->n_tcp_conns >= base->global_max_tcp_conns))
+		return best;
+	conn = nameserver_tcp_conn_new(ns);
+	return conn ? conn : best;
+}
+
+/* Queue req to be sent to ns over TCP. */
+/* */
+/* return: */
+/*   0 ok */
+/*   2 failure */
+static int
+nameserver_tcp_send(struct nameserver *ns, struct evdns_request *req) {
+	struct nameserver_tcp_conn *conn;
+	u16 len;
+
+	ASSERT_LOCKED(ns->base);
+	request_tcp_detach(req);
+	if (!(conn = nameserver_tcp_conn_pick(ns)))
+		return 2;
+
+	/* Make room for the whole frame first, so that we can't add the */
+	/* length and then fail to add the request after it. */
+	if (evbuffer_expand(conn->output, 2 + req->request_len) < 0)
+		return 2;
+	len = htons((u16) req->request_len);
+	evbuffer_add(conn->output, &len, 2);
+	evbuffer_add(conn->output, req->request, req->request_len);
+	req->tcp_conn = conn;
+	++conn->n_outstanding;
+	if (!conn->connecting)
+		nameserver_tcp_conn_set_events(conn, EV_READ|EV_WRITE);
+	return 0;
+}
+
+/* Remove a TCP connection from its nameserver's list, if it's there. */
+static void
+nameserver_tcp_conn_unlink(struct nameserver_tcp_conn *conn) {
+	struct nameserver *ns = conn->ns;
+	struct nameserver_tcp_conn **connp;
+
+	for (connp = &ns->tcp_conns; *connp; connp = &(*connp)->next) {
+		if (*connp == conn) {
+			*connp = conn->next;
+			ns->n_tcp_conns--;
+			return;
+		}
+	}
+}
+
+/* Remove a TCP connection from its nameserver's list, close it, and */
+/* free it. */
+static void
+nameserver_tcp_conn_free(struct nameserver_tcp_conn *conn) {
+	nameserver_tcp_conn_unlink(conn);
+	(void) event_del(&conn->event);
+	CLOSE_SOCKET(conn->socket);
+	evbuffer_free(conn->input);
+	evbuffer_free(conn->output);
+	mm_free(conn);
+}
+
+/* Called when a TCP connection to a nameserver has closed or failed. */
+/* If we never managed to connect, the nameserver probably doesn't */
+/* speak TCP, so we fail the requests we wrote to it as truncated. */
+/* Otherwise, we let them time out and get retransmitted on a new */
+/* connection. */
+static void
+nameserver_tcp_conn_closed(struct nameserver_tcp_conn *conn, const char *msg) {
+	struct evdns_base *base = conn->ns->base;
+	struct evdns_request *req, *started_at;
+
+	ASSERT_LOCKED(base);
+	log(EVDNS_LOG_DEBUG, "TCP connection %lx to %s closed: %s",
+	    (unsigned long) conn,
+	    debug_ntop((struct sockaddr *)&conn->ns->address), msg);
+	/* Make sure that nothing we do below picks this connection again. */
+	nameserver_tcp_conn_unlink(conn);
+
+again:
+	req = started_at = base->req_inflight_head;
+	if (req && conn->n_outstanding) {
+		do {
+			if (req->tcp_conn == conn) {
+				request_tcp_detach(req);
+				if (conn->connecting) {
+					/* Handle it as we would have */
+					/* handled the truncated reply. */
+					reply_handle(req, 0x0200, 0, NULL);
+					goto again;
+				}
+			}
+			req = req->next;
+		} while (req != started_at && conn->n_outstanding);
+	}
+	nameserver_tcp_conn_free(conn);
+}
+
+/* Pull all the complete replies out of a TCP connection's input buffer */
+/* and process them. */
+static void
+nameserver_tcp_conn_read_replies(struct nameserver_tcp_conn *conn) {
+	ASSERT_LOCKED(conn->ns->base);
+	for (;;) {
+		size_t buflen = evbuffer_get_length(conn->input);
+		u8 *packet;
+		int len;
+		if (buflen < 2)
+			return;
+		packet = evbuffer_pullup(conn->input, 2);
+		len = (packet[0] << 8) | packet[1];
+		if (buflen < (size_t)len + 2)
+			return;
+		packet = evbuffer_pullup(conn->input, len + 2);
+		conn->ns->timedout = 0;
+		reply_parse(conn->ns->base, conn->ns, packet + 2, len, 1);
+		evbuffer_drain(conn->input, len + 2);
+	}
+}
+
+/* a callback function. Called by libevent when the kernel says that */
+/* a TCP connection to a nameserver is ready for writing or reading. */
+static void
+nameserver_tcp_callback(evutil_socket_t fd, short events, void *arg) {
+	struct nameserver_tcp_conn *conn = arg;
+	struct evdns_base *base = conn->ns->base;
+	int r;
+
+	EVDNS_LOCK(base);
+	if (events & EV_WRITE) {
+		if (conn->connecting) {
+			r = evutil_socket_finished_connecting(fd);
+			if (r == 0)
+				goto done;
+			if (r < 0) {
+				nameserver_tcp_conn_closed(conn,
+				    evutil_socket_error_to_string(
+					    evutil_socket_geterror(fd)));
+				goto done;
+			}
+			conn->connecting = 0;
+		}
+		if (evbuffer_get_length(conn->output)) {
+			r = evbuffer_write(conn->output, fd);
+			if (r < 0) {
+				int err = evutil_socket_geterror(fd);
+				if (!EVUTIL_ERR_RW_RETRIABLE(err)) {
+					nameserver_tcp_conn_closed(conn,
+					    evutil_socket_error_to_string(err));
+					goto done;
+				}
+			}
+		}
+		nameserver_tcp_conn_set_events(conn, EV_READ |
+		    (evbuffer_get_length(conn->output) ? EV_WRITE : 0));
+	}
+	if (events & EV_READ) {
+		r = evbuffer_read(conn->input, fd, -1);
+		if (r == 0) {
+			nameserver_tcp_conn_closed(conn, "connection closed");
+			goto done;
+		} else if (r < 0) {
+			int err = evutil_socket_geterror(fd);
+			if (!EVUTIL_ERR_RW_RETRIABLE(err))
+				nameserver_tcp_conn_closed(conn,
+				    evutil_socket_error_to_string(err));
+			goto done;
+		}
+		nameserver_tcp_conn_read_replies(conn);
+	}
+done:
+	EVDNS_UNLOCK(base);
+}
+
 /* a callback function. Called by libevent when the kernel says that */
 /* a server socket is ready for writing or reading. */
 static void
@@ -1636,18 +2500,22 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 		return NULL;
 	memset(port, 0, sizeof(struct evdns_server_port));
 
-	EVUTIL_ASSERT(!is_tcp); /* TCP sockets not yet implemented */
 	port->socket = socket;
 	port->refcnt = 1;
 	port->choked = 0;
 	port->closing = 0;
+	port->is_tcp = is_tcp != 0;
 	port->user_callback = cb;
 	port->user_data = user_data;
 	port->pending_replies = NULL;
+	port->tcp_conns = NULL;
+	port->max_tcp_conns = SERVER_TCP_MAX_CONNS;
+	port->tcp_idle_timeout.tv_sec = SERVER_TCP_IDLE_TIMEOUT;
 	port->event_base = base;
 
 	event_assign(&port->event, port->event_base,
 				 port->socket, EV_READ | EV_PERSIST,
+				 is_tcp ? server_port_accept_callback :
 				 server_port_ready_callback, port);
 	if (event_add(&port->event, NULL) < 0) {
 		mm_free(port);
@@ -1676,6 +2544,22 @@ evdns_close_server_port(struct evdns_server_port *port)
 	}
 }
 
+/* exported function */
+int
+evdns_server_port_set_tcp_limits(struct evdns_server_port *port, int max_conns, const struct timeval *idle_timeout)
+{
+	if (max_conns < 1)
+		return -1;
+	EVDNS_LOCK(port);
+	port->max_tcp_conns = max_conns;
+	if (idle_timeout)
+		port->tcp_idle_timeout = *idle_timeout;
+	else
+		evutil_timerclear(&port->tcp_idle_timeout);
+	EVDNS_UNLOCK(port);
+	return 0;
+}
+
 /* exported function */
 int
 evdns_server_request_add_reply(struct evdns_server_request *_req, int section, const char *name, int type, int class, int ttl, int datalen, int is_name, const char *data)
@@ -1810,8 +2694,11 @@ evdns_server_request_set_flags(struct evdns_server_request *exreq, int flags)
 static int
 evdns_server_request_format_response(struct server_request *req, int err)
 {
-	unsigned char buf[1500];
-	size_t buf_len = sizeof(buf);
+	unsigned char udp_buf[1500], *buf = udp_buf;
+	size_t buf_len = sizeof(udp_buf);
+	/* Replies over UDP get truncated at 512 bytes; replies over TCP can */
+	/* be as long as their length prefix allows. */
+	size_t max_len = 512;
 	off_t j = 0, r;
 	u16 _t;
 	u32 _t32;
@@ -1821,6 +2708,12 @@ evdns_server_request_format_response(struct server_request *req, int err)
 
 	if (err < 0 || err > 15) return -1;
 
+	if (req->tcp_conn) {
+		buf_len = max_len = 65535;
+		if (!(buf = mm_malloc(buf_len)))
+			return -1;
+	}
+
 	/* Set response bit and error code; copy OPCODE and RD fields from
 	 * question; copy RA and AA if set by caller. */
 	flags = req->base.flags;
@@ -1840,6 +2733,8 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), &table);
 		if (j < 0) {
 			dnslabel_clear(&table);
+			if (buf != udp_buf)
+				mm_free(buf);
 			return (int) j;
 		}
 		APPEND16(req->base.questions[i]->type);
@@ -1885,9 +2780,9 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		}
 	}
 
-	if (j > 512) {
+	if (j > (off_t)max_len) {
 overflow:
-		j = 512;
+		j = max_len;
 		buf[2] |= 0x02; /* set the truncated bit. */
 	}
 
@@ -1896,11 +2791,15 @@ overflow:
 	if (!(req->response = mm_malloc(req->response_len))) {
 		server_request_free_answers(req);
 		dnslabel_clear(&table);
+		if (buf != udp_buf)
+			mm_free(buf);
 		return (-1);
 	}
 	memcpy(req->response, buf, req->response_len);
 	server_request_free_answers(req);
 	dnslabel_clear(&table);
+	if (buf != udp_buf)
+		mm_free(buf);
 	return (0);
 }
 
@@ -1918,6 +2817,13 @@ evdns_server_request_respond(struct evdns_server_request *_req, int err)
 			goto done;
 	}
 
+	if (req->tcp_conn) {
+		r = server_tcp_conn_queue_reply(req->tcp_conn, req->response,
+		    req->response_len);
+		server_request_free(req);
+		goto done;
+	}
+
 	r = sendto(port->socket, req->response, req->response_len, 0,
 			   (struct sockaddr*) &req->addr, req->addrlen);
 	if (r<0) {
@@ -2003,6 +2909,11 @@ server_request_free(struct server_request *req)
 	if (req->port) {
 		EVDNS_LOCK(req->port);
 		lock=1;
+		if (req->tcp_conn) {
+			--req->tcp_conn->n_pending;
+			server_tcp_conn_maybe_free(req->tcp_conn);
+			req->tcp_conn = NULL;
+		}
 		if (req->port->pending_replies == req) {
 			if (req->next_pending)
 				req->port->pending_replies = req->next_pending;
@@ -2042,6 +2953,8 @@ server_port_free(struct evdns_server_port *port)
 	EVUTIL_ASSERT(port);
 	EVUTIL_ASSERT(!port->refcnt);
 	EVUTIL_ASSERT(!port->pending_replies);
+	while (port->tcp_conns)
+		server_tcp_conn_free(port->tcp_conns);
 	if (port->socket > 0) {
 		CLOSE_SOCKET(port->socket);
 		port->socket = -1;
@@ -2095,7 +3008,7 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	if (req->tx_count >= req->base->global_max_retransmits) {
 		/* this request has failed */
 		reply_schedule_callback(req, 0, DNS_ERR_TIMEOUT, NULL);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		request_finished(req, &req->base->req_inflight_head);
 	} else {
 		/* retransmit it */
 		(void) evtimer_del(&req->timeout_event);
@@ -2112,21 +3025,37 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 /*   2 other failure */
 static int
 evdns_request_transmit_to(struct evdns_request *req, struct nameserver *server) {
-	int r;
+	struct nameserver_udp_socket *s;
+	int i, n, r;
 	ASSERT_LOCKED(req->base);
-	r = sendto(server->socket, req->request, req->request_len, 0,
-                (struct sockaddr *)&server->address, server->addrlen);
-	if (r < 0) {
-		int err = evutil_socket_geterror(server->socket);
-		if (EVUTIL_ERR_RW_RETRIABLE(err))
-			return 1;
-		nameserver_failed(req->ns, evutil_socket_error_to_string(err));
-		return 2;
-	} else if (r != (int)req->request_len) {
-		return 1;  /* short write */
-	} else {
-		return 0;
+	if (req->use_tcp)
+		return nameserver_tcp_send(server, req);
+	/* The transaction id is random, so this spreads requests over */
+	/* the sockets unpredictably; retransmissions move on to the next. */
+	i = (req->trans_id + req->tx_count) % server->n_udp_sockets;
+	for (n = 0; n < server->n_udp_sockets;
+	     ++n, i = (i + 1) % server->n_udp_sockets) {
+		s = server->udp_sockets[i];
+		if (s->choked)
+			continue;
+		r = sendto(s->socket, req->request, req->request_len, 0,
+		    (struct sockaddr *)&server->address, server->addrlen);
+		if (r < 0) {
+			int err = evutil_socket_geterror(s->socket);
+			if (!EVUTIL_ERR_RW_RETRIABLE(err)) {
+				nameserver_failed(req->ns,
+				    evutil_socket_error_to_string(err));
+				return 2;
+			}
+		} else if (r == (int)req->request_len) {
+			return 0;
+		}
+		/* EAGAIN or a short write: wait until this one is */
+		/* writable, and try the next. */
+		s->choked = 1;
+		nameserver_write_waiting(s, 1);
 	}
+	return 1;
 }
 
 /* try to send a request, updating the fields of the request */
@@ -2145,7 +3074,7 @@ evdns_request_transmit(struct evdns_request *req) {
 	req->transmit_me = 1;
 	if (req->trans_id == 0xffff) abort();
 
-	if (req->ns->choked) {
+	if (req->ns->choked && !req->use_tcp) {
 		/* don't bother trying to write to a socket */
 		/* which we have had EAGAIN from */
 		return 1;
@@ -2154,9 +3083,9 @@ evdns_request_transmit(struct evdns_request *req) {
 	r = evdns_request_transmit_to(req, req->ns);
 	switch (r) {
 	case 1:
-		/* temp failure */
+		/* temp failure: every socket is choked, and waiting for */
+		/* EV_WRITE. */
 		req->ns->choked = 1;
-		nameserver_write_waiting(req->ns, 1);
 		return 1;
 	case 2:
 		/* failed to transmit the request entirely. */
@@ -2216,7 +3145,6 @@ nameserver_send_probe(struct nameserver *const ns) {
 	if (!req) return;
 	ns->probe_request = req;
 	/* we force this into the inflight queue no matter what */
-	request_trans_id_set(req, transaction_id_pick(ns->base));
 	req->ns = ns;
 	request_submit(req);
 }
@@ -2227,22 +3155,19 @@ nameserver_send_probe(struct nameserver *const ns) {
 static int
 evdns_transmit(struct evdns_base *base) {
 	char did_try_to_transmit = 0;
-	int i;
 
 	ASSERT_LOCKED(base);
-	for (i = 0; i < base->n_req_heads; ++i) {
-		if (base->req_heads[i]) {
-			struct evdns_request *const started_at = base->req_heads[i], *req = started_at;
-			/* first transmit all the requests which are currently waiting */
-			do {
-				if (req->transmit_me) {
-					did_try_to_transmit = 1;
-					evdns_request_transmit(req);
-				}
+	if (base->req_inflight_head) {
+		struct evdns_request *const started_at = base->req_inflight_head, *req = started_at;
+		/* first transmit all the requests which are currently waiting */
+		do {
+			if (req->transmit_me) {
+				did_try_to_transmit = 1;
+				evdns_request_transmit(req);
+			}
 
-				req = req->next;
-			} while (req != started_at);
-		}
+			req = req->next;
+		} while (req != started_at);
 	}
 
 	return did_try_to_transmit;
@@ -2279,7 +3204,7 @@ int
 evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 {
 	struct nameserver *server, *started_at;
-	int i;
+	struct evdns_request *req, *req_started_at;
 
 	EVDNS_LOCK(base);
 	server = base->server_head;
@@ -2290,11 +3215,13 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 	}
 	while (1) {
 		struct nameserver *next = server->next;
-		(void) event_del(&server->event);
+		nameserver_set_udp_sockets(server, 0);
 		if (evtimer_initialized(&server->timeout_event))
 			(void) evtimer_del(&server->timeout_event);
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
+		while (server->tcp_conns)
+			nameserver_tcp_conn_free(server->tcp_conns);
+		if (server->trans_ids_used)
+			mm_free(server->trans_ids_used);
 		mm_free(server);
 		if (next == started_at)
 			break;
@@ -2303,32 +3230,36 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 	base->server_head = NULL;
 	base->global_good_nameservers = 0;
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		struct evdns_request *req, *req_started_at;
-		req = req_started_at = base->req_heads[i];
-		while (req) {
-			struct evdns_request *next = req->next;
-			req->tx_count = req->reissue_count = 0;
-			req->ns = NULL;
-			/* ???? What to do about searches? */
-			(void) evtimer_del(&req->timeout_event);
-			req->trans_id = 0;
-			req->transmit_me = 0;
+	/* The servers (and their transaction ids) are gone, so just forget */
+	/* every inflight request's place in the table. */
+	if (base->req_table)
+		memset(base->req_table, 0,
+		    base->req_table_size * sizeof(struct evdns_request *));
+	base->req_table_count = 0;
+	req = req_started_at = base->req_inflight_head;
+	while (req) {
+		struct evdns_request *next = req->next;
+		req->tx_count = req->reissue_count = 0;
+		req->ns = NULL;
+		req->tcp_conn = NULL;
+		/* ???? What to do about searches? */
+		(void) evtimer_del(&req->timeout_event);
+		request_trans_id_set(req, 0xffff);
+		req->transmit_me = 0;
 
-			base->global_requests_waiting++;
-			evdns_request_insert(req, &base->req_waiting_head);
-			/* We want to insert these suspended elements at the front of
-			 * the waiting queue, since they were pending before any of
-			 * the waiting entries were added.  This is a circular list,
-			 * so we can just shift the start back by one.*/
-			base->req_waiting_head = base->req_waiting_head->prev;
+		base->global_requests_waiting++;
+		evdns_request_insert(req, &base->req_waiting_head);
+		/* We want to insert these suspended elements at the front of
+		 * the waiting queue, since they were pending before any of
+		 * the waiting entries were added.  This is a circular list,
+		 * so we can just shift the start back by one.*/
+		base->req_waiting_head = base->req_waiting_head->prev;
 
-			if (next == req_started_at)
-				break;
-			req = next;
-		}
-		base->req_heads[i] = NULL;
+		if (next == req_started_at)
+			break;
+		req = next;
 	}
+	base->req_inflight_head = NULL;
 
 	base->global_requests_inflight = 0;
 
@@ -2356,7 +3287,91 @@ evdns_base_resume(struct evdns_base *base)
 int
 evdns_resume(void)
 {
-	return evdns_base_resume(current_base);
+	return evdns_base_resume(current_base);
+}
+
+/* Open or close UDP sockets so that ns has n of them.  Replies to */
+/* requests we sent from a socket we close are lost, and the requests */
+/* will time out and be retransmitted. */
+/* */
+/* return: */
+/*   0 ok */
+/*   1 couldn't make a socket */
+/*   2 couldn't bind it or add its event */
+static int
+nameserver_set_udp_sockets(struct nameserver *ns, int n) {
+	struct evdns_base *base = ns->base;
+	struct nameserver_udp_socket *s, **new_sockets;
+	int i;
+
+	ASSERT_LOCKED(base);
+	while (ns->n_udp_sockets > n) {
+		s = ns->udp_sockets[--ns->n_udp_sockets];
+		(void) event_del(&s->event);
+		CLOSE_SOCKET(s->socket);
+		mm_free(s);
+	}
+	if (n == 0 && ns->udp_sockets) {
+		mm_free(ns->udp_sockets);
+		ns->udp_sockets = NULL;
+	}
+	if (ns->n_udp_sockets < n) {
+		new_sockets = mm_realloc(ns->udp_sockets,
+		    n * sizeof(struct nameserver_udp_socket *));
+		if (!new_sockets)
+			return 1;
+		ns->udp_sockets = new_sockets;
+	}
+	while (ns->n_udp_sockets < n) {
+		if (!(s = mm_calloc(1, sizeof(struct nameserver_udp_socket))))
+			return 1;
+		s->ns = ns;
+		s->socket = socket(ns->address.ss_family, SOCK_DGRAM, 0);
+		if (s->socket < 0) {
+			mm_free(s);
+			return 1;
+		}
+		evutil_make_socket_nonblocking(s->socket);
+		if (base->global_outgoing_addrlen &&
+		    bind(s->socket,
+			(struct sockaddr*)&base->global_outgoing_address,
+			base->global_outgoing_addrlen) < 0) {
+			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
+			CLOSE_SOCKET(s->socket);
+			mm_free(s);
+			return 2;
+		}
+		event_assign(&s->event, base->event_base, s->socket,
+		    EV_READ | EV_PERSIST, nameserver_ready_callback, s);
+		if (event_add(&s->event, NULL) < 0) {
+			CLOSE_SOCKET(s->socket);
+			mm_free(s);
+			return 2;
+		}
+		ns->udp_sockets[ns->n_udp_sockets++] = s;
+	}
+
+	/* we're choked only if every socket we have left is */
+	ns->choked = n > 0;
+	for (i = 0; i < ns->n_udp_sockets; ++i) {
+		if (!ns->udp_sockets[i]->choked)
+			ns->choked = 0;
+	}
+	return 0;
+}
+
+/* Return true iff sa names a specific port.  If "bind-to:" gives us one, */
+/* only one socket per nameserver can bind to it. */
+static int
+sockaddr_has_port(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return ((const struct sockaddr_in*)sa)->sin_port != 0;
+#ifdef AF_INET6
+	if (sa->sa_family == AF_INET6)
+		return ((const struct sockaddr_in6*)sa)->sin6_port != 0;
+#endif
+	return 0;
 }
 
 static int
@@ -2387,28 +3402,11 @@ _evdns_nameserver_add_impl(struct evdns_base *base, const struct sockaddr *addre
 
 	evtimer_assign(&ns->timeout_event, ns->base->event_base, nameserver_prod_callback, ns);
 
-	ns->socket = socket(PF_INET, SOCK_DGRAM, 0);
-	if (ns->socket < 0) { err = 1; goto out1; }
-	evutil_make_socket_nonblocking(ns->socket);
-
-	if (base->global_outgoing_addrlen) {
-		if (bind(ns->socket,
-			(struct sockaddr*)&base->global_outgoing_address,
-			base->global_outgoing_addrlen) < 0) {
-			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
-			err = 2;
-			goto out2;
-		}
-	}
-
 	memcpy(&ns->address, address, addrlen);
 	ns->addrlen = addrlen;
 	ns->state = 1;
-	event_assign(&ns->event, ns->base->event_base, ns->socket, EV_READ | EV_PERSIST, nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
-		err = 2;
-		goto out2;
-	}
+	if ((err = nameserver_set_udp_sockets(ns, base->global_udp_sockets)))
+		goto out1;
 
 	log(EVDNS_LOG_DEBUG, "Added nameserver %s", debug_ntop(address));
 
@@ -2429,9 +3427,8 @@ _evdns_nameserver_add_impl(struct evdns_base *base, const struct sockaddr *addre
 
 	return 0;
 
-out2:
-	CLOSE_SOCKET(ns->socket);
 out1:
+	nameserver_set_udp_sockets(ns, 0);
 	mm_free(ns);
 	log(EVDNS_LOG_WARN, "Unable to add nameserver %s: error %d", debug_ntop(address), err);
 	return err;
@@ -2574,7 +3571,8 @@ request_new(struct evdns_base *base, int type, const char *name, int flags,
 
 	const size_t name_len = strlen(name);
 	const size_t request_max_len = evdns_request_len(name_len);
-	const u16 trans_id = issuing_now ? transaction_id_pick(base) : 0xffff;
+	/* the real transaction id is picked when the request goes inflight */
+	const u16 trans_id = 0xffff;
 	/* the request data is alloced in a single block with the header */
 	struct evdns_request *const req =
 	    mm_malloc(sizeof(struct evdns_request) + request_max_len);
@@ -2640,13 +3638,13 @@ static void
 request_submit(struct evdns_request *const req) {
 	struct evdns_base *base = req->base;
 	ASSERT_LOCKED(base);
-	if (req->ns) {
+	if (req->ns && request_inflight_insert(req) == 0) {
 		/* if it has a nameserver assigned then this is going */
 		/* straight into the inflight queue */
-		evdns_request_insert(req, &REQ_HEAD(base, req->trans_id));
 		base->global_requests_inflight++;
 		evdns_request_transmit(req);
 	} else {
+		req->ns = NULL;
 		evdns_request_insert(req, &base->req_waiting_head);
 		base->global_requests_waiting++;
 	}
@@ -2660,10 +3658,19 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *req)
 		base = req->base;
 
 	EVDNS_LOCK(base);
+	if (req->search_group) {
+		/* cancel every candidate of the search, not just this one */
+		search_group_cancel(req->search_group);
+		EVDNS_UNLOCK(base);
+		return;
+	}
 	reply_schedule_callback(req, 0, DNS_ERR_CANCEL, NULL);
-	if (req->ns) {
+	if (req->local_reply) {
+		/* remove from the queue of hosts file answers */
+		request_finished(req, &base->req_local_head);
+	} else if (req->ns) {
 		/* remove from inflight queue */
-		request_finished(req, &REQ_HEAD(base, req->trans_id));
+		request_finished(req, &base->req_inflight_head);
 	} else {
 		/* remove from global_waiting head */
 		request_finished(req, &base->req_waiting_head);
@@ -2678,7 +3685,10 @@ evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
 	struct evdns_request *req;
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
 	EVDNS_LOCK(base);
-	if (flags & DNS_QUERY_NO_SEARCH) {
+	req = hosts_request_new(base, TYPE_A, name, flags, callback, ptr);
+	if (req) {
+		/* answered from the hosts file. */
+	} else if (flags & DNS_QUERY_NO_SEARCH) {
 		req =
 			request_new(base, TYPE_A, name, flags, callback, ptr);
 		if (req)
@@ -2707,7 +3717,10 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
 	struct evdns_request *req;
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
 	EVDNS_LOCK(base);
-	if (flags & DNS_QUERY_NO_SEARCH) {
+	req = hosts_request_new(base, TYPE_AAAA, name, flags, callback, ptr);
+	if (req) {
+		/* answered from the hosts file. */
+	} else if (flags & DNS_QUERY_NO_SEARCH) {
 		req = request_new(base, TYPE_AAAA, name, flags, callback, ptr);
 		if (req)
 			request_submit(req);
@@ -2958,6 +3971,8 @@ search_make_new(const struct search_state *const state, int n, const char *const
 	return NULL; /* unreachable; stops warnings in some compilers. */
 }
 
+static struct evdns_request *search_group_new(struct evdns_base *base, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg);
+
 static struct evdns_request *
 search_request_new(struct evdns_base *base, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg) {
 	ASSERT_LOCKED(base);
@@ -2967,6 +3982,8 @@ search_request_new(struct evdns_base *base, int type, const char *const name, in
 		 base->global_search_state->num_domains) {
 		/* we have some domains to search */
 		struct evdns_request *req;
+		if (base->global_search_parallel)
+			return search_group_new(base, type, name, flags, user_callback, user_arg);
 		if (string_num_dots(name) >= base->global_search_state->ndots) {
 			req = request_new(base, type, name, flags, user_callback, user_arg);
 			if (!req) return NULL;
@@ -3040,6 +4057,8 @@ search_try_next(struct evdns_request *const req) {
 	return 1;
 }
 
+static void search_group_detach(struct evdns_request *const req);
+
 static void
 search_request_finished(struct evdns_request *const req) {
 	ASSERT_LOCKED(req->base);
@@ -3051,6 +4070,549 @@ search_request_finished(struct evdns_request *const req) {
 		mm_free(req->search_origname);
 		req->search_origname = NULL;
 	}
+	if (req->search_group)
+		search_group_detach(req);
+}
+
+/* Parallel search: rather than waiting for each candidate name to fail */
+/* before we try the next, we look them all up at once.  To give the same */
+/* answer that a sequential search would, we only report a candidate's */
+/* answer once every candidate before it in the search order has failed. */
+
+#define SEARCH_CANDIDATE_PENDING 0
+#define SEARCH_CANDIDATE_FAILED 1
+#define SEARCH_CANDIDATE_SUCCEEDED 2
+
+struct search_candidate {
+	/* the request looking up this name, or NULL once it's finished. */
+	struct evdns_request *req;
+	int state;  /* one of the SEARCH_CANDIDATE_* values */
+	/* the outcome, once we know it. */
+	u32 ttl;
+	u32 err;
+	struct reply reply;
+};
+
+struct search_group {
+	/* the number of live candidate requests, plus any temporary */
+	/* references; we free the group when this drops to 0. */
+	int refcount;
+	char done;  /* true once we've told the user the outcome. */
+	int n_candidates;
+	/* the candidates, in search order; the array is allocated to hold */
+	/* n_candidates entries. */
+	struct search_candidate candidates[1];
+};
+
+/* Remove req from its search group, freeing the group if that was its */
+/* last request. */
+static void
+search_group_detach(struct evdns_request *const req) {
+	struct search_group *const group = req->search_group;
+	group->candidates[req->search_group_idx].req = NULL;
+	req->search_group = NULL;
+	if (--group->refcount == 0)
+		mm_free(group);
+}
+
+/* Finish every live request in group except for 'except', without */
+/* telling the user anything. */
+static void
+search_group_finish_others(struct search_group *group,
+    struct evdns_request *except) {
+	int i;
+	++group->refcount;
+	for (i = 0; i < group->n_candidates; ++i) {
+		struct evdns_request *const req = group->candidates[i].req;
+		if (!req || req == except)
+			continue;
+		if (req->ns)
+			request_finished(req, &req->base->req_inflight_head);
+		else
+			request_finished(req, &req->base->req_waiting_head);
+	}
+	if (--group->refcount == 0)
+		mm_free(group);
+}
+
+/* Record the outcome of req, one candidate of a parallel search, and tell */
+/* the user if that decides the outcome of the whole search.  The caller */
+/* still needs to finish req. */
+static void
+search_group_result(struct evdns_request *req, u32 ttl, u32 err, struct reply *reply) {
+	struct search_group *const group = req->search_group;
+	struct search_candidate *cand = &group->candidates[req->search_group_idx];
+	int i;
+
+	ASSERT_LOCKED(req->base);
+	if (group->done)
+		return;
+
+	cand->ttl = ttl;
+	cand->err = err;
+	if (reply) {
+		cand->state = SEARCH_CANDIDATE_SUCCEEDED;
+		memcpy(&cand->reply, reply, sizeof(struct reply));
+	} else {
+		cand->state = SEARCH_CANDIDATE_FAILED;
+	}
+
+	/* find the first candidate in search order that hasn't failed. */
+	for (i = 0; i < group->n_candidates; ++i) {
+		if (group->candidates[i].state != SEARCH_CANDIDATE_FAILED)
+			break;
+	}
+	if (i < group->n_candidates &&
+	    group->candidates[i].state == SEARCH_CANDIDATE_PENDING) {
+		/* it might still succeed; wait for it. */
+		return;
+	}
+
+	group->done = 1;
+	if (i == group->n_candidates) {
+		/* everything failed; report the error for the last name, */
+		/* as a sequential search would. */
+		cand = &group->candidates[group->n_candidates - 1];
+		log(EVDNS_LOG_DEBUG, "Search: all %d names failed",
+		    group->n_candidates);
+		reply_schedule_user_callback(req, 0, cand->err, NULL);
+	} else {
+		cand = &group->candidates[i];
+		log(EVDNS_LOG_DEBUG, "Search: name %d of %d succeeded", i,
+		    group->n_candidates);
+		reply_schedule_user_callback(req, cand->ttl, 0, &cand->reply);
+	}
+	search_group_finish_others(group, req);
+}
+
+/* Cancel every request in a parallel search, and tell the user once. */
+static void
+search_group_cancel(struct search_group *group) {
+	int i;
+	if (!group->done) {
+		group->done = 1;
+		for (i = 0; i < group->n_candidates; ++i) {
+			if (group->candidates[i].req) {
+				reply_schedule_user_callback(
+					group->candidates[i].req, 0,
+					DNS_ERR_CANCEL, NULL);
+				break;
+			}
+		}
+	}
+	search_group_finish_others(group, NULL);
+}
+
+/* Launch a parallel search for every candidate name for 'name'.  Returns */
+/* the request for the first candidate, or NULL on failure. */
+static struct evdns_request *
+search_group_new(struct evdns_base *base, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg) {
+	const struct search_state *const state = base->global_search_state;
+	const int n_candidates = state->num_domains + 1;
+	/* the raw name goes first if it has enough dots, and last otherwise */
+	const int raw_idx =
+	    string_num_dots(name) >= state->ndots ? 0 : n_candidates - 1;
+	struct search_group *group;
+	int i;
+
+	ASSERT_LOCKED(base);
+	group = mm_calloc(1, sizeof(struct search_group) +
+	    (n_candidates - 1) * sizeof(struct search_candidate));
+	if (!group)
+		return NULL;
+	group->n_candidates = n_candidates;
+
+	for (i = 0; i < n_candidates; ++i) {
+		struct evdns_request *req;
+		if (i == raw_idx) {
+			req = request_new(base, type, name, flags, user_callback, user_arg);
+		} else {
+			char *const new_name = search_make_new(state,
+			    raw_idx == 0 ? i - 1 : i, name);
+			if (!new_name)
+				break;
+			req = request_new(base, type, new_name, flags, user_callback, user_arg);
+			mm_free(new_name);
+		}
+		if (!req)
+			break;
+		req->search_group = group;
+		req->search_group_idx = i;
+		group->candidates[i].req = req;
+		++group->refcount;
+	}
+
+	if (i < n_candidates) {
+		/* none of these have been submitted, so we can just */
+		/* free them. */
+		for (i = 0; i < n_candidates; ++i) {
+			if (group->candidates[i].req)
+				mm_free(group->candidates[i].req);
+		}
+		mm_free(group);
+		return NULL;
+	}
+
+	log(EVDNS_LOG_DEBUG, "Search: trying %d names for %s at once",
+	    n_candidates, name);
+	for (i = 0; i < n_candidates; ++i)
+		request_submit(group->candidates[i].req);
+	return group->candidates[0].req;
+}
+
+/*/////////////////////////////////////////////////////////////////// */
+/* Hosts file support */
+/* */
+/* We load the hosts file into a hash table keyed by (lowercased) name, */
+/* with one entry for each name/address pair, so that lookups for local */
+/* names can be answered without going to the network.  Whenever we use */
+/* the table, we check (at most once a second) whether the file has been */
+/* modified, and reload it if so. */
+
+struct hosts_entry {
+	struct hosts_entry *next;
+	u32 hash;
+	int family;  /* AF_INET or AF_INET6 */
+	union {
+		u32 ipv4;  /* in network order */
+		u8 ipv6[16];
+	} addr;
+	/* the name is appended to this structure */
+};
+
+#define HOSTS_ENTRY_NAME(e) ((char *) (((u8 *) (e)) + sizeof(struct hosts_entry)))
+/* Room for the longest name DNS allows, and its NUL.  (HOST_NAME_MAX is */
+/* only 64 on some systems, and is about our own hostname anyway.) */
+#define HOSTS_NAME_MAX 256
+
+/* Lowercase name into buf, dropping any trailing dot.  Return the hash of */
+/* the result, or 0 on failure. */
+static u32
+hosts_normalize_name(const char *name, char *buf, size_t buflen) {
+	/* FNV-1a */
+	u32 hash = 2166136261U;
+	size_t i, len = strlen(name);
+	if (len && name[len-1] == '.')
+		--len;
+	if (!len || len >= buflen)
+		return 0;
+	for (i = 0; i < len; ++i) {
+		buf[i] = EVUTIL_TOLOWER(name[i]);
+		hash = (hash ^ (u8)buf[i]) * 16777619U;
+	}
+	buf[len] = '\0';
+	return hash ? hash : 1;
+}
+
+static void
+hosts_clear(struct evdns_base *base) {
+	int i;
+	struct hosts_entry *e, *next;
+	for (i = 0; i < base->hosts_n_buckets; ++i) {
+		for (e = base->hosts_table[i]; e; e = next) {
+			next = e->next;
+			mm_free(e);
+		}
+	}
+	if (base->hosts_table)
+		mm_free(base->hosts_table);
+	base->hosts_table = NULL;
+	base->hosts_n_buckets = base->hosts_n_entries = 0;
+}
+
+/* Make sure the table has at least as many buckets as entries. */
+static int
+hosts_grow(struct evdns_base *base) {
+	int i, new_n_buckets;
+	struct hosts_entry **new_table, *e, *next, **tail;
+
+	if (base->hosts_n_entries < base->hosts_n_buckets)
+		return 0;
+	new_n_buckets = base->hosts_n_buckets ? base->hosts_n_buckets * 2 : 64;
+	new_table = mm_calloc(new_n_buckets, sizeof(struct hosts_entry *));
+	if (!new_table)
+		return -1;
+	for (i = 0; i < base->hosts_n_buckets; ++i) {
+		for (e = base->hosts_table[i]; e; e = next) {
+			next = e->next;
+			/* append, so that addresses for the same name stay */
+			/* in the order they appeared in the file. */
+			tail = &new_table[e->hash & (new_n_buckets - 1)];
+			while (*tail)
+				tail = &(*tail)->next;
+			e->next = NULL;
+			*tail = e;
+		}
+	}
+	if (base->hosts_table)
+		mm_free(base->hosts_table);
+	base->hosts_table = new_table;
+	base->hosts_n_buckets = new_n_buckets;
+	return 0;
+}
+
+static void
+hosts_add(struct evdns_base *base, const char *name, int family,
+    const void *addr) {
+	char namebuf[HOSTS_NAME_MAX];
+	struct hosts_entry *e, **tail;
+	size_t len;
+	const u32 hash = hosts_normalize_name(name, namebuf, sizeof(namebuf));
+
+	if (!hash || hosts_grow(base) < 0)
+		return;
+	len = strlen(namebuf);
+	e = mm_malloc(sizeof(struct hosts_entry) + len + 1);
+	if (!e)
+		return;
+	e->next = NULL;
+	e->hash = hash;
+	e->family = family;
+	if (family == AF_INET)
+		memcpy(&e->addr.ipv4, addr, 4);
+	else
+		memcpy(e->addr.ipv6, addr, 16);
+	memcpy(HOSTS_ENTRY_NAME(e), namebuf, len + 1);
+
+	tail = &base->hosts_table[hash & (base->hosts_n_buckets - 1)];
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = e;
+	++base->hosts_n_entries;
+}
+
+static void
+hosts_parse_line(struct evdns_base *base, char *const start) {
+	char *strtok_state;
+	static const char *const delims = " \t\r";
+	char *cp, *addr_str;
+	const char *name;
+	u8 addr[16];
+	int family;
+
+	if ((cp = strchr(start, '#')))
+		*cp = '\0';
+	addr_str = strtok_r(start, delims, &strtok_state);
+	if (!addr_str)
+		return;
+	if (evutil_inet_pton(AF_INET, addr_str, addr) == 1)
+		family = AF_INET;
+	else if (evutil_inet_pton(AF_INET6, addr_str, addr) == 1)
+		family = AF_INET6;
+	else
+		return;
+
+	while ((name = strtok_r(NULL, delims, &strtok_state)))
+		hosts_add(base, name, family, addr);
+}
+
+static const char *
+hosts_default_filename(void) {
+#ifdef WIN32
+	static char fname[MAX_PATH];
+	const char *root = getenv("SystemRoot");
+	if (!root)
+		root = "C:\\Windows";
+	evutil_snprintf(fname, sizeof(fname),
+	    "%s\\system32\\drivers\\etc\\hosts", root);
+	return fname;
+#else
+	return "/etc/hosts";
+#endif
+}
+
+/* Replace the hosts index with the contents of base->hosts_fname. */
+/* returns: */
+/*   0 no errors */
+/*   1 failed to open file */
+/*   2 failed to stat file */
+/*   3 file too large */
+/*   4 out of memory */
+/*   5 short read from file */
+static int
+hosts_reload(struct evdns_base *base) {
+	struct stat st;
+	int fd, n, r;
+	char *hosts, *start;
+	int err = 0;
+
+	ASSERT_LOCKED(base);
+	log(EVDNS_LOG_DEBUG, "Loading hosts file %s", base->hosts_fname);
+	hosts_clear(base);
+	base->hosts_mtime = 0;
+
+	fd = open(base->hosts_fname, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st)) { err = 2; goto out1; }
+	base->hosts_mtime = st.st_mtime;
+	/* big ad-blocking hosts files run to several megabytes */
+	if (st.st_size > 64*1024*1024) { err = 3; goto out1; }
+
+	hosts = mm_malloc((size_t)st.st_size + 1);
+	if (!hosts) { err = 4; goto out1; }
+
+	n = 0;
+	while (n < st.st_size &&
+	    (r = read(fd, hosts+n, (size_t)st.st_size-n)) > 0)
+		n += r;
+	if (n < st.st_size) { err = 5; goto out2; }
+	hosts[n] = 0;
+
+	start = hosts;
+	for (;;) {
+		char *const newline = strchr(start, '\n');
+		if (!newline) {
+			hosts_parse_line(base, start);
+			break;
+		} else {
+			*newline = 0;
+			hosts_parse_line(base, start);
+			start = newline + 1;
+		}
+	}
+	log(EVDNS_LOG_DEBUG, "Loaded %d entries from hosts file %s",
+	    base->hosts_n_entries, base->hosts_fname);
+
+out2:
+	mm_free(hosts);
+out1:
+	close(fd);
+	return err;
+}
+
+/* Reload the hosts file if it has changed since we loaded it. */
+static void
+hosts_maybe_reload(struct evdns_base *base) {
+	struct stat st;
+	const time_t now = time(NULL);
+
+	if (!base->hosts_fname || now == base->hosts_last_check)
+		return;
+	base->hosts_last_check = now;
+	if (stat(base->hosts_fname, &st) < 0) {
+		if (base->hosts_n_entries) {
+			log(EVDNS_LOG_DEBUG, "Hosts file %s is gone",
+			    base->hosts_fname);
+			hosts_clear(base);
+			base->hosts_mtime = 0;
+		}
+	} else if (st.st_mtime != base->hosts_mtime) {
+		hosts_reload(base);
+	}
+}
+
+/* Look name up in the hosts index, and fill in reply with up to MAX_ADDRS */
+/* of its addresses of the right type.  Return the number of addresses. */
+static int
+hosts_lookup(struct evdns_base *base, int type, const char *name,
+    struct reply *reply) {
+	char namebuf[HOSTS_NAME_MAX];
+	struct hosts_entry *e;
+	u32 hash, n = 0;
+	const int family = (type == TYPE_A) ? AF_INET : AF_INET6;
+
+	hosts_maybe_reload(base);
+	if (!base->hosts_n_entries)
+		return 0;
+	if (!(hash = hosts_normalize_name(name, namebuf, sizeof(namebuf))))
+		return 0;
+
+	memset(reply, 0, sizeof(struct reply));
+	for (e = base->hosts_table[hash & (base->hosts_n_buckets - 1)];
+	     e && n < MAX_ADDRS; e = e->next) {
+		if (e->hash != hash || e->family != family ||
+		    strcmp(HOSTS_ENTRY_NAME(e), namebuf))
+			continue;
+		if (family == AF_INET)
+			reply->data.a.addresses[n++] = e->addr.ipv4;
+		else
+			memcpy(&reply->data.aaaa.addresses[n++], e->addr.ipv6,
+			    16);
+	}
+	if (!n)
+		return 0;
+	reply->type = type;
+	reply->have_answer = 1;
+	if (family == AF_INET)
+		reply->data.a.addrcount = n;
+	else
+		reply->data.aaaa.addrcount = n;
+	return n;
+}
+
+/* Called (via a zero-length timeout) to deliver a hosts file answer. */
+static void
+hosts_answer_callback(evutil_socket_t fd, short events, void *arg) {
+	struct evdns_request *const req = (struct evdns_request *) arg;
+	struct evdns_base *base = req->base;
+
+	(void) fd;
+	(void) events;
+
+	EVDNS_LOCK(base);
+	reply_schedule_callback(req, 0, 0, req->local_reply);
+	request_finished(req, &base->req_local_head);
+	EVDNS_UNLOCK(base);
+}
+
+/* If the hosts file has an answer for a request of type 'type' for name, */
+/* return a new request that will deliver that answer from the event loop */
+/* without using the network.  Otherwise return NULL. */
+static struct evdns_request *
+hosts_request_new(struct evdns_base *base, int type, const char *name,
+    int flags, evdns_callback_type callback, void *ptr) {
+	struct reply reply;
+	struct evdns_request *req;
+	struct timeval tv;
+
+	ASSERT_LOCKED(base);
+	if (!hosts_lookup(base, type, name, &reply))
+		return NULL;
+	log(EVDNS_LOG_DEBUG, "Answering %s from the hosts file", name);
+
+	req = request_new(base, type, name, flags, callback, ptr);
+	if (!req)
+		return NULL;
+	req->local_reply = mm_malloc(sizeof(struct reply));
+	if (!req->local_reply) {
+		mm_free(req);
+		return NULL;
+	}
+	memcpy(req->local_reply, &reply, sizeof(struct reply));
+
+	evtimer_assign(&req->timeout_event, base->event_base,
+	    hosts_answer_callback, req);
+	evdns_request_insert(req, &base->req_local_head);
+	tv.tv_sec = tv.tv_usec = 0;
+	evtimer_add(&req->timeout_event, &tv);
+	return req;
+}
+
+static int
+evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname) {
+	char *fname;
+
+	ASSERT_LOCKED(base);
+	if (!hosts_fname)
+		hosts_fname = hosts_default_filename();
+	if (!(fname = mm_strdup(hosts_fname)))
+		return -1;
+	if (base->hosts_fname)
+		mm_free(base->hosts_fname);
+	base->hosts_fname = fname;
+	base->hosts_last_check = time(NULL);
+	return hosts_reload(base) == 0 ? 0 : -1;
+}
+
+/* exported function */
+int
+evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname) {
+	int res;
+	EVDNS_LOCK(base);
+	res = evdns_base_load_hosts_impl(base, hosts_fname);
+	EVDNS_UNLOCK(base);
+	return res;
 }
 
 /*/////////////////////////////////////////////////////////////////// */
@@ -3127,32 +4689,16 @@ strtoint_clipped(const char *const str, int min, int max)
 static int
 evdns_base_set_max_requests_inflight(struct evdns_base *base, int maxinflight)
 {
-	int old_n_heads = base->n_req_heads, n_heads;
-	struct evdns_request **old_heads = base->req_heads, **new_heads, *req;
-	int i;
+	int size = 16;
 
 	ASSERT_LOCKED(base);
 	if (maxinflight < 1)
 		maxinflight = 1;
-	n_heads = (maxinflight+4) / 5;
-	EVUTIL_ASSERT(n_heads > 0);
-	new_heads = mm_malloc(n_heads * sizeof(struct evdns_request*));
-	if (!new_heads)
+	/* Keep the table at most half full. */
+	while (size < maxinflight * 2 || size < base->req_table_count * 2)
+		size <<= 1;
+	if (size != base->req_table_size && request_table_resize(base, size) < 0)
 		return (-1);
-	for (i=0; i < n_heads; ++i)
-		new_heads[i] = NULL;
-	if (old_heads) {
-		for (i = 0; i < old_n_heads; ++i) {
-			while (old_heads[i]) {
-				req = old_heads[i];
-				evdns_request_remove(req, &old_heads[i]);
-				evdns_request_insert(req, &new_heads[req->trans_id % n_heads]);
-			}
-		}
-		mm_free(old_heads);
-	}
-	base->req_heads = new_heads;
-	base->n_req_heads = n_heads;
 	base->global_max_requests_inflight = maxinflight;
 	return (0);
 }
@@ -3182,6 +4728,12 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		if (!base->global_search_state) base->global_search_state = search_state_new();
 		if (!base->global_search_state) return -1;
 		base->global_search_state->ndots = ndots;
+	} else if (!strncmp(option, "search-parallel:", 16)) {
+		const int parallel = strtoint(val);
+		if (parallel == -1) return -1;
+		if (!(flags & DNS_OPTION_SEARCH)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting parallel search to %d", parallel);
+		base->global_search_parallel = parallel;
 	} else if (!strncmp(option, "timeout:", 8)) {
 		struct timeval tv;
 		if (strtotimeval(val, &tv) == -1) return -1;
@@ -3196,7 +4748,7 @@ evdns_base_set_option_impl(struct evdns_base *base,
 			maxtimeout);
 		base->global_max_nameserver_timeout = maxtimeout;
 	} else if (!strncmp(option, "max-inflight:", 13)) {
-		const int maxinflight = strtoint_clipped(val, 1, 65000);
+		const int maxinflight = strtoint_clipped(val, 1, 1<<20);
 		if (maxinflight == -1) return -1;
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		log(EVDNS_LOG_DEBUG, "Setting maximum inflight requests to %d",
@@ -3213,14 +4765,73 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		int randcase = strtoint(val);
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		base->global_randomize_case = randcase;
+	} else if (!strncmp(option, "tcp-fallback:", 13)) {
+		int fallback = strtoint(val);
+		if (fallback == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting TCP fallback to %d", fallback);
+		base->global_tcp_fallback = fallback;
+	} else if (!strncmp(option, "tcp-connections:", 16)) {
+		const int maxconns = strtoint_clipped(val, 1, 255);
+		if (maxconns == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting maximum TCP connections to %d",
+			maxconns);
+		base->global_max_tcp_conns = maxconns;
+	} else if (!strncmp(option, "tcp-pipeline:", 13)) {
+		const int pipeline = strtoint_clipped(val, 1, 65535);
+		if (pipeline == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting TCP pipeline depth to %d",
+			pipeline);
+		base->global_tcp_pipeline = pipeline;
+	} else if (!strncmp(option, "udp-sockets:", 12)) {
+		const int nsockets = strtoint_clipped(val, 1, 64);
+		struct nameserver *server = base->server_head;
+		int r = 0;
+		if (nsockets == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		if (nsockets > 1 && base->global_outgoing_addrlen &&
+		    sockaddr_has_port(
+			(struct sockaddr*)&base->global_outgoing_address)) {
+			log(EVDNS_LOG_WARN, "Can't use %d UDP sockets per "
+			    "nameserver when bind-to gives a port", nsockets);
+			return -1;
+		}
+		log(EVDNS_LOG_DEBUG, "Setting UDP sockets per nameserver to %d",
+			nsockets);
+		base->global_udp_sockets = nsockets;
+		if (server) {
+			do {
+				if (nameserver_set_udp_sockets(server,
+					nsockets)) {
+					log(EVDNS_LOG_WARN, "Unable to open %d "
+					    "UDP sockets for nameserver %s",
+					    nsockets,
+					    debug_ntop((struct sockaddr*)
+						&server->address));
+					r = -1;
+				}
+				server = server->next;
+			} while (server != base->server_head);
+		}
+		return r;
 	} else if (!strncmp(option, "bind-to:", 8)) {
 		/* XXX This only applies to successive nameservers, not
 		 * to already-configured ones.	We might want to fix that. */
-		int len = sizeof(base->global_outgoing_address);
+		struct sockaddr_storage ss;
+		int len = sizeof(ss);
 		if (!(flags & DNS_OPTION_NAMESERVERS)) return 0;
-		if (evutil_parse_sockaddr_port(val,
-			(struct sockaddr*)&base->global_outgoing_address, &len))
+		if (evutil_parse_sockaddr_port(val, (struct sockaddr*)&ss, &len))
 			return -1;
+		if (base->global_udp_sockets > 1 &&
+		    sockaddr_has_port((struct sockaddr*)&ss)) {
+			log(EVDNS_LOG_WARN, "Can't bind to a fixed port with "
+			    "%d UDP sockets per nameserver",
+			    base->global_udp_sockets);
+			return -1;
+		}
+		memcpy(&base->global_outgoing_address, &ss, len);
 		base->global_outgoing_addrlen = len;
 	}
 	return 0;
@@ -3300,6 +4911,9 @@ evdns_base_resolv_conf_parse_impl(struct evdns_base *base, int flags, const char
 
 	log(EVDNS_LOG_DEBUG, "Parsing resolv.conf file %s", filename);
 
+	if (flags & DNS_OPTION_HOSTSFILE)
+		evdns_base_load_hosts_impl(base, NULL);
+
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
 		evdns_resolv_set_defaults(base, flags);
@@ -3602,8 +5216,10 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	EVTHREAD_ALLOC_LOCK(base->lock);
 	EVDNS_LOCK(base);
 
-	/* Set max requests inflight and allocate req_heads. */
-	base->req_heads = NULL;
+	/* Set max requests inflight and allocate the request table. */
+	base->req_inflight_head = NULL;
+	base->req_table = NULL;
+	base->req_table_size = base->req_table_count = 0;
 
 	evdns_base_set_max_requests_inflight(base, 64);
 
@@ -3619,11 +5235,16 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	base->global_max_nameserver_timeout = 3;
 	base->global_search_state = NULL;
 	base->global_randomize_case = 1;
+	base->global_tcp_fallback = 1;
+	base->global_max_tcp_conns = 2;
+	base->global_tcp_pipeline = 16;
+	base->global_udp_sockets = 1;
 
 	if (initialize_nameservers) {
 		int r;
 #ifdef WIN32
 		r = evdns_base_config_windows_nameservers(base);
+		evdns_base_load_hosts_impl(base, NULL);
 #else
 		r = evdns_base_resolv_conf_parse(base, DNS_OPTIONS_ALL, "/etc/resolv.conf");
 #endif
@@ -3673,33 +5294,37 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 {
 	struct nameserver *server, *server_next;
 	struct search_domain *dom, *dom_next;
-	int i;
 
 	/* Requires that we hold the lock. */
 
 	/* TODO(nickm) we might need to refcount here. */
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		while (base->req_heads[i]) {
-			if (fail_requests)
-				reply_schedule_callback(base->req_heads[i], 0, DNS_ERR_SHUTDOWN, NULL);
-			request_finished(base->req_heads[i], &REQ_HEAD(base, base->req_heads[i]->trans_id));
-		}
+	while (base->req_inflight_head) {
+		if (fail_requests)
+			reply_schedule_callback(base->req_inflight_head, 0, DNS_ERR_SHUTDOWN, NULL);
+		request_finished(base->req_inflight_head, &base->req_inflight_head);
 	}
 	while (base->req_waiting_head) {
 		if (fail_requests)
 			reply_schedule_callback(base->req_waiting_head, 0, DNS_ERR_SHUTDOWN, NULL);
 		request_finished(base->req_waiting_head, &base->req_waiting_head);
 	}
+	while (base->req_local_head) {
+		if (fail_requests)
+			reply_schedule_callback(base->req_local_head, 0, DNS_ERR_SHUTDOWN, NULL);
+		request_finished(base->req_local_head, &base->req_local_head);
+	}
 	base->global_requests_inflight = base->global_requests_waiting = 0;
 
 	for (server = base->server_head; server; server = server_next) {
 		server_next = server->next;
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
-		(void) event_del(&server->event);
+		nameserver_set_udp_sockets(server, 0);
 		if (server->state == 0)
 			(void) event_del(&server->timeout_event);
+		while (server->tcp_conns)
+			nameserver_tcp_conn_free(server->tcp_conns);
+		if (server->trans_ids_used)
+			mm_free(server->trans_ids_used);
 		mm_free(server);
 		if (server_next == base->server_head)
 			break;
@@ -3715,6 +5340,11 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 		mm_free(base->global_search_state);
 		base->global_search_state = NULL;
 	}
+	hosts_clear(base);
+	if (base->hosts_fname)
+		mm_free(base->hosts_fname);
+	if (base->req_table)
+		mm_free(base->req_table);
 	EVDNS_UNLOCK(base);
 	EVTHREAD_FREE_LOCK(base->lock);
 
@@ -96,12 +96,18 @@ struct eventop {
 struct event_map_entry;
 HT_HEAD(event_io_map, event_map_entry);
 #else
-#define event_io_map event_signal_map
+/* Used to map fds to a list of events: a single array, indexed by fd, of
+   fixed-size slots.  Each slot holds a struct evmap_io followed by the
+   backend's fdinfo, so looking up an fd touches one piece of memory. */
+struct event_io_map {
+	char *entries;
+	int nentries;
+	/* The size of one slot, or 0 if we haven't allocated any yet. */
+	size_t slot_size;
+};
 #endif
 
-/* Used to map signal numbers to a list of events.  If EVMAP_USE_HT is not
-   defined, this is also used as event_io_map, to map fds to a list of events.
-*/
+/* Used to map signal numbers to a list of events. */
 struct event_signal_map {
 	void **entries;
 	int nentries;
@@ -114,6 +120,22 @@ struct common_timeout_list {
 	struct event_base *base;
 };
 
+/** Internal structure: converts readings of the CPU's timestamp counter
+ * into monotonic time.  We calibrate it against CLOCK_MONOTONIC, and take
+ * a fresh reading of that clock whenever the last one is more than a
+ * fraction of a second old. */
+struct event_tsc_clock {
+	/** The TSC and CLOCK_MONOTONIC, in nsec, as of the last resync. */
+	ev_uint64_t tsc_base;
+	ev_uint64_t nsec_base;
+	/** Nanoseconds per tick, in 32.32 fixed point; 0 until calibrated. */
+	ev_uint64_t nsec_per_tick;
+	/** How many ticks past tsc_base we trust the extrapolation. */
+	ev_uint64_t resync_ticks;
+	/** The last time we reported, so that a resync can't go backwards. */
+	ev_uint64_t last_nsec;
+};
+
 struct event_base {
 	/** Function pointers and other data to describe this event_base's
 	 * backend. */
@@ -140,6 +162,18 @@ struct event_base {
 	 */
 	struct event_list *activequeues;
 	int nactivequeues;
+	/** If set, an array of nactivequeues limits on how many callbacks
+	 * each priority may run in one pass through the loop; see
+	 * event_base_priority_set_weights(). */
+	int *activequeue_weights;
+
+	/** Once we've run this many callbacks of priority
+	 * limit_callbacks_after_prio or worse, or spent max_dispatch_time
+	 * running them, we stop and check for new events.  tv_sec is -1 if
+	 * there is no time limit. */
+	struct timeval max_dispatch_time;
+	int max_dispatch_callbacks;
+	int limit_callbacks_after_prio;
 
 	struct common_timeout_list **common_timeout_queues;
 	int n_common_timeouts;
@@ -166,10 +200,40 @@ struct event_base {
 
 	struct timeval tv_cache;
 
+	/** Which clock gettime() reads: one of enum event_base_clock_source.
+	 * May differ from what the event_config asked for, if that clock
+	 * isn't usable here. */
+	int clock_source;
+	/** Calibration state, if clock_source is EVENT_CLOCK_TSC. */
+	struct event_tsc_clock tsc;
+
+	/** True iff we're collecting stats; see event_base_collect_stats(). */
+	int stats_enabled;
+	struct event_base_stats stats;
+	/** Callbacks run at each priority; nactivequeues entries. */
+	ev_uint64_t *stats_prio_callbacks;
+
+	/* See event_base_set_poll_hooks(). */
+	event_base_poll_hook_cb before_poll_fn;
+	event_base_poll_hook_cb after_poll_fn;
+	void *poll_hook_arg;
+	/* See event_base_set_slow_callback_hook(). */
+	event_base_slow_callback_cb slow_cb_fn;
+	struct timeval slow_cb_threshold;
+	void *slow_cb_arg;
+
+	/** The chain memory used by evbuffers charged to this base; see
+	 * evbuffer_set_memory_base(). */
+	struct evbuffer_mem_account *evbuffer_mem;
+
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	/* threading support */
 	/** The thread currently running the event_loop for this base */
 	unsigned long th_owner_id;
+	/** True once any thread but th_owner_id has used this base.  Until
+	 * then, nobody else can be waiting for current_event_lock, so the
+	 * loop keeps it held across callbacks.  Protected by th_base_lock. */
+	int th_foreign_seen;
 	/** A lock to prevent conflicting accesses to this event_base */
 	void *th_base_lock;
 	/** A lock to prevent event_del from deleting an event while its
@@ -180,6 +244,10 @@ struct event_base {
 #ifdef WIN32
 	struct event_iocp_port *iocp;
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	/** Our io_uring completion port, if bufferevents should use one. */
+	struct event_uring_port *uring;
+#endif
 
         enum event_base_config_flag flags;
 
@@ -187,6 +255,11 @@ struct event_base {
 	int th_notify_fd[2];
 	struct event th_notify;
 	int (*th_notify_fn)(struct event_base *base);
+	/** Set while event_add_batch() or event_del_batch() is running:
+	 * instead of waking the main thread for each event, we note that it
+	 * needs waking in th_notify_pending, and wake it once at the end. */
+	int th_notify_batched;
+	int th_notify_pending;
 };
 
 struct event_config_entry {
@@ -202,6 +275,14 @@ struct event_config {
 
 	enum event_method_feature require_features;
         enum event_base_config_flag flags;
+
+	/* See event_config_set_max_dispatch_interval(). */
+	struct timeval max_dispatch_interval;
+	int max_dispatch_callbacks;
+	int limit_callbacks_after_prio;
+
+	/* See event_config_set_clock_source(). */
+	enum event_base_clock_source clock_source;
 };
 
 /* Internal use only: Functions that might be missing from <sys/queue.h> */
@@ -53,6 +53,12 @@
 #include <signal.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+#include <cpuid.h>
+#define USE_TSC_CLOCK
+#endif
 
 #include "event2/event.h"
 #include "event2/event_struct.h"
@@ -62,9 +68,13 @@
 #include "evthread-internal.h"
 #include "event2/thread.h"
 #include "event2/util.h"
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
 #include "iocp-internal.h"
+#include "uring-internal.h"
+#include "evbuffer-internal.h"
 
 #ifdef _EVENT_HAVE_EVENT_PORTS
 extern const struct eventop evportops;
@@ -78,6 +88,9 @@ extern const struct eventop pollops;
 #ifdef _EVENT_HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+extern const struct eventop io_uringops;
+#endif
 #ifdef _EVENT_HAVE_WORKING_KQUEUE
 extern const struct eventop kqops;
 #endif
@@ -99,6 +112,9 @@ static const struct eventop *eventops[] = {
 #ifdef _EVENT_HAVE_EPOLL
 	&epollops,
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	&io_uringops,
+#endif
 #ifdef _EVENT_HAVE_DEVPOLL
 	&devpollops,
 #endif
@@ -138,6 +154,7 @@ static inline void	event_signal_closure(struct event_base *, struct event *ev);
 static inline void	event_persist_closure(struct event_base *, struct event *ev);
 
 static int	evthread_notify_base(struct event_base *base);
+static void	evthread_notify_base_or_defer(struct event_base *base);
 
 static void
 detect_monotonic(void)
@@ -156,18 +173,170 @@ detect_monotonic(void)
 #endif
 }
 
+#if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+static inline int
+read_clock_nsec(clockid_t id, ev_uint64_t *nsec)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(id, &ts) == -1)
+		return (-1);
+	*nsec = (ev_uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return (0);
+}
+#endif
+
+#ifdef USE_TSC_CLOCK
+/* Don't trust a calibration over an interval shorter than this. */
+#define TSC_CALIBRATE_NSEC 1000000
+/* Take a fresh reading of CLOCK_MONOTONIC at least this often. */
+#define TSC_RESYNC_NSEC 100000000
+
+static inline ev_uint64_t
+read_tsc(void)
+{
+	ev_uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((ev_uint64_t)hi << 32) | lo;
+}
+
+/* Return true iff the CPU promises that its TSC ticks at a constant rate,
+ * whatever its frequency or sleep state. */
 static int
-gettime(struct event_base *base, struct timeval *tp)
+tsc_is_invariant(void)
 {
-	if (base->tv_cache.tv_sec) {
-		*tp = base->tv_cache;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+	    eax < 0x80000007)
+		return (0);
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
 		return (0);
+	return (edx & (1 << 8)) != 0;
+}
+
+static int
+tsc_init(struct event_tsc_clock *tsc)
+{
+	memset(tsc, 0, sizeof(*tsc));
+	if (!tsc_is_invariant())
+		return (-1);
+	tsc->tsc_base = read_tsc();
+	if (read_clock_nsec(CLOCK_MONOTONIC, &tsc->nsec_base) == -1)
+		return (-1);
+	tsc->last_nsec = tsc->nsec_base;
+	return (0);
+}
+
+/* Read CLOCK_MONOTONIC into *nsec, and use the ticks since the last resync
+ * to re-estimate the TSC's rate. */
+static int
+tsc_resync(struct event_tsc_clock *tsc, ev_uint64_t *nsec)
+{
+	ev_uint64_t now_tsc, now_nsec, ticks, elapsed;
+
+	now_tsc = read_tsc();
+	if (read_clock_nsec(CLOCK_MONOTONIC, &now_nsec) == -1)
+		return (-1);
+	*nsec = now_nsec;
+
+	ticks = now_tsc - tsc->tsc_base;
+	elapsed = now_nsec - tsc->nsec_base;
+	if (elapsed < TSC_CALIBRATE_NSEC || ticks == 0)
+		return (0);
+
+	tsc->nsec_per_tick = (ev_uint64_t)
+	    ((double)elapsed * 4294967296.0 / (double)ticks);
+	if (tsc->nsec_per_tick == 0)
+		tsc->nsec_per_tick = 1;
+	tsc->resync_ticks = ((ev_uint64_t)TSC_RESYNC_NSEC << 32) /
+	    tsc->nsec_per_tick;
+	tsc->tsc_base = now_tsc;
+	tsc->nsec_base = now_nsec;
+	return (0);
+}
+
+static int
+tsc_gettime(struct event_tsc_clock *tsc, ev_uint64_t *nsec)
+{
+	ev_uint64_t ticks = read_tsc() - tsc->tsc_base, now;
+
+	/* A TSC that went backwards (we moved to a CPU whose counter is
+	 * slightly behind) shows up here as a huge number of ticks, and so
+	 * gets a resync too. */
+	if (!tsc->nsec_per_tick || ticks > tsc->resync_ticks) {
+		if (tsc_resync(tsc, &now) == -1)
+			return (-1);
+	} else {
+		now = tsc->nsec_base + ((ticks * tsc->nsec_per_tick) >> 32);
 	}
 
+	if (now < tsc->last_nsec)
+		now = tsc->last_nsec;
+	else
+		tsc->last_nsec = now;
+	*nsec = now;
+	return (0);
+}
+#endif
+
+/* Pick the clock that base will use; fall back to EVENT_CLOCK_DEFAULT if
+ * the requested one isn't available. */
+static void
+clock_init(struct event_base *base, enum event_base_clock_source source)
+{
+	base->clock_source = EVENT_CLOCK_DEFAULT;
+	if (!use_monotonic)
+		return;
+
+	switch (source) {
+#ifdef CLOCK_MONOTONIC_COARSE
+	case EVENT_CLOCK_COARSE: {
+		struct timespec ts;
+		if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+			base->clock_source = EVENT_CLOCK_COARSE;
+		break;
+	}
+#endif
+#ifdef USE_TSC_CLOCK
+	case EVENT_CLOCK_TSC:
+		if (tsc_init(&base->tsc) == 0)
+			base->clock_source = EVENT_CLOCK_TSC;
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/* Read base's clock, ignoring the time cache. */
+static int
+gettime_uncached(struct event_base *base, struct timeval *tp)
+{
+#ifdef USE_TSC_CLOCK
+	if (base->clock_source == EVENT_CLOCK_TSC) {
+		ev_uint64_t nsec;
+
+		if (tsc_gettime(&base->tsc, &nsec) == -1)
+			return (-1);
+
+		tp->tv_sec = nsec / 1000000000;
+		tp->tv_usec = (nsec % 1000000000) / 1000;
+		return (0);
+	}
+#endif
+
 #if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
 	if (use_monotonic) {
 		struct timespec	ts;
 
+#ifdef CLOCK_MONOTONIC_COARSE
+		if (base->clock_source == EVENT_CLOCK_COARSE) {
+			if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == -1)
+				return (-1);
+		} else
+#endif
 		if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
 			return (-1);
 
@@ -180,6 +349,17 @@ gettime(struct event_base *base, struct timeval *tp)
 	return (evutil_gettimeofday(tp, NULL));
 }
 
+static int
+gettime(struct event_base *base, struct timeval *tp)
+{
+	if (base->tv_cache.tv_sec) {
+		*tp = base->tv_cache;
+		return (0);
+	}
+
+	return (gettime_uncached(base, tp));
+}
+
 static inline void
 clear_time_cache(struct event_base *base)
 {
@@ -251,6 +431,75 @@ event_base_get_features(struct event_base *base)
 	return base->evsel->features;
 }
 
+enum event_base_clock_source
+event_base_get_clock_source(struct event_base *base)
+{
+	return base->clock_source;
+}
+
+/* How many times to read the clock when measuring its cost. */
+#define CLOCK_COST_SAMPLES 10000
+
+int
+event_base_get_clock_info(struct event_base *base, long *resolution_nsec,
+    long *cost_nsec)
+{
+	struct timeval start, end, tv, elapsed;
+	long resolution = 1000;
+	int i, r = -1;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+
+#if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (use_monotonic) {
+		struct timespec ts;
+		clockid_t id = CLOCK_MONOTONIC;
+#ifdef CLOCK_MONOTONIC_COARSE
+		if (base->clock_source == EVENT_CLOCK_COARSE)
+			id = CLOCK_MONOTONIC_COARSE;
+#endif
+		if (clock_getres(id, &ts) == 0)
+			resolution = ts.tv_sec * 1000000000L + ts.tv_nsec;
+	}
+#endif
+#ifdef USE_TSC_CLOCK
+	if (base->clock_source == EVENT_CLOCK_TSC) {
+		/* Make sure we've calibrated, so that we report the cost of
+		 * reading the TSC and not of the calibration. */
+		while (!base->tsc.nsec_per_tick) {
+			if (gettime_uncached(base, &tv) == -1)
+				goto done;
+		}
+		resolution = (long)(base->tsc.nsec_per_tick >> 32);
+		if (resolution < 1)
+			resolution = 1;
+	}
+#endif
+
+	/* Time the readings with the default clock, so that we measure a
+	 * coarse clock with a fine one. */
+	if (evutil_gettimeofday(&start, NULL) == -1)
+		goto done;
+	for (i = 0; i < CLOCK_COST_SAMPLES; ++i) {
+		if (gettime_uncached(base, &tv) == -1)
+			goto done;
+	}
+	if (evutil_gettimeofday(&end, NULL) == -1)
+		goto done;
+	evutil_timersub(&end, &start, &elapsed);
+
+	if (resolution_nsec)
+		*resolution_nsec = resolution;
+	if (cost_nsec)
+		*cost_nsec = (elapsed.tv_sec * 1000000000L +
+		    elapsed.tv_usec * 1000L) / CLOCK_COST_SAMPLES;
+	r = 0;
+done:
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (r);
+}
+
 void
 event_deferred_cb_queue_init(struct deferred_cb_queue *cb)
 {
@@ -262,8 +511,10 @@ static void
 notify_base_cbq_callback(struct deferred_cb_queue *cb, void *baseptr)
 {
 	struct event_base *base = baseptr;
-	if (!EVBASE_IN_THREAD(base))
-	    evthread_notify_base(base);
+	if (!EVBASE_IN_THREAD(base)) {
+		EVBASE_NOTE_THREAD(base);
+		evthread_notify_base(base);
+	}
 }
 
 struct deferred_cb_queue *
@@ -285,6 +536,7 @@ event_base_new_with_config(struct event_config *cfg)
 	}
 
 	detect_monotonic();
+	clock_init(base, cfg ? cfg->clock_source : EVENT_CLOCK_DEFAULT);
 	gettime(base, &base->event_tv);
 
 	min_heap_ctor(&base->timeheap);
@@ -295,8 +547,18 @@ event_base_new_with_config(struct event_config *cfg)
 	event_deferred_cb_queue_init(&base->defer_queue);
 	base->defer_queue.notify_fn = notify_base_cbq_callback;
 	base->defer_queue.notify_arg = base;
-	if (cfg)
+	if (cfg) {
 		base->flags = cfg->flags;
+		memcpy(&base->max_dispatch_time, &cfg->max_dispatch_interval,
+		    sizeof(struct timeval));
+		base->max_dispatch_callbacks = cfg->max_dispatch_callbacks;
+		base->limit_callbacks_after_prio =
+		    cfg->limit_callbacks_after_prio;
+	} else {
+		base->max_dispatch_time.tv_sec = -1;
+		base->max_dispatch_callbacks = INT_MAX;
+		base->limit_callbacks_after_prio = 1;
+	}
 
 	evmap_io_initmap(&base->io);
 	evmap_signal_initmap(&base->sigmap);
@@ -305,6 +567,8 @@ event_base_new_with_config(struct event_config *cfg)
 
 	should_check_environment =
 	    !(cfg && (cfg->flags & EVENT_BASE_FLAG_IGNORE_ENV));
+	if (should_check_environment && getenv("EVENT_PRECISE_TIMER"))
+		base->flags |= EVENT_BASE_FLAG_PRECISE_TIMER;
 
 	for (i = 0; eventops[i] && !base->evbase; i++) {
 		if (cfg != NULL) {
@@ -343,12 +607,21 @@ event_base_new_with_config(struct event_config *cfg)
 		return NULL;
 	}
 
+	if ((base->evbuffer_mem = _evbuffer_mem_account_new()) == NULL) {
+		event_base_free(base);
+		return NULL;
+	}
+
 	/* prepare for threading */
 	base->th_notify_fd[0] = -1;
 	base->th_notify_fd[1] = -1;
 
 	if (!cfg || !(cfg->flags & EVENT_BASE_FLAG_NOLOCK)) {
 		int r;
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+		/* Until some loop runs, the creating thread owns the base. */
+		base->th_owner_id = EVTHREAD_GET_ID();
+#endif
 		EVTHREAD_ALLOC_LOCK(base->th_base_lock);
 		base->defer_queue.lock = base->th_base_lock;
 		EVTHREAD_ALLOC_LOCK(base->current_event_lock);
@@ -363,6 +636,10 @@ event_base_new_with_config(struct event_config *cfg)
 	if (cfg && (cfg->flags & EVENT_BASE_FLAG_STARTUP_IOCP))
 		event_base_start_iocp(base);
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	if (cfg && (cfg->flags & EVENT_BASE_FLAG_STARTUP_URING))
+		event_base_start_uring(base, 0);
+#endif
 
 	return (base);
 }
@@ -384,6 +661,21 @@ event_base_start_iocp(struct event_base *base)
 #endif
 }
 
+#ifdef _EVENT_HAVE_IO_URING
+int
+event_base_start_uring(struct event_base *base, int flags)
+{
+	if (base->uring)
+		return 0;
+	base->uring = event_uring_port_launch(base, flags);
+	if (!base->uring) {
+		event_warnx("%s: Couldn't launch io_uring", __func__);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 void
 event_base_free(struct event_base *base)
 {
@@ -409,6 +701,13 @@ event_base_free(struct event_base *base)
 		base->th_notify_fd[1] = -1;
 	}
 
+#ifdef _EVENT_HAVE_IO_URING
+	if (base->uring) {
+		event_uring_port_free(base->uring);
+		base->uring = NULL;
+	}
+#endif
+
 	/* Delete all non-internal events. */
 	for (ev = TAILQ_FIRST(&base->eventqueue); ev; ) {
 		struct event *next = TAILQ_NEXT(ev, ev_next);
@@ -465,12 +764,20 @@ event_base_free(struct event_base *base)
 	min_heap_dtor(&base->timeheap);
 
 	mm_free(base->activequeues);
+	if (base->activequeue_weights)
+		mm_free(base->activequeue_weights);
+	if (base->stats_prio_callbacks)
+		mm_free(base->stats_prio_callbacks);
 
 	EVUTIL_ASSERT(TAILQ_EMPTY(&base->eventqueue));
 
 	evmap_io_clear(&base->io);
 	evmap_signal_clear(&base->sigmap);
 
+	/* Chains charged to the account keep it alive until they go. */
+	if (base->evbuffer_mem)
+		_evbuffer_mem_account_decref(base->evbuffer_mem);
+
 	EVTHREAD_FREE_LOCK(base->th_base_lock);
 	EVTHREAD_FREE_LOCK(base->current_event_lock);
 
@@ -566,6 +873,9 @@ event_config_new(void)
 		return (NULL);
 
 	TAILQ_INIT(&cfg->entries);
+	cfg->max_dispatch_interval.tv_sec = -1;
+	cfg->max_dispatch_callbacks = INT_MAX;
+	cfg->limit_callbacks_after_prio = 1;
 
 	return (cfg);
 }
@@ -600,6 +910,16 @@ event_config_set_flag(struct event_config *cfg, int flag)
 	return 0;
 }
 
+int
+event_config_set_clock_source(struct event_config *cfg,
+    enum event_base_clock_source source)
+{
+	if (!cfg)
+		return -1;
+	cfg->clock_source = source;
+	return 0;
+}
+
 int
 event_config_avoid_method(struct event_config *cfg, const char *method)
 {
@@ -627,6 +947,25 @@ event_config_require_features(struct event_config *cfg,
 	return (0);
 }
 
+int
+event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority)
+{
+	if (!cfg)
+		return (-1);
+	if (max_interval)
+		memcpy(&cfg->max_dispatch_interval, max_interval,
+		    sizeof(struct timeval));
+	else
+		cfg->max_dispatch_interval.tv_sec = -1;
+	cfg->max_dispatch_callbacks =
+	    max_callbacks >= 0 ? max_callbacks : INT_MAX;
+	if (min_priority < 0)
+		min_priority = 0;
+	cfg->limit_callbacks_after_prio = min_priority;
+	return (0);
+}
+
 int
 event_priority_init(int npriorities)
 {
@@ -647,8 +986,18 @@ event_base_priority_init(struct event_base *base, int npriorities)
 
 	if (base->nactivequeues) {
 		mm_free(base->activequeues);
+		base->activequeues = NULL;
 		base->nactivequeues = 0;
 	}
+	/* The weights and stats were for the old priorities. */
+	if (base->activequeue_weights) {
+		mm_free(base->activequeue_weights);
+		base->activequeue_weights = NULL;
+	}
+	if (base->stats_prio_callbacks) {
+		mm_free(base->stats_prio_callbacks);
+		base->stats_prio_callbacks = NULL;
+	}
 
 	/* Allocate our priority queues */
 	base->activequeues = (struct event_list *)
@@ -657,6 +1006,14 @@ event_base_priority_init(struct event_base *base, int npriorities)
 		event_warn("%s: calloc", __func__);
 		return (-1);
 	}
+	base->stats_prio_callbacks = (ev_uint64_t *)
+	  mm_calloc(npriorities, sizeof(ev_uint64_t));
+	if (base->stats_prio_callbacks == NULL) {
+		event_warn("%s: calloc", __func__);
+		mm_free(base->activequeues);
+		base->activequeues = NULL;
+		return (-1);
+	}
 	base->nactivequeues = npriorities;
 				
 	for (i = 0; i < base->nactivequeues; ++i) {
@@ -666,6 +1023,183 @@ event_base_priority_init(struct event_base *base, int npriorities)
 	return (0);
 }
 
+int
+event_base_priority_set_weights(struct event_base *base, const int *weights)
+{
+	int i, *w = NULL;
+
+	if (weights) {
+		for (i = 0; i < base->nactivequeues; ++i) {
+			if (weights[i] < 1)
+				return (-1);
+		}
+		w = mm_malloc(base->nactivequeues * sizeof(int));
+		if (w == NULL)
+			return (-1);
+		memcpy(w, weights, base->nactivequeues * sizeof(int));
+	}
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	if (base->activequeue_weights)
+		mm_free(base->activequeue_weights);
+	base->activequeue_weights = w;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (0);
+}
+
+int
+event_base_collect_stats(struct event_base *base, int enable)
+{
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	base->stats_enabled = enable != 0;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+int
+event_base_get_stats(struct event_base *base, struct event_base_stats *stats)
+{
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	*stats = base->stats;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+int
+event_base_get_priority_stats(struct event_base *base, int priority,
+    ev_uint64_t *n_callbacks)
+{
+	int r = -1;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	if (priority >= 0 && priority < base->nactivequeues) {
+		*n_callbacks = base->stats_prio_callbacks[priority];
+		r = 0;
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (r);
+}
+
+void
+event_base_reset_stats(struct event_base *base)
+{
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	memset(&base->stats, 0, sizeof(base->stats));
+	memset(base->stats_prio_callbacks, 0,
+	    base->nactivequeues * sizeof(ev_uint64_t));
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
+int
+event_base_set_poll_hooks(struct event_base *base,
+    event_base_poll_hook_cb before, event_base_poll_hook_cb after, void *arg)
+{
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	base->before_poll_fn = before;
+	base->after_poll_fn = after;
+	base->poll_hook_arg = arg;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+int
+event_base_set_slow_callback_hook(struct event_base *base,
+    const struct timeval *threshold, event_base_slow_callback_cb fn,
+    void *arg)
+{
+	if (fn && !threshold)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	base->slow_cb_fn = fn;
+	if (fn)
+		base->slow_cb_threshold = *threshold;
+	base->slow_cb_arg = arg;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+/* Return the histogram bucket that a duration of usec belongs in. */
+static inline int
+stats_bucket(ev_uint64_t usec)
+{
+	int b = 0;
+
+	while (usec && b < EVENT_STATS_N_BUCKETS - 1) {
+		usec >>= 1;
+		++b;
+	}
+	return b;
+}
+
+/* Set *elapsed to the time from *start to *end, and return it in usec.  A
+ * clock that went backwards gives 0. */
+static inline ev_uint64_t
+stats_elapsed(const struct timeval *start, const struct timeval *end,
+    struct timeval *elapsed)
+{
+	if (evutil_timercmp(end, start, <)) {
+		evutil_timerclear(elapsed);
+		return (0);
+	}
+	evutil_timersub(end, start, elapsed);
+	return (ev_uint64_t)elapsed->tv_sec * 1000000 + elapsed->tv_usec;
+}
+
+/* Account for one event callback that started at *start, and report it to
+ * the slow-callback hook if it took too long. */
+static void
+stats_note_callback(struct event_base *base,
+    void (*cb)(evutil_socket_t, short, void *), void *cb_arg,
+    const struct timeval *start)
+{
+	struct event_base_stats *stats = &base->stats;
+	struct timeval now, elapsed;
+	ev_uint64_t usec;
+
+	if (gettime_uncached(base, &now) == -1)
+		return;
+	usec = stats_elapsed(start, &now, &elapsed);
+
+	if (base->stats_enabled) {
+		++stats->n_callbacks;
+		stats->callback_usec += usec;
+		if (usec > stats->max_callback_usec)
+			stats->max_callback_usec = usec;
+		++stats->callback_hist[stats_bucket(usec)];
+	}
+
+	if (base->slow_cb_fn &&
+	    evutil_timercmp(&elapsed, &base->slow_cb_threshold, >=))
+		base->slow_cb_fn(base, cb, cb_arg, &elapsed, base->slow_cb_arg);
+}
+
+/* Account for one wait for events that started at *start. */
+static void
+stats_note_poll(struct event_base *base, const struct timeval *start)
+{
+	struct event_base_stats *stats = &base->stats;
+	struct timeval now, elapsed;
+	ev_uint64_t usec;
+
+	/* The time cache was just refreshed, if we're using it. */
+	if (gettime(base, &now) == -1)
+		return;
+	usec = stats_elapsed(start, &now, &elapsed);
+
+	++stats->n_polls;
+	stats->poll_usec += usec;
+	++stats->poll_hist[stats_bucket(usec)];
+}
+
 static int
 event_haveevents(struct event_base *base)
 {
@@ -779,6 +1313,7 @@ event_base_init_common_timeout(struct event_base *base,
 	struct common_timeout_list *new_ctl;
 
 	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
 	if (duration->tv_usec > 1000000) {
 		memcpy(&tv, duration, sizeof(struct timeval));
 		if (is_common_timeout(duration, base))
@@ -873,19 +1408,40 @@ event_persist_closure(struct event_base *base, struct event *ev)
 	(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
 }
 
+/* Return true iff it's time to stop running callbacks, because it's no
+ * earlier than endtime.  Requires that the lock be held. */
+static int
+event_dispatch_time_is_up(struct event_base *base,
+    const struct timeval *endtime)
+{
+	struct timeval now;
+
+	if (!endtime)
+		return (0);
+	update_time_cache(base);
+	gettime(base, &now);
+	return evutil_timercmp(&now, endtime, >=);
+}
+
 /*
-  Helper for event_process_active to process all the events in a single queue,
+  Helper for event_process_active to process the events in a single queue,
   releasing the lock as we go.  This function requires that the lock be held
-  when it's invoked.  Returns -1 if we get a signal or an event_break that
-  means we should stop processing any active events now.  Otherwise returns
-  the number of non-internal events that we processed.
+  when it's invoked.  We stop once we have processed max_to_process
+  non-internal events, or after any callback that finishes at or after
+  endtime (if endtime is not NULL).  Returns -1 if we get a signal or an
+  event_break that means we should stop processing any active events now.
+  Otherwise returns the number of non-internal events that we processed.
 */
 static int
 event_process_active_single_queue(struct event_base *base,
-    struct event_list *activeq)
+    struct event_list *activeq, int max_to_process,
+    const struct timeval *endtime)
 {
 	struct event *ev;
-	int count = 0;
+	int count = 0, held_cur = 0, result, timing;
+	void (*cb)(evutil_socket_t, short, void *);
+	void *cb_arg;
+	struct timeval cb_start;
 
 	EVUTIL_ASSERT(activeq != NULL);
 
@@ -906,10 +1462,26 @@ event_process_active_single_queue(struct event_base *base,
 
 		base->current_event = ev;
 
-		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, current_event_lock);
+		timing = base->stats_enabled || base->slow_cb_fn;
+		if (timing) {
+			/* The callback may free ev. */
+			cb = ev->ev_callback;
+			cb_arg = ev->ev_arg;
+			timing = gettime_uncached(base, &cb_start) == 0;
+		}
 
-		EVBASE_RELEASE_LOCK(base,
-		    EVTHREAD_WRITE, th_base_lock);
+		/* If no other thread has used the base, nobody can be */
+		/* waiting for current_event_lock, so we keep it for the */
+		/* whole run of callbacks.  Any other thread marks the base */
+		/* while it holds th_base_lock, and event_del() waits for */
+		/* current_event_lock without holding th_base_lock, so we */
+		/* notice it after this callback at the latest. */
+		if (!held_cur) {
+			EVBASE_ACQUIRE_LOCK(base,
+			    EVTHREAD_WRITE, current_event_lock);
+			held_cur = EVBASE_LOCKS_UNCONTENDED(base);
+		}
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 
 		switch (ev->ev_closure) {
 		case EV_CLOSURE_SIGNAL:
@@ -925,22 +1497,49 @@ event_process_active_single_queue(struct event_base *base,
 			break;
 		}
 
-		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, current_event_lock);
+		if (!held_cur)
+			EVBASE_RELEASE_LOCK(base,
+			    EVTHREAD_WRITE, current_event_lock);
 		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 		base->current_event = NULL;
+		if (held_cur && !EVBASE_LOCKS_UNCONTENDED(base)) {
+			EVBASE_RELEASE_LOCK(base,
+			    EVTHREAD_WRITE, current_event_lock);
+			held_cur = 0;
+		}
 
-		if (base->event_break)
-			return -1;
+		if (timing)
+			stats_note_callback(base, cb, cb_arg, &cb_start);
+
+		if (base->event_break) {
+			result = -1;
+			goto done;
+		}
+		if (count >= max_to_process)
+			break;
+		if (count && event_dispatch_time_is_up(base, endtime))
+			break;
 	}
-	return count;
+	result = count;
+done:
+	if (held_cur)
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, current_event_lock);
+	return result;
 }
 
 static int
-event_process_deferred_callbacks(struct deferred_cb_queue *queue, int *breakptr)
+event_process_deferred_callbacks(struct event_base *base,
+    struct deferred_cb_queue *queue, int *breakptr)
 {
 	int count = 0;
 	struct deferred_cb *cb;
 
+	if (base->stats_enabled) {
+		if ((ev_uint64_t)queue->active_count >
+		    base->stats.max_deferred_queued)
+			base->stats.max_deferred_queued = queue->active_count;
+	}
+
 	while ((cb = TAILQ_FIRST(&queue->deferred_cb_list))) {
 		cb->queued = 0;
 		TAILQ_REMOVE(&queue->deferred_cb_list, cb, cb_next);
@@ -948,11 +1547,12 @@ event_process_deferred_callbacks(struct deferred_cb_queue *queue, int *breakptr)
 		UNLOCK_DEFERRED_QUEUE(queue);
 
 		cb->cb(cb, cb->arg);
+		LOCK_DEFERRED_QUEUE(queue);
 		++count;
+		if (base->stats_enabled)
+			++base->stats.n_deferred;
 		if (*breakptr)
 			return -1;
-
-		LOCK_DEFERRED_QUEUE(queue);
 	}
 	return count;
 }
@@ -960,7 +1560,12 @@ event_process_deferred_callbacks(struct deferred_cb_queue *queue, int *breakptr)
 /*
  * Active events are stored in priority queues.  Lower priorities are always
  * process before higher priorities.  Low priority events can starve high
- * priority ones.
+ * priority ones, unless the priorities have weights: then each priority runs
+ * at most its weight in callbacks before we move on to the next.
+ *
+ * Callbacks of priority limit_callbacks_after_prio or worse also count
+ * against max_dispatch_callbacks and max_dispatch_time; once either runs
+ * out, we go back to check for new events and run timeouts.
  */
 
 static void
@@ -968,23 +1573,51 @@ event_process_active(struct event_base *base)
 {
 	/* Caller must hold th_base_lock */
 	struct event_list *activeq = NULL;
-	int i, c;
+	const int *weights = base->activequeue_weights;
+	int i, c, max_to_process, n_limited = 0;
+	struct timeval tv;
+	const struct timeval *endtime = NULL;
+
+	if (base->max_dispatch_time.tv_sec >= 0) {
+		update_time_cache(base);
+		gettime(base, &tv);
+		evutil_timeradd(&base->max_dispatch_time, &tv, &tv);
+		endtime = &tv;
+	}
 
 	for (i = 0; i < base->nactivequeues; ++i) {
 		if (TAILQ_FIRST(&base->activequeues[i]) != NULL) {
+			const int limited = i >= base->limit_callbacks_after_prio;
 			activeq = &base->activequeues[i];
-			c = event_process_active_single_queue(base, activeq);
+			max_to_process = weights ? weights[i] : INT_MAX;
+			if (limited && max_to_process >
+			    base->max_dispatch_callbacks - n_limited)
+				max_to_process =
+				    base->max_dispatch_callbacks - n_limited;
+			c = event_process_active_single_queue(base, activeq,
+			    max_to_process, limited ? endtime : NULL);
 			if (c < 0)
 				return;
-			else if (c > 0)
+			if (base->stats_enabled)
+				base->stats_prio_callbacks[i] += c;
+			if (limited) {
+				n_limited += c;
+				if (n_limited >= base->max_dispatch_callbacks ||
+				    (c && event_dispatch_time_is_up(base,
+					endtime)))
+					break; /* Out of budget for now. */
+			}
+			if (c > 0 && !weights)
 				break; /* Processed a real event; do not
 					* consider lower-priority events */
 			/* If we get here, all of the events we processed
-			 * were internal.  Continue. */
+			 * were internal, or this priority has used up its
+			 * weight.  Continue. */
 		}
 	}
 
-	event_process_deferred_callbacks(&base->defer_queue,&base->event_break);
+	event_process_deferred_callbacks(base, &base->defer_queue,
+	    &base->event_break);
 }
 
 /*
@@ -1045,6 +1678,7 @@ event_base_loopbreak(struct event_base *event_base)
 		return (-1);
 
 	EVBASE_ACQUIRE_LOCK(event_base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(event_base);
 	event_base->event_break = 1;
 	EVBASE_RELEASE_LOCK(event_base, EVTHREAD_WRITE, th_base_lock);
 
@@ -1060,6 +1694,7 @@ event_base_got_break(struct event_base *event_base)
 {
 	int res;
 	EVBASE_ACQUIRE_LOCK(event_base, EVTHREAD_READ, th_base_lock);
+	EVBASE_NOTE_THREAD(event_base);
 	res = event_base->event_break;
 	EVBASE_RELEASE_LOCK(event_base, EVTHREAD_READ, th_base_lock);
 	return res;
@@ -1070,6 +1705,7 @@ event_base_got_exit(struct event_base *event_base)
 {
 	int res;
 	EVBASE_ACQUIRE_LOCK(event_base, EVTHREAD_READ, th_base_lock);
+	EVBASE_NOTE_THREAD(event_base);
 	res = event_base->event_gotterm;
 	EVBASE_RELEASE_LOCK(event_base, EVTHREAD_READ, th_base_lock);
 	return res;
@@ -1087,9 +1723,9 @@ int
 event_base_loop(struct event_base *base, int flags)
 {
 	const struct eventop *evsel = base->evsel;
-	struct timeval tv;
+	struct timeval tv, poll_start;
 	struct timeval *tv_p;
-	int res, done;
+	int res, done, timing;
 
 	/* Grab the lock.  We will release it inside evsel.dispatch, and again
 	 * as we invoke user callbacks. */
@@ -1102,7 +1738,18 @@ event_base_loop(struct event_base *base, int flags)
 	done = 0;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
-	base->th_owner_id = EVTHREAD_GET_ID();
+	if (base->th_owner_id != EVTHREAD_GET_ID()) {
+		/* The loop has moved to another thread; the old one may */
+		/* still be using the base. */
+		base->th_foreign_seen = 1;
+		base->th_owner_id = EVTHREAD_GET_ID();
+	}
+#endif
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+	/* Huge page chains for this base's evbuffers go where we run.  We
+	 * only bother finding out once one of them has used huge pages. */
+	if (base->evbuffer_mem->huge_pages_used)
+		base->evbuffer_mem->numa_node = _evbuffer_huge_current_node();
 #endif
 
 	base->event_gotterm = base->event_break = 0;
@@ -1121,6 +1768,11 @@ event_base_loop(struct event_base *base, int flags)
 
 		tv_p = &tv;
 		if (!N_ACTIVE_CALLBACKS(base) && !(flags & EVLOOP_NONBLOCK)) {
+			/* The cached time is as old as the callbacks we just
+			 * ran; that's close enough unless we've been asked
+			 * to wake up to the microsecond. */
+			if (base->flags & EVENT_BASE_FLAG_PRECISE_TIMER)
+				clear_time_cache(base);
 			timeout_next(base, &tv_p);
 		} else {
 			/*
@@ -1141,6 +1793,12 @@ event_base_loop(struct event_base *base, int flags)
 
 		clear_time_cache(base);
 
+		if (base->before_poll_fn)
+			base->before_poll_fn(base, base->poll_hook_arg);
+
+		timing = base->stats_enabled &&
+		    gettime_uncached(base, &poll_start) == 0;
+
 		res = evsel->dispatch(base, tv_p);
 
 		if (res == -1)
@@ -1148,6 +1806,11 @@ event_base_loop(struct event_base *base, int flags)
 
 		update_time_cache(base);
 
+		if (timing)
+			stats_note_poll(base, &poll_start);
+		if (base->after_poll_fn)
+			base->after_poll_fn(base, base->poll_hook_arg);
+
 		timeout_process(base);
 
 		if (N_ACTIVE_CALLBACKS(base)) {
@@ -1411,6 +2074,7 @@ event_add(struct event *ev, const struct timeval *tv)
 	int res;
 
 	EVBASE_ACQUIRE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(ev->ev_base);
 
 	res = event_add_internal(ev, tv, 0);
 
@@ -1455,6 +2119,17 @@ evthread_notify_base(struct event_base *base)
 	return base->th_notify_fn(base);
 }
 
+/* Wake up the main thread, unless we're in the middle of a batch, in which
+ * case wake it up once the batch is done.  Requires th_base_lock. */
+static void
+evthread_notify_base_or_defer(struct event_base *base)
+{
+	if (base->th_notify_batched)
+		base->th_notify_pending = 1;
+	else
+		evthread_notify_base(base);
+}
+
 static inline int
 event_add_internal(struct event *ev, const struct timeval *tv,
     int tv_is_absolute)
@@ -1583,7 +2258,7 @@ event_add_internal(struct event *ev, const struct timeval *tv,
 
 	/* if we are not in the right thread, we need to wake up the loop */
 	if (res != -1 && notify && !EVBASE_IN_THREAD(base))
-		evthread_notify_base(base);
+		evthread_notify_base_or_defer(base);
 
 	return (res);
 }
@@ -1594,6 +2269,7 @@ event_del(struct event *ev)
 	int res;
 
 	EVBASE_ACQUIRE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(ev->ev_base);
 
 	res = event_del_internal(ev);
 
@@ -1602,6 +2278,147 @@ event_del(struct event *ev)
 	return (res);
 }
 
+/* Return the length of the run of events starting at evs[0], all on the
+ * same fd, for which 'pred' holds, and which are all distinct. */
+static int
+event_same_fd_run(struct event **evs, int n_evs, int (*pred)(struct event *))
+{
+	int i, j;
+
+	if (!pred(evs[0]))
+		return 1;
+	for (i = 1; i < n_evs; ++i) {
+		if (evs[i]->ev_fd != evs[0]->ev_fd || !pred(evs[i]))
+			break;
+		for (j = 0; j < i; ++j)
+			if (evs[j] == evs[i])
+				return i;
+	}
+	return i;
+}
+
+/* True iff adding ev would add it to the evmap. */
+static int
+event_needs_io_insert(struct event *ev)
+{
+	return (ev->ev_events & (EV_READ|EV_WRITE)) &&
+	    !(ev->ev_flags & (EVLIST_INSERTED|EVLIST_ACTIVE));
+}
+
+/* True iff deleting ev would remove it from the evmap. */
+static int
+event_needs_io_remove(struct event *ev)
+{
+	return (ev->ev_events & (EV_READ|EV_WRITE)) &&
+	    (ev->ev_flags & EVLIST_INSERTED);
+}
+
+int
+event_add_batch(struct event **evs, int n_evs, const struct timeval *tv)
+{
+	struct event_base *base;
+	int i, j, n, r, res = 0;
+
+	if (n_evs <= 0)
+		return (0);
+	base = evs[0]->ev_base;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	base->th_notify_batched = 1;
+
+	/* Make room for all the new timeouts at once. */
+	if (tv != NULL && min_heap_reserve(&base->timeheap,
+		min_heap_size(&base->timeheap) + n_evs) == -1) {
+		res = -1;
+		goto done;
+	}
+
+	for (i = 0; i < n_evs; i += n) {
+		EVUTIL_ASSERT(evs[i]->ev_base == base);
+		n = event_same_fd_run(evs + i, n_evs - i,
+		    event_needs_io_insert);
+		if (n > 1) {
+			/* Tell the backend about the whole run at once;
+			 * event_add_internal() will see that the events are
+			 * inserted, and only do their timeouts. */
+			r = evmap_io_add_many(base, evs[i]->ev_fd, evs + i, n);
+			if (r == -1) {
+				res = -1;
+				continue;
+			}
+			for (j = i; j < i + n; ++j)
+				event_queue_insert(base, evs[j],
+				    EVLIST_INSERTED);
+			if (r == 1 && !EVBASE_IN_THREAD(base))
+				base->th_notify_pending = 1;
+		}
+		for (j = i; j < i + n; ++j) {
+			if (event_add_internal(evs[j], tv, 0) == -1)
+				res = -1;
+		}
+	}
+
+done:
+	base->th_notify_batched = 0;
+	if (base->th_notify_pending) {
+		base->th_notify_pending = 0;
+		evthread_notify_base(base);
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (res);
+}
+
+int
+event_del_batch(struct event **evs, int n_evs)
+{
+	struct event_base *base;
+	int i, j, n, r, res = 0;
+
+	if (n_evs <= 0)
+		return (0);
+	base = evs[0]->ev_base;
+	/* An event without a base has not been added */
+	if (base == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(base);
+	base->th_notify_batched = 1;
+
+	for (i = 0; i < n_evs; i += n) {
+		EVUTIL_ASSERT(evs[i]->ev_base == base);
+		n = event_same_fd_run(evs + i, n_evs - i,
+		    event_needs_io_remove);
+		if (n > 1) {
+			r = evmap_io_del_many(base, evs[i]->ev_fd, evs + i, n);
+			if (r == -1) {
+				res = -1;
+				continue;
+			}
+			for (j = i; j < i + n; ++j)
+				event_queue_remove(base, evs[j],
+				    EVLIST_INSERTED);
+			if (r == 1 && !EVBASE_IN_THREAD(base))
+				base->th_notify_pending = 1;
+		}
+		for (j = i; j < i + n; ++j) {
+			if (event_del_internal(evs[j]) == -1)
+				res = -1;
+		}
+	}
+
+	base->th_notify_batched = 0;
+	if (base->th_notify_pending) {
+		base->th_notify_pending = 0;
+		evthread_notify_base(base);
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (res);
+}
+
 /* Helper for event_del: always called with th_base_lock held. */
 static inline int
 event_del_internal(struct event *ev)
@@ -1623,6 +2440,27 @@ event_del_internal(struct event *ev)
 	 * when this function returns, it will be safe to free the
 	 * user-supplied argument. */
 	base = ev->ev_base;
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	if (_evthread_id_fn) {
+		/* The loop may hold current_event_lock across several
+		 * callbacks, and take th_base_lock while it does; so we
+		 * let go of th_base_lock while we wait.  Once we've marked
+		 * the base, the loop gives up current_event_lock after the
+		 * callback it's running. */
+		while (base->current_event == ev && !EVBASE_IN_THREAD(base)) {
+			EVBASE_NOTE_THREAD(base);
+			EVBASE_RELEASE_LOCK(base,
+			    EVTHREAD_WRITE, th_base_lock);
+			EVBASE_ACQUIRE_LOCK(base,
+			    EVTHREAD_WRITE, current_event_lock);
+			EVBASE_RELEASE_LOCK(base,
+			    EVTHREAD_WRITE, current_event_lock);
+			EVBASE_ACQUIRE_LOCK(base,
+			    EVTHREAD_WRITE, th_base_lock);
+		}
+		need_cur_lock = 0;
+	} else
+#endif
 	need_cur_lock = (base->current_event == ev);
 	if (need_cur_lock)
 		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, current_event_lock);
@@ -1666,7 +2504,7 @@ event_del_internal(struct event *ev)
 
 	/* if we are not in the right thread, we need to wake up the loop */
 	if (res != -1 && notify && !EVBASE_IN_THREAD(base))
-		evthread_notify_base(base);
+		evthread_notify_base_or_defer(base);
 
 	if (need_cur_lock)
 		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, current_event_lock);
@@ -1678,6 +2516,7 @@ void
 event_active(struct event *ev, int res, short ncalls)
 {
 	EVBASE_ACQUIRE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_NOTE_THREAD(ev->ev_base);
 
 	event_active_nolock(ev, res, ncalls);
 
@@ -1870,6 +2709,16 @@ timeout_process(struct event_base *base)
 		if (evutil_timercmp(&ev->ev_timeout, &now, >))
 			break;
 
+		if (base->stats_enabled) {
+			struct timeval late;
+			ev_uint64_t usec =
+			    stats_elapsed(&ev->ev_timeout, &now, &late);
+			++base->stats.n_timeouts;
+			if (usec > base->stats.max_timeout_lateness_usec)
+				base->stats.max_timeout_lateness_usec = usec;
+			++base->stats.lateness_hist[stats_bucket(usec)];
+		}
+
 		/* delete this event from the I/O queues */
 		event_del_internal(ev);
 
@@ -2189,6 +3038,7 @@ evthread_set_lock_create_callbacks(void *(*alloc_fn)(void),
 {
 	_evthread_lock_alloc_fn = alloc_fn;
 	_evthread_lock_free_fn = free_fn;
+	_evbuffer_mem_global_setup_lock();
 }
 #endif
 
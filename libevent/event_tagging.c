@@ -194,15 +194,19 @@ decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
 {
 	ev_uint32_t number = 0;
 	int len = evbuffer_get_length(evbuf);
-	ev_uint8_t *data;
+	const ev_uint8_t *data;
+	ev_uint8_t scratch[sizeof(number) + 1];
 	int count = 0, shift = 0, done = 0;
 
 	/*
 	 * the encoding of a number is at most one byte more than its
 	 * storage size.  however, it may also be much smaller.
 	 */
-	data = evbuffer_pullup(
-		evbuf, len < sizeof(number) + 1 ? len : sizeof(number) + 1);
+	if (len > (int)sizeof(scratch))
+		len = sizeof(scratch);
+	data = evbuffer_peek_contiguous(evbuf, NULL, len, scratch);
+	if (data == NULL)
+		return (-1);
 
 	while (count++ < len) {
 		ev_uint8_t lower = *data++;
@@ -257,6 +261,48 @@ evtag_marshal_buffer(struct evbuffer *evbuf, ev_uint32_t tag,
 	evbuffer_add_buffer(evbuf, data);
 }
 
+/*
+ * Checked marshaling: as above, but the payload is followed by its CRC32C,
+ * four bytes, most significant first.  The length we encode counts the
+ * CRC too.
+ */
+
+static void
+evtag_add_crc(struct evbuffer *evbuf, ev_uint32_t crc)
+{
+	ev_uint8_t data[4];
+
+	data[0] = (crc >> 24) & 0xff;
+	data[1] = (crc >> 16) & 0xff;
+	data[2] = (crc >> 8) & 0xff;
+	data[3] = crc & 0xff;
+	evbuffer_add(evbuf, data, 4);
+}
+
+void
+evtag_marshal_checked(struct evbuffer *evbuf, ev_uint32_t tag,
+    const void *data, ev_uint32_t len)
+{
+	evtag_encode_tag(evbuf, tag);
+	evtag_encode_int(evbuf, len + 4);
+	evbuffer_add(evbuf, (void *)data, len);
+	evtag_add_crc(evbuf, evutil_crc32c(0, data, len));
+}
+
+void
+evtag_marshal_buffer_checked(struct evbuffer *evbuf, ev_uint32_t tag,
+    struct evbuffer *data)
+{
+	ev_uint32_t crc = 0;
+
+	/* We checksum the chains where they are, before they move. */
+	evbuffer_crc32c(data, NULL, -1, &crc);
+	evtag_encode_tag(evbuf, tag);
+	evtag_encode_int(evbuf, evbuffer_get_length(data) + 4);
+	evbuffer_add_buffer(evbuf, data);
+	evtag_add_crc(evbuf, crc);
+}
+
 /* Marshaling for integers */
 void
 evtag_marshal_int(struct evbuffer *evbuf, ev_uint32_t tag, ev_uint32_t integer)
@@ -298,22 +344,29 @@ evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag, struct timeval *t
 
 #define DECODE_INT_INTERNAL(number, maxnibbles, pnumber, evbuf, offset) \
 do {									\
-	ev_uint8_t *data;						\
+	const ev_uint8_t *data;						\
+	ev_uint8_t scratch[(maxnibbles >> 1) + 1];			\
+	struct evbuffer_ptr pos;					\
 	int len = evbuffer_get_length(evbuf) - offset;			\
 	int nibbles = 0;						\
 									\
 	if (len <= 0)							\
+		return (-1);						\
+	if (evbuffer_ptr_set(evbuf, &pos, offset, EVBUFFER_PTR_SET) < 0) \
 		return (-1);						\
 									\
-	/* XXX(niels): faster? */					\
-	data = evbuffer_pullup(evbuf, offset + 1) + offset;		\
+	data = evbuffer_peek_contiguous(evbuf, &pos, 1, scratch);	\
+	if (data == NULL)						\
+		return (-1);						\
 									\
 	nibbles = ((data[0] & 0xf0) >> 4) + 1;				\
 	if (nibbles > maxnibbles || (nibbles >> 1) + 1 > len)		\
 		return (-1);						\
 	len = (nibbles >> 1) + 1;					\
 									\
-	data = evbuffer_pullup(evbuf, offset + len) + offset;		\
+	data = evbuffer_peek_contiguous(evbuf, &pos, len, scratch);	\
+	if (data == NULL)						\
+		return (-1);						\
 									\
 	while (nibbles > 0) {						\
 		number <<= 4;						\
@@ -451,12 +504,51 @@ evtag_unmarshal(struct evbuffer *src, ev_uint32_t *ptag, struct evbuffer *dst)
 	if ((len = evtag_unmarshal_header(src, ptag)) == -1)
 		return (-1);
 
-	if (evbuffer_add(dst, evbuffer_pullup(src, len), len) == -1)
+	if (evbuffer_remove_buffer(src, dst, len) != len)
 		return (-1);
 
-	evbuffer_drain(src, len);
+	return (len);
+}
 
+int
+evtag_unmarshal_checked(struct evbuffer *src, ev_uint32_t *ptag,
+    struct evbuffer *dst)
+{
+	struct evbuffer_ptr pos;
+	ev_uint8_t data[4];
+	const ev_uint8_t *p;
+	ev_uint32_t crc = 0, expected;
+	int len;
+
+	if ((len = evtag_unmarshal_header(src, ptag)) == -1)
+		return (-1);
+	if (len < 4) {
+		/* Too short to hold a CRC; skip just what it does hold. */
+		evbuffer_drain(src, len);
+		return (-1);
+	}
+	len -= 4;
+
+	/* Check the payload where it lies, so that nothing damaged reaches
+	 * 'dst'. */
+	if (evbuffer_ptr_set(src, &pos, len, EVBUFFER_PTR_SET) < 0 ||
+	    (p = evbuffer_peek_contiguous(src, &pos, 4, data)) == NULL ||
+	    evbuffer_crc32c(src, NULL, len, &crc) < 0)
+		goto bad;
+	expected = ((ev_uint32_t)p[0] << 24) | ((ev_uint32_t)p[1] << 16) |
+	    ((ev_uint32_t)p[2] << 8) | p[3];
+	if (crc != expected)
+		goto bad;
+
+	if (evbuffer_remove_buffer(src, dst, len) != len)
+		return (-1);
+	evbuffer_drain(src, 4);
 	return (len);
+
+bad:
+	/* Skip the damaged tag, so that the caller can go on to the next. */
+	evbuffer_drain(src, len + 4);
+	return (-1);
 }
 
 /* Marshaling for integers */
@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2009 Niels Provos, Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "event-config.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "event2/event.h"
+#include "event2/buffer.h"
+#include "event2/event_struct.h"
+#include "event2/util.h"
+#include "event2/thread.h"
+#include "event-internal.h"
+#include "defer-internal.h"
+#include "evthread-internal.h"
+#include "log-internal.h"
+#include "mm-internal.h"
+#include "uring-internal.h"
+
+/*
+ * The io_uring counterpart of event_iocp.c.
+ *
+ * An event_uring_port is a ring of its own, separate from the one the
+ * io_uring backend polls with (if it's in use at all).  We learn about
+ * completions by watching the ring's fd with an ordinary read event, so
+ * it works under any backend.  That event is only added while the kernel
+ * has operations of ours, so that a base with nothing but idle
+ * bufferevents can still run out of events.
+ *
+ * Operations are queued as they're submitted, and handed to the kernel
+ * together from a deferred callback, so a loop iteration that starts many
+ * reads and writes costs one system call.
+ */
+
+#define URING_PORT_ENTRIES 256
+#define URING_PORT_CQ_ENTRIES 4096
+/* How many completions we copy out of the ring at a time. */
+#define URING_REAP_BATCH 64
+
+/* The pool of provided buffers that reads can pick from. */
+#define URING_PBUF_COUNT 128
+#define URING_PBUF_SIZE 16384
+#define URING_PBUF_GROUP 0
+/* Reads up to this size are copied out of the provided buffer, rather than
+ * holding on to it. */
+#define URING_PBUF_COPY_MAX 4096
+
+int
+event_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, arg, argsz);
+}
+
+static void
+uring_ring_unmap(struct event_uring_ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_sz);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_sz);
+	r->sqes = NULL;
+	r->cq_ring = r->sq_ring = NULL;
+}
+
+int
+event_uring_ring_init(struct event_uring_ring *r, unsigned entries,
+    unsigned cq_entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+	if ((fd = (int)syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		/* Old kernels, and kernels with io_uring turned off. */
+		if (errno != ENOSYS && errno != EPERM)
+			event_warn("io_uring_setup");
+		return (-1);
+	}
+
+	/* We can't afford to lose completions, and we need to wait with a
+	 * timeout without queueing a timeout request each time. */
+	if (!(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(fd);
+		return (-1);
+	}
+	r->fd = fd;
+
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_sz > r->sq_ring_sz)
+			r->sq_ring_sz = r->cq_ring_sz;
+		r->cq_ring_sz = r->sq_ring_sz;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto err;
+		}
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->sq_local_tail = *r->sq_tail;
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return (0);
+
+err:
+	event_warn("mmap(io_uring)");
+	event_uring_ring_free(r);
+	return (-1);
+}
+
+void
+event_uring_ring_free(struct event_uring_ring *r)
+{
+	uring_ring_unmap(r);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+}
+
+unsigned
+event_uring_ring_publish(struct event_uring_ring *r)
+{
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+	return r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *
+event_uring_ring_get_sqe(struct event_uring_ring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx, pending;
+
+	pending = r->sq_local_tail -
+	    __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (pending >= r->sq_entries) {
+		pending = event_uring_ring_publish(r);
+		if (event_uring_enter(r->fd, pending, 0, 0, NULL, 0) == -1) {
+			event_warn("io_uring_enter");
+			return (NULL);
+		}
+		if (r->sq_local_tail -
+		    __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+		    >= r->sq_entries)
+			return (NULL);
+	}
+
+	idx = r->sq_local_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	++r->sq_local_tail;
+	return (sqe);
+}
+
+/** A pool of buffers that the kernel picks from when a read is ready,
+ * instead of each read tying up a buffer of its own while it waits. */
+struct event_uring_pbuf_pool {
+	void *lock;
+	/* One for the port, plus one for each buffer that an evbuffer
+	 * holds by reference. */
+	int refcnt;
+	/* False once the port is gone, and the kernel with it. */
+	int live;
+
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	unsigned char *mem;
+	size_t mem_sz;
+};
+
+struct event_uring_port {
+	struct event_uring_ring ring;
+	struct event_base *base;
+	/* Protects the ring and n_pending. */
+	void *lock;
+
+	/* Read event on the ring's fd; added while n_pending > 0. */
+	struct event ev;
+	/* Hands queued operations to the kernel. */
+	struct deferred_cb flush;
+	/* How many operations with callbacks the kernel has yet to finish. */
+	int n_pending;
+
+	struct event_uring_pbuf_pool *pool;
+};
+
+#ifdef _EVENT_HAVE_IO_URING_PBUF
+/* Put buffer 'bid' back in the ring the kernel picks buffers from. */
+static void
+pbuf_recycle(struct event_uring_pbuf_pool *pool, unsigned bid)
+{
+	struct io_uring_buf *b;
+	ev_uint16_t tail = pool->br->tail;
+
+	b = &pool->br->bufs[tail & (URING_PBUF_COUNT - 1)];
+	b->addr = (ev_uint64_t)(uintptr_t)(pool->mem + bid * URING_PBUF_SIZE);
+	b->len = URING_PBUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&pool->br->tail, (ev_uint16_t)(tail + 1),
+	    __ATOMIC_RELEASE);
+}
+
+static void
+pbuf_pool_decref_and_unlock(struct event_uring_pbuf_pool *pool)
+{
+	if (--pool->refcnt) {
+		EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+		return;
+	}
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+	munmap(pool->br, pool->br_sz);
+	munmap(pool->mem, pool->mem_sz);
+	EVTHREAD_FREE_LOCK(pool->lock);
+	mm_free(pool);
+}
+
+static struct event_uring_pbuf_pool *
+pbuf_pool_new(struct event_uring_ring *r)
+{
+	struct event_uring_pbuf_pool *pool;
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	if (!(pool = mm_calloc(1, sizeof(*pool))))
+		return (NULL);
+	pool->br_sz = URING_PBUF_COUNT * sizeof(struct io_uring_buf);
+	pool->mem_sz = URING_PBUF_COUNT * URING_PBUF_SIZE;
+	/* The ring has to be page-aligned; the buffers are only touched
+	 * when the kernel first reads into them. */
+	pool->br = mmap(NULL, pool->br_sz, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	pool->mem = mmap(NULL, pool->mem_sz, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (pool->br == MAP_FAILED || pool->mem == MAP_FAILED)
+		goto err;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (ev_uint64_t)(uintptr_t)pool->br;
+	reg.ring_entries = URING_PBUF_COUNT;
+	reg.bgid = URING_PBUF_GROUP;
+	/* Before 5.19, the kernel doesn't know about buffer rings. */
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) == -1)
+		goto err;
+
+	for (i = 0; i < URING_PBUF_COUNT; ++i)
+		pbuf_recycle(pool, i);
+	EVTHREAD_ALLOC_LOCK(pool->lock);
+	pool->refcnt = 1;
+	pool->live = 1;
+	return (pool);
+
+err:
+	if (pool->br != MAP_FAILED)
+		munmap(pool->br, pool->br_sz);
+	if (pool->mem != MAP_FAILED)
+		munmap(pool->mem, pool->mem_sz);
+	mm_free(pool);
+	return (NULL);
+}
+#endif
+
+#ifdef _EVENT_HAVE_IO_URING_PBUF
+/* Cleanup callback for provided buffers that we added to an evbuffer by
+ * reference. */
+static void
+pbuf_release(const void *data, size_t len, void *arg)
+{
+	struct event_uring_pbuf_pool *pool = arg;
+	unsigned bid = ((const unsigned char *)data - pool->mem) /
+	    URING_PBUF_SIZE;
+
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	if (pool->live)
+		pbuf_recycle(pool, bid);
+	pbuf_pool_decref_and_unlock(pool);
+}
+#endif
+
+int
+event_uring_port_has_pbuf(struct event_uring_port *port)
+{
+	return port->pool != NULL;
+}
+
+int
+event_uring_port_take_pbuf(struct event_uring_port *port, unsigned flags,
+    struct evbuffer *buf, int n)
+{
+#ifdef _EVENT_HAVE_IO_URING_PBUF
+	struct event_uring_pbuf_pool *pool = port->pool;
+	unsigned char *data;
+	unsigned bid;
+	int r = 0;
+
+	if (!pool || !(flags & IORING_CQE_F_BUFFER))
+		return (0);
+	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	EVUTIL_ASSERT(bid < URING_PBUF_COUNT);
+	data = pool->mem + bid * URING_PBUF_SIZE;
+
+	if (n > URING_PBUF_COPY_MAX) {
+		EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+		++pool->refcnt;
+		EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+		if (evbuffer_add_reference(buf, data, n, pbuf_release,
+			pool) == 0)
+			return (1);
+		r = -1;
+		EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+		--pool->refcnt;
+	} else {
+		if (n > 0 && evbuffer_add(buf, data, n) < 0)
+			r = -1;
+		EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	}
+	pbuf_recycle(pool, bid);
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+	return r < 0 ? -1 : 1;
+#else
+	return (0);
+#endif
+}
+
+/* Deferred callback: submit everything that's been queued. */
+static void
+uring_port_flush(struct deferred_cb *cb, void *arg)
+{
+	struct event_uring_port *port = arg;
+	unsigned n;
+
+	EVLOCK_LOCK(port->lock, EVTHREAD_WRITE);
+	n = event_uring_ring_publish(&port->ring);
+	/* EBUSY means the completion queue is backed up; we'll try again
+	 * once we've reaped it. */
+	if (n && event_uring_enter(port->ring.fd, n, 0, 0, NULL, 0) == -1 &&
+	    errno != EBUSY && errno != EAGAIN)
+		event_warn("%s: io_uring_enter", __func__);
+	EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+}
+
+static void
+uring_port_schedule_flush(struct event_uring_port *port)
+{
+	event_deferred_cb_schedule(
+		event_base_get_deferred_cb_queue(port->base), &port->flush);
+}
+
+/* Read callback on the ring's fd: run the callbacks for every completion
+ * in the ring. */
+static void
+uring_port_reap(evutil_socket_t fd, short what, void *arg)
+{
+	struct event_uring_port *port = arg;
+	struct event_uring_ring *r = &port->ring;
+	struct io_uring_cqe cqes[URING_REAP_BATCH];
+	unsigned head, tail;
+	int i, n, idle, unsent;
+
+	do {
+		EVLOCK_LOCK(port->lock, EVTHREAD_WRITE);
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (n = 0; head != tail && n < URING_REAP_BATCH; ++head) {
+			cqes[n] = r->cqes[head & *r->cq_mask];
+			if (cqes[n].user_data &&
+			    !(cqes[n].flags & IORING_CQE_F_MORE))
+				--port->n_pending;
+			++n;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+
+		/* The callbacks may submit more operations, so we can't
+		 * hold the lock while they run. */
+		for (i = 0; i < n; ++i) {
+			struct event_uring_op *op = (struct event_uring_op *)
+			    (uintptr_t)cqes[i].user_data;
+			if (op)
+				op->cb(op, cqes[i].res, cqes[i].flags);
+		}
+	} while (n == URING_REAP_BATCH);
+
+	EVLOCK_LOCK(port->lock, EVTHREAD_WRITE);
+	idle = port->n_pending == 0;
+	unsent = port->ring.sq_local_tail !=
+	    __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+	if (unsent)
+		uring_port_schedule_flush(port);
+
+	if (idle) {
+		event_del(&port->ev);
+		/* Somebody may have submitted something since we looked;
+		 * if so, they saw the event as added already. */
+		EVLOCK_LOCK(port->lock, EVTHREAD_WRITE);
+		idle = port->n_pending == 0;
+		EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+		if (!idle)
+			event_add(&port->ev, NULL);
+	}
+}
+
+struct event_uring_port *
+event_uring_port_launch(struct event_base *base, int flags)
+{
+	struct event_uring_port *port;
+
+	if (!(port = mm_calloc(1, sizeof(struct event_uring_port))))
+		return NULL;
+	if (event_uring_ring_init(&port->ring, URING_PORT_ENTRIES,
+		URING_PORT_CQ_ENTRIES) == -1) {
+		mm_free(port);
+		return NULL;
+	}
+	port->base = base;
+	EVTHREAD_ALLOC_LOCK(port->lock);
+	event_deferred_cb_init(&port->flush, uring_port_flush, port);
+	event_assign(&port->ev, base, port->ring.fd, EV_READ|EV_PERSIST,
+	    uring_port_reap, port);
+
+#ifdef _EVENT_HAVE_IO_URING_PBUF
+	if (!(flags & EVENT_URING_NO_PBUF))
+		port->pool = pbuf_pool_new(&port->ring);
+#endif
+
+	return port;
+}
+
+void
+event_uring_port_free(struct event_uring_port *port)
+{
+	event_del(&port->ev);
+	event_deferred_cb_cancel(event_base_get_deferred_cb_queue(port->base),
+	    &port->flush);
+	/* Closing the ring cancels whatever the kernel is still doing. */
+	event_uring_ring_free(&port->ring);
+#ifdef _EVENT_HAVE_IO_URING_PBUF
+	if (port->pool) {
+		EVLOCK_LOCK(port->pool->lock, EVTHREAD_WRITE);
+		port->pool->live = 0;
+		pbuf_pool_decref_and_unlock(port->pool);
+	}
+#endif
+	EVTHREAD_FREE_LOCK(port->lock);
+	mm_free(port);
+}
+
+int
+event_uring_port_submit(struct event_uring_port *port,
+    const struct io_uring_sqe *sqe, struct event_uring_op *op)
+{
+	struct io_uring_sqe *s;
+	int first = 0;
+
+	EVLOCK_LOCK(port->lock, EVTHREAD_WRITE);
+	if (!(s = event_uring_ring_get_sqe(&port->ring))) {
+		EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+		return -1;
+	}
+	memcpy(s, sqe, sizeof(*s));
+	s->user_data = (ev_uint64_t)(uintptr_t)op;
+	if (op)
+		first = port->n_pending++ == 0;
+	EVLOCK_UNLOCK(port->lock, EVTHREAD_WRITE);
+
+	uring_port_schedule_flush(port);
+	if (first)
+		event_add(&port->ev, NULL);
+	return 0;
+}
+
+int
+event_uring_port_cancel(struct event_uring_port *port,
+    struct event_uring_op *op)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = (ev_uint64_t)(uintptr_t)op;
+	return event_uring_port_submit(port, &sqe, NULL);
+}
+
+struct event_uring_port *
+event_base_get_uring(struct event_base *base)
+{
+	return base->uring;
+}
@@ -67,6 +67,15 @@ int evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev);
 	@param ev the event to remove.
  */
 int evmap_io_del(struct event_base *base, evutil_socket_t fd, struct event *ev);
+/** As evmap_io_add() and evmap_io_del(), but for 'n_evs' events that all
+	have the same fd: the backend hears about the change to the fd once,
+	rather than once per event.  Either all the events are added (or
+	removed), or none are.
+ */
+int evmap_io_add_many(struct event_base *base, evutil_socket_t fd,
+    struct event **evs, int n_evs);
+int evmap_io_del_many(struct event_base *base, evutil_socket_t fd,
+    struct event **evs, int n_evs);
 /** Active the set of events waiting on an event_base for a given fd.
 
 	@param base the event_base to operate on.
@@ -67,8 +67,8 @@ struct evmap_signal {
 
 /* On some platforms, fds start at 0 and increment by 1 as they are
    allocated, and old numbers get used.  For these platforms, we
-   implement io maps just like signal maps: as an array of pointers to
-   struct evmap_io.  But on other platforms (windows), sockets are not
+   implement io maps as a flat array of struct evmap_io slots, each
+   followed by the backend's fdinfo.  But on other platforms (windows), sockets are not
    0-indexed, not necessarily consecutive, and not necessarily reused.
    There, we use a hashtable to implement evmap_io.
 */
@@ -167,22 +167,28 @@ void evmap_io_clear(struct event_io_map *ctx)
 		(x) = (struct type *)((map)->entries[slot]);		\
 	} while (0)
 
-/* If we aren't using hashtables, then define the IO_SLOT macros and functions
-   as thin aliases over the SIGNAL_SLOT versions. */
+/* If we aren't using hashtables, every slot up to map->nentries exists and
+   is initialized as soon as evmap_io_make_space() makes room for it, so
+   there is nothing to construct. */
 #ifndef EVMAP_USE_HT
-#define GET_IO_SLOT(x,map,slot,type) GET_SIGNAL_SLOT(x,map,slot,type)
+#define GET_IO_SLOT(x,map,slot,type)					\
+	(x) = (struct type *)((map)->entries + (slot)*(map)->slot_size)
 #define GET_IO_SLOT_AND_CTOR(x,map,slot,type,ctor,fdinfo_len)	\
-	GET_SIGNAL_SLOT_AND_CTOR(x,map,slot,type,ctor,fdinfo_len)
+	GET_IO_SLOT(x,map,slot,type)
 #define FDINFO_OFFSET sizeof(struct evmap_io)
 void
 evmap_io_initmap(struct event_io_map* ctx)
 {
-	evmap_signal_initmap(ctx);
+	ctx->entries = NULL;
+	ctx->nentries = 0;
+	ctx->slot_size = 0;
 }
 void
 evmap_io_clear(struct event_io_map* ctx)
 {
-	evmap_signal_clear(ctx);
+	if (ctx->entries != NULL)
+		mm_free(ctx->entries);
+	evmap_io_initmap(ctx);
 }
 #endif
 
@@ -249,18 +255,80 @@ evmap_io_init(struct evmap_io *entry)
 }
 
 
+#ifndef EVMAP_USE_HT
+/** Expand the fd table 'map' until it has a slot for 'slot', giving each
+    slot room for 'fdinfo_len' bytes of backend data.
+ */
+static int
+evmap_io_make_space(struct event_io_map *map, int slot, size_t fdinfo_len)
+{
+	if (map->nentries <= slot) {
+		int nentries = map->nentries ? map->nentries : 32;
+		char *tmp;
+		int i;
+
+		if (!map->slot_size) {
+			/* Round up, so that every slot is aligned for the
+			 * pointers in it. */
+			map->slot_size = (sizeof(struct evmap_io) + fdinfo_len +
+			    sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		}
+
+		while (nentries <= slot)
+			nentries <<= 1;
+
+		tmp = mm_realloc(map->entries, nentries * map->slot_size);
+		if (tmp == NULL)
+			return (-1);
+
+		/* The event lists' heads may have moved.  The first event in
+		 * each list points back at its head, and an empty head points
+		 * at itself; fix both up. */
+		if (tmp != map->entries) {
+			for (i = 0; i < map->nentries; ++i) {
+				struct evmap_io *ctx = (struct evmap_io *)
+				    (tmp + i * map->slot_size);
+				struct event *first = TAILQ_FIRST(&ctx->events);
+				if (first)
+					first->ev_io_next.tqe_prev =
+					    &TAILQ_FIRST(&ctx->events);
+				else
+					TAILQ_INIT(&ctx->events);
+			}
+		}
+
+		memset(tmp + map->nentries * map->slot_size, 0,
+		    (nentries - map->nentries) * map->slot_size);
+		for (i = map->nentries; i < nentries; ++i)
+			evmap_io_init((struct evmap_io *)
+			    (tmp + i * map->slot_size));
+
+		map->nentries = nentries;
+		map->entries = tmp;
+	}
+
+	return (0);
+}
+#endif
+
 /* return -1 on error, 0 on success if nothing changed in the event backend,
  * and 1 on success if something did. */
 int
 evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev)
+{
+	return evmap_io_add_many(base, fd, &ev, 1);
+}
+
+int
+evmap_io_add_many(struct event_base *base, evutil_socket_t fd,
+    struct event **evs, int n_evs)
 {
 	const struct eventop *evsel = base->evsel;
 	struct event_io_map *io = &base->io;
 	struct evmap_io *ctx = NULL;
-	int nread, nwrite, retval = 0;
-	short res = 0, old = 0;
+	int nread, nwrite, retval = 0, i;
+	short res = 0, old = 0, et = 0;
 
-	EVUTIL_ASSERT(fd == ev->ev_fd); /*XXX(nickm) always true? */
 	/*XXX(nickm) Should we assert that ev is not already inserted, or should
 	 * we make this function idempotent? */
 
@@ -269,7 +337,7 @@ evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev)
 
 #ifndef EVMAP_USE_HT
 	if (fd >= io->nentries) {
-		if (evmap_make_space(io, fd, sizeof(struct evmap_io *)) == -1)
+		if (evmap_io_make_space(io, fd, evsel->fdinfo_len) == -1)
 			return (-1);
 	}
 #endif
@@ -284,13 +352,18 @@ evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev)
 	if (nwrite)
 		old |= EV_WRITE;
 
-	if (ev->ev_events & EV_READ) {
-		if (++nread == 1)
-			res |= EV_READ;
-	}
-	if (ev->ev_events & EV_WRITE) {
-		if (++nwrite == 1)
-			res |= EV_WRITE;
+	for (i = 0; i < n_evs; ++i) {
+		struct event *ev = evs[i];
+		EVUTIL_ASSERT(fd == ev->ev_fd); /*XXX(nickm) always true? */
+		if (ev->ev_events & EV_READ) {
+			if (++nread == 1)
+				res |= EV_READ;
+		}
+		if (ev->ev_events & EV_WRITE) {
+			if (++nwrite == 1)
+				res |= EV_WRITE;
+		}
+		et |= ev->ev_events & EV_ET;
 	}
 
 	if (res) {
@@ -298,15 +371,15 @@ evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev)
 		/* XXX(niels): we cannot mix edge-triggered and
 		 * level-triggered, we should probably assert on
 		 * this. */
-		if (evsel->add(base, ev->ev_fd,
-					   old, (ev->ev_events & EV_ET) | res, extra) == -1)
+		if (evsel->add(base, fd, old, et | res, extra) == -1)
 			return (-1);
 		retval = 1;
 	}
 
 	ctx->nread = nread;
 	ctx->nwrite = nwrite;
-	TAILQ_INSERT_TAIL(&ctx->events, ev, ev_io_next);
+	for (i = 0; i < n_evs; ++i)
+		TAILQ_INSERT_TAIL(&ctx->events, evs[i], ev_io_next);
 
 	return (retval);
 }
@@ -315,17 +388,23 @@ evmap_io_add(struct event_base *base, evutil_socket_t fd, struct event *ev)
  * and 1 on success if something did. */
 int
 evmap_io_del(struct event_base *base, evutil_socket_t fd, struct event *ev)
+{
+	return evmap_io_del_many(base, fd, &ev, 1);
+}
+
+int
+evmap_io_del_many(struct event_base *base, evutil_socket_t fd,
+    struct event **evs, int n_evs)
 {
 	const struct eventop *evsel = base->evsel;
 	struct event_io_map *io = &base->io;
 	struct evmap_io *ctx;
-	int nread, nwrite, retval = 0;
-	short res = 0, old = 0;
+	int nread, nwrite, retval = 0, i;
+	short res = 0, old = 0, et = 0;
 
 	if (fd < 0)
 		return 0;
 
-	EVUTIL_ASSERT(fd == ev->ev_fd); /*XXX(nickm) always true? */
 	/*XXX(nickm) Should we assert that ev is not already inserted, or should
 	 * we make this function idempotent? */
 
@@ -344,27 +423,33 @@ evmap_io_del(struct event_base *base, evutil_socket_t fd, struct event *ev)
 	if (nwrite)
 		old |= EV_WRITE;
 
-	if (ev->ev_events & EV_READ) {
-		if (--nread == 0)
-			res |= EV_READ;
-		EVUTIL_ASSERT(nread >= 0);
-	}
-	if (ev->ev_events & EV_WRITE) {
-		if (--nwrite == 0)
-			res |= EV_WRITE;
-		EVUTIL_ASSERT(nwrite >= 0);
+	for (i = 0; i < n_evs; ++i) {
+		struct event *ev = evs[i];
+		EVUTIL_ASSERT(fd == ev->ev_fd); /*XXX(nickm) always true? */
+		if (ev->ev_events & EV_READ) {
+			if (--nread == 0)
+				res |= EV_READ;
+			EVUTIL_ASSERT(nread >= 0);
+		}
+		if (ev->ev_events & EV_WRITE) {
+			if (--nwrite == 0)
+				res |= EV_WRITE;
+			EVUTIL_ASSERT(nwrite >= 0);
+		}
+		et |= ev->ev_events & EV_ET;
 	}
 
 	if (res) {
 		void *extra = ((char*)ctx) + sizeof(struct evmap_io);
-		if (evsel->del(base, ev->ev_fd, old, res, extra) == -1)
+		if (evsel->del(base, fd, old, et | res, extra) == -1)
 			return (-1);
 		retval = 1;
 	}
 
 	ctx->nread = nread;
 	ctx->nwrite = nwrite;
-	TAILQ_REMOVE(&ctx->events, ev, ev_io_next);
+	for (i = 0; i < n_evs; ++i)
+		TAILQ_REMOVE(&ctx->events, evs[i], ev_io_next);
 
 	return (retval);
 }
@@ -461,6 +546,10 @@ void *
 evmap_io_get_fdinfo(struct event_io_map *map, evutil_socket_t fd)
 {
 	struct evmap_io *ctx;
+#ifndef EVMAP_USE_HT
+	if (fd < 0 || fd >= map->nentries)
+		return NULL;
+#endif
 	GET_IO_SLOT(ctx, map, fd, evmap_io);
 	if (ctx)
 		return ((char*)ctx) + sizeof(struct evmap_io);
@@ -57,6 +57,23 @@ extern void (*_evthread_lock_free_fn)(void *);
 	(_evthread_id_fn == NULL ||			 \
 	(base)->th_owner_id == _evthread_id_fn())
 
+/** Note that the current thread is using a given event_base.  Must be
+ * called with the base's th_base_lock held, so that the loop sees the
+ * note the next time it takes the lock. */
+#define EVBASE_NOTE_THREAD(base)					\
+	do {								\
+		if ((base) != NULL && !(base)->th_foreign_seen &&	\
+		    !EVBASE_IN_THREAD(base))				\
+			(base)->th_foreign_seen = 1;			\
+	} while (0)
+
+/** True iff no thread but the one running a given event_base's loop has
+ * ever used it, so that the loop can keep current_event_lock across
+ * callbacks.  Must be called with th_base_lock held.  Without an id
+ * function we can't tell threads apart, so we never assume this. */
+#define EVBASE_LOCKS_UNCONTENDED(base)				\
+	(_evthread_id_fn != NULL && !(base)->th_foreign_seen)
+
 /** Allocate a new lock, and store it in lockvar, a void*.  Sets lockvar to
     NULL if locking is not enabled. */
 #define EVTHREAD_ALLOC_LOCK(lockvar)		\
@@ -144,6 +161,8 @@ extern void (*_evthread_lock_free_fn)(void *);
 #define EVLOCK_UNLOCK2(lock1,lock2,mode1,mode2) _EVUTIL_NIL_STMT
 
 #define EVBASE_IN_THREAD(base)	1
+#define EVBASE_NOTE_THREAD(base) _EVUTIL_NIL_STMT
+#define EVBASE_LOCKS_UNCONTENDED(base) 1
 #define EVBASE_ACQUIRE_LOCK(base, mode, lock) _EVUTIL_NIL_STMT
 #define EVBASE_RELEASE_LOCK(base, mode, lock) _EVUTIL_NIL_STMT
 
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file evutil_checksum.c
+
+   Checksums and a hash, computed a piece at a time, so that evbuffer can
+   feed them its chains one after another.
+
+   CRC32C uses the SSE4.2 crc32 instruction if the CPU we're running on
+   has it, and a table otherwise.  The hash is XXH64, which is fast and
+   well distributed, and which other programs can compute too.
+*/
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <string.h>
+
+#if defined(_EVENT_HAVE_RUNTIME_SSE42)
+#define USE_SSE42
+#include <nmmintrin.h>
+#endif
+
+#include "event2/util.h"
+#include "util-internal.h"
+
+/* CRC32C (Castagnoli) of each byte value, bit-reflected. */
+static const ev_uint32_t crc32c_table[256] = {
+	0x00000000U, 0xf26b8303U, 0xe13b70f7U, 0x1350f3f4U,
+	0xc79a971fU, 0x35f1141cU, 0x26a1e7e8U, 0xd4ca64ebU,
+	0x8ad958cfU, 0x78b2dbccU, 0x6be22838U, 0x9989ab3bU,
+	0x4d43cfd0U, 0xbf284cd3U, 0xac78bf27U, 0x5e133c24U,
+	0x105ec76fU, 0xe235446cU, 0xf165b798U, 0x030e349bU,
+	0xd7c45070U, 0x25afd373U, 0x36ff2087U, 0xc494a384U,
+	0x9a879fa0U, 0x68ec1ca3U, 0x7bbcef57U, 0x89d76c54U,
+	0x5d1d08bfU, 0xaf768bbcU, 0xbc267848U, 0x4e4dfb4bU,
+	0x20bd8edeU, 0xd2d60dddU, 0xc186fe29U, 0x33ed7d2aU,
+	0xe72719c1U, 0x154c9ac2U, 0x061c6936U, 0xf477ea35U,
+	0xaa64d611U, 0x580f5512U, 0x4b5fa6e6U, 0xb93425e5U,
+	0x6dfe410eU, 0x9f95c20dU, 0x8cc531f9U, 0x7eaeb2faU,
+	0x30e349b1U, 0xc288cab2U, 0xd1d83946U, 0x23b3ba45U,
+	0xf779deaeU, 0x05125dadU, 0x1642ae59U, 0xe4292d5aU,
+	0xba3a117eU, 0x4851927dU, 0x5b016189U, 0xa96ae28aU,
+	0x7da08661U, 0x8fcb0562U, 0x9c9bf696U, 0x6ef07595U,
+	0x417b1dbcU, 0xb3109ebfU, 0xa0406d4bU, 0x522bee48U,
+	0x86e18aa3U, 0x748a09a0U, 0x67dafa54U, 0x95b17957U,
+	0xcba24573U, 0x39c9c670U, 0x2a993584U, 0xd8f2b687U,
+	0x0c38d26cU, 0xfe53516fU, 0xed03a29bU, 0x1f682198U,
+	0x5125dad3U, 0xa34e59d0U, 0xb01eaa24U, 0x42752927U,
+	0x96bf4dccU, 0x64d4cecfU, 0x77843d3bU, 0x85efbe38U,
+	0xdbfc821cU, 0x2997011fU, 0x3ac7f2ebU, 0xc8ac71e8U,
+	0x1c661503U, 0xee0d9600U, 0xfd5d65f4U, 0x0f36e6f7U,
+	0x61c69362U, 0x93ad1061U, 0x80fde395U, 0x72966096U,
+	0xa65c047dU, 0x5437877eU, 0x4767748aU, 0xb50cf789U,
+	0xeb1fcbadU, 0x197448aeU, 0x0a24bb5aU, 0xf84f3859U,
+	0x2c855cb2U, 0xdeeedfb1U, 0xcdbe2c45U, 0x3fd5af46U,
+	0x7198540dU, 0x83f3d70eU, 0x90a324faU, 0x62c8a7f9U,
+	0xb602c312U, 0x44694011U, 0x5739b3e5U, 0xa55230e6U,
+	0xfb410cc2U, 0x092a8fc1U, 0x1a7a7c35U, 0xe811ff36U,
+	0x3cdb9bddU, 0xceb018deU, 0xdde0eb2aU, 0x2f8b6829U,
+	0x82f63b78U, 0x709db87bU, 0x63cd4b8fU, 0x91a6c88cU,
+	0x456cac67U, 0xb7072f64U, 0xa457dc90U, 0x563c5f93U,
+	0x082f63b7U, 0xfa44e0b4U, 0xe9141340U, 0x1b7f9043U,
+	0xcfb5f4a8U, 0x3dde77abU, 0x2e8e845fU, 0xdce5075cU,
+	0x92a8fc17U, 0x60c37f14U, 0x73938ce0U, 0x81f80fe3U,
+	0x55326b08U, 0xa759e80bU, 0xb4091bffU, 0x466298fcU,
+	0x1871a4d8U, 0xea1a27dbU, 0xf94ad42fU, 0x0b21572cU,
+	0xdfeb33c7U, 0x2d80b0c4U, 0x3ed04330U, 0xccbbc033U,
+	0xa24bb5a6U, 0x502036a5U, 0x4370c551U, 0xb11b4652U,
+	0x65d122b9U, 0x97baa1baU, 0x84ea524eU, 0x7681d14dU,
+	0x2892ed69U, 0xdaf96e6aU, 0xc9a99d9eU, 0x3bc21e9dU,
+	0xef087a76U, 0x1d63f975U, 0x0e330a81U, 0xfc588982U,
+	0xb21572c9U, 0x407ef1caU, 0x532e023eU, 0xa145813dU,
+	0x758fe5d6U, 0x87e466d5U, 0x94b49521U, 0x66df1622U,
+	0x38cc2a06U, 0xcaa7a905U, 0xd9f75af1U, 0x2b9cd9f2U,
+	0xff56bd19U, 0x0d3d3e1aU, 0x1e6dcdeeU, 0xec064eedU,
+	0xc38d26c4U, 0x31e6a5c7U, 0x22b65633U, 0xd0ddd530U,
+	0x0417b1dbU, 0xf67c32d8U, 0xe52cc12cU, 0x1747422fU,
+	0x49547e0bU, 0xbb3ffd08U, 0xa86f0efcU, 0x5a048dffU,
+	0x8ecee914U, 0x7ca56a17U, 0x6ff599e3U, 0x9d9e1ae0U,
+	0xd3d3e1abU, 0x21b862a8U, 0x32e8915cU, 0xc083125fU,
+	0x144976b4U, 0xe622f5b7U, 0xf5720643U, 0x07198540U,
+	0x590ab964U, 0xab613a67U, 0xb831c993U, 0x4a5a4a90U,
+	0x9e902e7bU, 0x6cfbad78U, 0x7fab5e8cU, 0x8dc0dd8fU,
+	0xe330a81aU, 0x115b2b19U, 0x020bd8edU, 0xf0605beeU,
+	0x24aa3f05U, 0xd6c1bc06U, 0xc5914ff2U, 0x37faccf1U,
+	0x69e9f0d5U, 0x9b8273d6U, 0x88d28022U, 0x7ab90321U,
+	0xae7367caU, 0x5c18e4c9U, 0x4f48173dU, 0xbd23943eU,
+	0xf36e6f75U, 0x0105ec76U, 0x12551f82U, 0xe03e9c81U,
+	0x34f4f86aU, 0xc69f7b69U, 0xd5cf889dU, 0x27a40b9eU,
+	0x79b737baU, 0x8bdcb4b9U, 0x988c474dU, 0x6ae7c44eU,
+	0xbe2da0a5U, 0x4c4623a6U, 0x5f16d052U, 0xad7d5351U,
+};
+
+static ev_uint32_t
+crc32c_scalar(ev_uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef USE_SSE42
+/* 1 if the CPU has SSE4.2, 0 if it doesn't, -1 if we haven't checked yet.
+ * Racing threads all store the same answer. */
+static int have_sse42 = -1;
+
+static inline int
+use_sse42(void)
+{
+	if (have_sse42 < 0)
+		have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	return have_sse42;
+}
+
+__attribute__((target("sse4.2"))) static ev_uint32_t
+crc32c_sse42(ev_uint32_t crc, const unsigned char *p, size_t len)
+{
+	/* Byte at a time until we're aligned, then a word at a time. */
+	while (len && ((size_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		--len;
+	}
+#ifdef __x86_64__
+	for (; len >= 8; p += 8, len -= 8) {
+		ev_uint64_t v;
+		memcpy(&v, p, 8);
+		crc = (ev_uint32_t)_mm_crc32_u64(crc, v);
+	}
+#endif
+	for (; len >= 4; p += 4, len -= 4) {
+		ev_uint32_t v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+ev_uint32_t
+evutil_crc32c(ev_uint32_t crc, const void *data, size_t len)
+{
+	crc = ~crc;
+#ifdef USE_SSE42
+	if (use_sse42())
+		return ~crc32c_sse42(crc, data, len);
+#endif
+	return ~crc32c_scalar(crc, data, len);
+}
+
+/* The largest prime below 2^16, and the most bytes we can add up before
+ * the sums could overflow 32 bits. */
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552
+
+ev_uint32_t
+evutil_adler32(ev_uint32_t adler, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	ev_uint32_t a = adler & 0xffff, b = adler >> 16;
+	size_t n;
+
+	while (len) {
+		n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n >= 4) {
+			a += p[0]; b += a;
+			a += p[1]; b += a;
+			a += p[2]; b += a;
+			a += p[3]; b += a;
+			p += 4;
+			n -= 4;
+		}
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+	return (b << 16) | a;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline ev_uint64_t
+read64le(const unsigned char *p)
+{
+	return (ev_uint64_t)p[0] | ((ev_uint64_t)p[1] << 8) |
+	    ((ev_uint64_t)p[2] << 16) | ((ev_uint64_t)p[3] << 24) |
+	    ((ev_uint64_t)p[4] << 32) | ((ev_uint64_t)p[5] << 40) |
+	    ((ev_uint64_t)p[6] << 48) | ((ev_uint64_t)p[7] << 56);
+}
+
+static inline ev_uint32_t
+read32le(const unsigned char *p)
+{
+	return (ev_uint32_t)p[0] | ((ev_uint32_t)p[1] << 8) |
+	    ((ev_uint32_t)p[2] << 16) | ((ev_uint32_t)p[3] << 24);
+}
+
+static inline ev_uint64_t
+xxh64_round(ev_uint64_t acc, ev_uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline ev_uint64_t
+xxh64_merge_round(ev_uint64_t acc, ev_uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* Mix in as many 32-byte stripes as 'len' holds; return how many bytes
+ * that was. */
+static size_t
+xxh64_stripes(ev_uint64_t v[4], const unsigned char *p, size_t len)
+{
+	const unsigned char *start = p;
+
+	for (; len >= 32; p += 32, len -= 32) {
+		v[0] = xxh64_round(v[0], read64le(p));
+		v[1] = xxh64_round(v[1], read64le(p + 8));
+		v[2] = xxh64_round(v[2], read64le(p + 16));
+		v[3] = xxh64_round(v[3], read64le(p + 24));
+	}
+	return p - start;
+}
+
+void
+evutil_hash64_init(struct evutil_hash64_state *st, ev_uint64_t seed)
+{
+	memset(st, 0, sizeof(*st));
+	st->seed = seed;
+	st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	st->v[1] = seed + XXH_PRIME64_2;
+	st->v[2] = seed;
+	st->v[3] = seed - XXH_PRIME64_1;
+}
+
+void
+evutil_hash64_update(struct evutil_hash64_state *st, const void *data,
+    size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	st->total_len += len;
+	if (st->buf_len) {
+		/* Finish the stripe we have part of. */
+		n = 32 - st->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(st->buf + st->buf_len, p, n);
+		st->buf_len += n;
+		p += n;
+		len -= n;
+		if (st->buf_len < 32)
+			return;
+		xxh64_stripes(st->v, st->buf, 32);
+		st->buf_len = 0;
+	}
+	n = xxh64_stripes(st->v, p, len);
+	p += n;
+	len -= n;
+	memcpy(st->buf, p, len);
+	st->buf_len = len;
+}
+
+ev_uint64_t
+evutil_hash64_final(const struct evutil_hash64_state *st)
+{
+	const unsigned char *p = st->buf;
+	size_t len = st->buf_len;
+	ev_uint64_t h;
+
+	if (st->total_len >= 32) {
+		h = XXH_ROTL64(st->v[0], 1) + XXH_ROTL64(st->v[1], 7) +
+		    XXH_ROTL64(st->v[2], 12) + XXH_ROTL64(st->v[3], 18);
+		h = xxh64_merge_round(h, st->v[0]);
+		h = xxh64_merge_round(h, st->v[1]);
+		h = xxh64_merge_round(h, st->v[2]);
+		h = xxh64_merge_round(h, st->v[3]);
+	} else {
+		h = st->seed + XXH_PRIME64_5;
+	}
+	h += st->total_len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		h ^= xxh64_round(0, read64le(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (len >= 4) {
+		h ^= (ev_uint64_t)read32le(p) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		h ^= *p++ * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
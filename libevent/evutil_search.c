@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file evutil_search.c
+
+   Searching a block of memory for a string, or for either of two bytes.
+   evbuffer uses these to look through each chain.
+
+   Where we can, we look at 16 bytes at a time with SSE2, or 32 at a time
+   with AVX2 if the CPU we're running on has it.  To find a string whose
+   first byte is common, we compare its first byte and its last byte
+   against every candidate position at once, and only call memcmp() where
+   both match.
+*/
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(USE_SSE2) && defined(_EVENT_HAVE_RUNTIME_AVX2)
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
+#include "util-internal.h"
+
+#ifdef USE_AVX2
+/* 1 if the CPU has AVX2, 0 if it doesn't, -1 if we haven't checked yet.
+ * Racing threads all store the same answer. */
+static int have_avx2 = -1;
+
+static inline int
+use_avx2(void)
+{
+	if (have_avx2 < 0)
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return have_avx2;
+}
+#endif
+
+/* The scalar versions, for what is left over after the vector loops, or
+ * for when we have no vector instructions. */
+static const void *
+memchr2_scalar(const unsigned char *s, int c1, int c2, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (s[i] == c1 || s[i] == c2)
+			return s + i;
+	}
+	return NULL;
+}
+
+static const void *
+memmem_scalar(const unsigned char *s, size_t n, const unsigned char *what,
+    size_t len)
+{
+	const unsigned char *p, *end = s + n - len + 1;
+
+	while (s < end && (p = memchr(s, what[0], end - s))) {
+		if (p[len - 1] == what[len - 1] &&
+		    !memcmp(p + 1, what + 1, len - 2))
+			return p;
+		s = p + 1;
+	}
+	return NULL;
+}
+
+#ifdef USE_SSE2
+static const void *
+memchr2_sse2(const unsigned char *s, int c1, int c2, size_t n)
+{
+	const __m128i v1 = _mm_set1_epi8((char)c1);
+	const __m128i v2 = _mm_set1_epi8((char)c2);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+		if (mask)
+			return s + i + __builtin_ctz(mask);
+	}
+	return memchr2_scalar(s + i, c1, c2, n - i);
+}
+
+static const void *
+memmem_sse2(const unsigned char *s, size_t n, const unsigned char *what,
+    size_t len)
+{
+	const __m128i first = _mm_set1_epi8((char)what[0]);
+	const __m128i last = _mm_set1_epi8((char)what[len - 1]);
+	/* The number of places where a match could start. */
+	size_t n_starts = n - len + 1;
+	size_t i;
+
+	for (i = 0; i + 16 <= n_starts; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + len - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			size_t at = i + __builtin_ctz(mask);
+			if (!memcmp(s + at + 1, what + 1, len - 2))
+				return s + at;
+			mask &= mask - 1;
+		}
+	}
+	return memmem_scalar(s + i, n - i, what, len);
+}
+#endif
+
+#ifdef USE_AVX2
+__attribute__((target("avx2"))) static const void *
+memchr2_avx2(const unsigned char *s, int c1, int c2, size_t n)
+{
+	const __m256i v1 = _mm256_set1_epi8((char)c1);
+	const __m256i v2 = _mm256_set1_epi8((char)c2);
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, v1), _mm256_cmpeq_epi8(v, v2)));
+		if (mask)
+			return s + i + __builtin_ctz(mask);
+	}
+	return memchr2_sse2(s + i, c1, c2, n - i);
+}
+
+__attribute__((target("avx2"))) static const void *
+memmem_avx2(const unsigned char *s, size_t n, const unsigned char *what,
+    size_t len)
+{
+	const __m256i first = _mm256_set1_epi8((char)what[0]);
+	const __m256i last = _mm256_set1_epi8((char)what[len - 1]);
+	size_t n_starts = n - len + 1;
+	size_t i;
+
+	/* Two vectors at a time, so that stretches without candidates go
+	 * by quickly. */
+	for (i = 0; i + 64 <= n_starts; i += 64) {
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+		__m256i b0 = _mm256_loadu_si256(
+			(const __m256i *)(s + i + len - 1));
+		__m256i b1 = _mm256_loadu_si256(
+			(const __m256i *)(s + i + len + 31));
+		ev_uint64_t mask = (ev_uint32_t)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a0, first),
+			    _mm256_cmpeq_epi8(b0, last)));
+		mask |= ((ev_uint64_t)(ev_uint32_t)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a1, first),
+			    _mm256_cmpeq_epi8(b1, last)))) << 32;
+		while (mask) {
+			size_t at = i + __builtin_ctzll(mask);
+			if (!memcmp(s + at + 1, what + 1, len - 2))
+				return s + at;
+			mask &= mask - 1;
+		}
+	}
+	return memmem_sse2(s + i, n - i, what, len);
+}
+#endif
+
+const void *
+evutil_memchr2(const void *s, int c1, int c2, size_t n)
+{
+#ifdef USE_AVX2
+	if (n >= 32 && use_avx2())
+		return memchr2_avx2(s, c1 & 0xff, c2 & 0xff, n);
+#endif
+#ifdef USE_SSE2
+	return memchr2_sse2(s, c1 & 0xff, c2 & 0xff, n);
+#else
+	return memchr2_scalar(s, c1 & 0xff, c2 & 0xff, n);
+#endif
+}
+
+/* memchr() for the first byte is hard to beat when that byte is rare.  So
+ * we start out with it, and switch to looking at two bytes at once if it
+ * stops for nothing this many times. */
+#define MAX_FALSE_STARTS 4
+
+const void *
+evutil_memmem(const void *s, size_t n, const void *what, size_t len)
+{
+	const unsigned char *w = what;
+	const unsigned char *p = s, *end, *found;
+	int false_starts = 0;
+
+	if (len > n)
+		return NULL;
+	if (len == 0)
+		return s;
+	if (len == 1)
+		return memchr(s, w[0], n);
+
+	end = p + n - len + 1;
+	while (p < end && (found = memchr(p, w[0], end - p))) {
+		if (found[len - 1] == w[len - 1] &&
+		    !memcmp(found + 1, w + 1, len - 2))
+			return found;
+		p = found + 1;
+		if (++false_starts == MAX_FALSE_STARTS)
+			break;
+	}
+	if (p >= end || false_starts < MAX_FALSE_STARTS)
+		return NULL;
+
+	n -= p - (const unsigned char *)s;
+#ifdef USE_AVX2
+	if (n - len >= 32 && use_avx2())
+		return memmem_avx2(p, n, w, len);
+#endif
+#ifdef USE_SSE2
+	return memmem_sse2(p, n, w, len);
+#else
+	return memmem_scalar(p, n, w, len);
+#endif
+}
@@ -385,6 +385,16 @@ evhttp_connected(struct evhttp_connection *evcon)
 	}
 }
 
+/* Append "HTTP/major.minor" to 'output'. */
+static void
+evhttp_add_version(struct evbuffer *output, int major, int minor)
+{
+	evbuffer_add(output, "HTTP/", 5);
+	evbuffer_add_int(output, major);
+	evbuffer_add(output, ".", 1);
+	evbuffer_add_int(output, minor);
+}
+
 /*
  * Create the headers needed for an HTTP request
  */
@@ -392,15 +402,19 @@ static void
 evhttp_make_header_request(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
 	const char *method;
 
 	evhttp_remove_header(req->output_headers, "Proxy-Connection");
 
 	/* Generate request line */
 	method = evhttp_method(req->type);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "%s %s HTTP/%d.%d\r\n",
-	    method, req->uri, req->major, req->minor);
+	evbuffer_add(output, method, strlen(method));
+	evbuffer_add(output, " ", 1);
+	evbuffer_add(output, req->uri, strlen(req->uri));
+	evbuffer_add(output, " ", 1);
+	evhttp_add_version(output, req->major, req->minor);
+	evbuffer_add(output, "\r\n", 2);
 
 	/* Add the content length on a post or put request if missing */
 	if ((req->type == EVHTTP_REQ_POST || req->type == EVHTTP_REQ_PUT) &&
@@ -476,11 +490,16 @@ static void
 evhttp_make_header_response(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "HTTP/%d.%d %d %s\r\n",
-	    req->major, req->minor, req->response_code,
-	    req->response_code_line);
+
+	evhttp_add_version(output, req->major, req->minor);
+	evbuffer_add(output, " ", 1);
+	evbuffer_add_int(output, req->response_code);
+	evbuffer_add(output, " ", 1);
+	evbuffer_add(output, req->response_code_line,
+	    strlen(req->response_code_line));
+	evbuffer_add(output, "\r\n", 2);
 
 	if (req->major == 1) {
 		if (req->minor == 1)
@@ -542,8 +561,7 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
-		    header->key, header->value);
+		evbuffer_add_header_line(output, header->key, header->value);
 	}
 	evbuffer_add(output, "\r\n", 2);
 
@@ -752,6 +770,34 @@ evhttp_connection_done(struct evhttp_connection *evcon)
  *     ran over the maximum limit
  */
 
+/*
+ * Parses the hexadecimal chunk size at the start of the 'len' bytes at 'p',
+ * which are not NUL-terminated.  The size may be followed by a space and
+ * then anything at all.  Returns -1 if there is no size, or if it is too
+ * large.
+ */
+static ev_int64_t
+evhttp_parse_chunk_size(const char *p, size_t len)
+{
+	ev_int64_t size = 0;
+	size_t i;
+
+	for (i = 0; i < len && p[i] != ' '; ++i) {
+		int digit;
+		if (EVUTIL_ISDIGIT(p[i]))
+			digit = p[i] - '0';
+		else if (EVUTIL_ISXDIGIT(p[i]))
+			digit = EVUTIL_TOLOWER(p[i]) - 'a' + 10;
+		else
+			return (-1);
+		if (size >= ((ev_int64_t)1 << 59))
+			return (-1);
+		size = size * 16 + digit;
+	}
+
+	return (i ? size : -1);
+}
+
 static enum message_read_status
 evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 {
@@ -761,22 +807,34 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 		if (req->ntoread < 0) {
 			/* Read chunk size */
 			ev_int64_t ntoread;
-			char *p = evbuffer_readln(buf, NULL, EVBUFFER_EOL_CRLF);
-			char *endp;
-			int error;
-			if (p == NULL)
+			struct evbuffer_ptr eol;
+			size_t eol_len, n;
+			char scratch[64];
+			const char *p;
+
+			eol = evbuffer_search_eol(buf, NULL, &eol_len,
+			    EVBUFFER_EOL_CRLF);
+			if (eol.pos < 0)
 				break;
 			/* the last chunk is on a new line? */
-			if (strlen(p) == 0) {
-				mm_free(p);
+			if (eol.pos == 0) {
+				evbuffer_drain(buf, eol_len);
 				continue;
 			}
-			ntoread = evutil_strtoll(p, &endp, 16);
-			error = (*p == '\0' ||
-			    (*endp != '\0' && *endp != ' ') ||
-			    ntoread < 0);
-			mm_free(p);
-			if (error) {
+			/* The size is at the start of the line, and is short;
+			 * look at it where it is rather than copying the line
+			 * out. */
+			n = (size_t)eol.pos < sizeof(scratch) ?
+			    (size_t)eol.pos : sizeof(scratch);
+			p = evbuffer_peek_contiguous(buf, NULL, n, scratch);
+			/* If the line is longer than what we looked at, the
+			 * size must end inside it; otherwise we'd take a
+			 * prefix of the size for the whole. */
+			if (p && (size_t)eol.pos > n && !memchr(p, ' ', n))
+				p = NULL;
+			ntoread = p ? evhttp_parse_chunk_size(p, n) : -1;
+			evbuffer_drain(buf, eol.pos + eol_len);
+			if (ntoread < 0) {
 				/* could not get chunk size */
 				return (DATA_CORRUPTED);
 			}
@@ -2106,8 +2164,7 @@ evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
 	if (!evhttp_response_needs_body(req))
 		return;
 	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
-				    (unsigned)evbuffer_get_length(databuf));
+		evbuffer_add_chunk_size(output, evbuffer_get_length(databuf));
 	}
 	evbuffer_add_buffer(output, databuf);
 	if (req->chunked) {
@@ -2193,18 +2250,28 @@ static const char uri_chars[256] = {
 char *
 evhttp_encode_uri(const char *uri)
 {
+	static const char hex[] = "0123456789ABCDEF";
 	struct evbuffer *buf = evbuffer_new();
+	char escaped[3];
+	size_t len;
 	char *p;
 
+	escaped[0] = '%';
 	for (p = (char *)uri; *p != '\0'; p++) {
 		if (uri_chars[(unsigned char)(*p)]) {
 			evbuffer_add(buf, p, 1);
 		} else {
-			evbuffer_add_printf(buf, "%%%02X", (unsigned char)(*p));
+			escaped[1] = hex[(unsigned char)(*p) >> 4];
+			escaped[2] = hex[(unsigned char)(*p) & 15];
+			evbuffer_add(buf, escaped, 3);
 		}
 	}
-	evbuffer_add(buf, "", 1);
-	p = mm_strdup((char*)evbuffer_pullup(buf, -1));
+	len = evbuffer_get_length(buf);
+	p = mm_malloc(len + 1);
+	if (p != NULL) {
+		evbuffer_remove(buf, p, len);
+		p[len] = '\0';
+	}
 	evbuffer_free(buf);
 
 	return (p);
@@ -323,6 +323,29 @@ char *evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
  */
 int evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf);
 
+/**
+  Add a reference to the contents of one evbuffer to the end of another,
+  without copying them.
+
+  The data stays in inbuf too.  Each chain of memory in inbuf is shared
+  with outbuf: the memory is refcounted, and is released when the last
+  evbuffer referring to it has drained it or been freed.  This makes it
+  cheap to send one message to many evbuffers: build the message in one
+  evbuffer, add a reference to it to each of the others, and free it.
+
+  Once its memory has been shared, inbuf will not add data to its existing
+  chains any more, and an evbuffer_free() on inbuf does not release its
+  data until every reference to it is gone.
+
+  @param outbuf the output buffer
+  @param inbuf the input buffer
+  @return 0 if successful, or -1 if an error occurred.  It is an error
+    for inbuf to hold data that was itself added with
+    evbuffer_add_buffer_reference().
+ */
+int evbuffer_add_buffer_reference(struct evbuffer *outbuf,
+    struct evbuffer *inbuf);
+
 
 typedef void (*evbuffer_ref_cleanup_cb)(const void *data,
     size_t datalen, void *extra);
@@ -358,6 +381,9 @@ int evbuffer_add_reference(struct evbuffer *outbuf,
   The results of using evbuffer_remove() or evbuffer_pullup() are
   undefined.
 
+  To send the same file, or parts of it, from many evbuffers, use
+  evbuffer_file_segment_new() instead.
+
   @param outbuf the output buffer
   @param fd the file descriptor
   @param off the offset from which to read data
@@ -368,6 +394,105 @@ int evbuffer_add_reference(struct evbuffer *outbuf,
 int evbuffer_add_file(struct evbuffer *output, int fd, off_t offset,
     size_t length);
 
+/**
+  An evbuffer_file_segment holds a reference to a range of a file --
+  possibly the whole file! -- for use in writing from an evbuffer to a
+  socket.  It could be implemented with sendfile, with mmap, or by reading
+  the data into memory, depending on what the platform supports.  Unlike
+  evbuffer_add_file(), a file segment is opened once and can then be added,
+  in whole or in part, to any number of evbuffers.
+
+  The segment is reference-counted: it stays alive until it has been passed
+  to evbuffer_file_segment_free() and every evbuffer chain that refers to
+  it has been drained or freed.
+*/
+struct evbuffer_file_segment;
+
+/**
+   Flag for creating evbuffer_file_segment: If this flag is set, then when
+   the evbuffer_file_segment is freed and no longer in use by any
+   evbuffer, the underlying fd is closed.
+ */
+#define EVBUF_FS_CLOSE_ON_FREE    0x01
+/**
+   Flag for creating evbuffer_file_segment: Disable memory-map based
+   implementations.
+ */
+#define EVBUF_FS_DISABLE_MMAP     0x02
+/**
+   Flag for creating evbuffer_file_segment: Disable direct fd-to-fd
+   implementations (including sendfile and splice).
+
+   You might want to use this option if data needs to be taken from the
+   evbuffer by any means other than writing it to the network: the sendfile
+   backend is fast, but it only works for sending files directly to the
+   network.
+ */
+#define EVBUF_FS_DISABLE_SENDFILE 0x04
+/**
+   Flag for creating evbuffer_file_segment: Do not allocate a lock for this
+   segment.  If this option is set, then neither the segment nor any
+   evbuffer it is added to may ever be accessed from more than one thread
+   at a time.
+ */
+#define EVBUF_FS_DISABLE_LOCKING  0x08
+
+/**
+   Create and return a new evbuffer_file_segment for reading data from a
+   file and sending it out via an evbuffer.
+
+   This function avoids unnecessary data copies between userland and
+   kernel.  Where available, it uses sendfile.  Otherwise it maps the
+   segment into memory once, starting at the page that holds 'offset', and
+   every evbuffer that uses the segment shares that mapping.  If neither
+   works, it reads the segment into memory.
+
+   The file descriptor must not be closed so long as any evbuffer is using
+   this segment.
+
+   @param fd an open file to read from.
+   @param offset an index within the file at which to start reading
+   @param length how much data to read, or -1 to read as much as possible.
+      (-1 requires that 'fd' support fstat.)
+   @param flags any number of the EVBUF_FS_* flags
+   @return a new evbuffer_file_segment, or NULL on failure.
+ **/
+struct evbuffer_file_segment *evbuffer_file_segment_new(
+	int fd, off_t offset, off_t length, unsigned flags);
+
+/**
+   Release a reference to an evbuffer_file_segment.
+
+   The segment itself, and its fd if EVBUF_FS_CLOSE_ON_FREE was given, are
+   released once no evbuffer refers to it any longer.
+ */
+void evbuffer_file_segment_free(struct evbuffer_file_segment *seg);
+
+/**
+   Insert some or all of an evbuffer_file_segment at the end of an evbuffer
+
+   Note that the offset and length parameters of this function have a
+   different meaning from those provided to evbuffer_file_segment_new:
+   When you create the segment, the offset is the offset _within the file_,
+   and the length is the length _of the segment_, whereas when you add a
+   segment to an evbuffer, the offset is _within the segment_ and the
+   length is the length of the _part of the segment you want to use_.
+
+   In other words, if you have a 10 KiB file, and you create an
+   evbuffer_file_segment for it with offset 20 and length 1000, it will
+   refer to bytes 20..1019 inclusive.  If you then pass this segment to
+   evbuffer_add_file_segment and specify an offset of 20 and a length of
+   50, you will be adding bytes 40..89 inclusive.
+
+   @param buf the evbuffer to append to
+   @param seg the segment to add
+   @param offset the offset within the segment to start from
+   @param length the amount of data to add, or -1 to add it all.
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length);
+
 /**
   Append a formatted string to the end of an evbuffer.
 
@@ -394,6 +519,63 @@ int evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
  */
 int evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap);
 
+/**
+  Append an integer to the end of an evbuffer, in decimal.
+
+  This does what evbuffer_add_printf(buf, "%lld", value) would, without
+  parsing a format string.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+  @see evbuffer_add_uint, evbuffer_add_hex
+ */
+int evbuffer_add_int(struct evbuffer *buf, ev_int64_t value);
+
+/**
+  Append an unsigned integer to the end of an evbuffer, in decimal.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t value);
+
+/**
+  Append an unsigned integer to the end of an evbuffer, in lowercase
+  hexadecimal with no leading "0x".
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t value);
+
+/**
+  Append an HTTP chunk-size line to the end of an evbuffer: 'size' in
+  hexadecimal, followed by CRLF.
+
+  @param buf the evbuffer that will be appended to
+  @param size the length of the chunk that will follow
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_chunk_size(struct evbuffer *buf, size_t size);
+
+/**
+  Append a header line of the form "key: value", followed by CRLF, to the
+  end of an evbuffer.
+
+  The line is added in one piece, and the evbuffer's callbacks are invoked
+  once.
+
+  @param buf the evbuffer that will be appended to
+  @param key the header name, as a NUL-terminated string
+  @param value the header value, as a NUL-terminated string
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_header_line(struct evbuffer *buf, const char *key,
+    const char *value);
+
 
 /**
   Remove a specified number of bytes data from the beginning of an evbuffer.
@@ -432,6 +614,65 @@ int evbuffer_write(struct evbuffer *buffer, evutil_socket_t fd);
 int evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 						  ev_ssize_t howmuch);
 
+/**
+   If this flag is set, large writes from an evbuffer are cut down to the
+   room left in the socket's send buffer, as SO_SNDBUF and SIOCOUTQ report
+   it.  If the socket has TCP_NOTSENT_LOWAT set, they are also cut down so
+   that no more than that many bytes wait unsent in the kernel.  Only
+   available on Linux; elsewhere the flag has no effect.
+
+   @see evbuffer_set_write_flags()
+ */
+#define EVBUFFER_WRITE_FIT_SNDBUF	0x01
+/**
+   If this flag is set, large writes from an evbuffer to a socket that
+   supports it are sent with MSG_ZEROCOPY.  The kernel then sends straight
+   from the evbuffer's memory, so the chains that were written stay
+   allocated, even after they are drained, until the kernel says it is
+   done with them.  Only available on Linux; elsewhere the flag has no
+   effect.
+
+   @see evbuffer_set_write_flags(), evbuffer_zerocopy_reap()
+ */
+#define EVBUFFER_WRITE_ZEROCOPY		0x02
+
+/**
+   Change how evbuffer_write() and evbuffer_write_atmost() write from an
+   evbuffer.
+
+   The socket is examined (and, for EVBUFFER_WRITE_ZEROCOPY, given the
+   SO_ZEROCOPY option) the first time the evbuffer is written to it.
+
+   @param buf the evbuffer to change
+   @param flags any combination of EVBUFFER_WRITE_FIT_SNDBUF and
+     EVBUFFER_WRITE_ZEROCOPY, or 0 to go back to ordinary writes.
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_write_flags(struct evbuffer *buf, unsigned flags);
+
+/**
+   Release the memory of MSG_ZEROCOPY sends from an evbuffer that the
+   kernel is done with.
+
+   The kernel says that it is done with a send by putting a notification
+   on the socket's error queue, which makes the socket report an error
+   condition to poll() and friends until the notification is read.
+   evbuffer_write() and evbuffer_write_atmost() call this function
+   themselves, and so does a socket bufferevent whenever it is told that
+   its socket is readable or writable.  If you write from an evbuffer with
+   EVBUFFER_WRITE_ZEROCOPY yourself, call it when the socket reports an
+   error condition.
+
+   Freeing the evbuffer releases any sends that are still pending, so only
+   free it once the socket is closed or you don't care what the kernel
+   sends from the memory.
+
+   @param buf the evbuffer that was written
+   @param fd the socket it was written to
+   @return the number of sends still pending.
+ */
+int evbuffer_zerocopy_reap(struct evbuffer *buf, evutil_socket_t fd);
+
 /**
   Read from a file descriptor and store the result in an evbuffer.
 
@@ -552,6 +793,89 @@ int evbuffer_peek(struct evbuffer *buffer, ev_ssize_t len,
     struct evbuffer_ptr *start_at,
     struct evbuffer_iovec *vec_out, int n_vec);
 
+/** Function to look at a run of bytes inside an evbuffer as one
+    contiguous block, without changing the evbuffer.
+
+    If the 'len' bytes starting at 'start_at' are all in one chunk of the
+    evbuffer's memory, this returns a pointer to them there.  Otherwise,
+    it copies them into 'scratch' and returns 'scratch'.  Unlike
+    evbuffer_pullup(), it never moves data around inside the evbuffer,
+    which makes it cheap for looking at a short header that might happen
+    to straddle two chunks.
+
+    The returned pointer is only valid until the evbuffer is next
+    modified.
+
+    @param buffer the evbuffer to look at
+    @param start_at an evbuffer_ptr indicating the point at which the
+       bytes begin.  NULL means, "At the start of the buffer."
+    @param len the number of bytes to look at
+    @param scratch memory holding at least 'len' bytes, to copy the data
+       into if it isn't contiguous.  If NULL, we only succeed when the
+       data is contiguous already.
+    @return a pointer to the 'len' bytes, or NULL if the evbuffer holds
+       fewer than 'len' bytes after 'start_at', or if they are not
+       contiguous and 'scratch' is NULL, or if they are in a file that is
+       being sent with sendfile.
+ */
+const void *evbuffer_peek_contiguous(struct evbuffer *buffer,
+    struct evbuffer_ptr *start_at, size_t len, void *scratch);
+
+/**
+   Compute the CRC32C (Castagnoli) checksum of part of an evbuffer.
+
+   The bytes are read where they lie, one chunk after another, without
+   being copied or made contiguous.  The checksum can be computed
+   incrementally: pass the result of one call as '*crc' to the next, and
+   you get the checksum of both ranges together.  We use the SSE4.2
+   crc32 instruction when the CPU has it.
+
+   @param buffer the evbuffer to read
+   @param start an evbuffer_ptr to the first byte to checksum, or NULL
+      for the start of the buffer
+   @param len how many bytes to checksum, or -1 for all the bytes after
+      'start'
+   @param crc the checksum so far (0 to start a new one); set to the
+      checksum with these bytes added
+   @return 0 on success, or -1 if the evbuffer holds fewer than 'len'
+      bytes after 'start', or if some of them are in a file that is being
+      sent with sendfile.  On failure, '*crc' is unchanged.
+ */
+int evbuffer_crc32c(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *crc);
+
+/**
+   Compute the Adler-32 checksum of part of an evbuffer.
+
+   This works like evbuffer_crc32c(), except that a new checksum starts
+   with '*adler' set to 1, as in zlib.
+
+   @see evbuffer_crc32c()
+ */
+int evbuffer_adler32(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint32_t *adler);
+
+/**
+   Compute a fast 64-bit hash of part of an evbuffer.
+
+   The hash is XXH64, which is not cryptographic: it's for spotting
+   accidental damage and for hash tables, not for defending against an
+   attacker.  Like evbuffer_crc32c(), it reads the bytes in place.  It is
+   not incremental; hash the whole range at once.
+
+   @param buffer the evbuffer to read
+   @param start an evbuffer_ptr to the first byte to hash, or NULL for
+      the start of the buffer
+   @param len how many bytes to hash, or -1 for all the bytes after
+      'start'
+   @param seed a seed for the hash; the same bytes and seed always give
+      the same hash
+   @param hash_out set to the hash on success
+   @return 0 on success, or -1 on failure, as for evbuffer_crc32c()
+ */
+int evbuffer_hash64(struct evbuffer *buffer, const struct evbuffer_ptr *start,
+    ev_ssize_t len, ev_uint64_t seed, ev_uint64_t *hash_out);
+
 /** Type definition for a callback that is invoked whenever data is added or
     removed from an evbuffer.
 
@@ -709,6 +1033,64 @@ int evbuffer_freeze(struct evbuffer *buf, int at_front);
  */
 int evbuffer_unfreeze(struct evbuffer *buf, int at_front);
 
+/**
+   Statistics about how an evbuffer has merged its small chains.
+
+   @see evbuffer_set_compaction(), evbuffer_get_compaction_stats()
+ */
+struct evbuffer_compaction_stats {
+	/** How many times the evbuffer has looked for small chains to
+	 * merge. */
+	size_t n_compactions;
+	/** How many chains have gone away by being merged into others. */
+	size_t n_chains_merged;
+	/** How many bytes were copied to merge them. */
+	size_t n_bytes_copied;
+};
+
+/**
+   Make an evbuffer merge runs of small chains as they pile up.
+
+   An evbuffer that gets many small pieces of data appended with
+   evbuffer_add_buffer() or evbuffer_add_reference(), or small writes
+   between pieces it cannot write into, ends up with a long list of chains
+   that each hold a few bytes.  Such a list takes many iovecs to write, and
+   is slow to search.
+
+   With compaction on, a chain holding fewer than 'small_chain_size'
+   bytes is "small".  Once 'max_small_chains' small chains have been
+   appended, the evbuffer copies every run of two or more adjacent small
+   chains into a single chain.  It leaves alone chains that are pinned for
+   I/O, chains being sent with sendfile, and the last two chains, which
+   may be in use for a read.
+
+   Compaction changes how the evbuffer's data is laid out in memory, so
+   an evbuffer_ptr or an evbuffer_peek() result may be invalidated by any
+   call that adds data.  It never runs while the front of the buffer is
+   frozen.
+
+   Compaction is off by default.
+
+   @param buf the evbuffer to configure
+   @param small_chain_size chains holding fewer bytes than this are
+      candidates for merging; 0 turns compaction off.
+   @param max_small_chains how many small chains may be appended before
+      we merge them; must be at least 2.
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_compaction(struct evbuffer *buf, size_t small_chain_size,
+    unsigned max_small_chains);
+
+/**
+   Report how much merging of small chains an evbuffer has done.
+
+   @param buf the evbuffer to ask about
+   @param stats_out set to the evbuffer's statistics
+   @see evbuffer_set_compaction()
+ */
+void evbuffer_get_compaction_stats(struct evbuffer *buf,
+    struct evbuffer_compaction_stats *stats_out);
+
 struct event_base;
 /**
    Force all the callbacks on an evbuffer to be run, not immediately after
@@ -719,6 +1101,172 @@ struct event_base;
  */
 int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 
+/**
+   How much chain memory some evbuffers hold.
+
+   This counts the memory that evbuffers allocate for their chains,
+   including the chains' headers.  It doesn't count memory added with
+   evbuffer_add_reference(), or files added with evbuffer_add_file().
+
+   @see evbuffer_get_global_memory_stats(),
+     event_base_get_evbuffer_memory_stats()
+ */
+struct evbuffer_memory_stats {
+	/** Bytes held right now. */
+	size_t used;
+	/** The most bytes ever held at once. */
+	size_t peak;
+};
+
+/**
+   Return how many bytes of chain memory an evbuffer holds.
+
+   This walks the evbuffer's chains, so it takes time in proportion to
+   how many there are.
+
+   @param buf the evbuffer to ask about
+   @return the number of bytes allocated for chains in 'buf'
+ */
+size_t evbuffer_get_memory_used(struct evbuffer *buf);
+
+/**
+   Report how much chain memory all the evbuffers in this process hold.
+
+   @param stats_out set to the current and peak memory use
+ */
+void evbuffer_get_global_memory_stats(struct evbuffer_memory_stats *stats_out);
+
+/**
+   Charge the memory an evbuffer allocates to an event_base.
+
+   From now on, the chains that 'buf' allocates count towards the totals
+   that event_base_get_evbuffer_memory_stats() reports for 'base'.  They
+   go on counting there, even if they move to another evbuffer, until
+   they are freed.  A bufferevent charges its input and output buffers to
+   its event_base.
+
+   @param buf the evbuffer to charge memory for
+   @param base the event_base to charge it to, or NULL to stop
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_memory_base(struct evbuffer *buf, struct event_base *base);
+
+/**
+   Report how much chain memory is charged to an event_base.
+
+   @param base the event_base to ask about
+   @param stats_out set to the current and peak memory use
+   @see evbuffer_set_memory_base()
+ */
+void event_base_get_evbuffer_memory_stats(struct event_base *base,
+    struct evbuffer_memory_stats *stats_out);
+
+/**
+   A callback invoked when evbuffers' total memory use crosses the cap.
+
+   @param over_cap 1 if memory use just went over the cap, 0 if it just
+     came back under
+   @param used the number of bytes of chain memory now in use
+   @param arg the argument passed to evbuffer_set_global_memory_cap()
+   @see evbuffer_set_global_memory_cap()
+ */
+typedef void (*evbuffer_memory_cap_cb)(int over_cap, size_t used, void *arg);
+
+/**
+   Cap the chain memory that all evbuffers in this process may hold.
+
+   Memory use goes over the cap when it becomes more than 'high' bytes,
+   and comes back under once it falls to 'low' bytes or fewer.  Each time
+   it crosses, we invoke 'cb', if there is one, so that the program can
+   stop reading or producing data until memory is freed.  The callback
+   runs in whichever thread allocated or freed the memory, perhaps with
+   an evbuffer's lock held; it must not add data to or free any
+   evbuffer.
+
+   While memory use is over the cap, evbuffers set up with
+   evbuffer_set_memory_limited() refuse to allocate more chains, and
+   evbuffer_global_memory_over_cap() returns true.  Nothing else changes:
+   the cap is there to tell producers to slow down.
+
+   @param high the most memory to use before we are over the cap, or 0
+     for no cap
+   @param low how far memory use must fall to be back under the cap; no
+     more than 'high'
+   @param cb the function to invoke when we cross the cap, or NULL
+   @param arg an argument to pass to 'cb'
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_global_memory_cap(size_t high, size_t low,
+    evbuffer_memory_cap_cb cb, void *arg);
+
+/**
+   Return true iff the evbuffers in this process are over their memory cap.
+
+   @see evbuffer_set_global_memory_cap()
+ */
+int evbuffer_global_memory_over_cap(void);
+
+/**
+   Make an evbuffer refuse to grow while evbuffers are over their memory
+   cap.
+
+   While memory use is over the cap set with
+   evbuffer_set_global_memory_cap(), any function that would need to
+   allocate a chain for a limited evbuffer fails instead, as if we were
+   out of memory.  Data that fits in the space the evbuffer already has
+   can still be added, and evbuffer_add_buffer() still moves chains into
+   it.
+
+   This makes sense for output buffers, whose producers can wait until
+   memory use comes back under the cap.  An input buffer that refuses
+   memory makes evbuffer_read() fail, which a bufferevent treats as an
+   error.
+
+   Evbuffers are not limited by default.
+
+   @param buf the evbuffer to configure
+   @param limited true to refuse memory while over the cap, false to
+     allocate it anyway
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_memory_limited(struct evbuffer *buf, int limited);
+
+/**
+   If this flag is set, large chains for an evbuffer come from 2MB regions
+   of huge pages, rather than from malloc.  Copying data through such
+   chains takes fewer TLB misses, and freed chains are kept for reuse
+   instead of being handed back to the kernel.  The regions are placed on
+   the NUMA node of the thread that last ran the event loop of the
+   evbuffer's event_base (see evbuffer_set_memory_base()), or, if it has
+   none, of the thread that allocates the chain.
+
+   An evbuffer with this flag also lets the chains that evbuffer_add()
+   allocates grow to 256KB, instead of stopping at 4KB, so that data
+   added a little at a time ends up in large chains too.  Chains of less
+   than 32KB or so still come from malloc.
+
+   Where the system has no huge pages reserved, we ask for transparent
+   huge pages instead.  Only available on Linux; elsewhere the flag has
+   no effect.
+
+   @see evbuffer_set_alloc_flags()
+ */
+#define EVBUFFER_ALLOC_HUGE_PAGES	0x01
+
+/**
+   Change where an evbuffer gets memory for its chains.
+
+   Chains that are already allocated stay where they are.  This is meant
+   for evbuffers that carry bulk data, in large pieces; it does nothing
+   for one that never has a chain bigger than a few kilobytes.
+
+   @param buf the evbuffer to configure
+   @param flags a combination of EVBUFFER_ALLOC_* flags, or 0 to use
+     malloc for everything
+   @return 0 on success, -1 on failure.
+ */
+int evbuffer_set_alloc_flags(struct evbuffer *buf, unsigned flags);
+
 #ifdef __cplusplus
 }
 #endif
@@ -126,7 +126,15 @@ enum bufferevent_options {
 	BEV_OPT_THREADSAFE = (1<<1),
 
 	/** If set, callbacks are run deferred in the event loop. */
-	BEV_OPT_DEFER_CALLBACKS = (1<<2)
+	BEV_OPT_DEFER_CALLBACKS = (1<<2),
+
+	/** If set, and the event_base's backend supports EV_ET, a socket
+	 * bufferevent waits for its socket with edge-triggered events, and
+	 * reads (or writes) until the socket would block each time it wakes
+	 * up, instead of once.  It still stops at the high read watermark,
+	 * and after a fixed amount per wakeup so that other connections get
+	 * their turn.  The socket must be nonblocking. */
+	BEV_OPT_EDGE_TRIGGERED = (1<<3)
 };
 
 /**
@@ -185,6 +193,13 @@ struct evdns_base;
        ::1                  (ipv6address)
        [::1]                ([ipv6address])
 
+   If you provide an evdns_base and pass AF_UNSPEC as the family, we look up
+   IPv4 and IPv6 addresses at the same time, and try connecting to them in
+   parallel, alternating address families and starting with IPv6.  Each
+   connection attempt gets a short head start before the next one begins;
+   the first one to succeed is used, and the others are abandoned.  This
+   keeps a broken IPv6 (or IPv4) route from stalling the connection.
+
    Performance note: If you do not provide an evdns_base, this function
    may block while it waits for a DNS response.  This is probably not
    what you want.
@@ -201,7 +201,8 @@ extern "C" {
 #define DNS_OPTION_SEARCH 1
 #define DNS_OPTION_NAMESERVERS 2
 #define DNS_OPTION_MISC 4
-#define DNS_OPTIONS_ALL 7
+#define DNS_OPTION_HOSTSFILE 8
+#define DNS_OPTIONS_ALL 15
 
 /**
  * The callback that contains the results from a lookup.
@@ -401,7 +402,30 @@ void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
   The currently available configuration options are:
 
     ndots, timeout, max-timeouts, max-inflight, attempts, randomize-case,
-    bind-to.
+    bind-to, tcp-fallback, tcp-connections, tcp-pipeline, search-parallel,
+    udp-sockets.
+
+  When tcp-fallback is nonzero (the default), a request whose UDP reply
+  comes back truncated is retried over TCP to the same nameserver.  We keep
+  up to tcp-connections TCP connections open to each nameserver, and send up
+  to tcp-pipeline requests on each connection before opening another.
+
+  When search-parallel is nonzero, a lookup that uses the search list
+  sends queries for all of its candidate names at once, rather than
+  waiting for each one to fail before trying the next.  The answer is
+  still the one a sequential search would have given.
+
+  max-inflight limits how many requests we have outstanding at once,
+  across all nameservers.  Since each request to a nameserver needs its
+  own 16-bit transaction id, no single nameserver ever has more than 65535;
+  the rest wait until an id frees up.
+
+  udp-sockets sets how many UDP sockets (default 1) we open to each
+  nameserver.  Each has its own source port, and requests are spread
+  unpredictably across them, which makes replies harder to spoof and lets
+  more replies queue in the kernel during a burst of lookups.  Since only
+  one socket can bind to a given port, setting udp-sockets above 1 fails
+  if bind-to names a port, and vice versa.
 
   The option name needs to end with a colon.
 
@@ -428,9 +452,12 @@ int evdns_base_set_option(struct evdns_base *base, const char *option, const cha
   failed to open file, 2 = failed to stat file, 3 = file too large, 4 = out of
   memory, 5 = short read from file, 6 = no nameservers listed in the file
 
+  If DNS_OPTION_HOSTSFILE is set in 'flags', we also load the system hosts
+  file, as with evdns_base_load_hosts(base, NULL).
+
   @param base the evdns_base to which to apply this operation
   @param flags any of DNS_OPTION_NAMESERVERS|DNS_OPTION_SEARCH|DNS_OPTION_MISC|
-         DNS_OPTIONS_ALL
+         DNS_OPTION_HOSTSFILE|DNS_OPTIONS_ALL
   @param filename the path to the resolv.conf file
   @return 0 if successful, or various positive error codes if an error
           occurred (see above)
@@ -438,6 +465,21 @@ int evdns_base_set_option(struct evdns_base *base, const char *option, const cha
  */
 int evdns_base_resolv_conf_parse(struct evdns_base *base, int flags, const char *const filename);
 
+/**
+  Load an /etc/hosts-style file, and answer IPv4 and IPv6 lookups for the
+  names in it without going to the network.
+
+  The file replaces any hosts file that we loaded before.  We notice when
+  it is modified, and reload it.  Names are matched exactly (ignoring case
+  and any trailing dot), before any search domains are applied.
+
+  @param base the evdns_base to which to apply this operation
+  @param hosts_fname the path to the hosts file, or NULL for the system
+    hosts file
+  @return 0 if successful, or -1 if the file could not be loaded
+ */
+int evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname);
+
 
 /**
   Obtain nameserver information using the Windows API.
@@ -558,8 +600,10 @@ typedef void (*evdns_request_callback_fn_type)(struct evdns_server_request *, vo
 /** Create a new DNS server port.
 
     @param base The event base to handle events for the server port.
-    @param socket A UDP socket to accept DNS requests.
-    @param is_tcp Always 0 for now.
+    @param socket A UDP socket to accept DNS requests, or a listening TCP
+      socket to accept connections that carry DNS requests.
+    @param is_tcp 1 if socket is a listening TCP socket; 0 if it is a UDP
+      socket.
     @param callback A function to invoke whenever we get a DNS request
       on the socket.
     @param user_data Data to pass to the callback.
@@ -569,6 +613,22 @@ struct evdns_server_port *evdns_add_server_port_with_base(struct event_base *bas
 /** Close down a DNS server port, and free associated structures. */
 void evdns_close_server_port(struct evdns_server_port *port);
 
+/** Limit the connections that a TCP server port will serve.
+
+    By default, a TCP server port serves at most 64 connections at once, and
+    closes a connection once it has been idle for 10 seconds with no
+    request outstanding.  Connections beyond the limit are closed as soon
+    as they are accepted.
+
+    @param port a server port created with is_tcp set
+    @param max_conns the most connections to serve at once; must be at
+      least 1
+    @param idle_timeout how long a connection may be idle before we close
+      it, or NULL to never close idle connections
+    @return 0 on success, -1 on failure
+ */
+int evdns_server_port_set_tcp_limits(struct evdns_server_port *port, int max_conns, const struct timeval *idle_timeout);
+
 /** Sets some flags in a reply we're building.
     Allows setting of the AA or RD flags
  */
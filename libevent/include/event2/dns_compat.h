@@ -304,7 +304,7 @@ void evdns_search_add(const char *domain);
 void evdns_search_ndots_set(const int ndots);
 
 /**
-   As evdns_server_new_with_base.
+   As evdns_add_server_port_with_base.
 
   @deprecated This function is deprecated because it does not allow the
     caller to specify which even_base it uses.  The recommended
@@ -171,7 +171,37 @@ enum event_base_config_flag {
 	/** Instead of checking the current time every time the event loop is
 	    ready to run timeout callbacks, check after each timeout callback.
 	 */
-	EVENT_BASE_FLAG_NO_CACHE_TIME = 0x08
+	EVENT_BASE_FLAG_NO_CACHE_TIME = 0x08,
+	/** Wait for timeouts with microsecond precision, even when the
+	    backend's own timeout is only precise to a millisecond.  With
+	    epoll, this uses epoll_pwait2() or a timerfd, which makes each
+	    wait with a timeout somewhat more expensive.  Setting the
+	    EVENT_PRECISE_TIMER environment variable has the same effect.
+	    Pointless with EVENT_CLOCK_COARSE, whose readings are only
+	    precise to a few milliseconds anyway. */
+	EVENT_BASE_FLAG_PRECISE_TIMER = 0x10,
+	/** Linux only: give the event_base an io_uring at startup, so that
+	    bufferevent_socket_new() makes bufferevents that have the kernel
+	    do their reads and writes, rather than waiting for the socket to
+	    become ready.  Ignored if the kernel doesn't support io_uring. */
+	EVENT_BASE_FLAG_STARTUP_URING = 0x20
+};
+
+/** The clocks an event_base can use to tell the time.
+    @see event_config_set_clock_source() */
+enum event_base_clock_source {
+	/** CLOCK_MONOTONIC where it exists, or gettimeofday() where it
+	    doesn't. */
+	EVENT_CLOCK_DEFAULT = 0,
+	/** CLOCK_MONOTONIC_COARSE: much cheaper to read than the default
+	    clock, but only as precise as the kernel's scheduler tick
+	    (typically 1-4 msec).  Linux only. */
+	EVENT_CLOCK_COARSE = 1,
+	/** The CPU's timestamp counter, calibrated against CLOCK_MONOTONIC
+	    and re-synchronized with it several times a second.  Reading it
+	    doesn't enter the kernel or the vDSO at all.  Only available on
+	    x86 CPUs whose TSC runs at a constant rate. */
+	EVENT_CLOCK_TSC = 2
 };
 
 /**
@@ -179,6 +209,33 @@ enum event_base_config_flag {
  */
 int event_base_get_features(struct event_base *base);
 
+/**
+ Return the clock that an event base uses to tell the time.
+
+ This is the clock requested with event_config_set_clock_source() if it
+ was available, and EVENT_CLOCK_DEFAULT otherwise.
+ */
+enum event_base_clock_source event_base_get_clock_source(
+    struct event_base *base);
+
+/**
+ Report how precise, and how expensive to read, an event base's clock is.
+
+ The cost is measured afresh on each call, by reading the clock many times
+ in a row; it is meant for tuning and diagnostics, not for calling from a
+ busy loop.
+
+ @param base the event_base to examine
+ @param resolution_nsec if not NULL, set to the clock's resolution in
+   nanoseconds.
+ @param cost_nsec if not NULL, set to the average time, in nanoseconds,
+   that one reading of the clock takes.
+ @return 0 on success, -1 on failure.
+ @see event_base_get_clock_source()
+ */
+int event_base_get_clock_info(struct event_base *base,
+    long *resolution_nsec, long *cost_nsec);
+
 /**
    Enters a required event method feature that the application demands.
 
@@ -206,6 +263,52 @@ int event_config_require_features(struct event_config *cfg, int feature);
  * be initialized, and how they'll work. */
 int event_config_set_flag(struct event_config *cfg, int flag);
 
+/**
+   Limit how long the event loop runs callbacks before it checks for new
+   events.
+
+   By default, once the loop starts running the callbacks for a priority,
+   it runs every active callback of that priority before it checks for new
+   events or runs any timeouts.  Under heavy load, that can take a long
+   time.  With this function, the loop stops after running max_callbacks
+   callbacks, or after a callback finishes once max_interval has passed,
+   whichever comes first, and goes back to check for new events.  It always
+   runs at least one callback.
+
+   Callbacks with a priority less than min_priority don't count against
+   these limits, and always run to completion.
+
+   @param cfg the event configuration object
+   @param max_interval the longest time to spend running callbacks before
+     checking for new events, or NULL for no limit.
+   @param max_callbacks the most callbacks to run before checking for new
+     events, or -1 for no limit.
+   @param min_priority the most urgent priority that these limits apply to.
+   @return 0 on success, -1 on failure.
+   @see event_base_priority_set_weights()
+*/
+int event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority);
+
+/**
+   Choose the clock that the event_base uses to tell the time.
+
+   The event loop reads the clock at least once per iteration, and, with
+   EVENT_BASE_FLAG_NO_CACHE_TIME, every time it schedules a timeout.  A
+   cheaper clock makes that faster, at some cost in precision.
+
+   If the requested clock isn't available on this platform, the event_base
+   silently uses EVENT_CLOCK_DEFAULT instead; use
+   event_base_get_clock_source() to find out which one it got.
+
+   @param cfg the event configuration object
+   @param source the clock to use
+   @return 0 on success, -1 on failure.
+   @see event_base_get_clock_info()
+*/
+int event_config_set_clock_source(struct event_config *cfg,
+    enum event_base_clock_source source);
+
 /**
   Initialize the event API.
 
@@ -500,6 +603,45 @@ int event_add(struct event *, const struct timeval *);
  */
 int event_del(struct event *);
 
+/**
+  Add many events at once.
+
+  Equivalent to calling event_add() on each event in turn, with the same
+  timeout for each, but cheaper: the event_base is locked once, and a
+  thread running its loop is woken once, rather than once per event.
+  Events on the same file descriptor that are next to each other in the
+  array (say, a read event and a write event for one connection) are
+  registered with the backend together, which usually takes one system
+  call rather than two.
+
+  All the events must belong to the same event_base.
+
+  @param evs an array of events initialized with event_assign() or
+         event_new()
+  @param n_evs the number of events in evs
+  @param timeout the maximum amount of time to wait for each event, or NULL
+         to wait forever
+  @return 0 if every event was added, or -1 if any of them could not be
+         (the others are still added)
+  @see event_add(), event_del_batch()
+ */
+int event_add_batch(struct event **evs, int n_evs, const struct timeval *timeout);
+
+/**
+  Remove many events at once.
+
+  The counterpart to event_add_batch(): equivalent to calling event_del()
+  on each event, but locks the event_base once, and has the backend stop
+  watching each file descriptor once rather than once per event.  All the
+  events must belong to the same event_base.
+
+  @param evs an array of events
+  @param n_evs the number of events in evs
+  @return 0 if successful, or -1 if an error occurred
+  @see event_del(), event_add_batch()
+ */
+int event_del_batch(struct event **evs, int n_evs);
+
 
 /**
   Make an event active.
@@ -608,6 +750,118 @@ ev_uint32_t event_get_version_number(void);
  */
 int	event_base_priority_init(struct event_base *, int);
 
+/**
+  Share the event loop among the priorities of an event base.
+
+  Normally, the loop only runs callbacks of the most urgent priority that
+  has any active events, so that a steady stream of urgent events starves
+  all the others.  Once weights are set, each pass through the loop runs up
+  to weights[i] active callbacks of priority i, for each priority in turn,
+  before it checks for new events.
+
+  Changing the number of priorities with event_base_priority_init() clears
+  the weights.
+
+  @param eb the event_base whose priorities to weight
+  @param weights an array with one positive weight for each priority of
+     eb, or NULL to go back to strict priority order.
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_priority_init(), event_config_set_max_dispatch_interval()
+ */
+int	event_base_priority_set_weights(struct event_base *eb,
+    const int *weights);
+
+struct event_base_stats;
+
+/**
+  Start or stop collecting statistics about what an event_base's loop is
+  doing: how long it waits for events, how long its callbacks take and how
+  many run at each priority, how many deferred callbacks queue up, and how
+  late its timeouts fire.
+
+  Collecting them costs two clock readings per callback and per wait for
+  events; choosing a cheap clock with event_config_set_clock_source()
+  helps.  Statistics collected so far are kept when collection stops.
+
+  @param eb the event_base
+  @param enable 1 to collect statistics, 0 to stop
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_get_stats(), event_base_reset_stats()
+ */
+int	event_base_collect_stats(struct event_base *eb, int enable);
+
+/**
+  Copy the statistics an event_base has collected into *stats.
+
+  @see event_base_collect_stats()
+ */
+int	event_base_get_stats(struct event_base *eb,
+    struct event_base_stats *stats);
+
+/**
+  Report how many event callbacks of a given priority an event_base has
+  run while collecting statistics.
+
+  Changing the number of priorities resets these counts.
+
+  @param eb the event_base
+  @param priority the priority to report on
+  @param n_callbacks set to the number of callbacks run
+  @return 0 if successful, or -1 if priority is out of range
+ */
+int	event_base_get_priority_stats(struct event_base *eb, int priority,
+    ev_uint64_t *n_callbacks);
+
+/** Reset all of an event_base's statistics to zero. */
+void	event_base_reset_stats(struct event_base *eb);
+
+/** A function called by the event loop just before or after it waits for
+    events; see event_base_set_poll_hooks(). */
+typedef void (*event_base_poll_hook_cb)(struct event_base *eb, void *arg);
+
+/**
+  Have the event loop call one function just before it waits for events,
+  and another just after the wait ends, before it runs any callbacks.
+
+  The hooks run in the loop's thread with the event_base locked; they may
+  use the event_base, but should be quick.  By the time the first hook
+  runs, the loop has already worked out how long to wait, so a timeout
+  that it adds won't shorten this wait.
+
+  @param eb the event_base
+  @param before the function to call before each wait, or NULL
+  @param after the function to call after each wait, or NULL
+  @param arg an argument to pass to both functions
+  @return 0 if successful, or -1 if an error occurred
+ */
+int	event_base_set_poll_hooks(struct event_base *eb,
+    event_base_poll_hook_cb before, event_base_poll_hook_cb after,
+    void *arg);
+
+/** A function called after an event callback takes too long; see
+    event_base_set_slow_callback_hook().  The callback's event may no
+    longer exist, so we give its function and argument instead. */
+typedef void (*event_base_slow_callback_cb)(struct event_base *eb,
+    void (*callback)(evutil_socket_t, short, void *), void *callback_arg,
+    const struct timeval *duration, void *arg);
+
+/**
+  Have the event loop call a function whenever an event callback takes at
+  least a given time to run.
+
+  The hook runs in the loop's thread with the event_base locked, right
+  after the slow callback returns.
+
+  @param eb the event_base
+  @param threshold the shortest run time to report
+  @param fn the function to call, or NULL to stop reporting
+  @param arg an argument to pass to fn
+  @return 0 if successful, or -1 if an error occurred
+ */
+int	event_base_set_slow_callback_hook(struct event_base *eb,
+    const struct timeval *threshold, event_base_slow_callback_cb fn,
+    void *arg);
+
 
 /**
   Assign a priority to an event.
@@ -126,6 +126,43 @@ struct event {
 #define EVENT_FD(ev)		((int)(ev)->ev_fd)
 #endif
 
+/** Number of buckets in each histogram of struct event_base_stats. */
+#define EVENT_STATS_N_BUCKETS 24
+
+/**
+   What an event_base's loop has been doing; see event_base_get_stats().
+
+   Each histogram counts durations in microseconds on a log2 scale: bucket
+   0 counts durations under 1 usec, bucket i counts durations of at least
+   2^(i-1) and less than 2^i usec, and the last bucket also counts
+   everything longer.
+ */
+struct event_base_stats {
+	/** Times the loop has waited for events. */
+	ev_uint64_t n_polls;
+	/** Total time spent waiting for events, in usec. */
+	ev_uint64_t poll_usec;
+	/** Event callbacks run, and the total time they took, in usec. */
+	ev_uint64_t n_callbacks;
+	ev_uint64_t callback_usec;
+	/** The longest any one event callback took, in usec. */
+	ev_uint64_t max_callback_usec;
+	/** Deferred callbacks run, and the most that were ever waiting to
+	 * run at once. */
+	ev_uint64_t n_deferred;
+	ev_uint64_t max_deferred_queued;
+	/** Timeouts that expired, and the longest after its deadline that
+	 * the loop noticed one, in usec. */
+	ev_uint64_t n_timeouts;
+	ev_uint64_t max_timeout_lateness_usec;
+	/** How long each wait for events took. */
+	ev_uint64_t poll_hist[EVENT_STATS_N_BUCKETS];
+	/** How long each event callback took. */
+	ev_uint64_t callback_hist[EVENT_STATS_N_BUCKETS];
+	/** How long after its deadline the loop noticed each timeout. */
+	ev_uint64_t lateness_hist[EVENT_STATS_N_BUCKETS];
+};
+
 /*
  * Key-Value pairs.  Can be used for HTTP headers but also for
  * query argument parsing.
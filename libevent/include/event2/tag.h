@@ -78,6 +78,21 @@ void evtag_marshal(struct evbuffer *evbuf, ev_uint32_t tag, const void *data,
 void evtag_marshal_buffer(struct evbuffer *evbuf, ev_uint32_t tag,
     struct evbuffer *data);
 
+/**
+  Like evtag_marshal() and evtag_marshal_buffer(), but follow the payload
+  with its CRC32C, so that the receiver can tell whether it arrived intact.
+
+  The CRC is four bytes, most significant first, and the length in the
+  header counts it.  Data marshaled this way must be read back with
+  evtag_unmarshal_checked().
+
+  @see evtag_unmarshal_checked(), evbuffer_crc32c()
+ */
+void evtag_marshal_checked(struct evbuffer *evbuf, ev_uint32_t tag,
+    const void *data, ev_uint32_t len);
+void evtag_marshal_buffer_checked(struct evbuffer *evbuf, ev_uint32_t tag,
+    struct evbuffer *data);
+
 /**
   Encode an integer and store it in an evbuffer.
 
@@ -104,6 +119,22 @@ void evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag,
 
 int evtag_unmarshal(struct evbuffer *src, ev_uint32_t *ptag,
     struct evbuffer *dst);
+
+/**
+  Unmarshal a tag written by evtag_marshal_checked(), and check its CRC.
+
+  If the CRC matches, the payload is moved to 'dst', without its CRC.  If
+  it doesn't, the whole tag is removed from 'src' and nothing is added to
+  'dst'.
+
+  @param src the buffer from which to unmarshal data
+  @param ptag a pointer in which the tag id is being stored
+  @param dst the buffer to which the payload is added
+  @return the length of the payload, or -1 if the tag was malformed or its
+    CRC did not match.
+ */
+int evtag_unmarshal_checked(struct evbuffer *src, ev_uint32_t *ptag,
+    struct evbuffer *dst);
 int evtag_peek(struct evbuffer *evbuf, ev_uint32_t *ptag);
 int evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength);
 int evtag_payload_length(struct evbuffer *evbuf, ev_uint32_t *plength);
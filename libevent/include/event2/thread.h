@@ -51,6 +51,13 @@
   up.   To enable this feature, an application needs to provide a
   thread identity function via evthread_set_id_callback().
 
+  With a thread identity function, Libevent also notices whether any
+  thread other than the one running an event base's loop has ever used
+  that base.  Until one does, the loop takes the lock that event_del()
+  uses to wait for a running callback once per run of callbacks, rather
+  than once per callback.  The base itself is still unlocked while each
+  callback runs.
+
  */
 
 #ifdef __cplusplus
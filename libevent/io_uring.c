@@ -0,0 +1,385 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "event-config.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "event-internal.h"
+#include "evsignal-internal.h"
+#include "event2/thread.h"
+#include "evthread-internal.h"
+#include "log-internal.h"
+#include "evmap-internal.h"
+#include "uring-internal.h"
+
+/*
+ * An io_uring backend.
+ *
+ * Each fd with events gets one poll request in the ring.  Level-triggered
+ * fds get a one-shot request that we re-arm, once their callbacks have
+ * run, at the start of the next dispatch; the kernel checks readiness when
+ * the request arrives, so an fd that still has data gets reported again.
+ * Edge-triggered fds get a multishot request that stays armed.
+ *
+ * add and del only record what changed; dispatch turns the changes into
+ * submission queue entries, and submits them and waits for completions
+ * with a single io_uring_enter() call.  The exception is a del that leaves an
+ * fd with no events: we submit its cancellation at once, so that the
+ * kernel lets go of the file before the caller can close it.
+ */
+
+/* Per-fd state, kept by evmap in the fdinfo space. */
+struct uring_fdinfo {
+	/* The events we want: EV_READ|EV_WRITE, and EV_ET. */
+	short wanted;
+	/* The poll mask of the request the kernel has for this fd, or 0. */
+	short armed;
+	/* True iff the armed request is multishot. */
+	char multishot;
+	/* True iff this fd is on the change list. */
+	char changed;
+	/* Tells completions for the armed request apart from those for
+	 * requests we've since cancelled. */
+	ev_uint32_t gen;
+};
+
+struct uringop {
+	struct event_uring_ring ring;
+
+	/* Fds whose requests need updating before the next wait. */
+	evutil_socket_t *changes;
+	int n_changes, changes_alloc;
+
+	/* Set if the kernel turned down a multishot poll (before 5.13). */
+	int no_multishot;
+};
+
+static void *uring_init	(struct event_base *);
+static int uring_add(struct event_base *, int fd, short old, short events, void *);
+static int uring_del(struct event_base *, int fd, short old, short events, void *);
+static int uring_dispatch	(struct event_base *, struct timeval *);
+static void uring_dealloc	(struct event_base *);
+
+const struct eventop io_uringops = {
+	"io_uring",
+	uring_init,
+	uring_add,
+	uring_del,
+	uring_dispatch,
+	uring_dealloc,
+	1, /* need reinit */
+	EV_FEATURE_ET|EV_FEATURE_O1|EV_FEATURE_FDS,
+	sizeof(struct uring_fdinfo)
+};
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* The user_data of a poll request: its fd and generation.  Requests whose
+ * completions we don't care about get fd -1. */
+#define URING_UDATA(fd, gen) \
+	(((ev_uint64_t)(gen) << 32) | (ev_uint32_t)(fd))
+#define URING_UDATA_FD(u) ((int)(ev_uint32_t)(u))
+#define URING_UDATA_GEN(u) ((ev_uint32_t)((u) >> 32))
+#define URING_UDATA_IGNORE URING_UDATA(-1, 0)
+
+static void *
+uring_init(struct event_base *base)
+{
+	struct uringop *u;
+
+	if (!(u = mm_calloc(1, sizeof(struct uringop))))
+		return (NULL);
+	if (event_uring_ring_init(&u->ring, URING_ENTRIES,
+		URING_CQ_ENTRIES) == -1) {
+		mm_free(u);
+		return (NULL);
+	}
+
+	evsig_init(base);
+
+	return (u);
+}
+
+static int
+uring_note_change(struct uringop *u, evutil_socket_t fd,
+    struct uring_fdinfo *info)
+{
+	if (info->changed)
+		return (0);
+
+	if (u->n_changes == u->changes_alloc) {
+		int n = u->changes_alloc ? u->changes_alloc * 2 : 64;
+		evutil_socket_t *c = mm_realloc(u->changes,
+		    n * sizeof(evutil_socket_t));
+		if (c == NULL)
+			return (-1);
+		u->changes = c;
+		u->changes_alloc = n;
+	}
+	u->changes[u->n_changes++] = fd;
+	info->changed = 1;
+	return (0);
+}
+
+/* Queue the cancellation of fd's poll request. */
+static int
+uring_cancel(struct uringop *u, evutil_socket_t fd, struct uring_fdinfo *info)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = event_uring_ring_get_sqe(&u->ring)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = URING_UDATA(fd, info->gen);
+	sqe->user_data = URING_UDATA_IGNORE;
+	info->armed = 0;
+	/* Anything the old request still reports is stale. */
+	++info->gen;
+	return (0);
+}
+
+/* Hand the kernel the requests in the submission queue now, instead of at
+ * the next dispatch. */
+static int
+uring_submit_now(struct uringop *u)
+{
+	unsigned to_submit = event_uring_ring_publish(&u->ring);
+
+	if (!to_submit)
+		return (0);
+	if (event_uring_enter(u->ring.fd, to_submit, 0, 0, NULL, 0) == -1 &&
+	    errno != EBUSY && errno != EAGAIN && errno != EINTR) {
+		event_warn("io_uring_enter");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+uring_add(struct event_base *base, int fd, short old, short events, void *p)
+{
+	struct uring_fdinfo *info = p;
+
+	info->wanted = old | events | (info->wanted & EV_ET);
+	return uring_note_change(base->evbase, fd, info);
+}
+
+static int
+uring_del(struct event_base *base, int fd, short old, short events, void *p)
+{
+	struct uring_fdinfo *info = p;
+	short remaining = old & ~events & (EV_READ|EV_WRITE);
+
+	info->wanted = remaining ? (remaining | (info->wanted & EV_ET)) : 0;
+	/* The caller may close fd next, and open another file with the same
+	 * number before we dispatch; but the request we have polls the file
+	 * it was made for, and keeps it open until the kernel sees the
+	 * cancellation.  So submit the cancellation now, not when we apply
+	 * changes. */
+	if (!info->wanted && info->armed) {
+		if (uring_cancel(base->evbase, fd, info) == -1)
+			return (-1);
+		return uring_submit_now(base->evbase);
+	}
+	return uring_note_change(base->evbase, fd, info);
+}
+
+/* Bring the kernel's poll request for fd into line with what we want. */
+static int
+uring_apply_change(struct event_base *base, struct uringop *u,
+    evutil_socket_t fd)
+{
+	struct uring_fdinfo *info = evmap_io_get_fdinfo(&base->io, fd);
+	struct io_uring_sqe *sqe;
+	short mask = 0;
+	char multishot;
+
+	if (info == NULL)
+		return (0);
+	info->changed = 0;
+
+	if (info->wanted & EV_READ)
+		mask |= POLLIN;
+	if (info->wanted & EV_WRITE)
+		mask |= POLLOUT;
+	multishot = (info->wanted & EV_ET) && !u->no_multishot;
+
+	if (info->armed) {
+		if (info->armed == mask && info->multishot == multishot)
+			return (0);
+		if (uring_cancel(u, fd, info) == -1)
+			return (-1);
+	}
+
+	if (!mask)
+		return (0);
+
+	if ((sqe = event_uring_ring_get_sqe(&u->ring)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	if (multishot)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_UDATA(fd, info->gen);
+	info->armed = mask;
+	info->multishot = multishot;
+	return (0);
+}
+
+/* Handle one completion. */
+static void
+uring_complete(struct event_base *base, struct uringop *u,
+    const struct io_uring_cqe *cqe)
+{
+	evutil_socket_t fd = URING_UDATA_FD(cqe->user_data);
+	struct uring_fdinfo *info;
+	short ev = 0;
+
+	if (fd < 0)
+		return;
+	info = evmap_io_get_fdinfo(&base->io, fd);
+	if (info == NULL || info->gen != URING_UDATA_GEN(cqe->user_data))
+		return;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* The request is finished; ask for a new one, unless it
+		 * failed for good. */
+		info->armed = 0;
+		if (cqe->res == -EINVAL && info->multishot) {
+			u->no_multishot = 1;
+			uring_note_change(u, fd, info);
+			return;
+		}
+		if (cqe->res >= 0 || cqe->res == -ECANCELED)
+			uring_note_change(u, fd, info);
+	}
+
+	if (cqe->res == -ECANCELED)
+		return;
+	if (cqe->res < 0 || (cqe->res & (POLLHUP|POLLERR))) {
+		ev = EV_READ | EV_WRITE;
+	} else {
+		if (cqe->res & POLLIN)
+			ev |= EV_READ;
+		if (cqe->res & POLLOUT)
+			ev |= EV_WRITE;
+	}
+	if (ev)
+		evmap_io_active(base, fd, ev | EV_ET);
+}
+
+static int
+uring_dispatch(struct event_base *base, struct timeval *tv)
+{
+	struct uringop *u = base->evbase;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, to_submit, min_complete = 1;
+	int i, n, res;
+
+	/* Changes made by callbacks may add to the list as we go. */
+	n = u->n_changes;
+	for (i = 0; i < n; ++i) {
+		if (uring_apply_change(base, u, u->changes[i]) == -1)
+			return (-1);
+	}
+	if (n < u->n_changes)
+		memmove(u->changes, u->changes + n,
+		    (u->n_changes - n) * sizeof(evutil_socket_t));
+	u->n_changes -= n;
+	to_submit = event_uring_ring_publish(&u->ring);
+
+	memset(&arg, 0, sizeof(arg));
+	if (tv != NULL) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (ev_uint64_t)(uintptr_t)&ts;
+		if (!evutil_timerisset(tv))
+			min_complete = 0;
+	}
+	/* Don't sleep if there are completions waiting already. */
+	if (__atomic_load_n(u->ring.cq_tail, __ATOMIC_ACQUIRE) != *u->ring.cq_head)
+		min_complete = 0;
+
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	res = event_uring_enter(u->ring.fd, to_submit, min_complete,
+	    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	if (res == -1) {
+		if (errno == EINTR) {
+			evsig_process(base);
+		} else if (errno != ETIME && errno != EBUSY &&
+		    errno != EAGAIN) {
+			event_warn("io_uring_enter");
+			return (-1);
+		}
+	} else if (base->sig.evsig_caught) {
+		evsig_process(base);
+	}
+
+	head = *u->ring.cq_head;
+	tail = __atomic_load_n(u->ring.cq_tail, __ATOMIC_ACQUIRE);
+	event_debug(("%s: io_uring reports %u completions", __func__,
+		tail - head));
+	for (; head != tail; ++head)
+		uring_complete(base, u, &u->ring.cqes[head & *u->ring.cq_mask]);
+	__atomic_store_n(u->ring.cq_head, head, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+static void
+uring_dealloc(struct event_base *base)
+{
+	struct uringop *u = base->evbase;
+
+	evsig_dealloc(base);
+	event_uring_ring_free(&u->ring);
+	if (u->changes)
+		mm_free(u->changes);
+
+	memset(u, 0, sizeof(struct uringop));
+	mm_free(u);
+}
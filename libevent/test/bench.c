@@ -54,13 +54,28 @@
 
 #include <event.h>
 #include <evutil.h>
+#ifdef _EVENT_HAVE_PTHREADS
+#include <pthread.h>
+#include <event2/thread.h>
+#endif
 
 static int count, writes, fired;
 static int *pipes;
 static int num_pipes, num_active, num_writes;
 static struct event *events;
 
+#ifdef _EVENT_HAVE_PTHREADS
+static void *
+foreign_thread(void *arg)
+{
+	struct event *ev = arg;
 
+	/* Deleting an event that was never added does nothing, but it does
+	 * make the base notice that another thread uses it. */
+	event_del(ev);
+	return (NULL);
+}
+#endif
 
 static void
 read_cb(int fd, short which, void *arg)
@@ -126,6 +141,8 @@ main (int argc, char **argv)
 	int i, c;
 	struct timeval *tv;
 	int *cp;
+	int use_locks = 0, use_foreign = 0;
+	struct event_base *base;
 
 #ifdef WIN32
 	WSADATA WSAData;
@@ -134,7 +151,7 @@ main (int argc, char **argv)
 	num_pipes = 100;
 	num_active = 1;
 	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+	while ((c = getopt(argc, argv, "n:a:w:lf")) != -1) {
 		switch (c) {
 		case 'n':
 			num_pipes = atoi(optarg);
@@ -145,6 +162,12 @@ main (int argc, char **argv)
 		case 'w':
 			num_writes = atoi(optarg);
 			break;
+		case 'l':
+			use_locks = 1;
+			break;
+		case 'f':
+			use_foreign = 1;
+			break;
 		default:
 			fprintf(stderr, "Illegal argument \"%c\"\n", c);
 			exit(1);
@@ -166,7 +189,35 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
-	event_init();
+#ifdef _EVENT_HAVE_PTHREADS
+	if (use_locks && evthread_use_pthreads() < 0) {
+		fprintf(stderr, "Couldn't enable locking\n");
+		exit(1);
+	}
+#else
+	if (use_locks) {
+		fprintf(stderr, "Built without pthreads; can't enable locking\n");
+		exit(1);
+	}
+#endif
+
+	base = event_init();
+
+	if (use_foreign) {
+#ifdef _EVENT_HAVE_PTHREADS
+		/* Use the base from a second thread, so that the loop has to
+		 * release its lock around every callback. */
+		struct event ev;
+		pthread_t thread;
+		event_set(&ev, -1, 0, read_cb, NULL);
+		event_base_set(base, &ev);
+		pthread_create(&thread, NULL, foreign_thread, &ev);
+		pthread_join(thread, NULL);
+#else
+		fprintf(stderr, "Built without pthreads; can't use -f\n");
+		exit(1);
+#endif
+	}
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 #ifdef USE_PIPES
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark pushes data through a number of socketpairs, with a
+ * bufferevent at each end, and reports the throughput and how many times
+ * the loop waited for events.  It runs with ordinary socket bufferevents,
+ * with edge-triggered ones, and with EVENT_BASE_FLAG_STARTUP_URING so that
+ * bufferevent_socket_new() makes io_uring ones.
+ */
+
+static int n_pairs = 16;
+static size_t bytes_per_pair = 64*1024*1024;
+static size_t chunk_size = 16384;
+
+struct pair {
+	struct bufferevent *out, *in;
+	size_t n_written, n_read;
+};
+
+static struct event_base *base;
+static int n_done;
+static char *chunk;
+static unsigned long n_waits;
+
+static void
+count_wait(struct event_base *eb, void *arg)
+{
+	++n_waits;
+}
+
+static void
+writecb(struct bufferevent *bev, void *arg)
+{
+	struct pair *p = arg;
+	size_t n;
+
+	/* We're at the low watermark: queue another chunk, if there's any
+	 * left to send. */
+	if (p->n_written == bytes_per_pair)
+		return;
+	n = bytes_per_pair - p->n_written;
+	if (n > chunk_size)
+		n = chunk_size;
+	bufferevent_write(bev, chunk, n);
+	p->n_written += n;
+}
+
+static void
+readcb(struct bufferevent *bev, void *arg)
+{
+	struct pair *p = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t n = evbuffer_get_length(input);
+
+	evbuffer_drain(input, n);
+	p->n_read += n;
+	if (p->n_read == bytes_per_pair) {
+		bufferevent_disable(p->in, EV_READ);
+		bufferevent_disable(p->out, EV_WRITE);
+		if (++n_done == n_pairs)
+			event_base_loopexit(base, NULL);
+	}
+}
+
+static void
+eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	fprintf(stderr, "Unexpected event %d\n", (int)what);
+	exit(1);
+}
+
+static void
+run_once(const char *name, int flags, int options)
+{
+	struct event_config *cfg;
+	struct pair *pairs;
+	struct timeval start, end, elapsed;
+	double secs;
+	int i;
+
+	cfg = event_config_new();
+	event_config_set_flag(cfg, flags);
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (!base) {
+		fprintf(stderr, "Couldn't make an event_base\n");
+		exit(1);
+	}
+	event_base_set_poll_hooks(base, NULL, count_wait, NULL);
+
+	pairs = calloc(n_pairs, sizeof(struct pair));
+	for (i = 0; i < n_pairs; ++i) {
+		evutil_socket_t fds[2];
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		evutil_make_socket_nonblocking(fds[0]);
+		evutil_make_socket_nonblocking(fds[1]);
+		pairs[i].out = bufferevent_socket_new(base, fds[0],
+		    options|BEV_OPT_CLOSE_ON_FREE);
+		pairs[i].in = bufferevent_socket_new(base, fds[1],
+		    options|BEV_OPT_CLOSE_ON_FREE);
+		bufferevent_setcb(pairs[i].out, NULL, writecb, eventcb,
+		    &pairs[i]);
+		bufferevent_setcb(pairs[i].in, readcb, NULL, eventcb,
+		    &pairs[i]);
+		/* Keep two chunks queued: one being written, one waiting. */
+		bufferevent_setwatermark(pairs[i].out, EV_WRITE, chunk_size, 0);
+		bufferevent_enable(pairs[i].out, EV_WRITE);
+		bufferevent_enable(pairs[i].in, EV_READ);
+		writecb(pairs[i].out, &pairs[i]);
+		writecb(pairs[i].out, &pairs[i]);
+	}
+
+	n_done = 0;
+	n_waits = 0;
+	evutil_gettimeofday(&start, NULL);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+	printf("%-8s %d pairs, %8.1f MB/s, %lu waits\n", name, n_pairs,
+	    (double)bytes_per_pair * n_pairs / secs / (1024*1024), n_waits);
+
+	for (i = 0; i < n_pairs; ++i) {
+		bufferevent_free(pairs[i].out);
+		bufferevent_free(pairs[i].in);
+	}
+	free(pairs);
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:m:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_pairs = atoi(optarg);
+			break;
+		case 'm':
+			bytes_per_pair = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case 'c':
+			chunk_size = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_pairs < 1 || !bytes_per_pair || !chunk_size) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+
+	if (!(chunk = calloc(1, chunk_size)))
+		exit(1);
+
+	run_once("socket", 0, 0);
+	run_once("edge", 0, BEV_OPT_EDGE_TRIGGERED);
+	run_once("io_uring", EVENT_BASE_FLAG_STARTUP_URING, 0);
+
+	free(chunk);
+	return (0);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark copies bulk data through an evbuffer: it adds pieces
+ * until a window's worth is buffered, then removes them all into another
+ * block of memory, and repeats.  It runs with chains from malloc, and
+ * with EVBUFFER_ALLOC_HUGE_PAGES.
+ */
+
+static size_t total_size = (size_t)4096*1024*1024;
+static size_t piece_size = 64*1024;
+static size_t window_size = 64*1024*1024;
+
+static double
+elapsed_usec(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1e6 + diff.tv_usec;
+}
+
+static void
+run_once(const char *name, unsigned flags, char *src, char *dst)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct timeval start;
+	size_t n_copied = 0, n_chains = 0, n_windows = 0, mem = 0;
+	double usec;
+	int n;
+
+	if (evbuffer_set_alloc_flags(buf, flags) < 0) {
+		fprintf(stderr, "Couldn't set allocation flags\n");
+		exit(1);
+	}
+
+	evutil_gettimeofday(&start, NULL);
+	while (n_copied < total_size) {
+		while (evbuffer_get_length(buf) < window_size) {
+			if (evbuffer_add(buf, src, piece_size) < 0) {
+				fprintf(stderr, "evbuffer_add failed\n");
+				exit(1);
+			}
+		}
+		n_chains += evbuffer_peek(buf, evbuffer_get_length(buf), NULL,
+		    NULL, 0);
+		if (evbuffer_get_memory_used(buf) > mem)
+			mem = evbuffer_get_memory_used(buf);
+		++n_windows;
+		while ((n = evbuffer_remove(buf, dst, piece_size)) > 0)
+			n_copied += n;
+	}
+	usec = elapsed_usec(&start);
+
+	printf("%-8s %8.1f MB/s, %6.1f chains/window, %lu KB/window\n", name,
+	    n_copied / usec, (double)n_chains / n_windows,
+	    (unsigned long)(mem / 1024));
+	evbuffer_free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *src, *dst;
+	int c;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "m:p:w:")) != -1) {
+		switch (c) {
+		case 'm':
+			total_size = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case 'p':
+			piece_size = (size_t)atoi(optarg) * 1024;
+			break;
+		case 'w':
+			window_size = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (!total_size || !piece_size || !window_size) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+
+	if (!(src = malloc(piece_size)) || !(dst = malloc(piece_size)))
+		exit(1);
+	memset(src, 'x', piece_size);
+
+	run_once("malloc", 0, src, dst);
+	run_once("huge", EVBUFFER_ALLOC_HUGE_PAGES, src, dst);
+
+	free(src);
+	free(dst);
+	return (0);
+}
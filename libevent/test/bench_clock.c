@@ -0,0 +1,175 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures the cost of one trip around the event loop with
+ * each of the clocks an event_base can use.  Every iteration runs one
+ * callback, which reactivates itself and reschedules a timeout; so with -c
+ * (EVENT_BASE_FLAG_NO_CACHE_TIME), each iteration reads the clock twice,
+ * and otherwise once.
+ */
+
+static int n_iterations = 1000000;
+static int no_cache;
+
+static int count;
+static struct event *timeout_ev;
+
+static void
+timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static void
+loop_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event *ev = arg;
+	struct timeval tv = { 10, 0 };
+
+	event_add(timeout_ev, &tv);
+	if (++count == n_iterations)
+		event_base_loopbreak(event_get_base(ev));
+	else
+		event_active(ev, EV_READ, 1);
+}
+
+static const char *
+clock_name(enum event_base_clock_source source)
+{
+	switch (source) {
+	case EVENT_CLOCK_DEFAULT:
+		return "default";
+	case EVENT_CLOCK_COARSE:
+		return "coarse";
+	case EVENT_CLOCK_TSC:
+		return "tsc";
+	}
+	return "?";
+}
+
+static void
+run_once(enum event_base_clock_source source)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	struct event *ev;
+	struct timeval start, end, elapsed;
+	long resolution = 0, cost = 0;
+
+	cfg = event_config_new();
+	event_config_set_clock_source(cfg, source);
+	/* Go back to the backend after every callback, so that each one
+	 * costs a whole iteration of the loop. */
+	event_config_set_max_dispatch_interval(cfg, NULL, 1, 0);
+	if (no_cache)
+		event_config_set_flag(cfg, EVENT_BASE_FLAG_NO_CACHE_TIME);
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (!base) {
+		fprintf(stderr, "Couldn't make an event_base\n");
+		exit(1);
+	}
+
+	if (event_base_get_clock_source(base) != source) {
+		printf("%-8s unavailable\n", clock_name(source));
+		event_base_free(base);
+		return;
+	}
+	event_base_get_clock_info(base, &resolution, &cost);
+
+	timeout_ev = evtimer_new(base, timeout_cb, NULL);
+	ev = event_new(base, -1, 0, loop_cb, NULL);
+	event_assign(ev, base, -1, 0, loop_cb, ev);
+	count = 0;
+	event_active(ev, EV_READ, 1);
+
+	evutil_gettimeofday(&start, NULL);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	printf("%-8s resolution %8ld nsec, read %4ld nsec, "
+	    "loop %6.1f nsec/iteration\n", clock_name(source),
+	    resolution, cost,
+	    (elapsed.tv_sec * 1e9 + elapsed.tv_usec * 1e3) / n_iterations);
+
+	event_free(ev);
+	event_free(timeout_ev);
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:c")) != -1) {
+		switch (c) {
+		case 'n':
+			n_iterations = atoi(optarg);
+			break;
+		case 'c':
+			no_cache = 1;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_iterations < 1) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+
+	run_once(EVENT_CLOCK_DEFAULT);
+	run_once(EVENT_CLOCK_COARSE);
+	run_once(EVENT_CLOCK_TSC);
+
+	return (0);
+}
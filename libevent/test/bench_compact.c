@@ -0,0 +1,203 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark builds an output evbuffer the way a protocol encoder
+ * does: each message is formatted into an evbuffer of its own and then
+ * moved onto the output with evbuffer_add_buffer(), with a shared header
+ * added by reference in front of every few messages.  That leaves the
+ * output with one small chain per piece.  It then writes the output
+ * through a socketpair, and searches it, with and without
+ * evbuffer_set_compaction().
+ */
+
+static int n_messages = 200000;
+static int batch = 256;
+static size_t small_size = 512;
+static unsigned max_small = 16;
+
+static const char header[] = "HDR ";
+
+static double
+elapsed_usec(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1e6 + diff.tv_usec;
+}
+
+/* Append messages 'first' .. 'first'+'n'-1 to 'out'. */
+static void
+add_messages(struct evbuffer *out, struct evbuffer *msg, int first, int n)
+{
+	int i;
+
+	for (i = first; i < first + n; ++i) {
+		if (i % 4 == 0)
+			evbuffer_add_reference(out, header, sizeof(header) - 1,
+			    NULL, NULL);
+		evbuffer_add_printf(msg, "message %d: ok\r\n", i);
+		evbuffer_add_buffer(out, msg);
+	}
+}
+
+static void
+run_once(const char *name, int compact)
+{
+	struct evbuffer *out = evbuffer_new(), *msg = evbuffer_new();
+	struct evbuffer *in = evbuffer_new();
+	struct evbuffer_compaction_stats stats;
+	struct evbuffer_ptr pos;
+	struct timeval start;
+	evutil_socket_t fds[2];
+	unsigned long n_writes = 0, n_chains = 0, n_found = 0;
+	size_t n_bytes = 0;
+	double write_usec, search_usec = 0;
+	int i, r;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+	if (compact)
+		evbuffer_set_compaction(out, small_size, max_small);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n_messages; i += batch) {
+		add_messages(out, msg, i, batch);
+		while (evbuffer_get_length(out)) {
+			n_chains += evbuffer_peek(out,
+			    evbuffer_get_length(out), NULL, NULL, 0);
+			r = evbuffer_write(out, fds[0]);
+			++n_writes;
+			if (r < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("write");
+				exit(1);
+			}
+			while ((r = evbuffer_read(in, fds[1], 65536)) > 0) {
+				n_bytes += r;
+				evbuffer_drain(in, r);
+			}
+		}
+	}
+	write_usec = elapsed_usec(&start);
+
+	/* Now the same data, kept around to be searched. */
+	for (i = 0; i < n_messages / 10; i += batch)
+		add_messages(out, msg, i, batch);
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 10; ++i) {
+		pos = evbuffer_search(out, "9: ok", 5, NULL);
+		while (pos.pos >= 0) {
+			++n_found;
+			evbuffer_ptr_set(out, &pos, 1, EVBUFFER_PTR_ADD);
+			pos = evbuffer_search(out, "9: ok", 5, &pos);
+		}
+	}
+	search_usec = elapsed_usec(&start);
+
+	evbuffer_get_compaction_stats(out, &stats);
+	printf("%-8s write %7.1f MB/s, %6lu writes, %6.1f chains/write; "
+	    "search %7.1f MB/s (%lu found)\n", name,
+	    n_bytes / write_usec, n_writes, (double)n_chains / n_writes,
+	    evbuffer_get_length(out) * 10 / search_usec, n_found);
+	if (compact)
+		printf("         %lu compactions merged %lu chains, "
+		    "copying %lu bytes\n", (unsigned long)stats.n_compactions,
+		    (unsigned long)stats.n_chains_merged,
+		    (unsigned long)stats.n_bytes_copied);
+
+	EVUTIL_CLOSESOCKET(fds[0]);
+	EVUTIL_CLOSESOCKET(fds[1]);
+	evbuffer_free(out);
+	evbuffer_free(msg);
+	evbuffer_free(in);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:b:s:m:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_messages = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 's':
+			small_size = (size_t)atoi(optarg);
+			break;
+		case 'm':
+			max_small = (unsigned)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_messages < 1 || batch < 1 || !small_size || max_small < 2) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+
+	run_once("plain", 0);
+	run_once("compact", 1);
+
+	return (0);
+}
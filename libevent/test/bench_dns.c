@@ -0,0 +1,256 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how evdns copes with a very large number of
+ * requests in flight at once.  We run a few nameservers on the loopback
+ * interface that hold every query they get until all of them have arrived,
+ * so that the client really does have all of them outstanding at the same
+ * time; then they answer, a batch per loop iteration.
+ *
+ * Requests and answers are sent in batches so that we don't overflow the
+ * sockets' receive buffers: a dropped packet would turn into a timeout,
+ * and we'd be benchmarking that instead.
+ */
+
+#define MAX_SERVERS 16
+
+static struct event_base *base;
+static struct evdns_base *dns;
+
+static int n_requests = 65536;
+static int n_servers = 4;
+static int batch = 100;
+static int n_udp_sockets = 1;
+
+static int n_submitted, n_received, n_answered, n_done, n_failed;
+
+static struct evdns_server_request **held;
+static struct event *submit_ev, *answer_ev;
+static struct timeval tv_start, tv_sent, tv_received, tv_done;
+
+static void
+client_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	if (result != DNS_ERR_NONE)
+		++n_failed;
+	if (++n_done == n_requests) {
+		evutil_gettimeofday(&tv_done, NULL);
+		event_base_loopexit(base, NULL);
+	}
+}
+
+static void
+submit_batch_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval tv = { 0, 0 };
+	char name[64];
+	int i;
+
+	for (i = 0; i < batch && n_submitted < n_requests; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com",
+		    n_submitted++);
+		evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		    client_cb, NULL);
+	}
+	if (n_submitted < n_requests)
+		event_add(submit_ev, &tv);
+	else
+		evutil_gettimeofday(&tv_sent, NULL);
+}
+
+static void
+answer_batch_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval tv = { 0, 0 };
+	ev_uint32_t addr = htonl(0x7f000001);
+	int i;
+
+	for (i = 0; i < batch && n_answered < n_received; ++i) {
+		struct evdns_server_request *req = held[n_answered++];
+		evdns_server_request_add_a_reply(req, req->questions[0]->name,
+		    1, &addr, 3600);
+		evdns_server_request_respond(req, 0);
+	}
+	if (n_answered < n_received)
+		event_add(answer_ev, &tv);
+}
+
+static void
+server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct timeval tv = { 0, 0 };
+
+	if (n_received == n_requests) {
+		/* a retransmission; we've answered it already, or will. */
+		evdns_server_request_drop(req);
+		return;
+	}
+	held[n_received++] = req;
+	if (n_received == n_requests) {
+		evutil_gettimeofday(&tv_received, NULL);
+		event_add(answer_ev, &tv);
+	}
+}
+
+static double
+elapsed(const struct timeval *a, const struct timeval *b)
+{
+	struct timeval d;
+	evutil_timersub(b, a, &d);
+	return d.tv_sec + d.tv_usec / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evdns_server_port *ports[MAX_SERVERS];
+	evutil_socket_t socks[MAX_SERVERS];
+	struct timeval tv = { 0, 0 };
+	char buf[64];
+	int c, i;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:s:b:u:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_requests = atoi(optarg);
+			break;
+		case 's':
+			n_servers = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'u':
+			n_udp_sockets = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_requests < 1 || batch < 1 ||
+	    n_servers < 1 || n_servers > MAX_SERVERS) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+	if (n_requests > 65535 * n_servers) {
+		/* The servers would wait forever for requests that can't be */
+		/* sent until they answer some. */
+		fprintf(stderr, "At most 65535 requests per nameserver\n");
+		exit(1);
+	}
+
+	held = calloc(n_requests, sizeof(*held));
+	base = event_base_new();
+	dns = evdns_base_new(base, 0);
+	if (!held || !base || !dns) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n_servers; ++i) {
+		struct sockaddr_in sin;
+		ev_socklen_t slen = sizeof(sin);
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(0x7f000001);
+		socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (socks[i] < 0 ||
+		    bind(socks[i], (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		    getsockname(socks[i], (struct sockaddr *)&sin, &slen) < 0) {
+			perror("socket");
+			exit(1);
+		}
+		evutil_make_socket_nonblocking(socks[i]);
+		ports[i] = evdns_add_server_port_with_base(base, socks[i], 0,
+		    server_cb, NULL);
+		evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d",
+		    (int)ntohs(sin.sin_port));
+		evdns_base_nameserver_ip_add(dns, buf);
+	}
+
+	evutil_snprintf(buf, sizeof(buf), "%d", n_requests);
+	evdns_base_set_option(dns, "max-inflight:", buf, DNS_OPTION_MISC);
+	evutil_snprintf(buf, sizeof(buf), "%d", n_udp_sockets);
+	evdns_base_set_option(dns, "udp-sockets:", buf, DNS_OPTION_MISC);
+	evdns_base_set_option(dns, "timeout:", "60", DNS_OPTION_MISC);
+
+	submit_ev = evtimer_new(base, submit_batch_cb, NULL);
+	answer_ev = evtimer_new(base, answer_batch_cb, NULL);
+
+	evutil_gettimeofday(&tv_start, NULL);
+	event_add(submit_ev, &tv);
+	event_base_dispatch(base);
+
+	printf("%d requests to %d nameservers, %d failed\n",
+	    n_requests, n_servers, n_failed);
+	printf("  submit:  %.3f sec\n", elapsed(&tv_start, &tv_sent));
+	printf("  receive: %.3f sec\n", elapsed(&tv_start, &tv_received));
+	printf("  answer:  %.3f sec\n", elapsed(&tv_received, &tv_done));
+	printf("  total:   %.3f sec\n", elapsed(&tv_start, &tv_done));
+
+	evdns_base_free(dns, 0);
+	for (i = 0; i < n_servers; ++i)
+		evdns_close_server_port(ports[i]);
+	event_free(submit_ev);
+	event_free(answer_ev);
+	event_base_free(base);
+	free(held);
+
+	return (0);
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event-config.h"
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark fills an evbuffer with HTTP requests, in chains the size
+ * of TCP segments, and times the searches that parsing them does: finding
+ * each line's end, finding the blank line after each header block, and
+ * finding a multipart boundary in a request body.
+ */
+
+static int n_requests = 2000;
+static int n_iterations = 20;
+static size_t segment_size = 1448;
+
+static const char request[] =
+    "GET /images/logo-2009-small.png?session=8a7d2f3e HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; U; Linux x86_64; en-US; rv:1.9.1.5) "
+    "Gecko/20091109 Firefox/3.5.5\r\n"
+    "Accept: image/png,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-us,en;q=0.5\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.7\r\n"
+    "Keep-Alive: 300\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://www.example.com/news/2009/12/index.html\r\n"
+    "Cookie: __utma=12345678.1234567890.1234567890.1234567890.1234567890.1; "
+    "__utmz=12345678.1234567890.1.1.utmcsr=(direct)|utmccn=(direct)\r\n"
+    "If-Modified-Since: Tue, 01 Dec 2009 10:32:15 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char boundary[] = "\r\n-----------------------------7d93b2e1a0b4c";
+
+/* Add the 'len' bytes at 'data' to 'buf', one segment per chain. */
+static void
+add_segments(struct evbuffer *buf, const char *data, size_t len)
+{
+	struct evbuffer *tmp = evbuffer_new();
+
+	while (len) {
+		size_t n = len < segment_size ? len : segment_size;
+		evbuffer_add(tmp, data, n);
+		evbuffer_add_buffer(buf, tmp);
+		data += n;
+		len -= n;
+	}
+	evbuffer_free(tmp);
+}
+
+static double
+elapsed_usec(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1e6 + diff.tv_usec;
+}
+
+static void
+report(const char *name, double usec, size_t n_bytes, long n_found)
+{
+	printf("%-10s %8.1f MB/s  (%ld found)\n", name,
+	    n_bytes / usec, n_found);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evbuffer *headers, *body;
+	struct evbuffer_ptr pos;
+	struct timeval start;
+	size_t eol_len, body_len;
+	char *data;
+	long n_found;
+	int c, i;
+
+#ifdef WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:i:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_requests = atoi(optarg);
+			break;
+		case 'i':
+			n_iterations = atoi(optarg);
+			break;
+		case 's':
+			segment_size = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_requests < 1 || n_iterations < 1 || !segment_size) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(1);
+	}
+
+	/* Header blocks, back to back, as a pipelining client sends them. */
+	data = malloc((sizeof(request) - 1) * n_requests);
+	if (!data)
+		exit(1);
+	for (i = 0; i < n_requests; ++i)
+		memcpy(data + i * (sizeof(request) - 1), request,
+		    sizeof(request) - 1);
+	headers = evbuffer_new();
+	add_segments(headers, data, (sizeof(request) - 1) * n_requests);
+	free(data);
+
+	/* A form upload: printable junk, with a boundary every 64k. */
+	body_len = 16 * 65536;
+	data = malloc(body_len);
+	if (!data)
+		exit(1);
+	for (i = 0; i < (int)body_len; ++i)
+		data[i] = 33 + (i * 7 + (i >> 9)) % 90;
+	for (i = 65536 - sizeof(boundary); i < (int)body_len;
+	     i += 65536)
+		memcpy(data + i, boundary, sizeof(boundary) - 1);
+	body = evbuffer_new();
+	add_segments(body, data, body_len);
+	free(data);
+
+	evutil_gettimeofday(&start, NULL);
+	for (n_found = 0, i = 0; i < n_iterations; ++i) {
+		pos = evbuffer_search_eol(headers, NULL, &eol_len,
+		    EVBUFFER_EOL_CRLF);
+		while (pos.pos >= 0) {
+			++n_found;
+			evbuffer_ptr_set(headers, &pos, eol_len,
+			    EVBUFFER_PTR_ADD);
+			pos = evbuffer_search_eol(headers, &pos, &eol_len,
+			    EVBUFFER_EOL_CRLF);
+		}
+	}
+	report("eol", elapsed_usec(&start),
+	    evbuffer_get_length(headers) * n_iterations, n_found);
+
+	evutil_gettimeofday(&start, NULL);
+	for (n_found = 0, i = 0; i < n_iterations; ++i) {
+		pos = evbuffer_search(headers, "\r\n\r\n", 4, NULL);
+		while (pos.pos >= 0) {
+			++n_found;
+			evbuffer_ptr_set(headers, &pos, 4, EVBUFFER_PTR_ADD);
+			pos = evbuffer_search(headers, "\r\n\r\n", 4, &pos);
+		}
+	}
+	report("headers", elapsed_usec(&start),
+	    evbuffer_get_length(headers) * n_iterations, n_found);
+
+	evutil_gettimeofday(&start, NULL);
+	for (n_found = 0, i = 0; i < n_iterations; ++i) {
+		pos = evbuffer_search(body, boundary, sizeof(boundary) - 1,
+		    NULL);
+		while (pos.pos >= 0) {
+			++n_found;
+			evbuffer_ptr_set(body, &pos, 1, EVBUFFER_PTR_ADD);
+			pos = evbuffer_search(body, boundary,
+			    sizeof(boundary) - 1, &pos);
+		}
+	}
+	report("boundary", elapsed_usec(&start),
+	    evbuffer_get_length(body) * n_iterations, n_found);
+
+	evbuffer_free(headers);
+	evbuffer_free(body);
+	return (0);
+}
@@ -44,6 +44,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #endif
 #include <fcntl.h>
 #include <signal.h>
@@ -1077,6 +1078,442 @@ end:
 	event_del(&ev1);
 }
 
+/* Records the order in which the callbacks in the dispatch tests run. */
+static int dispatch_order[32];
+static int n_dispatched;
+
+static void
+dispatch_record_cb(evutil_socket_t fd, short what, void *arg)
+{
+	if (n_dispatched < 32)
+		dispatch_order[n_dispatched++] = (int)(intptr_t)arg;
+}
+
+static void
+dispatch_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+	/* The urgent event won't notice this until the loop polls again. */
+	write(fd, "x", 1);
+	dispatch_record_cb(fd, what, arg);
+}
+
+static void
+dispatch_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	char c;
+	read(fd, &c, 1);
+	dispatch_record_cb(fd, what, arg);
+}
+
+/* Runs eight callbacks at priority 1; the first one makes an urgent event
+ * at priority 0 ready.  Returns the position at which the urgent event
+ * ran. */
+static int
+run_dispatch_limit_test(struct event_base *base, evutil_socket_t *pair)
+{
+	struct event urgent, ev[8];
+	int i, pos = -1;
+
+	n_dispatched = 0;
+	tt_int_op(event_base_priority_init(base, 2), ==, 0);
+	event_assign(&urgent, base, pair[1], EV_READ, dispatch_read_cb,
+	    (void*)(intptr_t)100);
+	event_priority_set(&urgent, 0);
+	event_add(&urgent, NULL);
+	for (i = 0; i < 8; ++i) {
+		event_assign(&ev[i], base, i ? -1 : pair[0], 0,
+		    i ? dispatch_record_cb : dispatch_write_cb,
+		    (void*)(intptr_t)i);
+		event_priority_set(&ev[i], 1);
+		event_active(&ev[i], EV_READ, 1);
+	}
+
+	event_base_dispatch(base);
+
+	tt_int_op(n_dispatched, ==, 9);
+	for (i = 0; i < n_dispatched; ++i)
+		if (dispatch_order[i] == 100)
+			pos = i;
+end:
+	return pos;
+}
+
+static void
+test_max_dispatch(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct timeval tv = { 0, 0 };
+
+	/* Without a limit, the whole priority-1 queue runs first. */
+	tt_int_op(run_dispatch_limit_test(data->base, data->pair), ==, 8);
+
+	/* With at most 2 callbacks per pass, the loop polls after the
+	 * second one and finds the urgent event. */
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, NULL, 2, 0),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_int_op(run_dispatch_limit_test(base, data->pair), ==, 2);
+	event_base_free(base);
+	event_config_free(cfg);
+
+	/* With a zero time slice, the loop polls after every callback. */
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, &tv, -1, 0),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_int_op(run_dispatch_limit_test(base, data->pair), ==, 1);
+
+	/* Callbacks at priorities below min_priority aren't limited. */
+	event_base_free(base);
+	event_config_free(cfg);
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, &tv, 1, 2),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_int_op(run_dispatch_limit_test(base, data->pair), ==, 8);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static int flood_count;
+
+static void
+dispatch_flood_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event *ev = arg;
+	dispatch_record_cb(fd, what, (void*)(intptr_t)0);
+	if (++flood_count < 20)
+		event_active(ev, EV_READ, 1);
+}
+
+static void
+test_priority_weights(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event flood, other;
+	const int weights[] = { 3, 1 };
+	const int bad_weights[] = { 1, 0 };
+	int i;
+
+	tt_int_op(event_base_priority_init(base, 2), ==, 0);
+	tt_int_op(event_base_priority_set_weights(base, bad_weights), ==, -1);
+
+	/* Without weights, a priority-0 event that keeps reactivating
+	 * itself starves priority 1 completely. */
+	for (i = 0; i < 2; ++i) {
+		n_dispatched = flood_count = 0;
+		event_assign(&flood, base, -1, 0, dispatch_flood_cb, &flood);
+		event_assign(&other, base, -1, 0, dispatch_record_cb,
+		    (void*)(intptr_t)1);
+		event_priority_set(&flood, 0);
+		event_priority_set(&other, 1);
+		event_active(&flood, EV_READ, 1);
+		event_active(&other, EV_READ, 1);
+
+		event_base_dispatch(base);
+
+		tt_int_op(n_dispatched, ==, 21);
+		if (i == 0) {
+			tt_int_op(dispatch_order[20], ==, 1);
+			tt_int_op(event_base_priority_set_weights(base,
+				weights), ==, 0);
+		} else {
+			/* With weights 3:1, it gets a turn after three. */
+			tt_int_op(dispatch_order[3], ==, 1);
+		}
+	}
+
+	/* Clearing the weights restores strict priorities. */
+	tt_int_op(event_base_priority_set_weights(base, NULL), ==, 0);
+	n_dispatched = flood_count = 0;
+	event_active(&flood, EV_READ, 1);
+	event_active(&other, EV_READ, 1);
+	event_base_dispatch(base);
+	tt_int_op(dispatch_order[20], ==, 1);
+
+end:
+	;
+}
+
+static void
+clock_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval *fired = arg;
+	evutil_gettimeofday(fired, NULL);
+}
+
+static void
+test_clock_source(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev;
+	struct timeval tv = { 0, 100000 }, start, fired, elapsed;
+	long resolution, cost;
+	int source, got;
+
+	for (source = EVENT_CLOCK_DEFAULT; source <= EVENT_CLOCK_TSC;
+	     ++source) {
+		cfg = event_config_new();
+		tt_assert(cfg);
+		tt_int_op(event_config_set_clock_source(cfg, source), ==, 0);
+		base = event_base_new_with_config(cfg);
+		tt_assert(base);
+
+		/* We get the clock we asked for, or the default one. */
+		got = event_base_get_clock_source(base);
+		if (got != source)
+			tt_int_op(got, ==, EVENT_CLOCK_DEFAULT);
+
+		resolution = cost = -1;
+		tt_int_op(event_base_get_clock_info(base, &resolution,
+			&cost), ==, 0);
+		tt_int_op(resolution, >, 0);
+		tt_int_op(cost, >=, 0);
+
+		/* Whatever the clock, timeouts should fire about on time. */
+		evtimer_assign(&ev, base, clock_timeout_cb, &fired);
+		evutil_gettimeofday(&start, NULL);
+		event_add(&ev, &tv);
+		event_base_dispatch(base);
+		evutil_timersub(&fired, &start, &elapsed);
+		tt_int_op(elapsed.tv_sec, ==, 0);
+		tt_int_op(elapsed.tv_usec, >=, 80000);
+
+		event_base_free(base);
+		base = NULL;
+		event_config_free(cfg);
+		cfg = NULL;
+	}
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static int precise_count;
+
+static void
+precise_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event *ev = arg;
+	struct timeval tv = { 0, 200 };
+
+	if (++precise_count < 20)
+		event_add(ev, &tv);
+}
+
+/* Run twenty 200-usec timeouts in a row on base, and return how many
+ * usec they took, or -1 if they didn't all run. */
+static long
+precise_timer_run(struct event_base *base)
+{
+	struct event ev;
+	struct timeval tv = { 0, 200 }, start, end, elapsed;
+
+	precise_count = 0;
+	evtimer_assign(&ev, base, precise_timer_cb, &ev);
+	evutil_gettimeofday(&start, NULL);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	if (precise_count != 20)
+		return -1;
+	return elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+}
+
+static void
+test_precise_timer(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	long elapsed, best = -1;
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	if (strcmp(event_base_get_method(base), "epoll"))
+		tt_skip();
+
+	/* Rounded up to a millisecond each, the twenty timeouts would take
+	 * at least 20 msec; done precisely, they take about 4.  None may
+	 * ever fire early.  So that one slow run on a loaded machine can't
+	 * fail the test, we judge precision by the best of three. */
+	for (i = 0; i < 3; ++i) {
+		elapsed = precise_timer_run(base);
+		tt_int_op(elapsed, >=, 4000);
+		if (best < 0 || elapsed < best)
+			best = elapsed;
+	}
+	tt_int_op(best, <, 15000);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static int n_before_poll, n_after_poll, n_slow;
+static void *slow_cb_arg;
+
+static void
+stats_before_poll(struct event_base *base, void *arg)
+{
+	++n_before_poll;
+}
+
+static void
+stats_after_poll(struct event_base *base, void *arg)
+{
+	++n_after_poll;
+}
+
+static void
+stats_slow_cb(struct event_base *base,
+    void (*cb)(evutil_socket_t, short, void *), void *cb_arg,
+    const struct timeval *duration, void *arg)
+{
+	++n_slow;
+	slow_cb_arg = cb_arg;
+}
+
+static void
+stats_busy_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval start, now, elapsed;
+
+	/* Take a bit over 3 msec. */
+	evutil_gettimeofday(&start, NULL);
+	do {
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &start, &elapsed);
+	} while (elapsed.tv_sec == 0 && elapsed.tv_usec < 3000);
+}
+
+/* Fails every allocation after the first n_mallocs_left. */
+static int n_mallocs_left;
+
+static void *
+failing_after_malloc(size_t sz)
+{
+	if (n_mallocs_left-- <= 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return malloc(sz);
+}
+
+static void
+test_base_stats(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event_base *other = NULL;
+	struct event_base_stats stats;
+	struct event busy, quick, timer;
+	struct timeval tv = { 0, 10000 }, threshold = { 0, 2000 };
+	ev_uint64_t n;
+	int i, total;
+
+	tt_int_op(event_base_priority_init(base, 2), ==, 0);
+	tt_int_op(event_base_collect_stats(base, 1), ==, 0);
+	tt_int_op(event_base_set_poll_hooks(base, stats_before_poll,
+		stats_after_poll, NULL), ==, 0);
+	tt_int_op(event_base_set_slow_callback_hook(base, &threshold,
+		stats_slow_cb, NULL), ==, 0);
+
+	event_assign(&busy, base, -1, 0, stats_busy_cb, &busy);
+	event_assign(&quick, base, -1, 0, dummy_read_cb, &quick);
+	event_priority_set(&busy, 1);
+	event_priority_set(&quick, 0);
+	evtimer_assign(&timer, base, dummy_read_cb, &timer);
+	event_active(&busy, EV_READ, 1);
+	event_active(&quick, EV_READ, 1);
+	event_add(&timer, &tv);
+
+	event_base_dispatch(base);
+
+	/* Only the busy callback was slow. */
+	tt_int_op(n_slow, ==, 1);
+	tt_ptr_op(slow_cb_arg, ==, &busy);
+	tt_int_op(n_before_poll, >=, 2);
+	tt_int_op(n_after_poll, ==, n_before_poll);
+
+	tt_int_op(event_base_get_stats(base, &stats), ==, 0);
+	tt_int_op(stats.n_polls, ==, n_after_poll);
+	tt_int_op(stats.n_callbacks, ==, 3);
+	tt_int_op(stats.max_callback_usec, >=, 3000);
+	tt_int_op(stats.callback_usec, >=, stats.max_callback_usec);
+	tt_int_op(stats.n_timeouts, ==, 1);
+	/* The timer was pending while the loop waited for it. */
+	tt_int_op(stats.poll_usec, >=, 5000);
+
+	for (i = total = 0; i < EVENT_STATS_N_BUCKETS; ++i)
+		total += (int)stats.callback_hist[i];
+	tt_int_op(total, ==, 3);
+	for (i = total = 0; i < EVENT_STATS_N_BUCKETS; ++i)
+		total += (int)stats.poll_hist[i];
+	tt_int_op(total, ==, stats.n_polls);
+	for (i = total = 0; i < EVENT_STATS_N_BUCKETS; ++i)
+		total += (int)stats.lateness_hist[i];
+	tt_int_op(total, ==, 1);
+
+	tt_int_op(event_base_get_priority_stats(base, 0, &n), ==, 0);
+	tt_int_op(n, ==, 1);
+	tt_int_op(event_base_get_priority_stats(base, 1, &n), ==, 0);
+	tt_int_op(n, ==, 2);
+	tt_int_op(event_base_get_priority_stats(base, 2, &n), ==, -1);
+
+	/* Once we stop collecting, the numbers stay put. */
+	tt_int_op(event_base_collect_stats(base, 0), ==, 0);
+	event_active(&quick, EV_READ, 1);
+	event_base_dispatch(base);
+	tt_int_op(event_base_get_stats(base, &stats), ==, 0);
+	tt_int_op(stats.n_callbacks, ==, 3);
+
+	event_base_reset_stats(base);
+	tt_int_op(event_base_get_stats(base, &stats), ==, 0);
+	tt_int_op(stats.n_callbacks, ==, 0);
+	tt_int_op(event_base_get_priority_stats(base, 1, &n), ==, 0);
+	tt_int_op(n, ==, 0);
+
+	/* If we can get the queues but not their counters, we must not
+	 * leave the freed queues behind for event_base_free(). */
+	other = event_base_new();
+	tt_assert(other);
+	n_mallocs_left = 1;
+	event_set_mem_functions(failing_after_malloc, realloc, free);
+	i = event_base_priority_init(other, 3);
+	event_set_mem_functions(malloc, realloc, free);
+	tt_int_op(i, ==, -1);
+
+end:
+	if (other)
+		event_base_free(other);
+}
+
 static void
 test_bad_assign(void *ptr)
 {
@@ -1567,6 +2004,57 @@ end:
 	evbuffer_free(tmp);
 }
 
+/* Decode from a buffer with every byte in a chain of its own, and check
+ * that decoding never gathers the bytes up into one chain. */
+static void
+evtag_scattered_test(void *ptr)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *scattered = evbuffer_new();
+	struct evbuffer *one = evbuffer_new();
+	ev_uint32_t integers[TEST_MAX_INT] = {
+		0xaf0, 0x1000, 0x1, 0xdeadbeef, 0x00, 0xbef000
+	};
+	ev_uint32_t integer, tag;
+	ev_uint64_t big_int;
+	int i, n_chains;
+
+	evtag_init();
+
+	for (i = 0; i < TEST_MAX_INT; i++) {
+		evtag_encode_tag(tmp, integers[i]);
+		evtag_encode_int(tmp, integers[i]);
+		big_int = integers[i];
+		big_int *= 1000000000; /* 1 billion */
+		evtag_encode_int64(tmp, big_int);
+	}
+	while (EVBUFFER_LENGTH(tmp)) {
+		evbuffer_remove_buffer(tmp, one, 1);
+		evbuffer_add_buffer(scattered, one);
+	}
+	n_chains = evbuffer_peek(scattered, EVBUFFER_LENGTH(scattered), NULL,
+	    NULL, 0);
+	tt_int_op(n_chains, ==, EVBUFFER_LENGTH(scattered));
+
+	for (i = 0; i < TEST_MAX_INT; i++) {
+		tt_int_op(evtag_decode_tag(&tag, scattered), !=, -1);
+		tt_uint_op(tag, ==, integers[i]);
+		tt_int_op(evtag_decode_int(&integer, scattered), !=, -1);
+		tt_uint_op(integer, ==, integers[i]);
+		tt_int_op(evtag_decode_int64(&big_int, scattered), !=, -1);
+		tt_assert((big_int / 1000000000) == integers[i]);
+		n_chains = evbuffer_peek(scattered, EVBUFFER_LENGTH(scattered),
+		    NULL, NULL, 0);
+		tt_int_op(n_chains, ==, EVBUFFER_LENGTH(scattered));
+	}
+
+	tt_uint_op(EVBUFFER_LENGTH(scattered), ==, 0);
+end:
+	evbuffer_free(tmp);
+	evbuffer_free(scattered);
+	evbuffer_free(one);
+}
+
 static void
 evtag_test_peek(void *ptr)
 {
@@ -1593,6 +2081,66 @@ end:
 	evbuffer_free(tmp);
 }
 
+static void
+evtag_test_checked(void *ptr)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *payload = evbuffer_new();
+	struct evbuffer *out = evbuffer_new();
+	struct evbuffer_ptr pos;
+	char buf[32];
+	ev_uint32_t tag;
+	unsigned char *p;
+
+	evtag_marshal_checked(tmp, 10, "Hello world", 11);
+	evbuffer_add_reference(payload, "Hello ", 6, NULL, NULL);
+	evbuffer_add_reference(payload, "again", 5, NULL, NULL);
+	evtag_marshal_buffer_checked(tmp, 20, payload);
+	tt_int_op(evbuffer_get_length(payload), ==, 0);
+	evtag_marshal_checked(tmp, 30, "Goodbye", 7);
+	evtag_marshal_string(tmp, 40, "no");
+
+	/* Both tags come back whole. */
+	tt_int_op(evtag_unmarshal_checked(tmp, &tag, out), ==, 11);
+	tt_uint_op(tag, ==, 10);
+	tt_int_op(evbuffer_get_length(out), ==, 11);
+	evbuffer_remove(out, buf, 11);
+	tt_assert(!memcmp(buf, "Hello world", 11));
+
+	tt_int_op(evtag_unmarshal_checked(tmp, &tag, out), ==, 11);
+	tt_uint_op(tag, ==, 20);
+	evbuffer_remove(out, buf, 11);
+	tt_assert(!memcmp(buf, "Hello again", 11));
+
+	/* Damage one byte of the third: it is skipped, and we can go on to
+	 * the fourth. */
+	tt_int_op(evtag_payload_length(tmp, &tag), ==, 0);
+	tt_uint_op(tag, ==, 7 + 4);
+	evbuffer_ptr_set(tmp, &pos, 2 + 3, EVBUFFER_PTR_SET);
+	p = evbuffer_pullup(tmp, -1);
+	p[pos.pos] ^= 0x20;
+	tt_int_op(evtag_unmarshal_checked(tmp, &tag, out), ==, -1);
+	tt_int_op(evbuffer_get_length(out), ==, 0);
+	tt_int_op(evtag_peek(tmp, &tag), ==, 1);
+	tt_uint_op(tag, ==, 40);
+
+	/* A tag too short to hold a CRC is rejected too, without eating
+	 * into the tag after it. */
+	evtag_marshal_checked(tmp, 50, "Last", 4);
+	tt_int_op(evtag_unmarshal_checked(tmp, &tag, out), ==, -1);
+	tt_int_op(evbuffer_get_length(out), ==, 0);
+	tt_int_op(evtag_unmarshal_checked(tmp, &tag, out), ==, 4);
+	tt_uint_op(tag, ==, 50);
+	evbuffer_remove(out, buf, 4);
+	tt_assert(!memcmp(buf, "Last", 4));
+	tt_int_op(evbuffer_get_length(tmp), ==, 0);
+
+end:
+	evbuffer_free(tmp);
+	evbuffer_free(payload);
+	evbuffer_free(out);
+}
+
 
 
 static void
@@ -1968,6 +2516,200 @@ end:
 #undef MANY
 }
 
+static void
+test_batch_add_del(void *arg)
+{
+	/* Add a read and a write event for each of a bunch of socketpairs,
+	 * and a timer, all in one batch; then take them away again. */
+#define N_PAIRS 32
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	evutil_socket_t pairs[N_PAIRS][2];
+	struct event *evs[2*N_PAIRS + 1];
+	struct event *dup[3];
+	int called[2*N_PAIRS + 1];
+	struct timeval tv = { 0, 1 };
+	int i;
+
+	memset(pairs, 0xff, sizeof(pairs));
+	memset(evs, 0, sizeof(evs));
+	memset(called, 0, sizeof(called));
+
+	for (i = 0; i < N_PAIRS; ++i) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]),
+		    ==, 0);
+		/* Only the even pairs have anything to read. */
+		if (!(i & 1))
+			tt_int_op(send(pairs[i][1], "x", 1, 0), ==, 1);
+		evs[2*i] = event_new(base, pairs[i][0], EV_READ,
+		    many_event_cb, &called[2*i]);
+		evs[2*i+1] = event_new(base, pairs[i][0], EV_WRITE,
+		    many_event_cb, &called[2*i+1]);
+	}
+	evs[2*N_PAIRS] = evtimer_new(base, many_event_cb, &called[2*N_PAIRS]);
+
+	tt_int_op(event_add_batch(evs, 2*N_PAIRS, NULL), ==, 0);
+	tt_int_op(event_add_batch(evs + 2*N_PAIRS, 1, &tv), ==, 0);
+	for (i = 0; i < 2*N_PAIRS + 1; ++i)
+		tt_assert(event_pending(evs[i], EV_READ|EV_WRITE|EV_TIMEOUT,
+			NULL));
+
+	tv.tv_usec = 10000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	for (i = 0; i < N_PAIRS; ++i) {
+		tt_int_op(called[2*i], ==, (i & 1) ? 0 : 1);
+		tt_int_op(called[2*i+1], ==, 1);
+	}
+	tt_int_op(called[2*N_PAIRS], ==, 1);
+
+	/* The odd read events are still there; a duplicate in the array
+	 * mustn't register anything twice. */
+	dup[0] = evs[0];
+	dup[1] = evs[0];
+	dup[2] = evs[1];
+	tt_int_op(event_add_batch(dup, 3, NULL), ==, 0);
+	tt_assert(event_pending(evs[0], EV_READ, NULL));
+	tt_assert(event_pending(evs[1], EV_WRITE, NULL));
+
+	tt_int_op(event_del_batch(evs, 2*N_PAIRS + 1), ==, 0);
+	for (i = 0; i < 2*N_PAIRS + 1; ++i)
+		tt_assert(!event_pending(evs[i], EV_READ|EV_WRITE|EV_TIMEOUT,
+			NULL));
+
+	/* Nothing left to wait for. */
+	memset(called, 0, sizeof(called));
+	tt_int_op(event_base_loop(base, EVLOOP_NONBLOCK), ==, 1);
+	for (i = 0; i < 2*N_PAIRS + 1; ++i)
+		tt_int_op(called[i], ==, 0);
+
+end:
+	for (i = 0; i < 2*N_PAIRS + 1; ++i) {
+		if (evs[i])
+			event_free(evs[i]);
+	}
+	for (i = 0; i < N_PAIRS; ++i) {
+		if (pairs[i][0] >= 0)
+			EVUTIL_CLOSESOCKET(pairs[i][0]);
+		if (pairs[i][1] >= 0)
+			EVUTIL_CLOSESOCKET(pairs[i][1]);
+	}
+#undef N_PAIRS
+}
+
+#ifndef WIN32
+static void
+test_fd_table_grow(void *arg)
+{
+	/* Add events on some low fds, then one on a high fd so that the
+	 * fd table has to grow, and make sure the low ones still work. */
+#define N_PAIRS 4
+#define HIGH_FD 900
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	evutil_socket_t pairs[N_PAIRS][2];
+	struct event *evs[N_PAIRS + 1];
+	int called[N_PAIRS + 1];
+	struct timeval tv = { 0, 10000 };
+	int high = -1, i;
+
+	memset(pairs, 0xff, sizeof(pairs));
+	memset(evs, 0, sizeof(evs));
+	memset(called, 0, sizeof(called));
+
+	for (i = 0; i < N_PAIRS; ++i) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]),
+		    ==, 0);
+		evs[i] = event_new(base, pairs[i][0], EV_READ,
+		    many_event_cb, &called[i]);
+		tt_int_op(event_add(evs[i], NULL), ==, 0);
+	}
+
+	high = dup2(pairs[0][1], HIGH_FD);
+	tt_int_op(high, ==, HIGH_FD);
+	evs[N_PAIRS] = event_new(base, high, EV_READ, many_event_cb,
+	    &called[N_PAIRS]);
+	tt_int_op(event_add(evs[N_PAIRS], NULL), ==, 0);
+
+	for (i = 0; i < N_PAIRS; ++i)
+		tt_int_op(send(pairs[i][1], "x", 1, 0), ==, 1);
+	tt_int_op(send(pairs[0][0], "x", 1, 0), ==, 1);
+
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	for (i = 0; i < N_PAIRS + 1; ++i)
+		tt_int_op(called[i], ==, 1);
+
+	/* Once more, and take them away again. */
+	for (i = 0; i < N_PAIRS + 1; ++i)
+		tt_int_op(event_add(evs[i], NULL), ==, 0);
+	for (i = 0; i < N_PAIRS + 1; ++i)
+		tt_int_op(event_del(evs[i]), ==, 0);
+	tt_int_op(event_base_loop(base, EVLOOP_NONBLOCK), ==, 1);
+	for (i = 0; i < N_PAIRS + 1; ++i)
+		tt_int_op(called[i], ==, 1);
+
+end:
+	for (i = 0; i < N_PAIRS + 1; ++i) {
+		if (evs[i])
+			event_free(evs[i]);
+	}
+	for (i = 0; i < N_PAIRS; ++i) {
+		if (pairs[i][0] >= 0)
+			EVUTIL_CLOSESOCKET(pairs[i][0]);
+		if (pairs[i][1] >= 0)
+			EVUTIL_CLOSESOCKET(pairs[i][1]);
+	}
+	if (high >= 0)
+		close(high);
+#undef N_PAIRS
+#undef HIGH_FD
+}
+#endif
+
+/* Once event_del() returns, the backend mustn't be holding on to the fd:
+ * a socket that's deleted and closed can be replaced on the same port
+ * right away. */
+static void
+test_del_close_rebind(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct event *ev = NULL;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t fd = -1;
+	int called = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fd >= 0);
+	tt_int_op(bind(fd, (struct sockaddr*)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(getsockname(fd, (struct sockaddr*)&sin, &slen), ==, 0);
+
+	ev = event_new(base, fd, EV_READ|EV_PERSIST, many_event_cb, &called);
+	tt_int_op(event_add(ev, NULL), ==, 0);
+	/* Let the backend start watching the fd. */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_free(ev);
+	ev = NULL;
+	EVUTIL_CLOSESOCKET(fd);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fd >= 0);
+	if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+		tt_abort_perror("rebind");
+	tt_int_op(called, ==, 0);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (fd >= 0)
+		EVUTIL_CLOSESOCKET(fd);
+}
+
 struct testcase_t main_testcases[] = {
         /* Some converted-over tests */
         { "methods", test_methods, TT_FORK, NULL, NULL },
@@ -1981,6 +2723,11 @@ struct testcase_t main_testcases[] = {
 	BASIC(manipulate_active_events, TT_FORK|TT_NEED_BASE),
 
 	BASIC(bad_assign, TT_FORK|TT_NEED_BASE|TT_NO_LOGS),
+	BASIC(max_dispatch, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
+	BASIC(priority_weights, TT_FORK|TT_NEED_BASE),
+	BASIC(clock_source, TT_FORK),
+	BASIC(precise_timer, TT_FORK),
+	BASIC(base_stats, TT_FORK|TT_NEED_BASE),
 
         /* These are still using the old API */
         LEGACY(persistent_timeout, TT_FORK|TT_NEED_BASE),
@@ -2007,6 +2754,11 @@ struct testcase_t main_testcases[] = {
 	  NULL },
 	{ "mm_functions", test_mm_functions, TT_FORK, NULL, NULL },
 	BASIC(many_events, TT_ISOLATED),
+	BASIC(batch_add_del, TT_FORK|TT_NEED_BASE),
+#ifndef WIN32
+	BASIC(fd_table_grow, TT_FORK|TT_NEED_BASE),
+#endif
+	BASIC(del_close_rebind, TT_FORK|TT_NEED_BASE),
 
 #ifndef WIN32
         LEGACY(fork, TT_ISOLATED),
@@ -2018,7 +2770,9 @@ struct testcase_t evtag_testcases[] = {
 	{ "int", evtag_int_test, TT_FORK, NULL, NULL },
 	{ "fuzz", evtag_fuzz, TT_FORK, NULL, NULL },
 	{ "encoding", evtag_tag_encoding, TT_FORK, NULL, NULL },
+	{ "scattered", evtag_scattered_test, TT_FORK, NULL, NULL },
 	{ "peek", evtag_test_peek, 0, NULL, NULL },
+	{ "checked", evtag_test_checked, 0, NULL, NULL },
 
 	END_OF_TESTCASES
 };
@@ -39,6 +39,7 @@ extern struct testcase_t evtag_testcases[];
 extern struct testcase_t evbuffer_testcases[];
 extern struct testcase_t bufferevent_testcases[];
 extern struct testcase_t bufferevent_iocp_testcases[];
+extern struct testcase_t bufferevent_uring_testcases[];
 extern struct testcase_t util_testcases[];
 extern struct testcase_t signal_testcases[];
 extern struct testcase_t http_testcases[];
@@ -52,6 +53,8 @@ extern struct testcase_t listener_testcases[];
 extern struct testcase_t listener_iocp_testcases[];
 
 void regress_threads(void *);
+void regress_threads_del_wait(void *);
+void regress_threads_cb_wait(void *);
 void test_bufferevent_zlib(void *);
 
 /* Helpers to wrap old testcases */
@@ -86,6 +89,7 @@ void run_legacy_test_fn(void *ptr);
 #define TT_NO_LOGS           (TT_FIRST_USER_FLAG<<5)
 #define TT_ENABLE_IOCP_FLAG  (TT_FIRST_USER_FLAG<<6)
 #define TT_ENABLE_IOCP       (TT_ENABLE_IOCP_FLAG|TT_NEED_THREADS)
+#define TT_ENABLE_URING      (TT_FIRST_USER_FLAG<<7)
 
 /* All the flags that a legacy test needs. */
 #define TT_ISOLATED TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE
@@ -39,11 +39,13 @@
 #endif
 #include <sys/queue.h>
 #ifndef WIN32
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -399,6 +401,275 @@ test_evbuffer_add_file(void *ptr)
 	EVUTIL_CLOSESOCKET(pair[1]);
 	evbuffer_free(src);
 }
+
+/* Write the first 'len' bytes of 'buf' through a socketpair and check that
+ * what comes out is 'expect'. */
+static int
+check_file_segment_output(struct evbuffer *buf, evutil_socket_t pair[2],
+    const char *expect, size_t len)
+{
+	struct evbuffer *out = evbuffer_new();
+	size_t written = 0;
+	int n, ok = 0;
+
+	while (written < len) {
+		n = evbuffer_write_atmost(buf, pair[0], len - written);
+		if (n <= 0)
+			goto end;
+		written += n;
+		evbuffer_validate(buf);
+		while (evbuffer_get_length(out) < written)
+			if (evbuffer_read(out, pair[1], -1) <= 0)
+				goto end;
+	}
+	ok = evbuffer_get_length(out) == len &&
+	    !memcmp(evbuffer_pullup(out, -1), expect, len);
+ end:
+	evbuffer_free(out);
+	return ok;
+}
+
+static void
+test_evbuffer_file_segment(void *ptr)
+{
+	const char *mode = ptr;
+	struct evbuffer *bufs[3] = { NULL, NULL, NULL };
+	struct evbuffer_file_segment *seg = NULL;
+	const size_t datalen = 12000, seg_offset = 5000;
+	const char *expect;
+	char *data = NULL;
+	unsigned flags = EVBUF_FS_CLOSE_ON_FREE;
+	evutil_socket_t fd = -1, pair[2] = { -1, -1 };
+	int i;
+
+	if (!strcmp(mode, "mmap"))
+		flags |= EVBUF_FS_DISABLE_SENDFILE;
+	else if (!strcmp(mode, "read"))
+		flags |= EVBUF_FS_DISABLE_SENDFILE|EVBUF_FS_DISABLE_MMAP;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	tt_assert(data = malloc(datalen));
+	for (i = 0; i < (int)datalen; ++i)
+		data[i] = 'a' + (i * 7 + (i >> 8)) % 26;
+	fd = regress_make_tmpfile(data, datalen);
+	tt_assert(fd != -1);
+	expect = data + seg_offset;
+
+	/* Start in the middle of a page, and run to the end of the file. */
+	seg = evbuffer_file_segment_new(fd, seg_offset, -1, flags);
+	tt_assert(seg);
+	for (i = 0; i < 3; ++i)
+		tt_assert(bufs[i] = evbuffer_new());
+
+	tt_int_op(evbuffer_add_file_segment(bufs[0], seg, 0, 100), ==, 0);
+	tt_int_op(evbuffer_add_file_segment(bufs[0], seg, 3000, 2000), ==, 0);
+	tt_int_op(evbuffer_add_file_segment(bufs[1], seg, 0, -1), ==, 0);
+	tt_int_op(evbuffer_add_file_segment(bufs[2], seg, 6999, 1), ==, 0);
+	tt_int_op(evbuffer_get_length(bufs[0]), ==, 2100);
+	tt_int_op(evbuffer_get_length(bufs[1]), ==, datalen - seg_offset);
+	/* Ranges that run off the end of the segment are refused. */
+	tt_int_op(evbuffer_add_file_segment(bufs[2], seg, 7000, 1), ==, -1);
+	tt_int_op(evbuffer_add_file_segment(bufs[2], seg, 6000, 1001), ==, -1);
+	tt_int_op(evbuffer_get_length(bufs[2]), ==, 1);
+
+	/* The evbuffers keep the segment, and the fd, alive. */
+	evbuffer_file_segment_free(seg);
+	seg = NULL;
+	tt_int_op(fcntl(fd, F_GETFD), !=, -1);
+
+	tt_assert(check_file_segment_output(bufs[1], pair, expect,
+		datalen - seg_offset));
+	tt_assert(check_file_segment_output(bufs[2], pair, expect + 6999, 1));
+	evbuffer_free(bufs[1]);
+	evbuffer_free(bufs[2]);
+	bufs[1] = bufs[2] = NULL;
+	tt_int_op(fcntl(fd, F_GETFD), !=, -1);
+
+	if (!strcmp(mode, "sendfile")) {
+		tt_assert(check_file_segment_output(bufs[0], pair, expect,
+			100));
+	} else {
+		/* Everything but sendfile lets us look at the data. */
+		tt_assert(!memcmp(evbuffer_pullup(bufs[0], 100), expect, 100));
+		evbuffer_drain(bufs[0], 100);
+	}
+	tt_assert(check_file_segment_output(bufs[0], pair, expect + 3000,
+		2000));
+
+	/* Once the last chain goes, so does the fd. */
+	evbuffer_free(bufs[0]);
+	bufs[0] = NULL;
+	tt_int_op(fcntl(fd, F_GETFD), ==, -1);
+	fd = -1;
+
+ end:
+	for (i = 0; i < 3; ++i)
+		if (bufs[i])
+			evbuffer_free(bufs[i]);
+	if (seg)
+		evbuffer_file_segment_free(seg);
+	if (fd != -1 && !seg)
+		close(fd);
+	EVUTIL_CLOSESOCKET(pair[0]);
+	EVUTIL_CLOSESOCKET(pair[1]);
+	if (data)
+		free(data);
+}
+
+static int n_zerocopy_cleanups;
+static void
+zerocopy_cleanup(const void *data, size_t len, void *arg)
+{
+	++n_zerocopy_cleanups;
+}
+
+/* Read 'len' bytes from 'fd', and check that they match 'expect'. */
+static int
+read_and_check(evutil_socket_t fd, const char *expect, size_t len)
+{
+	char tmp[4096];
+	ev_ssize_t n;
+
+	while (len) {
+		n = recv(fd, tmp, len < sizeof(tmp) ? len : sizeof(tmp), 0);
+		if (n <= 0 || memcmp(tmp, expect, n))
+			return -1;
+		expect += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+test_evbuffer_write_flags(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_chain *chain;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t pair[2] = { -1, -1 }, listener = -1;
+	char *data = malloc(262144);
+	int i, n, sndbuf;
+	size_t written;
+
+	for (i = 0; i < 262144; ++i)
+		data[i] = 'a' + (i * 7 + (i >> 11)) % 26;
+	tt_int_op(evbuffer_set_write_flags(buf, 0x80), ==, -1);
+
+	/* Fitting writes to the send buffer: a write never offers more than
+	 * the socket has room for, and everything still arrives. */
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	sndbuf = 16384;
+	setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf,
+	    sizeof(sndbuf));
+	tt_int_op(evbuffer_set_write_flags(buf, EVBUFFER_WRITE_FIT_SNDBUF),
+	    ==, 0);
+	for (i = 0; i < 262144; i += 1000)
+		evbuffer_add(buf, data + i, i + 1000 > 262144 ? 262144 - i : 1000);
+	n = evbuffer_write(buf, pair[0]);
+	tt_int_op(n, >, 0);
+	slen = sizeof(sndbuf);
+	getsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, &slen);
+	TT_BLATHER(("wrote %d with SO_SNDBUF %d", n, sndbuf));
+	tt_int_op(n, <=, sndbuf > 4096 ? sndbuf : 4096);
+	written = n;
+	tt_int_op(read_and_check(pair[1], data, n), ==, 0);
+	while (written < 262144) {
+		n = evbuffer_write(buf, pair[0]);
+		if (n > 0) {
+			tt_int_op(read_and_check(pair[1], data + written, n),
+			    ==, 0);
+			written += n;
+		} else {
+			tt_assert(n < 0 && errno == EAGAIN);
+		}
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	EVUTIL_CLOSESOCKET(pair[0]);
+	EVUTIL_CLOSESOCKET(pair[1]);
+	pair[0] = pair[1] = -1;
+
+	/* MSG_ZEROCOPY needs a TCP socket. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	slen = sizeof(sin);
+	tt_assert((listener = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+	tt_int_op(bind(listener, (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(listen(listener, 1), ==, 0);
+	tt_int_op(getsockname(listener, (struct sockaddr *)&sin, &slen), ==, 0);
+	tt_assert((pair[0] = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+	/* Room for everything we write, so that we never block. */
+	sndbuf = 1048576;
+	setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf,
+	    sizeof(sndbuf));
+	tt_int_op(connect(pair[0], (struct sockaddr *)&sin, sizeof(sin)), ==,
+	    0);
+	tt_assert((pair[1] = accept(listener, NULL, NULL)) >= 0);
+
+	tt_int_op(evbuffer_set_write_flags(buf, EVBUFFER_WRITE_ZEROCOPY), ==,
+	    0);
+	evbuffer_add_reference(buf, data, 65536, zerocopy_cleanup, NULL);
+	evbuffer_add(buf, data + 65536, 32768);
+	chain = buf->last;
+
+	/* Send the reference in two pieces: the second one takes it over
+	 * from the first. */
+	tt_int_op(evbuffer_write_atmost(buf, pair[0], 20000), ==, 20000);
+	if (!buf->write_state->zerocopy_ok) {
+		TT_BLATHER(("No MSG_ZEROCOPY here"));
+		tt_int_op(buf->write_state->n_pending, ==, 0);
+		goto end;
+	}
+	tt_int_op(buf->write_state->n_pending, ==, 1);
+	tt_assert(buf->first->flags & EVBUFFER_MEM_PINNED_ZC);
+	tt_int_op(evbuffer_write_atmost(buf, pair[0], 45536 + 20000), ==,
+	    45536 + 20000);
+
+	/* The reference chain was drained, but it's not gone yet. */
+	tt_assert(buf->first == chain);
+	tt_assert(chain->flags & EVBUFFER_MEM_PINNED_ZC);
+	tt_int_op(n_zerocopy_cleanups, ==, 0);
+
+	/* We don't write into the space in front of a pinned chain. */
+	tt_int_op(evbuffer_prepend(buf, "x", 1), ==, 0);
+	tt_assert(buf->first != chain);
+	tt_int_op(evbuffer_drain(buf, 1), ==, 0);
+
+	tt_int_op(read_and_check(pair[1], data, 85536), ==, 0);
+	for (i = 0; i < 5000 && evbuffer_zerocopy_reap(buf, pair[0]); ++i)
+		usleep(1000);
+	tt_int_op(evbuffer_zerocopy_reap(buf, pair[0]), ==, 0);
+	tt_int_op(n_zerocopy_cleanups, ==, 1);
+	tt_assert(!(chain->flags & EVBUFFER_MEM_PINNED_ZC));
+
+	/* Small writes are copied as usual. */
+	tt_int_op(evbuffer_write(buf, pair[0]), ==, 12768);
+	tt_int_op(buf->write_state->n_pending, ==, 0);
+	tt_int_op(read_and_check(pair[1], data + 85536, 12768), ==, 0);
+
+	/* Freeing the evbuffer releases what is still pending. */
+	evbuffer_add_reference(buf, data, 65536, zerocopy_cleanup, NULL);
+	tt_int_op(evbuffer_write(buf, pair[0]), ==, 65536);
+	tt_int_op(n_zerocopy_cleanups, ==, 1);
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(n_zerocopy_cleanups, ==, 2);
+	tt_int_op(read_and_check(pair[1], data, 65536), ==, 0);
+
+ end:
+	if (buf)
+		evbuffer_free(buf);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+	if (listener >= 0)
+		EVUTIL_CLOSESOCKET(listener);
+	free(data);
+}
 #endif
 
 static void *
@@ -650,6 +921,80 @@ test_evbuffer_iterative(void *ptr)
 
 }
 
+static void
+test_evbuffer_add_formatted(void *ptr)
+{
+	static const ev_int64_t ints[] = { 0, 1, -1, 9, 10, -10, 65535,
+	    2147483647, -2147483647 - 1, 4294967296LL };
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *expect = evbuffer_new();
+	char filler[250];
+	size_t len;
+	unsigned i;
+
+	for (i = 0; i < sizeof(ints)/sizeof(ints[0]); ++i) {
+		evbuffer_add_printf(expect, "%lld|", (long long)ints[i]);
+		tt_int_op(evbuffer_add_int(buf, ints[i]), >, 0);
+		evbuffer_add(buf, "|", 1);
+		if (ints[i] < 0)
+			continue;
+		evbuffer_add_printf(expect, "%llu|%llx|",
+		    (unsigned long long)ints[i], (unsigned long long)ints[i]);
+		tt_int_op(evbuffer_add_uint(buf, ints[i]), >, 0);
+		evbuffer_add(buf, "|", 1);
+		tt_int_op(evbuffer_add_hex(buf, ints[i]), >, 0);
+		evbuffer_add(buf, "|", 1);
+	}
+	/* The extremes, which don't fit in anything narrower. */
+	evbuffer_add(expect, "-9223372036854775808|18446744073709551615|"
+	    "ffffffffffffffff|", 59);
+	evbuffer_add_int(buf, -(ev_int64_t)9223372036854775807LL - 1);
+	evbuffer_add(buf, "|", 1);
+	evbuffer_add_uint(buf, ~(ev_uint64_t)0);
+	evbuffer_add(buf, "|", 1);
+	evbuffer_add_hex(buf, ~(ev_uint64_t)0);
+	evbuffer_add(buf, "|", 1);
+
+	tt_int_op(evbuffer_add_chunk_size(buf, 0), ==, 3);
+	tt_int_op(evbuffer_add_chunk_size(buf, 4096), ==, 6);
+	evbuffer_add(expect, "0\r\n1000\r\n", 9);
+
+	tt_int_op(evbuffer_add_header_line(buf, "Content-Type", "text/html"),
+	    ==, 25);
+	tt_int_op(evbuffer_add_header_line(buf, "X-Empty", ""), ==, 11);
+	evbuffer_add(expect, "Content-Type: text/html\r\nX-Empty: \r\n", 36);
+	evbuffer_validate(buf);
+
+	len = evbuffer_get_length(expect);
+	tt_int_op(evbuffer_get_length(buf), ==, len);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), evbuffer_pullup(expect, -1),
+		len));
+
+	/* A header line is never split between chains, even when the last
+	 * chain is nearly full or can't be written to. */
+	evbuffer_drain(buf, len);
+	memset(filler, 'x', sizeof(filler));
+	evbuffer_add(buf, filler, sizeof(filler));
+	evbuffer_add_reference(buf, "ref", 3, NULL, NULL);
+	tt_int_op(evbuffer_add_header_line(buf, "Host", "www.example.com"),
+	    ==, 23);
+	tt_int_op(evbuffer_peek(buf, 276, NULL, NULL, 0), ==, 3);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1) + 253,
+		"Host: www.example.com\r\n", 23));
+	evbuffer_validate(buf);
+
+	/* Frozen buffers refuse all of them. */
+	evbuffer_freeze(buf, 0);
+	tt_int_op(evbuffer_add_int(buf, 5), ==, -1);
+	tt_int_op(evbuffer_add_chunk_size(buf, 5), ==, -1);
+	tt_int_op(evbuffer_add_header_line(buf, "A", "b"), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, 276);
+
+ end:
+	evbuffer_free(buf);
+	evbuffer_free(expect);
+}
+
 static void
 test_evbuffer_find(void *ptr)
 {
@@ -797,6 +1142,109 @@ end:
 		evbuffer_free(tmp);
 }
 
+/* Return the position of the first match for 'what' in the 'n' bytes at
+ * 's', starting at 'start', that ends no later than 'end'; or -1. */
+static int
+naive_search(const char *s, int n, const char *what, int len, int start,
+    int end)
+{
+	int i;
+	for (i = start; i + len <= end && i + len <= n; ++i) {
+		if (!memcmp(s + i, what, len))
+			return i;
+	}
+	return -1;
+}
+
+static void
+test_evbuffer_search_chains(void *ptr)
+{
+	/* Compare evbuffer_search_range() and evbuffer_search_eol() with
+	 * the obvious way of searching, on a long buffer with chains of all
+	 * sizes, so that matches straddle chain boundaries and the vector
+	 * loops have something to chew on. */
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer_ptr pos, start, end;
+	char flat[8192], what[64];
+	unsigned seed = 12345;
+	int i, j, n = 0;
+	size_t eol_len;
+
+#define NEXT_RAND() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+
+	while (n < (int)sizeof(flat) - 100) {
+		int chunk = NEXT_RAND() % 97 + 1;
+		for (j = 0; j < chunk; ++j)
+			flat[n + j] = "aab\r\nxyzab"[NEXT_RAND() % 10];
+		evbuffer_add(tmp, flat + n, chunk);
+		evbuffer_add_buffer(buf, tmp);
+		n += chunk;
+	}
+	flat[n] = '\0';
+	tt_int_op(evbuffer_get_length(buf), ==, n);
+
+	for (i = 0; i < 2000; ++i) {
+		int len = NEXT_RAND() % 40 + 1;
+		int from = NEXT_RAND() % n;
+		int to = NEXT_RAND() % (n + 1);
+		int expect, expect_bounded;
+
+		if (i & 1) {
+			/* Something that is really there. */
+			if (from + len > n)
+				len = n - from;
+			memcpy(what, flat + from, len);
+		} else {
+			for (j = 0; j < len; ++j)
+				what[j] = "aab\r\nxyzab"[NEXT_RAND() % 10];
+		}
+		from = NEXT_RAND() % n;
+
+		tt_int_op(evbuffer_ptr_set(buf, &start, from,
+			EVBUFFER_PTR_SET), ==, 0);
+		expect = naive_search(flat, n, what, len, from, n);
+		pos = evbuffer_search(buf, what, len, &start);
+		tt_int_op(pos.pos, ==, expect);
+
+		if (to < n) {
+			tt_int_op(evbuffer_ptr_set(buf, &end, to,
+				EVBUFFER_PTR_SET), ==, 0);
+			expect_bounded = naive_search(flat, n, what, len, from,
+			    to);
+			pos = evbuffer_search_range(buf, what, len, &start,
+			    &end);
+			tt_int_op(pos.pos, ==, expect_bounded);
+		}
+
+		/* The first end of line, of any kind. */
+		pos = evbuffer_search_eol(buf, &start, &eol_len,
+		    EVBUFFER_EOL_ANY);
+		for (j = from; j < n && flat[j] != '\r' && flat[j] != '\n'; ++j)
+			;
+		tt_int_op(pos.pos, ==, j < n ? j : -1);
+		if (j < n)
+			tt_int_op(eol_len, ==, strspn(flat + j, "\r\n"));
+
+		pos = evbuffer_search_eol(buf, &start, &eol_len,
+		    EVBUFFER_EOL_LF);
+		expect = naive_search(flat, n, "\n", 1, from, n);
+		tt_int_op(pos.pos, ==, expect);
+
+		pos = evbuffer_search_eol(buf, &start, &eol_len,
+		    EVBUFFER_EOL_CRLF_STRICT);
+		expect = naive_search(flat, n, "\r\n", 2, from, n);
+		tt_int_op(pos.pos, ==, expect);
+	}
+#undef NEXT_RAND
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (tmp)
+		evbuffer_free(tmp);
+}
+
 static void
 log_change_callback(struct evbuffer *buffer,
     const struct evbuffer_cb_info *cbinfo,
@@ -979,6 +1427,101 @@ end:
 		evbuffer_free(buf2);
 }
 
+static void
+test_evbuffer_add_buffer_reference(void *ptr)
+{
+	struct evbuffer *src = NULL, *dst[3] = { NULL, NULL, NULL };
+	struct evbuffer *tmp = NULL;
+	const char shared[] = "shared by everybody";
+	char big[5000], *expect = NULL, *p;
+	size_t len;
+	int i;
+
+	ref_done_cb_called_count = 0;
+	memset(big, 'x', sizeof(big));
+	big[0] = '<';
+	big[sizeof(big)-1] = '>';
+
+	tt_assert(src = evbuffer_new());
+	evbuffer_add(src, "hello, ", 7);
+	evbuffer_add_reference(src, shared, strlen(shared), ref_done_cb,
+	    (void*)44);
+	evbuffer_add(src, big, sizeof(big));
+	len = evbuffer_get_length(src);
+	tt_assert(expect = malloc(len));
+	memcpy(expect, "hello, ", 7);
+	memcpy(expect + 7, shared, strlen(shared));
+	memcpy(expect + 7 + strlen(shared), big, sizeof(big));
+
+	for (i = 0; i < 3; ++i)
+		tt_assert(dst[i] = evbuffer_new());
+	evbuffer_add(dst[1], "prefix", 6);
+	/* Leave an empty chain at the end of dst[2]. */
+	evbuffer_expand(dst[2], 100);
+
+	for (i = 0; i < 3; ++i) {
+		tt_int_op(evbuffer_add_buffer_reference(dst[i], src), ==, 0);
+		evbuffer_validate(dst[i]);
+	}
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_length(src), ==, len);
+	tt_int_op(evbuffer_get_length(dst[0]), ==, len);
+	tt_int_op(evbuffer_get_length(dst[1]), ==, len + 6);
+	tt_int_op(evbuffer_get_length(dst[2]), ==, len);
+
+	/* We don't share references to references. */
+	tt_assert(tmp = evbuffer_new());
+	tt_int_op(evbuffer_add_buffer_reference(tmp, dst[0]), ==, -1);
+	tt_int_op(evbuffer_get_length(tmp), ==, 0);
+
+	/* Changing src leaves the others alone, and vice versa. */
+	evbuffer_add(src, "more", 4);
+	evbuffer_drain(src, 3);
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_length(dst[0]), ==, len);
+	p = (char *)evbuffer_pullup(dst[0], -1);
+	tt_assert(p);
+	tt_assert(!memcmp(p, expect, len));
+	evbuffer_validate(dst[0]);
+	evbuffer_drain(dst[1], 8);
+	p = (char *)evbuffer_pullup(dst[1], 30);
+	tt_assert(p);
+	tt_assert(!memcmp(p, expect + 2, 30));
+	p = (char *)evbuffer_pullup(src, -1);
+	tt_assert(p);
+	tt_assert(!memcmp(p, expect + 3, len - 3));
+	tt_assert(!memcmp(p + len - 3, "more", 4));
+
+	/* The shared memory stays around until the last reference is
+	 * gone, even after src is freed. */
+	evbuffer_free(src);
+	src = NULL;
+	evbuffer_free(dst[0]);
+	dst[0] = NULL;
+	evbuffer_drain(dst[1], len);
+	tt_int_op(ref_done_cb_called_count, ==, 0);
+	tt_int_op(evbuffer_remove(dst[2], big, 10), ==, 10);
+	tt_assert(!memcmp(big, expect, 10));
+	tt_int_op(ref_done_cb_called_count, ==, 0);
+	evbuffer_drain(dst[2], strlen(shared) - 3);
+	tt_int_op(ref_done_cb_called_count, ==, 1);
+	tt_assert(ref_done_cb_called_with == (void*)44);
+	tt_int_op(evbuffer_get_length(dst[2]), ==, sizeof(big));
+	tt_int_op(evbuffer_remove(dst[2], big, sizeof(big)), ==, sizeof(big));
+	tt_assert(big[0] == '<' && big[sizeof(big)-1] == '>');
+
+end:
+	if (src)
+		evbuffer_free(src);
+	for (i = 0; i < 3; ++i)
+		if (dst[i])
+			evbuffer_free(dst[i]);
+	if (tmp)
+		evbuffer_free(tmp);
+	if (expect)
+		free(expect);
+}
+
 /* Some cases that we didn't get in test_evbuffer() above, for more coverage. */
 static void
 test_evbuffer_prepend(void *ptr)
@@ -1135,6 +1678,122 @@ end:
 		evbuffer_free(tmp_buf);
 }
 
+static void
+test_evbuffer_peek_contiguous(void *ptr)
+{
+	static const char *pieces[] = { "Some ", "water", "-", "proof ",
+		"boots" };
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_ptr pos;
+	const char *p;
+	char scratch[32];
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		evbuffer_add_reference(buf, pieces[i], strlen(pieces[i]),
+		    NULL, NULL);
+	tt_int_op(evbuffer_peek(buf, 22, NULL, NULL, 0), ==, 5);
+
+	/* In one chain: we get a pointer to the chain's memory. */
+	p = evbuffer_peek_contiguous(buf, NULL, 4, scratch);
+	tt_assert(p == pieces[0]);
+	tt_assert(evbuffer_ptr_set(buf, &pos, 7, EVBUFFER_PTR_SET) == 0);
+	p = evbuffer_peek_contiguous(buf, &pos, 3, NULL);
+	tt_assert(p == pieces[1] + 2);
+	/* Starting just where a chain ends. */
+	tt_assert(evbuffer_ptr_set(buf, &pos, 10, EVBUFFER_PTR_SET) == 0);
+	p = evbuffer_peek_contiguous(buf, &pos, 1, NULL);
+	tt_assert(p == pieces[2]);
+
+	/* Across chains: we get a copy, or nothing without scratch space. */
+	p = evbuffer_peek_contiguous(buf, NULL, 12, scratch);
+	tt_assert(p == scratch);
+	tt_assert(!memcmp(p, "Some water-p", 12));
+	tt_assert(evbuffer_peek_contiguous(buf, NULL, 12, NULL) == NULL);
+	tt_assert(evbuffer_ptr_set(buf, &pos, 8, EVBUFFER_PTR_SET) == 0);
+	p = evbuffer_peek_contiguous(buf, &pos, 14, scratch);
+	tt_assert(p == scratch);
+	tt_assert(!memcmp(p, "er-proof boots", 14));
+
+	/* Not enough data. */
+	tt_assert(evbuffer_peek_contiguous(buf, NULL, 23, scratch) == NULL);
+	tt_assert(evbuffer_peek_contiguous(buf, &pos, 15, scratch) == NULL);
+	p = evbuffer_peek_contiguous(buf, &pos, 14, scratch);
+	tt_assert(p != NULL);
+
+	/* None of that changed the buffer. */
+	tt_int_op(evbuffer_peek(buf, 22, NULL, NULL, 0), ==, 5);
+	tt_int_op(evbuffer_get_length(buf), ==, 22);
+	evbuffer_validate(buf);
+
+ end:
+	evbuffer_free(buf);
+}
+
+static char big_chunk[1000];
+
+static void
+test_evbuffer_compaction(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *plain = evbuffer_new();
+	struct evbuffer *msg = evbuffer_new();
+	struct evbuffer *expect = evbuffer_new();
+	struct evbuffer_compaction_stats stats;
+	size_t len;
+	int i, n_chains;
+
+	tt_int_op(evbuffer_set_compaction(buf, 256, 1), ==, -1);
+	tt_int_op(evbuffer_set_compaction(buf, 256, 8), ==, 0);
+	ref_done_cb_called_count = 0;
+
+	for (i = 0; i < 200; ++i) {
+		if (i % 3 == 0) {
+			evbuffer_add_reference(buf, "[ref]", 5, ref_done_cb,
+			    NULL);
+			evbuffer_add_reference(plain, "[ref]", 5, NULL, NULL);
+			evbuffer_add(expect, "[ref]", 5);
+		}
+		evbuffer_add_printf(msg, "message %d;", i);
+		evbuffer_add_printf(expect, "message %d;", i);
+		evbuffer_add_printf(plain, "message %d;", i);
+		evbuffer_add_buffer(buf, msg);
+		evbuffer_validate(buf);
+	}
+	/* One chain bigger than "small", which has to stay put. */
+	evbuffer_add_reference(buf, big_chunk, sizeof(big_chunk), NULL, NULL);
+	evbuffer_add(expect, big_chunk, sizeof(big_chunk));
+	evbuffer_add(buf, "end", 3);
+	evbuffer_add(expect, "end", 3);
+	evbuffer_validate(buf);
+
+	len = evbuffer_get_length(buf);
+	tt_int_op(len, ==, evbuffer_get_length(expect));
+	n_chains = evbuffer_peek(buf, len, NULL, NULL, 0);
+	TT_BLATHER(("%d chains with compaction, %d without", n_chains,
+		evbuffer_peek(plain, evbuffer_get_length(plain), NULL, NULL,
+		    0)));
+	tt_int_op(n_chains, <, 20);
+	tt_int_op(evbuffer_peek(plain, evbuffer_get_length(plain), NULL, NULL,
+		0), >, 60);
+
+	evbuffer_get_compaction_stats(buf, &stats);
+	tt_int_op(stats.n_compactions, >, 0);
+	tt_int_op(stats.n_chains_merged, >, 200);
+	tt_int_op(stats.n_bytes_copied, >, 0);
+	/* Copied references are released as soon as they are copied. */
+	tt_int_op(ref_done_cb_called_count, >, 50);
+
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1),
+		evbuffer_pullup(expect, -1), len));
+
+ end:
+	evbuffer_free(buf);
+	evbuffer_free(plain);
+	evbuffer_free(msg);
+	evbuffer_free(expect);
+}
+
 /* Check whether evbuffer freezing works right.  This is called twice,
    once with the argument "start" and once with the argument "end".
    When we test "start", we freeze the start of an evbuffer and make sure
@@ -1142,6 +1801,266 @@ end:
    "end", we freeze the end of an evbuffer and make sure that modifying
    the end of the buffer doesn't work.
  */
+static int memory_cap_calls;
+static int memory_cap_over;
+
+static void
+memory_cap_cb(int over_cap, size_t used, void *arg)
+{
+	++memory_cap_calls;
+	memory_cap_over = over_cap;
+	TT_BLATHER(("memory cap: over=%d, used=%lu", over_cap,
+		(unsigned long)used));
+}
+
+static void
+test_evbuffer_memory(void *ptr)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *other = evbuffer_new();
+	struct evbuffer_memory_stats start, stats, base_stats;
+	char data[1000];
+	size_t used;
+	int i, n_added;
+
+	memset(data, 'x', sizeof(data));
+	evbuffer_get_global_memory_stats(&start);
+
+	/* Every chain we allocate counts, globally and for the buffer. */
+	for (i = 0; i < 10; ++i)
+		evbuffer_add(buf, data, sizeof(data));
+	used = evbuffer_get_memory_used(buf);
+	tt_assert(used >= 10 * sizeof(data));
+	evbuffer_get_global_memory_stats(&stats);
+	tt_int_op(stats.used, ==, start.used + used);
+	tt_assert(stats.peak >= stats.used);
+
+	/* Moving chains moves their memory; draining frees it. */
+	evbuffer_add_buffer(other, buf);
+	tt_int_op(evbuffer_get_memory_used(buf), ==, 0);
+	tt_int_op(evbuffer_get_memory_used(other), ==, used);
+	evbuffer_drain(other, evbuffer_get_length(other));
+	evbuffer_get_global_memory_stats(&stats);
+	tt_int_op(stats.used, ==, start.used);
+
+	/* Memory charged to a base stays charged there until it's freed,
+	 * even if it outlives the base. */
+	event_base_get_evbuffer_memory_stats(base, &base_stats);
+	tt_int_op(base_stats.used, ==, 0);
+	tt_int_op(evbuffer_set_memory_base(buf, base), ==, 0);
+	evbuffer_add(buf, data, sizeof(data));
+	used = evbuffer_get_memory_used(buf);
+	event_base_get_evbuffer_memory_stats(base, &base_stats);
+	tt_int_op(base_stats.used, ==, used);
+	evbuffer_add_buffer(other, buf);
+	event_base_get_evbuffer_memory_stats(base, &base_stats);
+	tt_int_op(base_stats.used, ==, used);
+	evbuffer_drain(other, evbuffer_get_length(other));
+	event_base_get_evbuffer_memory_stats(base, &base_stats);
+	tt_int_op(base_stats.used, ==, 0);
+	tt_int_op(base_stats.peak, ==, used);
+	evbuffer_add(buf, data, sizeof(data));
+	event_base_free(base);
+	base = NULL;
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+
+	/* A cap with room for a few chunks over what we use now. */
+	tt_int_op(evbuffer_set_global_memory_cap(1000, 2000, NULL, NULL),
+	    ==, -1);
+	tt_int_op(evbuffer_set_global_memory_cap(start.used + 8000,
+		start.used + 2000, memory_cap_cb, NULL), ==, 0);
+	tt_int_op(memory_cap_calls, ==, 0);
+	tt_assert(!evbuffer_global_memory_over_cap());
+
+	/* An unlimited buffer can go over; a limited one then gets no
+	 * more memory. */
+	tt_int_op(evbuffer_set_memory_limited(buf, 1), ==, 0);
+	for (i = 0; i < 10; ++i)
+		tt_int_op(evbuffer_add(other, data, sizeof(data)), ==, 0);
+	tt_int_op(memory_cap_calls, ==, 1);
+	tt_int_op(memory_cap_over, ==, 1);
+	tt_assert(evbuffer_global_memory_over_cap());
+	tt_int_op(evbuffer_add(buf, data, sizeof(data)), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(evbuffer_add_reference(buf, data, sizeof(data), NULL,
+		NULL), ==, -1);
+	tt_int_op(evbuffer_expand(buf, 100), ==, -1);
+	tt_int_op(evbuffer_add(other, data, sizeof(data)), ==, 0);
+
+	/* Freeing only a little doesn't take us back under... */
+	evbuffer_drain(other, 4 * sizeof(data));
+	tt_int_op(memory_cap_calls, ==, 1);
+	tt_assert(evbuffer_global_memory_over_cap());
+	/* ...but going below the low watermark does. */
+	evbuffer_drain(other, evbuffer_get_length(other));
+	tt_int_op(memory_cap_calls, ==, 2);
+	tt_int_op(memory_cap_over, ==, 0);
+	tt_assert(!evbuffer_global_memory_over_cap());
+
+	/* A limited buffer fills up until it's over, and no further. */
+	for (n_added = 0; n_added < 100; ++n_added) {
+		if (evbuffer_add(buf, data, sizeof(data)) < 0)
+			break;
+	}
+	tt_int_op(n_added, <, 100);
+	tt_int_op(memory_cap_calls, ==, 3);
+	evbuffer_get_global_memory_stats(&stats);
+	/* We can overshoot by no more than one chain. */
+	tt_assert(stats.used <= start.used + 8000 + 8192);
+
+	/* Turning off the cap takes us under it. */
+	tt_int_op(evbuffer_set_global_memory_cap(0, 0, memory_cap_cb, NULL),
+	    ==, 0);
+	tt_int_op(memory_cap_calls, ==, 4);
+	tt_int_op(memory_cap_over, ==, 0);
+	tt_int_op(evbuffer_add(buf, data, sizeof(data)), ==, 0);
+
+end:
+	evbuffer_set_global_memory_cap(0, 0, NULL, NULL);
+	if (base)
+		event_base_free(base);
+	evbuffer_free(buf);
+	evbuffer_free(other);
+}
+
+static void
+test_evbuffer_huge_pages(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char *data = malloc(3*1024*1024), *out = malloc(3*1024*1024);
+	size_t len;
+	int i, round;
+
+	tt_assert(data && out);
+	for (i = 0; i < 3*1024*1024; ++i)
+		data[i] = (char)(i * 7 + (i >> 12));
+
+	tt_int_op(evbuffer_set_alloc_flags(buf, 0x80), ==, -1);
+	tt_int_op(evbuffer_set_alloc_flags(buf, EVBUFFER_ALLOC_HUGE_PAGES),
+	    ==, 0);
+
+	/* Fill and drain a few times, so that we reuse freed slots. */
+	for (round = 0; round < 4; ++round) {
+		for (len = 0; len < 1024*1024; len += 10000)
+			evbuffer_add(buf, data + len, 10000);
+		tt_int_op(evbuffer_get_length(buf), ==, len);
+#ifdef _EVENT_HAVE_HUGEPAGE_CHAINS
+		/* Chains grow well past 4KB. */
+		tt_int_op(evbuffer_peek(buf, len, NULL, NULL, 0), <, 20);
+#endif
+		tt_assert(evbuffer_get_memory_used(buf) >= len);
+		tt_int_op(evbuffer_remove(buf, out, len), ==, len);
+		tt_assert(!memcmp(out, data, len));
+	}
+
+	/* A chain bigger than a region. */
+	evbuffer_add(buf, "x", 1);
+	tt_int_op(evbuffer_add(buf, data, 3*1024*1024), ==, 0);
+	evbuffer_drain(buf, 1);
+	tt_int_op(evbuffer_remove(buf, out, 3*1024*1024), ==, 3*1024*1024);
+	tt_assert(!memcmp(out, data, 3*1024*1024));
+	tt_int_op(evbuffer_get_memory_used(buf), ==, 0);
+
+	/* Chains already allocated outlive the flag. */
+	evbuffer_add(buf, data, 100000);
+	tt_int_op(evbuffer_set_alloc_flags(buf, 0), ==, 0);
+	evbuffer_add(buf, data + 100000, 100000);
+	tt_int_op(evbuffer_remove(buf, out, 200000), ==, 200000);
+	tt_assert(!memcmp(out, data, 200000));
+
+end:
+	evbuffer_free(buf);
+	free(data);
+	free(out);
+}
+
+static void
+test_evbuffer_checksums(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *split = evbuffer_new();
+	struct evbuffer_ptr pos;
+	unsigned char data[1000];
+	ev_uint32_t crc, crc2, adler, adler2;
+	ev_uint64_t hash, hash2;
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (unsigned char)(i * 7 + (i >> 3));
+
+	/* Known answers. */
+	evbuffer_add(buf, "123456789", 9);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_uint_op(crc, ==, 0xe3069283);
+	evbuffer_drain(buf, 9);
+	evbuffer_add(buf, "Wikipedia", 9);
+	adler = 1;
+	tt_int_op(evbuffer_adler32(buf, NULL, -1, &adler), ==, 0);
+	tt_uint_op(adler, ==, 0x11e60398);
+	evbuffer_drain(buf, 9);
+	tt_int_op(evbuffer_hash64(buf, NULL, -1, 0, &hash), ==, 0);
+	tt_assert(hash == 0xef46db3751d8e999ULL);
+	evbuffer_add(buf, "abc", 3);
+	tt_int_op(evbuffer_hash64(buf, NULL, -1, 0, &hash), ==, 0);
+	tt_assert(hash == 0x44bc2cf5ad770999ULL);
+	evbuffer_drain(buf, 3);
+
+	evbuffer_add(buf, data, sizeof(data));
+	crc = 0;
+	adler = 1;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(evbuffer_adler32(buf, NULL, -1, &adler), ==, 0);
+	tt_int_op(evbuffer_hash64(buf, NULL, -1, 12345, &hash), ==, 0);
+	tt_uint_op(crc, ==, 0x2aa22ec4);
+	tt_uint_op(adler, ==, 0x697eef74);
+	tt_assert(hash == 0x3c00b30a8a3d0998ULL);
+	tt_int_op(evbuffer_hash64(buf, NULL, -1, 0, &hash), ==, 0);
+	tt_assert(hash == 0x89765902cc28352aULL);
+
+	/* The same bytes in odd-sized chains give the same answers. */
+	for (i = 0; i < (int)sizeof(data); i += 37)
+		evbuffer_add_reference(split, data + i,
+		    i + 37 < (int)sizeof(data) ? 37 : sizeof(data) - i,
+		    NULL, NULL);
+	crc2 = 0;
+	adler2 = 1;
+	tt_int_op(evbuffer_crc32c(split, NULL, -1, &crc2), ==, 0);
+	tt_int_op(evbuffer_adler32(split, NULL, -1, &adler2), ==, 0);
+	tt_int_op(evbuffer_hash64(split, NULL, -1, 12345, &hash2), ==, 0);
+	tt_uint_op(crc2, ==, crc);
+	tt_uint_op(adler2, ==, adler);
+	tt_assert(hash2 == 0x3c00b30a8a3d0998ULL);
+
+	/* A range in the middle, in two pieces and in one. */
+	evbuffer_ptr_set(split, &pos, 100, EVBUFFER_PTR_SET);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(split, &pos, 300, &crc), ==, 0);
+	evbuffer_ptr_set(split, &pos, 300, EVBUFFER_PTR_ADD);
+	tt_int_op(evbuffer_crc32c(split, &pos, 500, &crc), ==, 0);
+	evbuffer_drain(buf, 100);
+	crc2 = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, 800, &crc2), ==, 0);
+	tt_uint_op(crc, ==, crc2);
+	evbuffer_ptr_set(split, &pos, 100, EVBUFFER_PTR_SET);
+	tt_int_op(evbuffer_hash64(split, &pos, 800, 7, &hash), ==, 0);
+	tt_int_op(evbuffer_hash64(buf, NULL, 800, 7, &hash2), ==, 0);
+	tt_assert(hash == hash2);
+
+	/* Asking for more than there is fails, and changes nothing. */
+	crc = 1234;
+	evbuffer_ptr_set(split, &pos, 900, EVBUFFER_PTR_SET);
+	tt_int_op(evbuffer_crc32c(split, &pos, 101, &crc), ==, -1);
+	tt_int_op(evbuffer_crc32c(split, NULL, 1001, &crc), ==, -1);
+	tt_uint_op(crc, ==, 1234);
+	tt_int_op(evbuffer_crc32c(split, &pos, 100, &crc), ==, 0);
+
+end:
+	evbuffer_free(buf);
+	evbuffer_free(split);
+}
+
 static void
 test_evbuffer_freeze(void *ptr)
 {
@@ -1249,18 +2168,34 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "reference", test_evbuffer_reference, 0, NULL, NULL },
 	{ "iterative", test_evbuffer_iterative, 0, NULL, NULL },
 	{ "readln", test_evbuffer_readln, TT_NO_LOGS, &basic_setup, NULL },
+	{ "add_formatted", test_evbuffer_add_formatted, 0, NULL, NULL },
 	{ "find", test_evbuffer_find, 0, NULL, NULL },
 	{ "ptr_set", test_evbuffer_ptr_set, 0, NULL, NULL },
 	{ "search", test_evbuffer_search, 0, NULL, NULL },
+	{ "search_chains", test_evbuffer_search_chains, 0, NULL, NULL },
 	{ "callbacks", test_evbuffer_callbacks, 0, NULL, NULL },
 	{ "add_reference", test_evbuffer_add_reference, 0, NULL, NULL },
+	{ "add_buffer_reference", test_evbuffer_add_buffer_reference, 0, NULL,
+	  NULL },
 	{ "prepend", test_evbuffer_prepend, 0, NULL, NULL },
 	{ "peek", test_evbuffer_peek, 0, NULL, NULL },
+	{ "peek_contiguous", test_evbuffer_peek_contiguous, 0, NULL, NULL },
+	{ "compaction", test_evbuffer_compaction, 0, NULL, NULL },
+	{ "memory", test_evbuffer_memory, TT_FORK, NULL, NULL },
+	{ "huge_pages", test_evbuffer_huge_pages, 0, NULL, NULL },
+	{ "checksums", test_evbuffer_checksums, 0, NULL, NULL },
 	{ "freeze_start", test_evbuffer_freeze, 0, &nil_setup, (void*)"start" },
 	{ "freeze_end", test_evbuffer_freeze, 0, &nil_setup, (void*)"end" },
 #ifndef WIN32
 	/* TODO: need a temp file implementation for Windows */
 	{ "add_file", test_evbuffer_add_file, 0, NULL, NULL },
+	{ "file_segment_sendfile", test_evbuffer_file_segment, 0, &nil_setup,
+	  (void*)"sendfile" },
+	{ "file_segment_mmap", test_evbuffer_file_segment, 0, &nil_setup,
+	  (void*)"mmap" },
+	{ "file_segment_read", test_evbuffer_file_segment, 0, &nil_setup,
+	  (void*)"read" },
+	{ "write_flags", test_evbuffer_write_flags, TT_FORK, NULL, NULL },
 #endif
 
 	END_OF_TESTCASES
@@ -74,6 +74,7 @@
 #ifdef WIN32
 #include "iocp-internal.h"
 #endif
+#include "uring-internal.h"
 
 #include "regress.h"
 
@@ -595,6 +596,178 @@ end:
 		event_del(&close_listener_event);
 }
 
+#define TRANSFER_SIZE (1024*1024 + 17)
+#define TRANSFER_HIGH_WM 20000
+
+struct transfer_state {
+	struct event_base *base;
+	struct bufferevent *out;
+	size_t n_written;
+	size_t n_read;
+	int bad_byte;
+	int over_wm;
+	int got_eof;
+};
+
+static unsigned char
+transfer_byte(size_t i)
+{
+	return (unsigned char)(i * 7 + (i >> 11));
+}
+
+static void
+transfer_fill(struct transfer_state *st)
+{
+	unsigned char chunk[8192];
+	size_t i, n;
+
+	/* Keep about a chunk's worth queued, so that we write while the
+	 * other side reads. */
+	while (st->n_written < TRANSFER_SIZE &&
+	    evbuffer_get_length(bufferevent_get_output(st->out)) <
+	    sizeof(chunk)) {
+		n = TRANSFER_SIZE - st->n_written;
+		if (n > sizeof(chunk))
+			n = sizeof(chunk);
+		for (i = 0; i < n; ++i)
+			chunk[i] = transfer_byte(st->n_written + i);
+		bufferevent_write(st->out, chunk, n);
+		st->n_written += n;
+	}
+}
+
+static void
+transfer_writecb(struct bufferevent *bev, void *ctx)
+{
+	struct transfer_state *st = ctx;
+
+	transfer_fill(st);
+	if (st->n_written == TRANSFER_SIZE &&
+	    !evbuffer_get_length(bufferevent_get_output(bev))) {
+		/* All sent; closing the socket gives the reader an EOF. */
+		bufferevent_free(bev);
+		st->out = NULL;
+	}
+}
+
+static void
+transfer_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct transfer_state *st = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	unsigned char buf[4096];
+	size_t i;
+	int n;
+
+	if (evbuffer_get_length(input) > TRANSFER_HIGH_WM)
+		st->over_wm = 1;
+	while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < (size_t)n; ++i) {
+			if (buf[i] != transfer_byte(st->n_read + i) &&
+			    st->bad_byte < 0)
+				st->bad_byte = (int)(st->n_read + i);
+		}
+		st->n_read += n;
+	}
+}
+
+static void
+transfer_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct transfer_state *st = ctx;
+
+	if (what & BEV_EVENT_EOF)
+		st->got_eof = 1;
+	else
+		TT_FAIL(("got event %d", (int)what));
+	event_base_loopexit(st->base, NULL);
+}
+
+static void
+test_bufferevent_transfer(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct transfer_state st;
+	struct bufferevent *in = NULL, *idle = NULL;
+	evutil_socket_t idle_pair[2] = { -1, -1 };
+	int options = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.base = data->base;
+	st.bad_byte = -1;
+
+	if (strstr((char*)data->setup_data, "uring")) {
+#ifdef _EVENT_HAVE_IO_URING
+		int flags = 0;
+		if (strstr((char*)data->setup_data, "nopbuf"))
+			flags |= EVENT_URING_NO_PBUF;
+		if (event_base_start_uring(data->base, flags) < 0)
+			tt_skip();
+#else
+		tt_skip();
+#endif
+	}
+
+	if (strstr((char*)data->setup_data, "edge"))
+		options |= BEV_OPT_EDGE_TRIGGERED;
+
+	st.out = bufferevent_socket_new(data->base, data->pair[0],
+	    options|BEV_OPT_CLOSE_ON_FREE);
+	data->pair[0] = -1;
+	in = bufferevent_socket_new(data->base, data->pair[1], options);
+	tt_assert(st.out);
+	tt_assert(in);
+	if (strstr((char*)data->setup_data, "uring"))
+		tt_assert(BEV_IS_URING(st.out) && BEV_IS_URING(in));
+	if ((options & BEV_OPT_EDGE_TRIGGERED) &&
+	    (event_base_get_features(data->base) & EV_FEATURE_ET)) {
+		tt_assert(in->ev_read.ev_events & EV_ET);
+		tt_assert(st.out->ev_write.ev_events & EV_ET);
+	}
+
+	bufferevent_setcb(st.out, NULL, transfer_writecb, NULL, &st);
+	bufferevent_setcb(in, transfer_readcb, NULL, transfer_eventcb, &st);
+	bufferevent_setwatermark(in, EV_READ, 0, TRANSFER_HIGH_WM);
+	bufferevent_enable(st.out, EV_WRITE);
+	bufferevent_enable(in, EV_READ);
+	transfer_fill(&st);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(st.n_written, ==, TRANSFER_SIZE);
+	tt_int_op(st.n_read, ==, TRANSFER_SIZE);
+	tt_int_op(st.bad_byte, ==, -1);
+	tt_assert(!st.over_wm);
+	tt_assert(st.got_eof);
+	tt_ptr_op(st.out, ==, NULL);
+
+	/* Freeing a bufferevent that is waiting for data mustn't leave the
+	 * loop waiting for it too. */
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, idle_pair), ==, 0);
+	evutil_make_socket_nonblocking(idle_pair[0]);
+	idle = bufferevent_socket_new(data->base, idle_pair[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(idle);
+	idle_pair[0] = -1;
+	bufferevent_enable(idle, EV_READ);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	bufferevent_free(idle);
+	idle = NULL;
+	tt_int_op(event_base_dispatch(data->base), ==, 1);
+
+end:
+	if (st.out)
+		bufferevent_free(st.out);
+	if (in)
+		bufferevent_free(in);
+	if (idle)
+		bufferevent_free(idle);
+	if (idle_pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(idle_pair[0]);
+	if (idle_pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(idle_pair[1]);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
         LEGACY(bufferevent, TT_ISOLATED),
@@ -614,6 +787,12 @@ struct testcase_t bufferevent_testcases[] = {
 	  (void*)"defer lock" },
 	{ "bufferevent_connect_fail", test_bufferevent_connect_fail,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_transfer", test_bufferevent_transfer,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup,
+	  (void*)"socket" },
+	{ "bufferevent_transfer_et", test_bufferevent_transfer,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup,
+	  (void*)"socket edge" },
 #ifdef _EVENT_HAVE_LIBZ
         LEGACY(bufferevent_zlib, TT_ISOLATED),
 #else
@@ -650,3 +829,27 @@ struct testcase_t bufferevent_iocp_testcases[] = {
 
         END_OF_TESTCASES,
 };
+
+struct testcase_t bufferevent_uring_testcases[] = {
+
+	{ "bufferevent_connect", test_bufferevent_connect,
+	  TT_FORK|TT_NEED_BASE|TT_ENABLE_URING, &basic_setup, (void*)"" },
+	{ "bufferevent_connect_defer", test_bufferevent_connect,
+	  TT_FORK|TT_NEED_BASE|TT_ENABLE_URING, &basic_setup, (void*)"defer" },
+	{ "bufferevent_connect_lock", test_bufferevent_connect,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_THREADS|TT_ENABLE_URING, &basic_setup,
+	  (void*)"lock" },
+	{ "bufferevent_connect_lock_defer", test_bufferevent_connect,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_THREADS|TT_ENABLE_URING, &basic_setup,
+	  (void*)"defer lock" },
+	{ "bufferevent_connect_fail", test_bufferevent_connect_fail,
+	  TT_FORK|TT_NEED_BASE|TT_ENABLE_URING, &basic_setup, NULL },
+	{ "bufferevent_transfer", test_bufferevent_transfer,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup,
+	  (void*)"uring" },
+	{ "bufferevent_transfer_nopbuf", test_bufferevent_transfer,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup,
+	  (void*)"uring nopbuf" },
+
+        END_OF_TESTCASES,
+};
@@ -65,6 +65,7 @@
 #include <event2/bufferevent.h>
 #include "evdns.h"
 #include "log-internal.h"
+#include "util-internal.h"
 #include "regress.h"
 
 static int dns_ok = 0;
@@ -509,6 +510,30 @@ end:
 	return NULL;
 }
 
+/* Return a nonblocking TCP socket listening on 127.0.0.1:portnum. */
+static evutil_socket_t
+get_tcp_listener(ev_uint16_t portnum)
+{
+	evutil_socket_t listener;
+	struct sockaddr_in my_addr;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(listener >= 0);
+	evutil_make_listen_socket_reuseable(listener);
+	evutil_make_socket_nonblocking(listener);
+	memset(&my_addr, 0, sizeof(my_addr));
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_port = htons(portnum);
+	my_addr.sin_addr.s_addr = htonl(0x7f000001UL);
+	if (bind(listener, (struct sockaddr*)&my_addr, sizeof(my_addr)) < 0)
+		tt_abort_perror("bind");
+	if (listen(listener, 16) < 0)
+		tt_abort_perror("listen");
+	return listener;
+end:
+	return -1;
+}
+
 static int n_replies_left;
 static struct event_base *exit_base;
 
@@ -613,6 +638,231 @@ end:
 		evdns_close_server_port(port);
 }
 
+static struct generic_dns_server_table search_parallel_table[] = {
+	{ "host.a.example.com", "err", "3", 0 },
+	{ "host.b.example.com", "err", "3", 0 },
+	{ "host.c.example.com", "A", "11.22.33.44", 0 },
+	{ "host2.a.example.com", "err", "3", 0 },
+	{ "host2.b.example.com", "A", "200.100.0.100", 0 },
+	{ "host2.c.example.com", "err", "3", 0 },
+	{ "host4.a.example.com", "A", "10.0.0.3", 0 },
+	{ "host4.b.example.com", "A", "10.0.0.2", 0 },
+
+	{ "*", "err", "3", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static void
+search_parallel_delayed_answer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	struct in_addr in;
+	evutil_inet_pton(AF_INET, "10.0.0.1", &in);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &in.s_addr, 100);
+	tt_want(! evdns_server_request_respond(req, 0));
+}
+
+/* Like generic_dns_server_cb, but answers host4.c.example.com only after a
+ * delay, so that later names in the search list answer first. */
+static void
+search_parallel_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct timeval tv;
+	if (req->nquestions == 1 &&
+	    !evutil_ascii_strcasecmp(req->questions[0]->name,
+		"host4.c.example.com")) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100*1000;
+		event_base_once(exit_base, -1, EV_TIMEOUT,
+		    search_parallel_delayed_answer_cb, req, &tv);
+		return;
+	}
+	generic_dns_server_cb(req, data);
+}
+
+static void
+dns_search_parallel_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	struct evdns_request *req;
+
+	struct generic_dns_callback_result r1, r2, r3, r4, r5;
+
+	memset(&r5, 0, sizeof(r5));
+	exit_base = base;
+	port = get_generic_server(base, 53900, search_parallel_server_cb,
+	    search_parallel_table);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+	tt_assert(! evdns_base_set_option(dns, "search-parallel:", "1", DNS_OPTIONS_ALL));
+
+	evdns_base_search_add(dns, "a.example.com");
+	evdns_base_search_add(dns, "b.example.com");
+	evdns_base_search_add(dns, "c.example.com");
+
+	n_replies_left = 5;
+
+	evdns_base_resolve_ipv4(dns, "host", 0, generic_dns_callback, &r1);
+	evdns_base_resolve_ipv4(dns, "host2", 0, generic_dns_callback, &r2);
+	evdns_base_resolve_ipv4(dns, "host3", 0, generic_dns_callback, &r3);
+	evdns_base_resolve_ipv4(dns, "host4", 0, generic_dns_callback, &r4);
+	req = evdns_base_resolve_ipv4(dns, "host5", 0, generic_dns_callback,
+	    &r5);
+	tt_assert(req);
+	evdns_cancel_request(dns, req);
+
+	event_base_dispatch(base);
+
+	tt_int_op(n_replies_left, ==, 0);
+	tt_int_op(r1.type, ==, DNS_IPv4_A);
+	tt_int_op(r1.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r1.addrs)[0], ==, htonl(0x0b16212c));
+	tt_int_op(r2.type, ==, DNS_IPv4_A);
+	tt_int_op(r2.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r2.addrs)[0], ==, htonl(0xc8640064));
+	tt_int_op(r3.result, ==, DNS_ERR_NOTEXIST);
+	/* evdns_base_search_add() puts each domain at the front of the list,
+	 * so c comes first: a and b answered sooner, but c wins. */
+	tt_int_op(r4.type, ==, DNS_IPv4_A);
+	tt_int_op(r4.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r4.addrs)[0], ==, htonl(0x0a000001));
+	tt_int_op(r5.result, ==, DNS_ERR_CANCEL);
+
+	/* A sequential search would have stopped at host2.b.example.com. */
+	tt_int_op(search_parallel_table[3].seen, ==, 1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+#ifndef WIN32
+static int
+write_hosts_file(const char *fname, const char *contents)
+{
+	FILE *f = fopen(fname, "w");
+	if (!f)
+		return -1;
+	fputs(contents, f);
+	return fclose(f);
+}
+
+static void
+dns_hosts_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	struct evdns_request *req;
+	char fname[32];
+	int fd;
+	struct in6_addr in6;
+
+	struct generic_dns_callback_result r1, r2, r3, r4, r5, r6, r7;
+	/* Longer than HOST_NAME_MAX on some systems. */
+	const char *long_name = "a-rather-long-host-name-for-testing."
+	    "a-rather-long-domain-name-for-testing.example.com";
+
+	strcpy(fname, "/tmp/eventtmp.XXXXXX");
+	fd = mkstemp(fname);
+	tt_int_op(fd, >=, 0);
+	close(fd);
+	tt_assert(! write_hosts_file(fname,
+		"# A comment\n"
+		"127.0.0.1 localhost\n"
+		"10.1.2.3\tFoo.Example.COM foo   # not-a-name\n"
+		"10.1.2.4 foo\n"
+		"\n"
+		"::1 foo6 foo\n"
+		"not-an-address bar\n"
+		"10.1.2.5 a-rather-long-host-name-for-testing."
+		"a-rather-long-domain-name-for-testing.example.com\n"));
+
+	port = get_generic_server(base, 53900, generic_dns_server_cb,
+	    search_table);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+	tt_int_op(evdns_base_load_hosts(dns, "/nonexistent/hosts"), ==, -1);
+	tt_int_op(evdns_base_load_hosts(dns, fname), ==, 0);
+
+	n_replies_left = 7;
+	exit_base = base;
+
+	evdns_base_resolve_ipv4(dns, "foo", 0, generic_dns_callback, &r1);
+	evdns_base_resolve_ipv4(dns, "FOO.example.com.", 0,
+	    generic_dns_callback, &r2);
+	evdns_base_resolve_ipv6(dns, "foo", 0, generic_dns_callback, &r3);
+	/* These aren't in the hosts file, so they go to the nameserver. */
+	evdns_base_resolve_ipv4(dns, "foo6", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r4);
+	evdns_base_resolve_ipv4(dns, "not-an-address", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r5);
+	req = evdns_base_resolve_ipv4(dns, "localhost", 0,
+	    generic_dns_callback, &r6);
+	tt_assert(req);
+	evdns_cancel_request(dns, req);
+	evdns_base_resolve_ipv4(dns, long_name, 0, generic_dns_callback, &r7);
+
+	event_base_dispatch(base);
+
+	tt_int_op(r1.result, ==, DNS_ERR_NONE);
+	tt_int_op(r1.type, ==, DNS_IPv4_A);
+	tt_int_op(r1.count, ==, 2);
+	tt_int_op(((ev_uint32_t*)r1.addrs)[0], ==, htonl(0x0a010203));
+	tt_int_op(((ev_uint32_t*)r1.addrs)[1], ==, htonl(0x0a010204));
+	tt_int_op(r2.result, ==, DNS_ERR_NONE);
+	tt_int_op(r2.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r2.addrs)[0], ==, htonl(0x0a010203));
+	tt_int_op(r3.result, ==, DNS_ERR_NONE);
+	tt_int_op(r3.type, ==, DNS_IPv6_AAAA);
+	tt_int_op(r3.count, ==, 1);
+	evutil_inet_pton(AF_INET6, "::1", &in6);
+	tt_assert(!memcmp(r3.addrs, in6.s6_addr, 16));
+	tt_int_op(r4.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(r5.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(r6.result, ==, DNS_ERR_CANCEL);
+	tt_int_op(r7.result, ==, DNS_ERR_NONE);
+	tt_int_op(r7.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r7.addrs)[0], ==, htonl(0x0a010205));
+
+	/* Change the file; we should notice within a second. */
+	tt_assert(! write_hosts_file(fname, "10.9.9.9 foo\n"));
+	{
+		struct timeval tv[2];
+		tv[0].tv_sec = tv[1].tv_sec = 1000000;
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		tt_assert(! utimes(fname, tv));
+	}
+	sleep(1);
+
+	memset(&r1, 0, sizeof(r1));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "foo", 0, generic_dns_callback, &r1);
+	event_base_dispatch(base);
+	tt_int_op(r1.result, ==, DNS_ERR_NONE);
+	tt_int_op(r1.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r1.addrs)[0], ==, htonl(0x0a090909));
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	unlink(fname);
+}
+#endif
+
 static void
 fail_server_cb(struct evdns_server_request *req, void *data)
 {
@@ -840,6 +1090,532 @@ end:
 		evdns_close_server_port(port);
 }
 
+static struct generic_dns_server_table inflight_table_a[] = {
+	{ "*", "A", "10.0.0.1", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+static struct generic_dns_server_table inflight_table_b[] = {
+	{ "*", "A", "10.0.0.2", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static int inflight_many_ok;
+
+static void
+inflight_many_callback(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count == 1)
+		++inflight_many_ok;
+	if (--n_replies_left == 0)
+		event_base_loopexit(exit_base, NULL);
+}
+
+static void
+dns_inflight_many_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port1 = NULL, *port2 = NULL;
+	struct evdns_base *dns = NULL;
+	char name[64];
+	int i;
+
+	port1 = get_generic_server(base, 53900, generic_dns_server_cb,
+	    inflight_table_a);
+	tt_assert(port1);
+	port2 = get_generic_server(base, 53901, generic_dns_server_cb,
+	    inflight_table_b);
+	tt_assert(port2);
+
+	/* With only 6 bits of entropy per id, we'll have to go looking for
+	 * free transaction ids at each server. */
+	evdns_set_random_bytes_fn(dumb_bytes_fn);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53901"));
+	tt_assert(! evdns_base_set_option(dns, "max-inflight:", "150", DNS_OPTIONS_ALL));
+
+	for (i = 0; i < 300; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, name, 0,
+			inflight_many_callback, NULL));
+	}
+
+	n_replies_left = 300;
+	exit_base = base;
+
+	event_base_dispatch(base);
+
+	tt_int_op(inflight_many_ok, ==, 300);
+	tt_int_op(inflight_table_a[0].seen, ==, 150);
+	tt_int_op(inflight_table_b[0].seen, ==, 150);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port1)
+		evdns_close_server_port(port1);
+	if (port2)
+		evdns_close_server_port(port2);
+}
+
+/* The distinct source ports we've seen requests come from. */
+static int udp_sockets_ports[16];
+static int udp_sockets_n_ports;
+
+static void
+udp_sockets_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct sockaddr_in sin;
+	ev_uint32_t addr = htonl(0x0a000001);
+	int i, port;
+
+	tt_int_op(evdns_server_request_get_requesting_addr(req,
+		(struct sockaddr *)&sin, sizeof(sin)), ==, sizeof(sin));
+	port = ntohs(sin.sin_port);
+	for (i = 0; i < udp_sockets_n_ports; ++i) {
+		if (udp_sockets_ports[i] == port)
+			break;
+	}
+	if (i == udp_sockets_n_ports && i < 16)
+		udp_sockets_ports[udp_sockets_n_ports++] = port;
+
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &addr, 100);
+	tt_assert(! evdns_server_request_respond(req, 0));
+	return;
+end:
+	tt_want(! evdns_server_request_drop(req));
+}
+
+static void
+dns_udp_sockets_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	char name[64];
+	int i;
+
+	port = get_generic_server(base, 53900, udp_sockets_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+	tt_assert(! evdns_base_set_option(dns, "udp-sockets:", "4", DNS_OPTIONS_ALL));
+
+	/* Requests get spread over all four sockets. */
+	inflight_many_ok = 0;
+	for (i = 0; i < 100; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, name, 0,
+			inflight_many_callback, NULL));
+	}
+	n_replies_left = 100;
+	exit_base = base;
+	event_base_dispatch(base);
+
+	tt_int_op(inflight_many_ok, ==, 100);
+	tt_int_op(udp_sockets_n_ports, ==, 4);
+
+	/* Once we go back to one socket, everything comes from one port. */
+	tt_assert(! evdns_base_set_option(dns, "udp-sockets:", "1", DNS_OPTIONS_ALL));
+	udp_sockets_n_ports = 0;
+	for (i = 0; i < 10; ++i) {
+		evutil_snprintf(name, sizeof(name), "again%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, name, 0,
+			inflight_many_callback, NULL));
+	}
+	n_replies_left = 10;
+	event_base_dispatch(base);
+
+	tt_int_op(inflight_many_ok, ==, 110);
+	tt_int_op(udp_sockets_n_ports, ==, 1);
+
+	/* Only one socket can bind to a fixed source port. */
+	tt_assert(! evdns_base_set_option(dns, "bind-to:", "127.0.0.1:53901",
+		DNS_OPTIONS_ALL));
+	tt_int_op(evdns_base_set_option(dns, "udp-sockets:", "2",
+		DNS_OPTIONS_ALL), ==, -1);
+	tt_assert(! evdns_base_set_option(dns, "bind-to:", "127.0.0.1",
+		DNS_OPTIONS_ALL));
+	tt_assert(! evdns_base_set_option(dns, "udp-sockets:", "2",
+		DNS_OPTIONS_ALL));
+	tt_int_op(evdns_base_set_option(dns, "bind-to:", "127.0.0.1:53901",
+		DNS_OPTIONS_ALL), ==, -1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+/* === Test for falling back to TCP on truncated replies */
+
+struct tcp_fallback_server_data {
+	int n_udp;
+	int n_tcp;
+	/* the source ports of the TCP requests we've seen */
+	int tcp_ports[16];
+};
+
+/* Answers every question with 40 A records: more than fit in the 512
+ * bytes of a UDP reply. */
+static void
+tcp_fallback_server_cb(struct evdns_server_request *req, void *data)
+{
+	ev_uint32_t addr;
+	int i;
+
+	if (req->nquestions != 1)
+		TT_DIE(("Only handling one question at a time; got %d",
+			req->nquestions));
+
+	for (i = 0; i < 40; ++i) {
+		addr = htonl(0x0a000001 + i);
+		evdns_server_request_add_a_reply(req, req->questions[0]->name,
+		    1, &addr, 100);
+	}
+	tt_assert(! evdns_server_request_respond(req, 0));
+	return;
+end:
+	tt_want(! evdns_server_request_drop(req));
+}
+
+static void
+tcp_fallback_udp_cb(struct evdns_server_request *req, void *data)
+{
+	struct tcp_fallback_server_data *d = data;
+	++d->n_udp;
+	tcp_fallback_server_cb(req, data);
+}
+
+static void
+tcp_fallback_tcp_cb(struct evdns_server_request *req, void *data)
+{
+	struct tcp_fallback_server_data *d = data;
+	struct sockaddr_in sin;
+	tt_int_op(evdns_server_request_get_requesting_addr(req,
+		(struct sockaddr *)&sin, sizeof(sin)), ==, sizeof(sin));
+	if (d->n_tcp < 16)
+		d->tcp_ports[d->n_tcp] = ntohs(sin.sin_port);
+	++d->n_tcp;
+	tcp_fallback_server_cb(req, data);
+end:
+	;
+}
+
+static void
+dns_tcp_fallback_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *udp_port = NULL, *tcp_port = NULL;
+	struct evdns_base *dns = NULL;
+	struct tcp_fallback_server_data sd;
+	struct generic_dns_callback_result r[5];
+	evutil_socket_t listener = -1;
+	int i;
+
+	memset(&sd, 0, sizeof(sd));
+	memset(r, 0, sizeof(r));
+	udp_port = get_generic_server(base, 53900, tcp_fallback_udp_cb, &sd);
+	tt_assert(udp_port);
+
+	/* Listen for TCP on the same address and port. */
+	listener = get_tcp_listener(53900);
+	tt_assert(listener >= 0);
+	tcp_port = evdns_add_server_port_with_base(base, listener, 1,
+	    tcp_fallback_tcp_cb, &sd);
+	tt_assert(tcp_port);
+	listener = -1; /* the port owns it now. */
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+	tt_assert(! evdns_base_set_option(dns, "tcp-connections:", "1", DNS_OPTIONS_ALL));
+
+	/* All of these get truncated over UDP; they should all be
+	 * retried, pipelined, over one TCP connection. */
+	n_replies_left = 5;
+	exit_base = base;
+	for (i = 0; i < 5; ++i) {
+		char name[64];
+		evutil_snprintf(name, sizeof(name), "big%d.example.com", i);
+		evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r[i]);
+	}
+
+	event_base_dispatch(base);
+
+	tt_int_op(sd.n_udp, ==, 5);
+	tt_int_op(sd.n_tcp, ==, 5);
+	for (i = 0; i < 5; ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].type, ==, DNS_IPv4_A);
+		/* We only keep the first 32 addresses. */
+		tt_int_op(r[i].count, ==, 32);
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==, htonl(0x0a000001));
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[31], ==, htonl(0x0a000020));
+		tt_int_op(sd.tcp_ports[i], ==, sd.tcp_ports[0]);
+	}
+
+	/* The connection should still be open for the next request. */
+	memset(r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "big5.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].count, ==, 32);
+	tt_int_op(sd.n_tcp, ==, 6);
+	tt_int_op(sd.tcp_ports[5], ==, sd.tcp_ports[0]);
+
+	/* With the fallback disabled, we just report the truncation. */
+	tt_assert(! evdns_base_set_option(dns, "tcp-fallback:", "0", DNS_OPTIONS_ALL));
+	memset(r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "big6.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_TRUNCATED);
+	tt_int_op(sd.n_udp, ==, 7);
+	tt_int_op(sd.n_tcp, ==, 6);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (udp_port)
+		evdns_close_server_port(udp_port);
+	if (tcp_port)
+		evdns_close_server_port(tcp_port);
+	if (listener >= 0)
+		EVUTIL_CLOSESOCKET(listener);
+}
+
+/* Make sure that a nameserver that doesn't take TCP connections gives us
+ * back the truncation error, rather than a timeout. */
+static void
+dns_tcp_fallback_refused_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	struct tcp_fallback_server_data sd;
+	struct generic_dns_callback_result r1;
+
+	memset(&sd, 0, sizeof(sd));
+	memset(&r1, 0, sizeof(r1));
+	port = get_generic_server(base, 53900, tcp_fallback_udp_cb, &sd);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+
+	n_replies_left = 1;
+	exit_base = base;
+	evdns_base_resolve_ipv4(dns, "big.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r1);
+	event_base_dispatch(base);
+
+	tt_int_op(r1.result, ==, DNS_ERR_TRUNCATED);
+	tt_int_op(sd.n_udp, ==, 1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+/* A TCP "nameserver" that answers every query with a reply that is still
+ * truncated. */
+static struct event *tcp_truncated_ev;
+
+static void
+tcp_truncated_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	unsigned char query[512], reply[14];
+	int n;
+
+	n = recv(fd, (void*)query, sizeof(query), 0);
+	if (n == 0)
+		event_del(tcp_truncated_ev);
+	if (n < 4)
+		return;
+	/* We assume the whole query arrives at once; it's small. */
+	memset(reply, 0, sizeof(reply));
+	reply[1] = 12; /* length */
+	reply[2] = query[2]; /* transaction ID */
+	reply[3] = query[3];
+	reply[4] = 0x82; /* QR, TC */
+	reply[5] = 0x80; /* RA */
+	send(fd, (void*)reply, sizeof(reply), 0);
+}
+
+static void
+tcp_truncated_accept_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	evutil_socket_t s;
+
+	s = accept(fd, NULL, NULL);
+	if (s < 0)
+		return;
+	if (tcp_truncated_ev) {
+		/* We only serve one connection. */
+		EVUTIL_CLOSESOCKET(s);
+		return;
+	}
+	evutil_make_socket_nonblocking(s);
+	tcp_truncated_ev = event_new(base, s, EV_READ|EV_PERSIST,
+	    tcp_truncated_read_cb, NULL);
+	event_add(tcp_truncated_ev, NULL);
+}
+
+/* A reply that's truncated even over TCP should fail the request as
+ * truncated right away, not leave it to time out. */
+static void
+dns_tcp_fallback_truncated_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	struct event *accept_ev = NULL;
+	struct tcp_fallback_server_data sd;
+	struct generic_dns_callback_result r1;
+	struct timeval start, end, elapsed;
+	evutil_socket_t listener = -1;
+
+	memset(&sd, 0, sizeof(sd));
+	memset(&r1, 0, sizeof(r1));
+	port = get_generic_server(base, 53900, tcp_fallback_udp_cb, &sd);
+	tt_assert(port);
+	listener = get_tcp_listener(53900);
+	tt_assert(listener >= 0);
+	accept_ev = event_new(base, listener, EV_READ|EV_PERSIST,
+	    tcp_truncated_accept_cb, base);
+	event_add(accept_ev, NULL);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:53900"));
+
+	n_replies_left = 1;
+	exit_base = base;
+	evutil_gettimeofday(&start, NULL);
+	evdns_base_resolve_ipv4(dns, "big.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r1);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	tt_int_op(r1.result, ==, DNS_ERR_TRUNCATED);
+	tt_int_op(sd.n_udp, ==, 1);
+	tt_assert(tcp_truncated_ev);
+	/* Well under the 5-second request timeout. */
+	tt_int_op(elapsed.tv_sec, <, 3);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (tcp_truncated_ev) {
+		EVUTIL_CLOSESOCKET(event_get_fd(tcp_truncated_ev));
+		event_free(tcp_truncated_ev);
+		tcp_truncated_ev = NULL;
+	}
+	if (accept_ev)
+		event_free(accept_ev);
+	if (listener >= 0)
+		EVUTIL_CLOSESOCKET(listener);
+}
+
+/* Run base for msec milliseconds. */
+static void
+run_base_for(struct event_base *base, int msec)
+{
+	struct timeval tv;
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+}
+
+/* Return 1 if the server has closed sock, 0 if it's still open. */
+static int
+tcp_client_closed(evutil_socket_t sock)
+{
+	char c;
+	int n = recv(sock, &c, 1, 0);
+	if (n < 0 &&
+	    EVUTIL_ERR_RW_RETRIABLE(evutil_socket_geterror(sock)))
+		return 0;
+	return 1;
+}
+
+/* A TCP server port should refuse connections beyond its limit, and close
+ * connections that stay idle too long. */
+static void
+dns_server_tcp_limits_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct tcp_fallback_server_data sd;
+	struct sockaddr_in sin;
+	struct timeval tv = { 0, 300000 };
+	evutil_socket_t listener = -1, c1 = -1, c2 = -1;
+
+	memset(&sd, 0, sizeof(sd));
+	listener = get_tcp_listener(53900);
+	tt_assert(listener >= 0);
+	port = evdns_add_server_port_with_base(base, listener, 1,
+	    tcp_fallback_tcp_cb, &sd);
+	tt_assert(port);
+	listener = -1; /* the port owns it now. */
+	tt_int_op(evdns_server_port_set_tcp_limits(port, 0, NULL), ==, -1);
+	tt_assert(!evdns_server_port_set_tcp_limits(port, 1, &tv));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(53900);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	c1 = socket(AF_INET, SOCK_STREAM, 0);
+	c2 = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(c1 >= 0 && c2 >= 0);
+
+	tt_assert(!connect(c1, (struct sockaddr*)&sin, sizeof(sin)));
+	run_base_for(base, 50);
+	tt_assert(!connect(c2, (struct sockaddr*)&sin, sizeof(sin)));
+	run_base_for(base, 50);
+	evutil_make_socket_nonblocking(c1);
+	evutil_make_socket_nonblocking(c2);
+
+	/* The second connection is over the limit; the first isn't idle
+	 * yet. */
+	tt_int_op(tcp_client_closed(c2), ==, 1);
+	tt_int_op(tcp_client_closed(c1), ==, 0);
+
+	run_base_for(base, 500);
+	tt_int_op(tcp_client_closed(c1), ==, 1);
+
+end:
+	if (c1 >= 0)
+		EVUTIL_CLOSESOCKET(c1);
+	if (c2 >= 0)
+		EVUTIL_CLOSESOCKET(c2);
+	if (port)
+		evdns_close_server_port(port);
+	if (listener >= 0)
+		EVUTIL_CLOSESOCKET(listener);
+}
+
 /* === Test for bufferevent_socket_connect_hostname */
 
 static int total_connected_or_failed = 0;
@@ -1051,6 +1827,158 @@ end:
 	{ #name, run_legacy_test_fn, flags|TT_LEGACY, &legacy_setup,   \
                     dns_##name }
 
+/* Implements a DNS server for the connect_hostname_dualstack test. */
+static void
+be_dualstack_server_cb(struct evdns_server_request *req, void *data)
+{
+	int i;
+	int *n_got_p=data;
+	int added_any=0;
+	++*n_got_p;
+
+	for (i=0;i<req->nquestions;++i) {
+		const int qtype = req->questions[i]->type;
+		const char *qname = req->questions[i]->name;
+		ev_uint32_t ans4[2];
+		unsigned char ans6[16];
+
+		if (!evutil_ascii_strcasecmp(qname, "dualstack.example.com")) {
+			if (qtype == EVDNS_TYPE_AAAA) {
+				/* Nobody is listening on ::1. */
+				memset(ans6, 0, sizeof(ans6));
+				ans6[15] = 1;
+				evdns_server_request_add_aaaa_reply(req,
+				    qname, 1, ans6, 2000);
+				added_any = 1;
+			} else if (qtype == EVDNS_TYPE_A) {
+				/* Nobody is listening on 127.0.0.2, either;
+				 * the listener is on 127.0.0.1. */
+				ans4[0] = htonl(0x7f000002);
+				ans4[1] = htonl(0x7f000001);
+				evdns_server_request_add_a_reply(req, qname,
+				    2, ans4, 2000);
+				added_any = 1;
+			}
+		} else if (!evutil_ascii_strcasecmp(qname,
+			"v4only.example.com")) {
+			if (qtype == EVDNS_TYPE_A) {
+				ans4[0] = htonl(0x7f000001);
+				evdns_server_request_add_a_reply(req, qname,
+				    1, ans4, 2000);
+				added_any = 1;
+			}
+		} else if (!evutil_ascii_strcasecmp(qname,
+			"nosuchplace.example.com")) {
+			/* ok, just say notfound. */
+		} else {
+			TT_GRIPE(("Got weird request for %s",qname));
+		}
+	}
+	if (added_any)
+		evdns_server_request_respond(req, 0);
+	else
+		evdns_server_request_respond(req, 3);
+}
+
+static void
+test_bufferevent_connect_hostname_dualstack(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct bufferevent *be1=NULL, *be2=NULL, *be3=NULL;
+	int be1_outcome=0, be2_outcome=0, be3_outcome=0;
+	struct evdns_base *dns=NULL;
+	struct evdns_server_port *port=NULL;
+	evutil_socket_t server_fd=-1;
+	struct sockaddr_in sin;
+	ev_socklen_t socklen;
+	int listener_port=-1, dns_port=-1;
+	int n_accept=0, n_dns=0;
+	char buf[128];
+
+	be_connect_hostname_base = data->base;
+	total_connected_or_failed = 2; /* we only launch three. */
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	sin.sin_port = 0;
+	listener = evconnlistener_new_bind(data->base, nil_accept_cb,
+	    &n_accept,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC,
+	    -1, (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	listener_port = get_socket_port(evconnlistener_get_fd(listener));
+
+	server_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_int_op(server_fd, >=, 0);
+	if (bind(server_fd, (struct sockaddr*)&sin, sizeof(sin))<0) {
+		tt_abort_perror("bind");
+	}
+	evutil_make_socket_nonblocking(server_fd);
+	dns_port = get_socket_port(server_fd);
+	port = evdns_add_server_port_with_base(data->base, server_fd, 0,
+	    be_dualstack_server_cb, &n_dns);
+
+	dns = evdns_base_new(data->base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", dns_port);
+	evdns_base_nameserver_ip_add(dns, buf);
+
+	be1 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be2 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be3 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(be1, NULL, NULL, be_connect_hostname_event_cb,
+	    &be1_outcome);
+	bufferevent_setcb(be2, NULL, NULL, be_connect_hostname_event_cb,
+	    &be2_outcome);
+	bufferevent_setcb(be3, NULL, NULL, be_connect_hostname_event_cb,
+	    &be3_outcome);
+
+	/* Two of the three addresses refuse connections; we should fall
+	 * through to the one that works. */
+	tt_assert(!bufferevent_socket_connect_hostname(be1, dns, AF_UNSPEC,
+		"dualstack.example.com", listener_port));
+	/* No AAAA record: we should connect over IPv4 anyway. */
+	tt_assert(!bufferevent_socket_connect_hostname(be2, dns, AF_UNSPEC,
+		"v4only.example.com", listener_port));
+	/* Neither lookup succeeds. */
+	tt_assert(!bufferevent_socket_connect_hostname(be3, dns, AF_UNSPEC,
+		"nosuchplace.example.com", listener_port));
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(be1_outcome, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(be2_outcome, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(be3_outcome, ==, BEV_EVENT_ERROR);
+	tt_int_op(n_accept, ==, 2);
+	tt_int_op(n_dns, ==, 6);
+
+	/* Make sure be1 ended up on the address that works. */
+	memset(&sin, 0, sizeof(sin));
+	socklen = sizeof(sin);
+	tt_assert(!getpeername(bufferevent_getfd(be1), (struct sockaddr*)&sin,
+		&socklen));
+	tt_int_op(sin.sin_family, ==, AF_INET);
+	tt_int_op(ntohl(sin.sin_addr.s_addr), ==, 0x7f000001);
+	tt_int_op(ntohs(sin.sin_port), ==, listener_port);
+
+end:
+	if (listener)
+		evconnlistener_free(listener);
+	if (port)
+		evdns_close_server_port(port);
+	if (server_fd>=0)
+		EVUTIL_CLOSESOCKET(server_fd);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (be1)
+		bufferevent_free(be1);
+	if (be2)
+		bufferevent_free(be2);
+	if (be3)
+		bufferevent_free(be3);
+}
+
 struct testcase_t dns_testcases[] = {
         DNS_LEGACY(server, TT_FORK|TT_NEED_BASE),
         DNS_LEGACY(gethostbyname, TT_FORK|TT_NEED_BASE|TT_NEED_DNS),
@@ -1058,11 +1986,31 @@ struct testcase_t dns_testcases[] = {
         DNS_LEGACY(gethostbyaddr, TT_FORK|TT_NEED_BASE|TT_NEED_DNS),
         { "resolve_reverse", dns_resolve_reverse, TT_FORK, NULL, NULL },
 	{ "search", dns_search_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "search_parallel", dns_search_parallel_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#ifndef WIN32
+	{ "hosts", dns_hosts_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#endif
 	{ "retry", dns_retry_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "reissue", dns_reissue_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "inflight", dns_inflight_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "inflight_many", dns_inflight_many_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "udp_sockets", dns_udp_sockets_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "tcp_fallback", dns_tcp_fallback_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "tcp_fallback_refused", dns_tcp_fallback_refused_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "tcp_fallback_truncated", dns_tcp_fallback_truncated_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "server_tcp_limits", dns_server_tcp_limits_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "bufferevent_connnect_hostname", test_bufferevent_connect_hostname,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_connect_hostname_dualstack",
+	  test_bufferevent_connect_hostname_dualstack,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 
         END_OF_TESTCASES
 };
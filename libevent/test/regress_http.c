@@ -2138,6 +2138,64 @@ http_multi_line_header_test(void)
 		evhttp_free(http);
 }
 
+static void
+http_chunk_size_readcb(struct bufferevent *bev, void *arg)
+{
+	char *line = evbuffer_readln(bufferevent_get_input(bev), NULL,
+	    EVBUFFER_EOL_CRLF);
+
+	if (line == NULL)
+		return;
+	test_ok = !strncmp(line, "HTTP/1.1 400 ", 13) ? 1 : -1;
+	free(line);
+	bufferevent_disable(bev, EV_READ);
+	event_loopexit(NULL);
+}
+
+static void
+http_chunk_size_test(void)
+{
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fd = -1;
+	short port = -1;
+	char zeros[65];
+
+	test_ok = 0;
+
+	http = http_setup(&port, NULL);
+
+	fd = http_connect("127.0.0.1", port);
+
+	bev = bufferevent_new(fd, http_chunk_size_readcb, NULL, http_errorcb,
+	    NULL);
+
+	/* A chunk size that goes on past the first 64 bytes of its line
+	 * must not be read as "0", the last chunk.  If it were, the chunk
+	 * would pass for a trailer, and we'd get a 200. */
+	memset(zeros, '0', sizeof(zeros) - 1);
+	zeros[sizeof(zeros) - 1] = '\0';
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "POST /test HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Transfer-Encoding: chunked\r\n"
+	    "\r\n"
+	    "%s1a\r\n"
+	    "X-Smuggled: abcdefghijklmn\r\n"
+	    "\r\n", zeros);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	event_dispatch();
+
+	tt_int_op(test_ok, ==, 1);
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (fd >= 0)
+		EVUTIL_CLOSESOCKET(fd);
+	if (http)
+		evhttp_free(http);
+}
+
 static void
 http_request_bad(struct evhttp_request *req, void *arg)
 {
@@ -2291,6 +2349,7 @@ struct testcase_t http_testcases[] = {
 	HTTP_LEGACY(multi_line_header),
 	HTTP_LEGACY(negative_content_length),
 	HTTP_LEGACY(chunk_out),
+	HTTP_LEGACY(chunk_size),
 	HTTP_LEGACY(stream_out),
 
 	HTTP_LEGACY(stream_in),
@@ -74,6 +74,7 @@
 #include "tinytest.h"
 #include "tinytest_macros.h"
 #include "../iocp-internal.h"
+#include "../uring-internal.h"
 
 
 /* ============================================================ */
@@ -181,6 +182,16 @@ basic_test_setup(const struct testcase_t *testcase)
 			return (void*)TT_SKIP;
 		}
 	}
+	if (testcase->flags & TT_ENABLE_URING) {
+#ifdef _EVENT_HAVE_IO_URING
+		if (event_base_start_uring(base, 0)<0) {
+			event_base_free(base);
+			return (void*)TT_SKIP;
+		}
+#else
+		return (void*)TT_SKIP;
+#endif
+	}
 
         if (testcase->flags & TT_NEED_DNS) {
                 evdns_set_log_fn(dnslogcb);
@@ -296,8 +307,12 @@ const struct testcase_setup_t legacy_setup = {
 struct testcase_t thread_testcases[] = {
 #if defined(_EVENT_HAVE_PTHREADS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
 	{ "pthreads", regress_threads, TT_FORK, NULL, NULL, },
+	{ "del_wait", regress_threads_del_wait, TT_FORK, NULL, NULL, },
+	{ "cb_wait", regress_threads_cb_wait, TT_FORK, NULL, NULL, },
 #else
 	{ "pthreads", NULL, TT_SKIP, NULL, NULL },
+	{ "del_wait", NULL, TT_SKIP, NULL, NULL },
+	{ "cb_wait", NULL, TT_SKIP, NULL, NULL },
 #endif
 	END_OF_TESTCASES
 };
@@ -321,6 +336,9 @@ struct testgroup_t testgroups[] = {
 	{ "iocp/bufferevent/", bufferevent_iocp_testcases },
 	{ "iocp/listener/", listener_iocp_testcases },
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	{ "uring/bufferevent/", bufferevent_uring_testcases },
+#endif
 #ifdef _EVENT_HAVE_OPENSSL
 	{ "ssl/", ssl_testcases },
 #endif
@@ -32,6 +32,8 @@
 
 #include <pthread.h>
 #include <assert.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "event2/util.h"
 #include "event2/event.h"
@@ -144,3 +146,153 @@ regress_threads(void *arg)
 end:
         ;
 }
+
+/* An event_del() from another thread must wait for the event's callback to
+ * finish, even though the loop had no reason to expect another thread when
+ * it started running the callback. */
+static struct cond_wait del_wait_cw;
+static int del_wait_started, del_wait_done, del_wait_done_at_del;
+
+static void
+del_wait_cb(int fd, short what, void *arg)
+{
+	assert(pthread_mutex_lock(&del_wait_cw.lock) == 0);
+	del_wait_started = 1;
+	assert(pthread_cond_broadcast(&del_wait_cw.cond) == 0);
+	assert(pthread_mutex_unlock(&del_wait_cw.lock) == 0);
+
+	usleep(200000);
+	del_wait_done = 1;
+}
+
+static void *
+del_wait_thread(void *arg)
+{
+	struct event *ev = arg;
+
+	assert(pthread_mutex_lock(&del_wait_cw.lock) == 0);
+	while (!del_wait_started)
+		assert(pthread_cond_wait(&del_wait_cw.cond,
+			&del_wait_cw.lock) == 0);
+	assert(pthread_mutex_unlock(&del_wait_cw.lock) == 0);
+
+	event_del(ev);
+	del_wait_done_at_del = del_wait_done;
+	return (NULL);
+}
+
+void
+regress_threads_del_wait(void *arg)
+{
+	struct event_base *base = NULL;
+	struct event ev;
+	struct timeval tv;
+	pthread_t thread;
+	(void) arg;
+
+	if (evthread_use_pthreads()<0)
+		tt_abort_msg("Couldn't initialize pthreads!");
+	assert(pthread_mutex_init(&del_wait_cw.lock, NULL) == 0);
+	assert(pthread_cond_init(&del_wait_cw.cond, NULL) == 0);
+
+	base = event_base_new();
+	tt_assert(base);
+	evtimer_assign(&ev, base, del_wait_cb, NULL);
+	evutil_timerclear(&tv);
+	tv.tv_usec = 10000;
+	evtimer_add(&ev, &tv);
+
+	pthread_create(&thread, NULL, del_wait_thread, &ev);
+	event_base_loop(base, EVLOOP_ONCE);
+	pthread_join(thread, NULL);
+
+	tt_int_op(del_wait_done, ==, 1);
+	tt_int_op(del_wait_done_at_del, ==, 1);
+
+end:
+	if (base)
+		event_base_free(base);
+}
+
+/* A callback may wait for another thread that uses the base; the loop must
+ * not be holding the base's lock while it runs. */
+static struct cond_wait cb_wait_cw;
+static int cb_wait_started, cb_wait_finished, cb_wait_seen, cb_wait_other_ran;
+
+static void *
+cb_wait_thread(void *arg)
+{
+	struct event *other = arg;
+
+	assert(pthread_mutex_lock(&cb_wait_cw.lock) == 0);
+	while (!cb_wait_started)
+		assert(pthread_cond_wait(&cb_wait_cw.cond,
+			&cb_wait_cw.lock) == 0);
+	assert(pthread_mutex_unlock(&cb_wait_cw.lock) == 0);
+
+	event_active(other, EV_TIMEOUT, 1);
+
+	assert(pthread_mutex_lock(&cb_wait_cw.lock) == 0);
+	cb_wait_finished = 1;
+	assert(pthread_cond_broadcast(&cb_wait_cw.cond) == 0);
+	assert(pthread_mutex_unlock(&cb_wait_cw.lock) == 0);
+	return (NULL);
+}
+
+static void
+cb_wait_other_cb(int fd, short what, void *arg)
+{
+	cb_wait_other_ran = 1;
+}
+
+static void
+cb_wait_cb(int fd, short what, void *arg)
+{
+	struct timespec ts;
+
+	ts.tv_sec = time(NULL) + 5;
+	ts.tv_nsec = 0;
+	assert(pthread_mutex_lock(&cb_wait_cw.lock) == 0);
+	cb_wait_started = 1;
+	assert(pthread_cond_broadcast(&cb_wait_cw.cond) == 0);
+	while (!cb_wait_finished) {
+		if (pthread_cond_timedwait(&cb_wait_cw.cond, &cb_wait_cw.lock,
+			&ts) != 0)
+			break;
+	}
+	cb_wait_seen = cb_wait_finished;
+	assert(pthread_mutex_unlock(&cb_wait_cw.lock) == 0);
+}
+
+void
+regress_threads_cb_wait(void *arg)
+{
+	struct event_base *base = NULL;
+	struct event ev, other;
+	pthread_t thread;
+	(void) arg;
+
+	if (evthread_use_pthreads()<0)
+		tt_abort_msg("Couldn't initialize pthreads!");
+	assert(pthread_mutex_init(&cb_wait_cw.lock, NULL) == 0);
+	assert(pthread_cond_init(&cb_wait_cw.cond, NULL) == 0);
+
+	base = event_base_new();
+	tt_assert(base);
+	evtimer_assign(&ev, base, cb_wait_cb, NULL);
+	evtimer_assign(&other, base, cb_wait_other_cb, NULL);
+	event_active(&ev, EV_TIMEOUT, 1);
+
+	pthread_create(&thread, NULL, cb_wait_thread, &other);
+	event_base_loop(base, EVLOOP_ONCE);
+	pthread_join(thread, NULL);
+
+	/* The other thread got in while the callback waited for it. */
+	tt_int_op(cb_wait_seen, ==, 1);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(cb_wait_other_ran, ==, 1);
+
+end:
+	if (base)
+		event_base_free(base);
+}
@@ -6,6 +6,7 @@ setup () {
 	 EVENT_NOPOLL=yes; export EVENT_NOPOLL
 	 EVENT_NOSELECT=yes; export EVENT_NOSELECT
 	 EVENT_NOEPOLL=yes; export EVENT_NOEPOLL
+	 EVENT_NOIO_URING=yes; export EVENT_NOIO_URING
 	 EVENT_NOEVPORT=yes; export EVENT_NOEVPORT
 }
 
@@ -81,6 +82,12 @@ export EVENT_NOEPOLL
 echo "EPOLL"
 test
 
+setup
+unset EVENT_NOIO_URING
+export EVENT_NOIO_URING
+echo "IO_URING"
+test
+
 setup
 unset EVENT_NOEVPORT
 export EVENT_NOEVPORT
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EVENT_URING_INTERNAL_H
+#define _EVENT_URING_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Like iocp-internal.h, but for Linux: completion-based I/O on top of
+ * io_uring.  Only compiled in when we have _EVENT_HAVE_IO_URING. */
+#ifdef _EVENT_HAVE_IO_URING
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct event_base;
+struct evbuffer;
+struct evbuffer_chain;
+struct bufferevent;
+struct event_uring_port;
+struct event_uring_op;
+
+/**
+   The memory we share with the kernel for one io_uring instance.  Used both
+   by the io_uring backend and by event_uring_port.
+ */
+struct event_uring_ring {
+	int fd;
+
+	/* The submission queue. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/* Our tail, counting entries we haven't given the kernel yet. */
+	unsigned sq_local_tail;
+
+	/* The completion queue. */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+/** Set up an io_uring with room for 'entries' submissions and 'cq_entries'
+    completions, and map its rings.  Fails (quietly, if the kernel just
+    doesn't have io_uring) unless the kernel can wait with a timeout and
+    never drops completions.  Returns 0 on success, -1 on failure. */
+int event_uring_ring_init(struct event_uring_ring *r, unsigned entries,
+    unsigned cq_entries);
+/** Unmap a ring set up with event_uring_ring_init() and close it. */
+void event_uring_ring_free(struct event_uring_ring *r);
+/** Return a cleared submission queue entry, submitting the ones we have if
+    the queue is full.  Returns NULL on failure. */
+struct io_uring_sqe *event_uring_ring_get_sqe(struct event_uring_ring *r);
+/** Hand the kernel every submission queue entry we've filled in, and
+    return how many it has yet to consume. */
+unsigned event_uring_ring_publish(struct event_uring_ring *r);
+/** The io_uring_enter() system call. */
+int event_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz);
+
+/**
+   Called when the kernel finishes an operation that we submitted through an
+   event_uring_port: 'res' and 'flags' are from the completion.
+ */
+typedef void (*event_uring_cb)(struct event_uring_op *, int res,
+    unsigned flags);
+
+/**
+   Internal use only.  Identifies one operation submitted to an
+   event_uring_port; the port calls its callback when the operation
+   completes, in the event_base's thread.  Embed it in whatever structure
+   the callback needs.
+ */
+struct event_uring_op {
+	event_uring_cb cb;
+};
+
+/** Flag for event_base_start_uring(): don't give reads a pool of provided
+    buffers to pick from; each read gets a buffer of its own instead. */
+#define EVENT_URING_NO_PBUF 0x01
+
+/** Make an event_uring_port for 'base', or return NULL if io_uring isn't
+    usable here. */
+struct event_uring_port *event_uring_port_launch(struct event_base *base,
+    int flags);
+
+/** Free a port.  Operations that it has not finished yet are abandoned:
+    their callbacks will never run. */
+void event_uring_port_free(struct event_uring_port *port);
+
+/** Queue the operation described by 'sqe' on 'port', and call op's callback
+    when it completes.  'op' may be NULL for operations whose results we
+    don't care about.  Operations queued during one iteration of the event
+    loop are handed to the kernel together, once the callbacks for that
+    iteration have run.  Safe to call from any thread.  Returns 0 on
+    success, -1 on failure. */
+int event_uring_port_submit(struct event_uring_port *port,
+    const struct io_uring_sqe *sqe, struct event_uring_op *op);
+
+/** Ask the kernel to cancel 'op', if it is still running.  If it does, op's
+    callback is called with -ECANCELED. */
+int event_uring_port_cancel(struct event_uring_port *port,
+    struct event_uring_op *op);
+
+/** Return true iff 'port' has a pool of provided buffers for reads. */
+int event_uring_port_has_pbuf(struct event_uring_port *port);
+
+/** If 'flags' (from a completion) say that the kernel read into one of
+    port's provided buffers, append the 'n' bytes it read to 'buf', and
+    return 1; otherwise return 0.  Small reads are copied, so that the
+    buffer can go straight back to the pool; larger ones are added by
+    reference, and the buffer goes back once 'buf' is done with it.
+    Returns -1 if we couldn't add the data. */
+int event_uring_port_take_pbuf(struct event_uring_port *port,
+    unsigned flags, struct evbuffer *buf, int n);
+
+/** Return the event_uring_port for 'base', or NULL if it doesn't have one. */
+struct event_uring_port *event_base_get_uring(struct event_base *base);
+
+/** Give 'base' an event_uring_port, if it doesn't have one already.  Once it
+    has one, bufferevent_socket_new() makes io_uring bufferevents.  'flags'
+    are passed to event_uring_port_launch().  Returns 0 on success, -1 on
+    failure. */
+int event_base_start_uring(struct event_base *base, int flags);
+
+/** The most chains that one read or write on an evbuffer will use. */
+#define EVBUFFER_URING_MAX_IOVECS 64
+
+/**
+   Internal use only.  Holds the state of one read or write that the kernel
+   is doing on an evbuffer.
+ */
+struct evbuffer_uring_io {
+	struct event_uring_op op;
+
+	/** The buffer we're reading into or writing from. */
+	struct evbuffer *buf;
+	struct event_uring_port *port;
+	/** The socket we're reading from or writing to. */
+	evutil_socket_t fd;
+	/** Called once the buffer has been updated with the result of the
+	    operation: 'res' is the number of bytes transferred, 0 on EOF,
+	    or -errno.  The buffer isn't locked. */
+	void (*done)(struct evbuffer_uring_io *, int res);
+
+	/** For writes: the chains we pinned, and how many of them there
+	    are. */
+	struct evbuffer_chain *pinned[EVBUFFER_URING_MAX_IOVECS];
+	int n_pinned;
+	/** For writes: the parts of the pinned chains we're sending. */
+	struct iovec iov[EVBUFFER_URING_MAX_IOVECS];
+	struct msghdr msg;
+
+	/** For reads without a provided buffer: memory of our own for the
+	    kernel to read into, and its size. */
+	unsigned char *rbuf;
+	size_t rbuf_len;
+
+	/** True iff the kernel has this operation. */
+	unsigned in_progress : 1;
+	/** True iff this is a read that asked for a provided buffer. */
+	unsigned pbuf : 1;
+	/** True iff this is a write that waits for the socket to become
+	    writable and then calls evbuffer_write_atmost(). */
+	unsigned poll_then_write : 1;
+};
+
+/** Ask the kernel to read up to 'at_most' bytes from 'fd' into 'buf', and
+    call io->done when it's finished.  If 'use_pbuf' is true and the port
+    has provided buffers, the kernel picks one of those when the data
+    arrives; otherwise it reads into io's own buffer.  Either way, nothing
+    in 'buf' is tied up while the read waits, so the caller can do what it
+    likes with 'buf' meanwhile.  Returns 0 on success, -1 on failure. */
+int evbuffer_uring_launch_read(struct evbuffer_uring_io *io,
+    struct event_uring_port *port, evutil_socket_t fd, struct evbuffer *buf,
+    size_t at_most, int use_pbuf);
+
+/** Ask the kernel to send up to 'at_most' bytes (or everything, if
+    'at_most' is negative) from the start of 'buf' to 'fd'.  Pins the chains
+    holding them, and stops anyone draining 'buf', until it's done; then
+    drains what was sent and calls io->done.  Returns 0 on success, -1 on
+    failure. */
+int evbuffer_uring_launch_write(struct evbuffer_uring_io *io,
+    struct event_uring_port *port, evutil_socket_t fd, struct evbuffer *buf,
+    ev_ssize_t at_most);
+
+/** Free the memory that 'io' holds, once it is no longer in progress. */
+void evbuffer_uring_io_clear(struct evbuffer_uring_io *io);
+
+/** Internal use only: make an io_uring bufferevent.  Use
+    bufferevent_socket_new() instead. */
+struct bufferevent *bufferevent_uring_new(struct event_base *base,
+    evutil_socket_t fd, int options);
+
+/** Internal use only: start connecting an io_uring bufferevent to 'sa', or
+    if 'sa' is NULL, wait for 'fd' to finish connecting. */
+int bufferevent_uring_connect(struct bufferevent *bev, evutil_socket_t fd,
+    const struct sockaddr *sa, int socklen);
+
+#endif /* _EVENT_HAVE_IO_URING */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
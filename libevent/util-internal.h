@@ -144,6 +144,34 @@ int evutil_socket_finished_connecting(evutil_socket_t fd);
 int evutil_resolve(int family, const char *hostname, struct sockaddr *sa,
     ev_socklen_t *socklen, int port);
 
+/* Return a pointer to the first byte in the 'n' bytes at 's' that is equal
+ * to 'c1' or to 'c2', or NULL if there is none. */
+const void *evutil_memchr2(const void *s, int c1, int c2, size_t n);
+/* Return a pointer to the first place where the 'len' bytes at 'what' occur
+ * in the 'n' bytes at 's', or NULL if they don't. */
+const void *evutil_memmem(const void *s, size_t n, const void *what,
+    size_t len);
+
+/* Continue the CRC32C 'crc' over the 'len' bytes at 'data'.  Start with 0. */
+ev_uint32_t evutil_crc32c(ev_uint32_t crc, const void *data, size_t len);
+/* Continue the Adler-32 sum 'adler' over the 'len' bytes at 'data'.  Start
+ * with 1. */
+ev_uint32_t evutil_adler32(ev_uint32_t adler, const void *data, size_t len);
+
+/* A 64-bit hash (XXH64) being computed a piece at a time. */
+struct evutil_hash64_state {
+	ev_uint64_t v[4];
+	ev_uint64_t seed;
+	ev_uint64_t total_len;
+	/* Bytes left over that don't yet make a 32-byte stripe. */
+	unsigned char buf[32];
+	size_t buf_len;
+};
+void evutil_hash64_init(struct evutil_hash64_state *st, ev_uint64_t seed);
+void evutil_hash64_update(struct evutil_hash64_state *st, const void *data,
+    size_t len);
+ev_uint64_t evutil_hash64_final(const struct evutil_hash64_state *st);
+
 /* Evaluates to the same boolean value as 'p', and hints to the compiler that
  * we expect this value to be false. */
 #ifdef __GNUC__X